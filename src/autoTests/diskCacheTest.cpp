@@ -0,0 +1,205 @@
+#include "../nekoav/nekoprivate.hpp"
+
+#include <QTemporaryDir>
+#include <QDateTime>
+#include <QFile>
+#include <QDir>
+
+#include <gtest/gtest.h>
+#include <gmock/gmock.h>
+
+using namespace testing;
+using namespace NekoAV;
+
+namespace {
+
+/**
+ * @brief Seekable source in memory, counts the bytes read from it
+ */
+class MemorySource final : public ByteSource {
+    public:
+        MemorySource(const QByteArray &data, int64_t *readBytes) : data(data), readBytes(readBytes) { }
+
+        int read(uint8_t *buf, int size) override {
+            if (pos >= data.size()) {
+                return AVERROR_EOF;
+            }
+            int n = std::min<int64_t>(size, data.size() - pos);
+            ::memcpy(buf, data.constData() + pos, n);
+            pos += n;
+            *readBytes += n;
+            return n;
+        }
+        bool seek(int64_t to) override {
+            pos = to;
+            return true;
+        }
+        int64_t size() override {
+            return data.size();
+        }
+        bool isSeekable() const override {
+            return true;
+        }
+    private:
+        QByteArray data;
+        int64_t    pos = 0;
+        int64_t   *readBytes;
+};
+
+QByteArray MakeContent(char seed, int size) {
+    QByteArray data(size, Qt::Uninitialized);
+    for (int i = 0; i < size; i++) {
+        data[i] = char(seed + i * 7);
+    }
+    return data;
+}
+
+QByteArray ReadAll(ByteSource *source, int64_t begin, int size) {
+    QByteArray out;
+    source->seek(begin);
+    while (out.size() < size) {
+        uint8_t buf[4096];
+        int n = source->read(buf, std::min<int>(sizeof(buf), size - out.size()));
+        if (n <= 0) {
+            break;
+        }
+        out.append(reinterpret_cast<char*>(buf), n);
+    }
+    return out;
+}
+
+// An entry as the cache leaves it, the data file is sparse so its size is the source size
+void WriteEntry(const QString &dir, const QString &key, int64_t size, const DiskCache::Ranges &ranges, qint64 lastUse) {
+    ASSERT_TRUE(DiskCache::saveMeta(dir + "/" + key + ".meta", size, ranges));
+    QFile data(dir + "/" + key + ".data");
+    ASSERT_TRUE(data.open(QIODevice::WriteOnly));
+    ASSERT_TRUE(data.resize(size));
+    data.close();
+
+    QFile meta(dir + "/" + key + ".meta");
+    ASSERT_TRUE(meta.open(QIODevice::ReadWrite));
+    meta.setFileTime(QDateTime::fromMSecsSinceEpoch(lastUse), QFileDevice::FileModificationTime);
+}
+
+}
+
+TEST(DiskCacheTest, mergeRanges) {
+    DiskCache::Ranges ranges;
+    DiskCache::addRange(ranges, 0, 10);
+    DiskCache::addRange(ranges, 20, 30);
+    EXPECT_EQ(ranges.size(), 2u);
+
+    // Adjacent ones
+    DiskCache::addRange(ranges, 10, 20);
+    EXPECT_THAT(ranges, ElementsAre(Pair(0, 30)));
+
+    // Inside one
+    DiskCache::addRange(ranges, 5, 8);
+    EXPECT_THAT(ranges, ElementsAre(Pair(0, 30)));
+
+    // Overlapped with many
+    DiskCache::addRange(ranges, 40, 50);
+    DiskCache::addRange(ranges, 60, 70);
+    DiskCache::addRange(ranges, 35, 65);
+    EXPECT_THAT(ranges, ElementsAre(Pair(0, 30), Pair(35, 70)));
+    EXPECT_EQ(DiskCache::rangesBytes(ranges), 65);
+}
+
+TEST(DiskCacheTest, keyDropsSigningItems) {
+    auto a = DiskCache::keyOf(QUrl("https://CDN.example.com/v.mp4?id=1&Expires=100&Signature=abc&Key-Pair-Id=k"));
+    auto b = DiskCache::keyOf(QUrl("https://cdn.example.com/v.mp4?id=1&Expires=200&Signature=def&Key-Pair-Id=k"));
+    auto c = DiskCache::keyOf(QUrl("https://cdn.example.com/v.mp4?id=2&Expires=100&Signature=abc&Key-Pair-Id=k"));
+    EXPECT_EQ(a, b);
+    EXPECT_NE(a, c);
+
+    // The items named by uparams are signed
+    auto d = DiskCache::keyOf(QUrl("https://upos.example.com/a.m4s?e=x&os=a&uparams=e,os&upsig=1&bvc=vod"));
+    auto e = DiskCache::keyOf(QUrl("https://upos.example.com/a.m4s?e=y&os=b&uparams=e,os&upsig=2&bvc=vod"));
+    EXPECT_EQ(d, e);
+}
+
+TEST(DiskCacheTest, scanCountsFetchedRanges) {
+    QTemporaryDir dir;
+    ASSERT_TRUE(dir.isValid());
+    // A half fetched source, the sparse data file has the full size
+    WriteEntry(dir.path(), "half", 64 * 1024 * 1024, {{0, 1024 * 1024}, {2 * 1024 * 1024, 3 * 1024 * 1024}}, 1000);
+
+    DiskCache cache;
+    cache.configure(dir.path(), 1024 * 1024 * 1024);
+    int errcode = 0;
+    EXPECT_EQ(cache.open(QUrl("https://example.com/other.mp4"), {}, [](int *errcode) {
+        *errcode = AVERROR(EIO);
+        return nullptr;
+    }, &errcode), nullptr);
+    EXPECT_EQ(cache.usedBytes(), 2 * 1024 * 1024);
+}
+
+TEST(DiskCacheTest, evictByLastUse) {
+    QTemporaryDir dir;
+    ASSERT_TRUE(dir.isValid());
+    constexpr int64_t MB = 1024 * 1024;
+    WriteEntry(dir.path(), "oldest", 16 * MB, {{0, 2 * MB}}, 1000);
+    WriteEntry(dir.path(), "middle", 16 * MB, {{0, 2 * MB}}, 2000);
+    WriteEntry(dir.path(), "newest", 16 * MB, {{0, 2 * MB}}, 3000);
+
+    DiskCache cache;
+    cache.configure(dir.path(), 5 * MB);
+    int errcode = 0;
+    cache.open(QUrl("https://example.com/other.mp4"), {}, [](int *errcode) {
+        *errcode = AVERROR(EIO);
+        return nullptr;
+    }, &errcode);
+
+    QDir d(dir.path());
+    EXPECT_FALSE(d.exists("oldest.meta"));
+    EXPECT_FALSE(d.exists("oldest.data"));
+    EXPECT_TRUE(d.exists("middle.meta"));
+    EXPECT_TRUE(d.exists("newest.meta"));
+    EXPECT_EQ(cache.usedBytes(), 4 * MB);
+}
+
+TEST(DiskCacheTest, serveOnlySameContent) {
+    QTemporaryDir dir;
+    ASSERT_TRUE(dir.isValid());
+    constexpr int Size = 2 * 1024 * 1024;
+    constexpr int Fetched = 256 * 1024;
+    auto content = MakeContent(1, Size);
+    auto url = QUrl("https://example.com/v.mp4?id=1");
+
+    DiskCache cache;
+    cache.configure(dir.path(), 1024 * 1024 * 1024);
+    int64_t upstreamBytes = 0;
+    int errcode = 0;
+    auto opener = [&](const QByteArray &data) {
+        return [&, data](int *) -> std::unique_ptr<ByteSource> {
+            return std::make_unique<MemorySource>(data, &upstreamBytes);
+        };
+    };
+
+    // Fetch the head
+    {
+        auto source = cache.open(url, {}, opener(content), &errcode);
+        ASSERT_NE(source, nullptr);
+        EXPECT_EQ(ReadAll(source.get(), 0, Fetched), content.left(Fetched));
+    }
+    EXPECT_EQ(upstreamBytes, Fetched);
+    EXPECT_EQ(cache.usedBytes(), Fetched);
+
+    // Same content, only the fingerprint goes to the upstream
+    upstreamBytes = 0;
+    {
+        auto source = cache.open(url, {}, opener(content), &errcode);
+        ASSERT_NE(source, nullptr);
+        EXPECT_EQ(ReadAll(source.get(), 0, Fetched), content.left(Fetched));
+    }
+    EXPECT_EQ(upstreamBytes, DiskCache::FingerprintSize);
+
+    // Same size but another content, the cached bytes must not be served
+    auto changed = MakeContent(2, Size);
+    {
+        auto source = cache.open(url, {}, opener(changed), &errcode);
+        ASSERT_NE(source, nullptr);
+        EXPECT_EQ(ReadAll(source.get(), 0, Fetched), changed.left(Fetched));
+    }
+    EXPECT_EQ(cache.usedBytes(), Fetched);
+}
@@ -18,8 +18,19 @@ target("autoTests")
 
     add_deps("sqlite", "common")
     add_deps("common")
+    add_deps("nekoav")
 
     add_frameworks("QtCore", "QtGui", "QtWidgets")
+    add_frameworks("QtOpenGL", "QtOpenGLWidgets")
+
+    if is_plat("linux") then 
+        add_packages("libavformat", "libavutil", "libavcodec", "libswresample", "libswscale", "libavfilter")
+        add_packages("libsdl")
+    else 
+        add_packages("ffmpeg")
+        add_packages("miniaudio")
+        add_syslinks("psapi")
+    end
 
     add_files("./*.cpp")
 target_end()
\ No newline at end of file
@@ -0,0 +1,253 @@
+#include "../nekoav/nekoav.hpp"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QFileInfo>
+#include <QProcess>
+#include <QTimer>
+#include <QDir>
+#include <cstdio>
+
+#if defined(_WIN32)
+    #include <windows.h>
+    #include <psapi.h>
+#else
+    #include <sys/resource.h>
+#endif
+
+namespace {
+
+/**
+ * @brief Get the peak resident memory of this process in MB
+ *
+ */
+double PeakRssMB() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0.0;
+    }
+    return counters.PeakWorkingSetSize / 1024.0 / 1024.0;
+#else
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0.0;
+    }
+    #if defined(__APPLE__)
+    return usage.ru_maxrss / 1024.0 / 1024.0; //< Bytes on macOS
+    #else
+    return usage.ru_maxrss / 1024.0; //< KB on linux
+    #endif
+#endif
+}
+
+/**
+ * @brief A synthetic test source, encoded by the ffmpeg cli from the lavfi sources
+ *
+ */
+struct Preset {
+    QString     file;
+    QStringList audioArgs;
+    QList<QStringList> videoArgs; //< Alternatives, the first encoder available is used
+};
+
+int Generate(const QString &dir, const QString &size, int duration) {
+    QString ffmpeg = qEnvironmentVariable("NEKOAV_BENCH_FFMPEG", "ffmpeg");
+    QStringList x264 = {"-c:v", "libx264", "-preset", "veryfast", "-pix_fmt", "yuv420p"};
+    QStringList x265 = {"-c:v", "libx265", "-preset", "veryfast", "-pix_fmt", "yuv420p", "-tag:v", "hvc1"};
+    QStringList svtav1 = {"-c:v", "libsvtav1", "-preset", "10", "-pix_fmt", "yuv420p"};
+    QStringList aomav1 = {"-c:v", "libaom-av1", "-cpu-used", "8", "-row-mt", "1", "-pix_fmt", "yuv420p"};
+    QStringList aac = {"-c:a", "aac", "-b:a", "128k"};
+    QStringList opus = {"-c:a", "libopus", "-b:a", "96k"};
+
+    const QList<Preset> presets = {
+        {"h264_aac.mp4",  aac,  {x264}},
+        {"hevc_aac.mp4",  aac,  {x265}},
+        {"av1_opus.mkv",  opus, {svtav1, aomav1}},
+        {"h264_opus.mkv", opus, {x264}},
+    };
+
+    QDir().mkpath(dir);
+    int generated = 0;
+    for (const auto &preset : presets) {
+        QString path = QDir(dir).filePath(preset.file);
+        bool ok = false;
+        for (const auto &video : preset.videoArgs) {
+            QStringList args = {
+                "-y", "-hide_banner", "-loglevel", "error",
+                "-f", "lavfi", "-i", QString("testsrc2=size=%1:rate=30").arg(size),
+                "-f", "lavfi", "-i", "sine=frequency=440:sample_rate=48000",
+                "-t", QString::number(duration),
+                "-map", "0:v", "-map", "1:a"
+            };
+            args << video << preset.audioArgs << path;
+            if (QProcess::execute(ffmpeg, args) == 0) {
+                ok = true;
+                break;
+            }
+        }
+        if (ok) {
+            generated += 1;
+            std::printf("generated %s\n", qPrintable(path));
+        }
+        else {
+            // The encoder is not in this ffmpeg build
+            std::printf("skipped %s\n", qPrintable(path));
+        }
+    }
+    return generated > 0 ? 0 : 1;
+}
+
+/**
+ * @brief Play the file with the null sinks in this process, print the result as a json line
+ *
+ */
+int RunOne(QCoreApplication &app, const QString &file, bool rgbaOnly, int timeout) {
+    NekoMediaPlayer player;
+    NekoVideoSink   sink;
+    NekoAudioOutput audio;
+
+    audio.setNullDevice(true);
+    if (!rgbaOnly) {
+        // Any format the decoder gives, so only the needed conversions are measured
+        for (auto fmt : {NekoVideoPixelFormat::YUV420P, NekoVideoPixelFormat::NV12, NekoVideoPixelFormat::NV21,
+                         NekoVideoPixelFormat::YUY2, NekoVideoPixelFormat::UYVY, NekoVideoPixelFormat::RGB24}) {
+            sink.addPixelFormat(fmt);
+        }
+    }
+    quint64 presented = 0;
+    QObject::connect(&sink, &NekoVideoSink::videoFrameChanged, [&](const NekoVideoFrame &frame) {
+        if (!frame.isNull()) {
+            presented += 1;
+        }
+    });
+
+    int exitCode = 0;
+    QObject::connect(&player, &NekoMediaPlayer::mediaStatusChanged, [&](NekoMediaPlayer::MediaStatus status) {
+        if (status == NekoMediaPlayer::EndOfMedia) {
+            app.quit();
+        }
+    });
+    QObject::connect(&player, &NekoMediaPlayer::errorOccurred, [&](NekoMediaPlayer::Error, const QString &message) {
+        std::fprintf(stderr, "%s : %s\n", qPrintable(file), qPrintable(message));
+        exitCode = 1;
+        app.quit();
+    });
+    QTimer::singleShot(timeout * 1000, &app, [&]() {
+        std::fprintf(stderr, "%s : timeout\n", qPrintable(file));
+        exitCode = 1;
+        app.quit();
+    });
+
+    player.setFreeRunning(true);
+    player.setStatisticsInterval(0);
+    player.setAudioOutput(&audio);
+    player.setVideoSink(&sink);
+    player.setSource(QUrl::fromLocalFile(file));
+
+    QElapsedTimer timer;
+    timer.start();
+    player.play();
+    app.exec();
+
+    double seconds = timer.nsecsElapsed() / 1000000000.0;
+    auto stats = player.statistics();
+    player.stop();
+    if (exitCode != 0) {
+        return exitCode;
+    }
+
+    QJsonObject result;
+    result["file"] = QFileInfo(file).fileName();
+    result["seconds"] = seconds;
+    result["decodedFrames"] = qint64(stats.frames);
+    result["presentedFrames"] = qint64(presented);
+    result["coalescedFrames"] = qint64(stats.coalescedFrames);
+    result["fps"] = stats.frames / seconds;
+    result["decodeMs"] = stats.decodeTime[0];
+    result["convertMs"] = stats.convertTime[0];
+    result["convertMsP90"] = stats.convertTime[1];
+    result["packets"] = qint64(stats.packets);
+    result["packetsPerSecond"] = stats.packets / seconds;
+    result["peakRssMB"] = PeakRssMB();
+    std::printf("%s\n", QJsonDocument(result).toJson(QJsonDocument::Compact).constData());
+    return 0;
+}
+
+/**
+ * @brief Run each file in a child process, so the peak memory is per file
+ *
+ */
+int RunAll(const QStringList &files, bool rgbaOnly, int timeout) {
+    std::printf("%-20s %9s %9s %9s %9s %11s %9s\n", "file", "fps", "decode", "convert", "cvt p90", "packets/s", "peak MB");
+    int failed = 0;
+    for (const auto &file : files) {
+        QStringList args = {"--run", "--timeout", QString::number(timeout), file};
+        if (rgbaOnly) {
+            args << "--rgba";
+        }
+        QProcess process;
+        process.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+        process.start(QCoreApplication::applicationFilePath(), args);
+        process.waitForFinished((timeout + 10) * 1000);
+
+        QJsonObject result;
+        for (const auto &line : process.readAllStandardOutput().split('\n')) {
+            if (line.startsWith('{')) {
+                result = QJsonDocument::fromJson(line).object();
+            }
+        }
+        if (process.exitCode() != 0 || result.isEmpty()) {
+            std::printf("%-20s failed\n", qPrintable(QFileInfo(file).fileName()));
+            failed += 1;
+            continue;
+        }
+        std::printf("%-20s %9.1f %7.2fms %7.2fms %7.2fms %11.0f %9.1f\n",
+            qPrintable(result["file"].toString()),
+            result["fps"].toDouble(),
+            result["decodeMs"].toDouble(),
+            result["convertMs"].toDouble(),
+            result["convertMsP90"].toDouble(),
+            result["packetsPerSecond"].toDouble(),
+            result["peakRssMB"].toDouble()
+        );
+    }
+    return failed > 0 ? 1 : 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("nekoav-bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Decode the files as fast as possible with null sinks, report the throughput");
+    parser.addHelpOption();
+    parser.addPositionalArgument("files", "Media files to benchmark");
+    QCommandLineOption generateOption("generate", "Generate the synthetic test media into <dir> by the ffmpeg cli and exit", "dir");
+    QCommandLineOption sizeOption("size", "Video size of the generated media", "WxH", "1920x1080");
+    QCommandLineOption durationOption("duration", "Seconds of the generated media", "seconds", "20");
+    QCommandLineOption rgbaOption("rgba", "Only accept RGBA frames, measure the full conversion");
+    QCommandLineOption timeoutOption("timeout", "Max seconds of a file", "seconds", "300");
+    QCommandLineOption runOption("run", "Run a file in this process, print a json line");
+    runOption.setFlags(QCommandLineOption::HiddenFromHelp);
+    parser.addOptions({generateOption, sizeOption, durationOption, rgbaOption, timeoutOption, runOption});
+    parser.process(app);
+
+    if (parser.isSet(generateOption)) {
+        return Generate(parser.value(generateOption), parser.value(sizeOption), parser.value(durationOption).toInt());
+    }
+    auto files = parser.positionalArguments();
+    if (files.isEmpty()) {
+        parser.showHelp(1);
+    }
+    int timeout = parser.value(timeoutOption).toInt();
+    if (parser.isSet(runOption)) {
+        return RunOne(app, files.first(), parser.isSet(rgbaOption), timeout);
+    }
+    return RunAll(files, parser.isSet(rgbaOption), timeout);
+}
@@ -0,0 +1,21 @@
+-- Headless decode benchmark of NekoAV, no window, GL context or sound card
+-- xmake run nekoav-bench --generate ./media && xmake run nekoav-bench ./media/*
+target("nekoav-bench")
+    add_rules("qt.console")
+
+    add_frameworks("QtCore", "QtGui", "QtWidgets")
+    add_frameworks("QtOpenGL", "QtOpenGLWidgets")
+
+    add_deps("nekoav")
+
+    if is_plat("linux") then 
+        add_packages("libavformat", "libavutil", "libavcodec", "libswresample", "libswscale", "libavfilter")
+        add_packages("libsdl")
+    else 
+        add_packages("ffmpeg")
+        add_packages("miniaudio")
+        add_syslinks("psapi")
+    end
+
+    add_files("./*.cpp")
+target_end()
@@ -1,10 +1,12 @@
 #include "../player/videocanvas.hpp"
+#include "../nekoav/nekofmt.hpp"
 #include "../net/bilibili.hpp"
 #include "../common/myGlobalLog.hpp"
 #include "testregister.hpp"
 #include "ui_biliplay.h"
 
 #include <QInputDialog>
+#include <algorithm>
 
 ZOOD_TEST(Network, BiliPlay) {
     auto root = new QWidget();
@@ -12,6 +14,7 @@ ZOOD_TEST(Network, BiliPlay) {
     auto player = new NekoMediaPlayer(root);
     auto bili = new BiliClient(root);
     auto audioOutput = new NekoAudioOutput(root);
+    auto dash = new NekoDashInputFormat(root);
 
     player->setAudioOutput(audioOutput);
 
@@ -107,14 +110,38 @@ ZOOD_TEST(Network, BiliPlay) {
                     canvas->setDanmakuList(dan.value());
                 }
             });
-            bili->fetchVideoSource(cid.value(), bvid).then([=](const Result<BiliVideoSource> &src) mutable {
-                if (src) {
-                    player->setHttpReferer("https://www.bilibili.com");
-                    player->setHttpUseragent("Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537");
-                    player->setOption("multiple_requests", "1");
-                    player->setSource(src.value().urls.first());
-                    player->play();
+            bili->fetchVideoSource(cid.value(), bvid, true).then([=](const Result<BiliVideoSource> &src) mutable {
+                if (!src || src.value().videoStreams.isEmpty() || src.value().audioStreams.isEmpty()) {
+                    return;
+                }
+                auto &source = src.value();
+
+                // All qualities in one codec, the switching could not change the decoder, prefer avc
+                QString codec = source.videoStreams.first().codecs.section('.', 0, 0);
+                for (auto &stream : source.videoStreams) {
+                    if (stream.codecs.startsWith("avc1")) {
+                        codec = "avc1";
+                        break;
+                    }
+                }
+                dash->clearVideoRepresentations();
+                for (auto &stream : source.videoStreams) {
+                    if (stream.codecs.startsWith(codec)) {
+                        dash->addVideoRepresentation(stream.url, stream.bandwidth, stream.description);
+                    }
+                }
+                auto audio = std::max_element(source.audioStreams.begin(), source.audioStreams.end(), [](auto &a, auto &b) {
+                    return a.bandwidth < b.bandwidth;
+                });
+                dash->setAudioSource(audio->url);
+                for (auto setOption : {&NekoDashInputFormat::setVideoOption, &NekoDashInputFormat::setAudioOption}) {
+                    (dash->*setOption)("referer", "https://www.bilibili.com");
+                    (dash->*setOption)("user_agent", "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537");
+                    (dash->*setOption)("multiple_requests", "1");
                 }
+                player->setInputFormat(static_cast<AVInputFormat*>(dash->getAVInputFormat()));
+                player->setSource(source.videoStreams.first().url);
+                player->play();
             });
         });
     };
@@ -155,6 +182,11 @@ ZOOD_TEST(Network, BiliPlay) {
     QObject::connect(player, &NekoMediaPlayer::seekableChanged, [=](bool v) {
         play.progressSlider->setEnabled(v);
     });
+    QObject::connect(player, &NekoMediaPlayer::statisticsUpdated, [=](const NekoPlaybackStatistics &stats) {
+        if (!stats.representation.isEmpty()) {
+            ZOOD_QLOG("Dash representation %1, switches %2", stats.representation, stats.representationSwitches.join("; "));
+        }
+    });
 
     return root;
 }
\ No newline at end of file
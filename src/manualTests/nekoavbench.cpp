@@ -0,0 +1,358 @@
+#include "../nekoav/nekoprivate.hpp"
+#include "../nekoav/nekosimd.hpp"
+#include "testregister.hpp"
+
+#include <QElapsedTimer>
+#include <QStringList>
+#include <algorithm>
+#include <deque>
+#include <thread>
+
+using namespace NekoAV;
+
+namespace {
+
+/**
+ * @brief The PacketQueue before the ring, copied from the baseline as the comparison
+ *
+ * Only the wait has a timeout, the notify is not under condMutex so the old wait may miss the last packet,
+ * the demuxer hid it by putting more, a bench has no more packets.
+ */
+class MutexPacketQueue {
+    public:
+        void put(AVPacket *packet) {
+            if (!packet) {
+                return;
+            }
+            std::lock_guard locker(mutex);
+            packets.push_back(packet);
+            // Sums packet to let us known the buffered video
+            if (!IsSpecialPacket(packet)) {
+                packetsDuration += packet->duration;
+            }
+            cond.notify_one();
+        }
+        AVPacket *get(bool block = true) {
+            AVPacket *ret = nullptr;
+            mutex.lock();
+            while (packets.empty()) {
+                mutex.unlock();
+                if (!block) {
+                    return nullptr;
+                }
+                if (stop) {
+                    return nullptr;
+                }
+
+                std::unique_lock lock(condMutex);
+                cond.wait_for(lock, 10ms);
+
+                mutex.lock();
+            }
+            ret = packets.front();
+            packets.pop_front();
+            if (!IsSpecialPacket(ret)) {
+                packetsDuration -= ret->duration;
+            }
+
+            mutex.unlock();
+
+            return ret;
+        }
+        size_t size() const {
+            std::lock_guard locker(mutex);
+            return packets.size();
+        }
+        int64_t duration() const {
+            std::lock_guard locker(mutex);
+            return packetsDuration;
+        }
+    private:
+        std::deque<AVPacket*>   packets;
+        std::condition_variable cond;
+        std::mutex              condMutex;
+        Atomic<int64_t>         packetsDuration = 0; //< Sums of packet duration
+        Atomic<bool>            stop = false;
+        mutable std::mutex      mutex;
+};
+
+/**
+ * @brief Push n packets from one thread and pop them in another one
+ *
+ * @return double packets per second
+ */
+template <typename Queue>
+double RunQueueBench(Queue &queue, std::vector<AVPacket*> &packets, int rounds) {
+    QElapsedTimer timer;
+    timer.start();
+
+    std::thread consumer([&]() {
+        size_t n = packets.size() * rounds;
+        for (size_t i = 0; i < n; i++) {
+            queue.get();
+        }
+    });
+    for (int r = 0; r < rounds; r++) {
+        for (auto pak : packets) {
+            // Keep the queue in a bounded size like the demuxer
+            while (queue.size() > 4000) {
+                std::this_thread::yield();
+            }
+            queue.put(pak);
+        }
+    }
+    consumer.join();
+
+    auto ns = timer.nsecsElapsed();
+    return double(packets.size()) * rounds / (ns / 1000000000.0);
+}
+
+}
+
+ZOOD_TEST_C(NekoAV, PacketQueueBench) {
+    constexpr int numPackets = 4096;
+    constexpr int rounds = 256;
+
+    std::vector<AVPacket*> packets;
+    for (int i = 0; i < numPackets; i++) {
+        auto pak = av_packet_alloc();
+        pak->pts = i;
+        pak->duration = 1;
+        packets.push_back(pak);
+    }
+
+    MutexPacketQueue mutexQueue;
+    PacketQueue      ringQueue;
+
+    auto mutexRate = RunQueueBench(mutexQueue, packets, rounds);
+    auto ringRate = RunQueueBench(ringQueue, packets, rounds);
+
+    ZoodLogString(QString("baseline deque queue : %1 packets/s").arg(mutexRate, 0, 'f', 0));
+    ZoodLogString(QString("spsc ring queue      : %1 packets/s").arg(ringRate, 0, 'f', 0));
+    ZoodLogString(QString("speedup              : %1x").arg(ringRate / mutexRate, 0, 'f', 2));
+
+    EXPECT_EQ(ringQueue.size(), size_t(0));
+    EXPECT_EQ(ringQueue.duration(), int64_t(0));
+    EXPECT_EQ(mutexQueue.duration(), int64_t(0));
+
+    for (auto pak : packets) {
+        av_packet_free(&pak);
+    }
+}
+
+namespace {
+
+/**
+ * @brief Convert a YUV420P picture to RGBA for rounds times
+ *
+ * @return double ms per frame
+ */
+double RunSwsBench(int width, int height, int slices, int rounds) {
+    AVPtr<AVFrame> src(av_frame_alloc());
+    AVPtr<AVFrame> dst(av_frame_alloc());
+    src->width = dst->width = width;
+    src->height = dst->height = height;
+    src->format = AV_PIX_FMT_YUV420P;
+    dst->format = AV_PIX_FMT_RGBA;
+    av_frame_get_buffer(src.get(), 32);
+    av_frame_get_buffer(dst.get(), 32);
+
+    // Some gradient, keep the converter away from the fast path of a flat picture
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            src->data[0][y * src->linesize[0] + x] = (x + y) & 0xFF;
+        }
+    }
+    for (int y = 0; y < height / 2; y++) {
+        for (int x = 0; x < width / 2; x++) {
+            src->data[1][y * src->linesize[1] + x] = x & 0xFF;
+            src->data[2][y * src->linesize[2] + x] = y & 0xFF;
+        }
+    }
+
+    SwsSlicer slicer;
+    if (!slicer.configure(width, height, AV_PIX_FMT_YUV420P, AV_PIX_FMT_RGBA, slices)) {
+        return -1.0;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < rounds; i++) {
+        if (slicer.convert(src.get(), dst.get()) < 0) {
+            return -1.0;
+        }
+    }
+    return timer.nsecsElapsed() / 1000000.0 / rounds;
+}
+
+}
+
+ZOOD_TEST_C(NekoAV, SwsSliceBench) {
+    constexpr int rounds = 50;
+    const QSize sizes[] = {
+        QSize(1920, 1080),
+        QSize(3840, 2160),
+    };
+
+    for (auto size : sizes) {
+        int slices = SwsSlicer::DefaultSlices(size.width(), size.height());
+        auto single = RunSwsBench(size.width(), size.height(), 1, rounds);
+        auto sliced = RunSwsBench(size.width(), size.height(), slices, rounds);
+
+        ZoodLogString(QString("%1x%2 YUV420P => RGBA 1 slice  : %3 ms/frame").arg(size.width()).arg(size.height()).arg(single, 0, 'f', 2));
+        ZoodLogString(QString("%1x%2 YUV420P => RGBA %3 slices : %4 ms/frame").arg(size.width()).arg(size.height()).arg(slices).arg(sliced, 0, 'f', 2));
+
+        EXPECT_GT(single, 0.0);
+        EXPECT_GT(sliced, 0.0);
+    }
+}
+
+ZOOD_TEST_C(NekoAV, LatencyHistogramBench) {
+    constexpr int samples = 1000000;
+
+    // 1ms .. 10ms uniform, so P50 is about 5.5ms and P99 is about 9.9ms
+    LatencyHistogram histogram;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < samples; i++) {
+        histogram.add(1000 + (int64_t(i) * 7919) % 9000);
+    }
+    auto ns = timer.nsecsElapsed();
+
+    auto p50 = histogram.percentile(0.5);
+    auto p99 = histogram.percentile(0.99);
+
+    ZoodLogString(QString("histogram add : %1 ns").arg(double(ns) / samples, 0, 'f', 2));
+    ZoodLogString(QString("P50 %1 us P99 %2 us").arg(p50).arg(p99));
+
+    EXPECT_EQ(histogram.count(), uint64_t(samples));
+    EXPECT_GE(p50, 5500);
+    EXPECT_LE(p50, 5500 * 5 / 4);
+    EXPECT_GE(p99, 9900);
+    EXPECT_LE(p99, 9900 * 5 / 4);
+}
+
+namespace {
+
+/**
+ * @brief Run gain + interleave on 10 seconds of 48kHz float audio
+ *
+ * @return double ms of the 10 seconds, for gain and interleave
+ */
+std::pair<double, double> RunAudioKernelBench(const AudioKernels &kernels, int channels) {
+    constexpr size_t samples = 48000 * 10;
+    constexpr size_t chunk = 1024; //< Like a frame of AAC
+
+    std::vector<std::vector<float>> planes(channels, std::vector<float>(samples));
+    for (int c = 0; c < channels; c++) {
+        for (size_t i = 0; i < samples; i++) {
+            planes[c][i] = float((i * 31 + c * 7) % 2000) / 1000.0f - 1.0f;
+        }
+    }
+    std::vector<float> packed(samples * channels);
+
+    QElapsedTimer timer;
+    timer.start();
+    for (size_t i = 0; i < samples; i += chunk) {
+        const uint8_t *src[8];
+        for (int c = 0; c < channels; c++) {
+            src[c] = reinterpret_cast<const uint8_t*>(planes[c].data() + i);
+        }
+        kernels.interleave32(packed.data() + i * channels, src, channels, qMin(chunk, samples - i));
+    }
+    double interleave = timer.nsecsElapsed() / 1000000.0;
+
+    timer.restart();
+    for (size_t i = 0; i < packed.size(); i += chunk * channels) {
+        size_t n = qMin(chunk * channels, packed.size() - i);
+        kernels.gainF32(packed.data() + i, packed.data() + i, n, 0.5f);
+    }
+    double gain = timer.nsecsElapsed() / 1000000.0;
+    return {gain, interleave};
+}
+
+/**
+ * @brief Run every kernel and the scalar one on the same input, the odd lengths cover the tails
+ *
+ * @return QStringList The kernels whose output differs from the scalar one
+ */
+QStringList CompareAudioKernels(const AudioKernels &kernels, const AudioKernels &scalar) {
+    constexpr size_t samples = 1003;
+    QStringList mismatched;
+
+    // Gain, out of range on purpose for the clipping
+    std::vector<float> f32(samples * 8), f32Out(f32.size()), f32Expected(f32.size());
+    std::vector<int16_t> s16(samples * 8), s16Out(s16.size()), s16Expected(s16.size());
+    for (size_t i = 0; i < f32.size(); i++) {
+        f32[i] = float(int(i * 37 % 4001) - 2000) / 1000.0f;
+        s16[i] = int16_t(int(i * 7919 % 65536) - 32768);
+    }
+    for (float gain : {0.37f, 1.0f, 1.7f}) {
+        kernels.gainF32(f32Out.data(), f32.data(), f32.size(), gain);
+        scalar.gainF32(f32Expected.data(), f32.data(), f32.size(), gain);
+        if (f32Out != f32Expected) {
+            mismatched.push_back(QString("gainF32 x%1").arg(gain));
+        }
+        kernels.gainS16(s16Out.data(), s16.data(), s16.size(), gain);
+        scalar.gainS16(s16Expected.data(), s16.data(), s16.size(), gain);
+        if (s16Out != s16Expected) {
+            mismatched.push_back(QString("gainS16 x%1").arg(gain));
+        }
+    }
+
+    // Interleave, stereo and 7.1 (the 8 x 8 transpose)
+    for (int channels : {2, 8}) {
+        const uint8_t *f32Planes[8];
+        const uint8_t *s16Planes[8];
+        for (int c = 0; c < channels; c++) {
+            f32Planes[c] = reinterpret_cast<const uint8_t*>(f32.data() + c * samples);
+            s16Planes[c] = reinterpret_cast<const uint8_t*>(s16.data() + c * samples);
+        }
+        size_t n = samples * channels;
+        kernels.interleave32(f32Out.data(), f32Planes, channels, samples);
+        scalar.interleave32(f32Expected.data(), f32Planes, channels, samples);
+        if (!std::equal(f32Out.begin(), f32Out.begin() + n, f32Expected.begin())) {
+            mismatched.push_back(QString("interleave32 %1ch").arg(channels));
+        }
+        kernels.interleave16(s16Out.data(), s16Planes, channels, samples);
+        scalar.interleave16(s16Expected.data(), s16Planes, channels, samples);
+        if (!std::equal(s16Out.begin(), s16Out.begin() + n, s16Expected.begin())) {
+            mismatched.push_back(QString("interleave16 %1ch").arg(channels));
+        }
+    }
+    return mismatched;
+}
+
+}
+
+ZOOD_TEST_C(NekoAV, AudioKernelBench) {
+    const int layouts[] = {2, 8}; //< Stereo and 7.1
+    auto &best = GetAudioKernels();
+    auto scalar = GetAudioKernels("scalar");
+
+    for (int channels : layouts) {
+        auto [scalarGain, scalarInterleave] = RunAudioKernelBench(*scalar, channels);
+        auto [bestGain, bestInterleave] = RunAudioKernelBench(best, channels);
+
+        ZoodLogString(QString("48kHz %1ch float, 10s of audio").arg(channels));
+        ZoodLogString(QString("  gain       scalar %1 ms, %2 %3 ms").arg(scalarGain, 0, 'f', 3).arg(best.name).arg(bestGain, 0, 'f', 3));
+        ZoodLogString(QString("  interleave scalar %1 ms, %2 %3 ms").arg(scalarInterleave, 0, 'f', 3).arg(best.name).arg(bestInterleave, 0, 'f', 3));
+
+        EXPECT_GT(scalarGain, 0.0);
+        EXPECT_GT(bestGain, 0.0);
+    }
+
+    // The vectorized ones must give the same result, every one this cpu supports
+    for (auto name : {"sse2", "avx2"}) {
+        auto kernels = GetAudioKernels(name);
+        if (!kernels) {
+            ZoodLogString(QString("%1 not supported, skipped").arg(name));
+            continue;
+        }
+        auto mismatched = CompareAudioKernels(*kernels, *scalar);
+        if (!mismatched.isEmpty()) {
+            ZoodLogString(QString("%1 differs from scalar: %2").arg(name, mismatched.join(", ")));
+        }
+        EXPECT_TRUE(mismatched.isEmpty());
+    }
+}
@@ -34,6 +34,13 @@ target("zoodWidgetTest")
     -- add_frameworks("QtWebEngineCore", "QtWebChannel");
 
 	add_deps("ui", "nekoav", "common", "net")
+
+    -- NekoAV benchmarks use the private headers
+    if is_plat("linux") then 
+        add_packages("libavformat", "libavutil", "libavcodec", "libswresample", "libswscale", "libavfilter")
+    else 
+        add_packages("ffmpeg")
+    end
 	add_files("../../resources/resources.qrc")
 
     -- Main
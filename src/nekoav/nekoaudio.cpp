@@ -1,5 +1,10 @@
 #define NEKO_SOURCE
 #include "nekoav.hpp"
+#include "nekosimd.hpp"
+#include <QThread>
+#include <algorithm>
+#include <atomic>
+#include <vector>
 #include <mutex>
 
 #define NEKOAV_DEBUG
@@ -30,6 +35,16 @@ extern "C" {
 
 namespace NekoAV {
 
+#if !defined(NEKOAV_MINIAUDIO)
+static void InitSDLAudio() {
+    static std::once_flag once;
+    std::call_once(once, []() {
+        SDL_Init(SDL_INIT_AUDIO);
+        qDebug() << "[SDL Audio backend] " << SDL_GetCurrentAudioDriver();
+    });
+}
+#endif
+
 // Impl for audio device
 class AudioOutputPrivate {
     public:
@@ -42,15 +57,30 @@ class AudioOutputPrivate {
 #else
         SDL_AudioSpec     spec;
         SDL_AudioDeviceID device;
-        std::vector<uint8_t> mixbuffer; //< Temp buffer for change the volume
 #endif
+        AudioSampleFormat format = AudioSampleFormat::Float32;
         float volume = 1.0f;
         bool  muted = false;
+        qreal latency = 0.0; //< Seconds of the device buffer
+
+        std::once_flag           nativeOnce;
+        QList<AudioDeviceFormat> nativeFormats;
+
+        // Null device, the callback is pulled by nullThread without clock
+        static constexpr uint32_t NullPeriodFrames = 1024;
+        bool              nullDevice = false;
+        QThread          *nullThread = nullptr;
+        std::atomic<bool> nullPaused = true;
+        std::atomic<bool> nullQuit = false;
+        uint32_t          nullPeriodBytes = 0;
 
         bool open(AudioSampleFormat format, int sample_rate, int channels);
         bool close();
+        void runNull();
 
+        void queryNativeFormats();
         void run(void *buffer, uint32_t bytes);
+        void applyVolume(void *buffer, uint32_t bytes);
         void pause(bool v);
         bool isPaused();
 };
@@ -60,6 +90,18 @@ inline bool AudioOutputPrivate::open(AudioSampleFormat format, int sample_rate,
         // Close previous
         close();
     }
+    this->format = format;
+    if (nullDevice) {
+        nullPeriodBytes = NullPeriodFrames * GetBytesPerFrame(format, channels);
+        nullPaused = true;
+        nullQuit = false;
+        nullThread = QThread::create(&AudioOutputPrivate::runNull, this);
+        nullThread->setObjectName("NekoAV NullAudioDevice");
+        nullThread->start();
+        latency = 0.0;
+        deviceInited = true;
+        return true;
+    }
 #if defined(NEKOAV_MINIAUDIO)
     // Convert to miniaudio format
     ma_format fmt;
@@ -89,12 +131,11 @@ inline bool AudioOutputPrivate::open(AudioSampleFormat format, int sample_rate,
     if (ma_device_init(nullptr, &conf, &device) != MA_SUCCESS) {
         return false;
     }
+    latency = qreal(device.playback.internalPeriodSizeInFrames) * device.playback.internalPeriods / device.playback.internalSampleRate;
     deviceInited = true;
     return true;
 #else
-    static std::once_flag once;
-    std::call_once(once, SDL_Init, SDL_INIT_AUDIO);
-    qDebug() << "[SDL Audio backend] " << SDL_GetCurrentAudioDriver();
+    InitSDLAudio();
 
     // Convert audio format to sdl format
     SDL_AudioFormat fmt;
@@ -117,12 +158,14 @@ inline bool AudioOutputPrivate::open(AudioSampleFormat format, int sample_rate,
     // spec.samples = 1024;
     spec.userdata = this;
 
-    device = SDL_OpenAudioDevice(nullptr, false, &spec, nullptr, 0);
+    SDL_AudioSpec obtained;
+    device = SDL_OpenAudioDevice(nullptr, false, &spec, &obtained, 0);
     if (device == 0) {
         // Failed to open audio device
         qDebug() << "[SDL Audio backend] Failed to open audio device :" << SDL_GetError();
         return false;
     }
+    latency = qreal(obtained.samples) / obtained.freq;
     deviceInited = true;
     return true;
 #endif
@@ -133,6 +176,14 @@ inline bool AudioOutputPrivate::close() {
         // No inited, failed to close it
         return false;
     }
+    if (nullThread) {
+        nullQuit = true;
+        nullThread->wait();
+        delete nullThread;
+        nullThread = nullptr;
+        deviceInited = false;
+        return true;
+    }
 #if defined(NEKOAV_MINIAUDIO)
     ma_device_uninit(&device);
 #else
@@ -142,10 +193,70 @@ inline bool AudioOutputPrivate::close() {
     deviceInited = false;
     return true;
 }
+inline void AudioOutputPrivate::queryNativeFormats() {
+    auto add = [this](AudioSampleFormat fmt, int sampleRate, int channels) {
+        nativeFormats.push_back({fmt, sampleRate, channels});
+    };
+    auto addAny = [&](int sampleRate, int channels) {
+        // Any sample format, prefer the float one
+        for (auto fmt : {AudioSampleFormat::Float32, AudioSampleFormat::Sint16, AudioSampleFormat::Sint32, AudioSampleFormat::Uint8}) {
+            add(fmt, sampleRate, channels);
+        }
+    };
+#if defined(NEKOAV_MINIAUDIO)
+    ma_context context;
+    if (ma_context_init(nullptr, 0, nullptr, &context) != MA_SUCCESS) {
+        return;
+    }
+    ma_device_info info;
+    if (ma_context_get_device_info(&context, ma_device_type_playback, nullptr, &info) == MA_SUCCESS) {
+        for (ma_uint32 i = 0; i < info.nativeDataFormatCount; i++) {
+            auto &f = info.nativeDataFormats[i];
+            switch (f.format) {
+                case ma_format_u8 : add(AudioSampleFormat::Uint8, f.sampleRate, f.channels); break;
+                case ma_format_s16 : add(AudioSampleFormat::Sint16, f.sampleRate, f.channels); break;
+                case ma_format_s32 : add(AudioSampleFormat::Sint32, f.sampleRate, f.channels); break;
+                case ma_format_f32 : add(AudioSampleFormat::Float32, f.sampleRate, f.channels); break;
+                case ma_format_unknown : addAny(f.sampleRate, f.channels); break;
+                default : break; //< S24, we donot output it
+            }
+        }
+    }
+    ma_context_uninit(&context);
+#else
+    InitSDLAudio();
+    // SDL only tells the preferred one
+    SDL_AudioSpec spec;
+#if SDL_VERSION_ATLEAST(2, 24, 0)
+    char *name = nullptr;
+    if (SDL_GetDefaultAudioInfo(&name, &spec, 0) != 0) {
+        return;
+    }
+    SDL_free(name);
+#elif SDL_VERSION_ATLEAST(2, 0, 16)
+    if (SDL_GetAudioDeviceSpec(0, 0, &spec) != 0) {
+        return;
+    }
+#else
+    return;
+#endif
+    switch (spec.format) {
+        case AUDIO_U8 : add(AudioSampleFormat::Uint8, spec.freq, spec.channels); break;
+        case AUDIO_S16SYS : add(AudioSampleFormat::Sint16, spec.freq, spec.channels); break;
+        case AUDIO_S32SYS : add(AudioSampleFormat::Sint32, spec.freq, spec.channels); break;
+        case AUDIO_F32SYS : add(AudioSampleFormat::Float32, spec.freq, spec.channels); break;
+        default : addAny(spec.freq, spec.channels); break;
+    }
+#endif
+}
 inline void AudioOutputPrivate::pause(bool v) {
     if (!deviceInited) {
         return;
     }
+    if (nullThread) {
+        nullPaused = v;
+        return;
+    }
 #if defined(NEKOAV_MINIAUDIO)
     if (v) {
         ma_device_stop(&device);
@@ -161,6 +272,9 @@ inline bool AudioOutputPrivate::isPaused() {
     if (!deviceInited) {
         // BTK_THROW(std::runtime_error("AudioDevice is not initialized"));
     }
+    if (nullThread) {
+        return nullPaused;
+    }
 #if defined(NEKOAV_MINIAUDIO)
     return ma_device_get_state(&device) == ma_device_state_stopped;
 #else
@@ -178,39 +292,43 @@ inline void AudioOutputPrivate::run(void *buffer, uint32_t bytes) {
     }
     if (muted) {
         callback(buffer, bytes);
-        ::memset(buffer, 0, bytes);
+        ::memset(buffer, format == AudioSampleFormat::Uint8 ? 0x80 : 0, bytes);
         return;
     }
 
-#if defined(NEKOAV_MINIAUDIO)
-    // Miniaudio 
-    ma_device_set_master_volume(&device, volume);
+    // Fill the device buffer, and apply the volume in place
     callback(buffer, bytes);
-#else
-    // SDL
-    if (volume == 1.0f) {
-        // No volume need be applied, 
-        callback(buffer, bytes);
-        return;
+    if (volume != 1.0f) {
+        applyVolume(buffer, bytes);
     }
-    // Check mixbuffer
-    if (mixbuffer.size() < bytes) {
-        mixbuffer.resize(bytes);
+}
+inline void AudioOutputPrivate::runNull() {
+    std::vector<uint8_t> buffer(nullPeriodBytes);
+    while (!nullQuit) {
+        if (nullPaused || callback == nullptr) {
+            QThread::msleep(1);
+            continue;
+        }
+        // No clock, as fast as the callback gives, it sleeps by itself when the data is not ready
+        run(buffer.data(), buffer.size());
+    }
+}
+inline void AudioOutputPrivate::applyVolume(void *buffer, uint32_t bytes) {
+    auto &kernels = GetAudioKernels();
+    switch (format) {
+        case AudioSampleFormat::Uint8 : 
+            kernels.gainU8(static_cast<uint8_t*>(buffer), static_cast<uint8_t*>(buffer), bytes, volume); 
+            break;
+        case AudioSampleFormat::Sint16 : 
+            kernels.gainS16(static_cast<int16_t*>(buffer), static_cast<int16_t*>(buffer), bytes / sizeof(int16_t), volume); 
+            break;
+        case AudioSampleFormat::Sint32 : 
+            kernels.gainS32(static_cast<int32_t*>(buffer), static_cast<int32_t*>(buffer), bytes / sizeof(int32_t), volume); 
+            break;
+        case AudioSampleFormat::Float32 : 
+            kernels.gainF32(static_cast<float*>(buffer), static_cast<float*>(buffer), bytes / sizeof(float), volume); 
+            break;
     }
-
-    // Fill current buffer
-    callback(mixbuffer.data(), bytes);
-    // Zero out buffer
-    ::memset(buffer, 0, bytes);
-    // Mix it
-    SDL_MixAudioFormat(
-        static_cast<uint8_t*>(buffer), 
-        mixbuffer.data(), 
-        spec.format, 
-        bytes, 
-        volume * 128 //< Convert normalized values [0, 1] => [0, 128]
-    );
-#endif
 }
 
 
@@ -241,6 +359,12 @@ bool AudioOutput::isOpen() const {
 bool AudioOutput::isMuted() const {
     return d->muted;
 }
+void AudioOutput::setNullDevice(bool enabled) {
+    d->nullDevice = enabled;
+}
+bool AudioOutput::isNullDevice() const {
+    return d->nullDevice;
+}
 void AudioOutput::setCallback(const Routinue &cb) {
     d->callback = cb;
 }
@@ -257,6 +381,44 @@ void AudioOutput::setMuted(bool v) {
 float AudioOutput::volume() const {
     return d->volume;
 }
+qreal AudioOutput::latency() const {
+    return d->latency;
+}
+QList<AudioDeviceFormat> AudioOutput::nativeFormats() const {
+    if (d->nullDevice) {
+        // Anything is native
+        return { };
+    }
+    std::call_once(d->nativeOnce, &AudioOutputPrivate::queryNativeFormats, d.data());
+    return d->nativeFormats;
+}
+AudioDeviceFormat AudioOutput::closestNativeFormat(const AudioDeviceFormat &wanted) const {
+    auto formats = nativeFormats();
+    if (formats.isEmpty()) {
+        // Unknown, let the backend convert it
+        return wanted;
+    }
+    // Resampling costs most, then remixing the channels, then converting the samples
+    auto score = [&](const AudioDeviceFormat &f) {
+        int s = 0;
+        s += (f.sampleRate == 0 || f.sampleRate == wanted.sampleRate) ? 4 : 0;
+        s += (f.channels == 0 || f.channels == wanted.channels) ? 2 : 0;
+        s += (f.format == wanted.format) ? 1 : 0;
+        return s;
+    };
+    auto best = std::max_element(formats.begin(), formats.end(), [&](const auto &a, const auto &b) {
+        return score(a) < score(b);
+    });
+
+    AudioDeviceFormat result = *best;
+    if (result.sampleRate == 0) {
+        result.sampleRate = wanted.sampleRate;
+    }
+    if (result.channels == 0) {
+        result.channels = wanted.channels;
+    }
+    return result;
+}
 
 }
 
@@ -1,75 +1,244 @@
 #define NEKO_SOURCE
 #include "nekoav.hpp"
 #include "nekoprivate.hpp"
+#include "nekosimd.hpp"
 #include <QAbstractEventDispatcher>
-#include <QRegularExpression>
 #include <QIODevice>
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <iterator>
 #include <thread>
+#include <utility>
 
 #define NEKOAV_TIME_BASE 1000000.0
 
 namespace NekoAV {
 
+// Packet Pool Part
+PacketPool::~PacketPool() {
+    for (auto list : {cache, stack.load()}) {
+        while (list) {
+            auto p = list;
+            list = static_cast<AVPacket*>(p->opaque);
+            av_packet_free(&p);
+        }
+    }
+}
+AVPacket *PacketPool::acquire() {
+    if (!cache) {
+        // Take all the released ones, one atomic op for many packets
+        cache = stack.exchange(nullptr, std::memory_order_acquire);
+    }
+    if (cache) {
+        auto p = cache;
+        cache = static_cast<AVPacket*>(p->opaque);
+        p->opaque = nullptr;
+        idle -= 1;
+        recycled += 1;
+        return p;
+    }
+    allocated += 1;
+    return av_packet_alloc();
+}
+void PacketPool::release(AVPacket *packet) {
+    if (IsSpecialPacket(packet)) {
+        return;
+    }
+    av_packet_unref(packet);
+
+    if (idle.fetch_add(1) >= MaxIdlePackets) {
+        idle -= 1;
+        av_packet_free(&packet);
+        return;
+    }
+    AVPacket *top = stack.load(std::memory_order_relaxed);
+    do {
+        packet->opaque = top;
+    }
+    while (!stack.compare_exchange_weak(top, packet, std::memory_order_release, std::memory_order_relaxed));
+}
+PacketGuard::~PacketGuard() {
+    if (pool) {
+        pool->release(packet);
+    }
+    else if (!IsSpecialPacket(packet)) {
+        av_packet_free(&packet);
+    }
+}
+
 // Packet Queue Part
-PacketQueue::PacketQueue() = default;
+PacketQueue::PacketQueue(PacketPool *pool, size_t cap) : pool(pool) {
+    // Round up to power of 2, so we can mask the index
+    size_t n = 1;
+    while (n < cap + UngetReserve) {
+        n <<= 1;
+    }
+    ring.reset(new AVPacket*[n]);
+    infos.reset(new SlotInfo[n]);
+    mask = n - 1;
+    limit = n - UngetReserve;
+}
 PacketQueue::~PacketQueue() {
-    flush();
+    clear();
 }
 
-void PacketQueue::put(AVPacket *packet) {
-    if (!packet) {
+template <typename Pred>
+void PacketQueue::sleepUntil(Atomic<bool> &waitting, std::condition_variable &c, Pred &&pred) {
+    std::unique_lock lock(condMutex);
+    waitting = true;
+    // Check again after the flag published, the other side may changed the state before it saw the flag
+    while (!pred()) {
+        c.wait(lock);
+    }
+    waitting = false;
+}
+void PacketQueue::wake(Atomic<bool> &waitting, std::condition_variable &c) {
+    if (!waitting) {
+        // Nobody sleeping, no syscall
         return;
     }
-    std::lock_guard locker(mutex);
-    packets.push_back(packet);
-    // Sums packet to let us known the buffered video
-    if (!IsSpecialPacket(packet)) {
-        packetsDuration += packet->duration;
+    std::lock_guard lock(condMutex);
+    c.notify_one();
+}
+void PacketQueue::advanceHead(size_t newHead) {
+    size_t n = newHead - head.load(std::memory_order_relaxed);
+    ungetDepth = ungetDepth > n ? ungetDepth - n : 0;
+    head.store(newHead);
+
+    // Space made, the producer may sleep on the full ring
+    wake(producerWaitting, notFullCond);
+}
+void PacketQueue::release(AVPacket *packet) {
+    PacketGuard guard(pool, packet);
+}
+
+void PacketQueue::push(AVPacket *packet) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    auto &info = infos[t & mask];
+    info.special = IsSpecialPacket(packet);
+    if (!info.special) {
+        // Sums packet to let us known the buffered video
+        info.pts = packet->pts;
+        info.duration = packet->duration;
+        info.key = packet->flags & AV_PKT_FLAG_KEY;
+        putDuration += packet->duration;
+        putBytes += packet->size;
     }
-    cond.notify_one();
+    ring[t & mask] = packet;
+    tail.store(t + 1);
+
+    wake(consumerWaitting, notEmptyCond);
 }
-void PacketQueue::unget(AVPacket *packet) {
-    std::lock_guard locker(mutex);
-    packets.push_front(packet);
+void PacketQueue::put(AVPacket *packet) {
+    if (tail.load(std::memory_order_relaxed) - head.load() >= limit) {
+        // Full, the demuxer keeps the queue away from it by tooMuchBuffered, so it is rare
+        sleepUntil(producerWaitting, notFullCond, [this]() {
+            return tail.load(std::memory_order_relaxed) - head.load() < limit || stop;
+        });
+        if (stop) {
+            release(packet);
+            return;
+        }
+    }
+    push(packet);
+}
+bool PacketQueue::tryPut(AVPacket *packet) {
+    if (tail.load(std::memory_order_relaxed) - head.load() >= limit) {
+        return false;
+    }
+    push(packet);
+    return true;
+}
+bool PacketQueue::unget(AVPacket *packet) {
+    // The producer may still write to (head + limit), so we can only go back in the reserved slots
+    if (ungetDepth >= UngetReserve) {
+        return false;
+    }
+    size_t h = head.load(std::memory_order_relaxed) - 1;
+    ring[h & mask] = packet;
     // Sums packet to let us known the buffered video
     if (!IsSpecialPacket(packet)) {
-        packetsDuration += packet->duration;
+        takenDuration -= packet->duration;
+        takenBytes -= packet->size;
     }
-    cond.notify_one();
+    ungetDepth += 1;
+    head.store(h);
+    return true;
 }
 void PacketQueue::flush() {
-    std::lock_guard locker(mutex);
-    while (!packets.empty()) {
-        auto p = packets.front();
-        if (!IsSpecialPacket(p)) {
-            av_packet_free(&p);
-        }
-        packets.pop_front();
-    }
-    packetsDuration = 0;
+    size_t t = tail.load(std::memory_order_relaxed);
+    {
+        std::lock_guard locker(commandMutex);
+        command.dropUntil = t;
+        command.seekPos = AV_NOPTS_VALUE;
+        commandSeq += 1;
+    }
+    flushMark = t;
+    flushedDuration = putDuration.load();
+    flushedBytes = putBytes.load();
+
+    wake(consumerWaitting, notEmptyCond);
+}
+void PacketQueue::clear() {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_relaxed);
+    for (size_t cur = h; cur != t; ++cur) {
+        release(ring[cur & mask]);
+    }
+    head = t;
+    ungetDepth = 0;
+    flushMark = t;
+    takenDuration = putDuration.load();
+    takenBytes = putBytes.load();
+    handledCommand = commandSeq;
+    seekMissed = false;
 }
 bool PacketQueue::stopRequested() const {
     return stop;
 }
 void PacketQueue::requestStop() {
     stop = true;
-    cond.notify_all();
+
+    std::lock_guard lock(condMutex);
+    notEmptyCond.notify_all();
+    notFullCond.notify_all();
+}
+void PacketQueue::resume() {
+    stop = false;
 }
 
 size_t PacketQueue::size() const {
-    std::lock_guard locker(mutex);
-    return packets.size();
+    // Load head first, tail only grows, so it never underflow
+    size_t h = head.load();
+    size_t t = tail.load();
+    return t - h;
+}
+size_t PacketQueue::capacity() const {
+    return limit;
 }
 int64_t PacketQueue::duration() const {
-    std::lock_guard locker(mutex);
-    return packetsDuration;
+    return putDuration - std::max(takenDuration.load(), flushedDuration.load());
+}
+int64_t PacketQueue::bytes() const {
+    return putBytes - std::max(takenBytes.load(), flushedBytes.load());
 }
 
 AVPacket *PacketQueue::get(bool block) {
-    AVPacket *ret = nullptr;
-    mutex.lock();
-    while (packets.empty()) {
-        mutex.unlock();
+    while (true) {
+        if (commandSeq.load() != handledCommand) {
+            return runCommand();
+        }
+        size_t h = head.load(std::memory_order_relaxed);
+        if (tail.load() != h) {
+            AVPacket *ret = ring[h & mask];
+            if (!IsSpecialPacket(ret)) {
+                takenDuration += ret->duration;
+                takenBytes += ret->size;
+            }
+            advanceHead(h + 1);
+            return ret;
+        }
         if (!block) {
             return nullptr;
         }
@@ -77,34 +246,87 @@ AVPacket *PacketQueue::get(bool block) {
             return nullptr;
         }
 
-
         qDebug() << "PacketQueue waiting for more packets...";
-
-        std::unique_lock lock(condMutex);
-        cond.wait(lock);
-
-        mutex.lock();
+        sleepUntil(consumerWaitting, notEmptyCond, [this]() {
+            return tail.load() != head.load() || commandSeq.load() != handledCommand || stop;
+        });
+    }
+}
+void PacketQueue::drop(size_t until) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (ptrdiff_t(until - h) <= 0) {
+        // The consumer took the packets after the command posted, nothing to drop
+        return;
+    }
+    for (size_t cur = h; cur != until; ++cur) {
+        auto pak = ring[cur & mask];
+        if (!IsSpecialPacket(pak)) {
+            takenDuration += pak->duration;
+            takenBytes += pak->size;
+        }
+        release(pak);
     }
-    ret = packets.front();
-    packets.pop_front();
-    if (!IsSpecialPacket(ret)) {
-        packetsDuration -= ret->duration;
+    advanceHead(until);
+}
+AVPacket *PacketQueue::runCommand() {
+    Command cmd;
+    {
+        std::lock_guard locker(commandMutex);
+        cmd = command;
+        handledCommand = commandSeq;
+    }
+    drop(cmd.dropUntil);
+    if (cmd.seekPos == AV_NOPTS_VALUE) {
+        return FlushPacket;
     }
 
-    mutex.unlock();
-
-    return ret;
+    // Search again, the packets may be taken after the producer searched
+    int64_t pos = cmd.seekPos;
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load();
+    int64_t startTs = AV_NOPTS_VALUE;
+    int64_t dur = 0;
+    size_t keyIter = t;
+    for (size_t cur = h; cur != t; ++cur) {
+        auto pak = ring[cur & mask];
+        if (IsSpecialPacket(pak)) {
+            continue;
+        }
+        if (startTs == AV_NOPTS_VALUE) {
+            startTs = pak->pts;
+        }
+        dur += pak->duration;
+        if ((pak->flags & AV_PKT_FLAG_KEY) && pak->pts != AV_NOPTS_VALUE && pos >= pak->pts) {
+            // Backword to key frame
+            keyIter = cur;
+        }
+    }
+    if (startTs == AV_NOPTS_VALUE || pos < startTs || pos > startTs + dur || keyIter == t) {
+        // Missed, drop them all, the producer seeks the file
+        qDebug() << "PacketQueue missed the seek, the packets were taken";
+        keyIter = t;
+        seekMissed = true;
+    }
+    drop(keyIter);
+    return FlushPacket;
 }
 bool PacketQueue::seek(int64_t pos) {
-    std::lock_guard locker(mutex);
+    // Only search what is after the last flush
+    size_t h = head.load();
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (ptrdiff_t(flushMark - h) > 0) {
+        h = flushMark;
+    }
+
     // Try to find start position
     int64_t startTs = AV_NOPTS_VALUE;
-    auto beginIter = packets.begin();
-    for (; beginIter != packets.end(); ++beginIter) {
-        if (IsSpecialPacket(*beginIter) || !*beginIter) {
+    size_t beginIter = h;
+    for (; beginIter != t; ++beginIter) {
+        auto &info = infos[beginIter & mask];
+        if (info.special) {
             continue;
         }
-        startTs = (*beginIter)->pts;
+        startTs = info.pts;
         break;
     }
     if (startTs == AV_NOPTS_VALUE) {
@@ -112,22 +334,23 @@ bool PacketQueue::seek(int64_t pos) {
     }
 
     // Check the position is in range
-    if (pos < startTs || pos > startTs + packetsDuration) {
+    int64_t dur = 0;
+    for (size_t cur = beginIter; cur != t; ++cur) {
+        dur += infos[cur & mask].duration;
+    }
+    if (pos < startTs || pos > startTs + dur) {
         return false;
     }
 
     // Try to find the current position
-    auto keyIter = packets.end();
-    for (; beginIter != packets.end(); ++beginIter) {
-        if (IsSpecialPacket(*beginIter) || !*beginIter) {
-            continue;
-        }
-        auto pak = *beginIter;
-        if (!(pak->flags & AV_PKT_FLAG_KEY)) {
+    size_t keyIter = t;
+    for (; beginIter != t; ++beginIter) {
+        auto &info = infos[beginIter & mask];
+        if (info.special || !info.key) {
             // Not key packet
             continue;
         }
-        if (pos >= pak->pts) {
+        if (pos >= info.pts) {
             // Backword to key frame
             keyIter = beginIter;
         }
@@ -136,51 +359,385 @@ bool PacketQueue::seek(int64_t pos) {
             break;
         }
     }
-    if (keyIter == packets.end()) {
+    if (keyIter == t) {
         // No data
         return false;
     }
 
-    // Erase the range
-    int64_t dur = 0;
-    for (auto cur = packets.begin(); cur != keyIter; ++cur) {
-        if (IsSpecialPacket(*cur) || !*cur) {
-            ++beginIter;
-            continue;
+    // The consumer drops to the keyframe by itself
+    {
+        std::lock_guard locker(commandMutex);
+        command.seekPos = pos;
+        commandSeq += 1;
+    }
+    wake(consumerWaitting, notEmptyCond);
+    return true;
+}
+bool PacketQueue::takeSeekMissed() {
+    if (!seekMissed) {
+        return false;
+    }
+    return seekMissed.exchange(false);
+}
+
+// Sws Slicer Part
+SwsSlicer::~SwsSlicer() {
+    stopWorkers();
+}
+void SwsSlicer::stopWorkers() {
+    {
+        std::lock_guard locker(mutex);
+        quit = true;
+    }
+    jobCond.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+    quit = false;
+}
+int  SwsSlicer::DefaultSlices(int width, int height) {
+    if (int64_t(width) * height < 1280 * 720) {
+        // Small picture, not worth it
+        return 1;
+    }
+    // 1080p => 4, 2160p => 8, and leave the cores to the decoder
+    int cores = qMax(1u, std::thread::hardware_concurrency());
+    int n = height / 270;
+    return std::clamp(n, 1, qMax(1, cores / 2));
+}
+bool SwsSlicer::configure(int w, int h, AVPixelFormat src, AVPixelFormat dst, int n) {
+    if (w == width && h == height && src == srcFormat && dst == dstFormat && n == requestedSlices && !slices.empty()) {
+        return true;
+    }
+    stopWorkers();
+    slices.clear();
+
+    width = w;
+    height = h;
+    srcFormat = src;
+    dstFormat = dst;
+    requestedSlices = n;
+
+    auto srcDesc = av_pix_fmt_desc_get(src);
+    auto dstDesc = av_pix_fmt_desc_get(dst);
+    if (!srcDesc || !dstDesc) {
+        return false;
+    }
+    if (n <= 0) {
+        n = DefaultSlices(w, h);
+    }
+    if ((srcDesc->flags | dstDesc->flags) & AV_PIX_FMT_FLAG_PAL) {
+        // Palette in data[1], could not be offseted
+        n = 1;
+    }
+
+    // Slice height should be aligned to the chroma subsampling, use 16 for the cache
+    int align = qMax(16, 1 << qMax(srcDesc->log2_chroma_h, dstDesc->log2_chroma_h));
+    int sliceHeight = FFALIGN((h + n - 1) / n, align);
+
+    for (int y = 0; y < h; y += sliceHeight) {
+        Slice slice;
+        slice.y = y;
+        slice.height = qMin(sliceHeight, h - y);
+        slice.ctxt.reset(
+            sws_getContext(
+                w, slice.height, src,
+                w, slice.height, dst,
+                0,
+                nullptr,
+                nullptr,
+                nullptr
+            )
+        );
+        if (!slice.ctxt) {
+            slices.clear();
+            return false;
         }
-        dur += (*cur)->duration;
-        av_packet_free(&*cur);
+        slices.push_back(std::move(slice));
+    }
+    // Hand the current generation to the workers, reading it at the thread start could miss the first job
+    uint64_t generation = 0;
+    {
+        std::lock_guard locker(mutex);
+        generation = jobGeneration;
+    }
+    for (size_t i = 1; i < slices.size(); i++) {
+        workers.emplace_back(&SwsSlicer::workerMain, this, int(i), generation);
     }
-    packetsDuration -= dur;
-    packets.erase(packets.begin(), keyIter);
-    packets.push_front(FlushPacket);
+
+    qDebug() << "SwsSlicer" << w << "x" << h << srcDesc->name << "=>" << dstDesc->name << "in" << slices.size() << "slices";
     return true;
 }
+int  SwsSlicer::convert(const AVFrame *src, AVFrame *dst) {
+    if (slices.empty()) {
+        return AVERROR(EINVAL);
+    }
+    {
+        std::lock_guard locker(mutex);
+        jobSrc = src;
+        jobDst = dst;
+        jobPending = slices.size() - 1;
+        jobError = 0;
+        jobGeneration += 1;
+    }
+    if (slices.size() > 1) {
+        jobCond.notify_all();
+    }
+
+    int ret = convertSlice(0);
+
+    if (slices.size() > 1) {
+        std::unique_lock locker(mutex);
+        doneCond.wait(locker, [this]() { return jobPending == 0; });
+        if (ret >= 0 && jobError < 0) {
+            ret = jobError;
+        }
+    }
+    return ret;
+}
+int  SwsSlicer::convertSlice(int idx) {
+    auto &slice = slices[idx];
+    auto srcDesc = av_pix_fmt_desc_get(srcFormat);
+    auto dstDesc = av_pix_fmt_desc_get(dstFormat);
+
+    // Move the planes to the slice begin, chroma planes has less lines
+    auto offset = [&](const AVPixFmtDescriptor *desc, int plane, int linesize) {
+        bool chroma = (plane == 1 || plane == 2) && !(desc->flags & AV_PIX_FMT_FLAG_RGB);
+        int  y = chroma ? (slice.y >> desc->log2_chroma_h) : slice.y;
+        return ptrdiff_t(y) * linesize;
+    };
+    const uint8_t *srcData[AV_NUM_DATA_POINTERS] = {};
+    uint8_t *dstData[AV_NUM_DATA_POINTERS] = {};
+    for (int i = 0; i < AV_NUM_DATA_POINTERS; i++) {
+        if (jobSrc->data[i]) {
+            srcData[i] = jobSrc->data[i] + offset(srcDesc, i, jobSrc->linesize[i]);
+        }
+        if (jobDst->data[i]) {
+            dstData[i] = jobDst->data[i] + offset(dstDesc, i, jobDst->linesize[i]);
+        }
+    }
+    return sws_scale(
+        slice.ctxt.get(),
+        srcData,
+        jobSrc->linesize,
+        0,
+        slice.height,
+        dstData,
+        jobDst->linesize
+    );
+}
+void SwsSlicer::workerMain(int idx, uint64_t generation) {
+    while (true) {
+        {
+            std::unique_lock locker(mutex);
+            jobCond.wait(locker, [&]() { return quit || jobGeneration != generation; });
+            if (quit) {
+                return;
+            }
+            generation = jobGeneration;
+        }
+
+        int ret = convertSlice(idx);
+
+        std::lock_guard locker(mutex);
+        if (ret < 0) {
+            jobError = ret;
+        }
+        jobPending -= 1;
+        if (jobPending == 0) {
+            doneCond.notify_one();
+        }
+    }
+}
+
+// Keyframe Index Part
+void KeyframeIndex::add(int64_t pts, int64_t pos) {
+    if (entries.empty() || pts > entries.back().pts) {
+        // Demuxing in order, the fast path
+        entries.push_back({pts, pos});
+        return;
+    }
+    auto iter = std::lower_bound(entries.begin(), entries.end(), pts, [](const Entry &e, int64_t v) {
+        return e.pts < v;
+    });
+    if (iter != entries.end() && iter->pts == pts) {
+        // Already in, like demuxing again after seek
+        if (iter->pos < 0) {
+            iter->pos = pos;
+        }
+        return;
+    }
+    entries.insert(iter, {pts, pos});
+}
+auto KeyframeIndex::lookup(int64_t pts) const -> const Entry * {
+    auto iter = std::upper_bound(entries.begin(), entries.end(), pts, [](int64_t v, const Entry &e) {
+        return v < e.pts;
+    });
+    if (iter == entries.begin()) {
+        return nullptr;
+    }
+    return &*(iter - 1);
+}
+
+// Pcm Ring Part
+void PcmRing::allocate(size_t bytes) {
+    size_t cap = 1;
+    while (cap < bytes) {
+        cap <<= 1;
+    }
+    buffer.reset(new uint8_t[cap]);
+    mask = cap - 1;
+    limit = bytes;
+    head = 0;
+    tail = 0;
+    discardPos = 0;
+}
+size_t PcmRing::write(const uint8_t *data, size_t n) {
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    uint64_t h = head.load(std::memory_order_acquire);
+    n = qMin<size_t>(n, limit - (t - h));
+    if (n == 0) {
+        return 0;
+    }
+    size_t offset = t & mask;
+    size_t first = qMin(n, mask + 1 - offset);
+    ::memcpy(buffer.get() + offset, data, first);
+    ::memcpy(buffer.get(), data + first, n - first);
+    tail.store(t + n, std::memory_order_release);
+    return n;
+}
+size_t PcmRing::read(uint8_t *data, size_t n) {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    uint64_t d = discardPos.load(std::memory_order_acquire);
+    uint64_t t = tail.load(std::memory_order_acquire);
+    h = qMax(h, d);
+    n = qMin<size_t>(n, t - h);
+    size_t offset = h & mask;
+    size_t first = qMin(n, mask + 1 - offset);
+    ::memcpy(data, buffer.get() + offset, first);
+    ::memcpy(data + first, buffer.get(), n - first);
+    head.store(h + n, std::memory_order_release);
+    return n;
+}
+void PcmRing::discard() {
+    // The space is freed when the consumer skips it
+    discardPos.store(tail.load(std::memory_order_relaxed), std::memory_order_release);
+}
+size_t PcmRing::size() const {
+    uint64_t h = qMax(head.load(), discardPos.load());
+    uint64_t t = tail.load();
+    return t > h ? t - h : 0;
+}
+size_t PcmRing::freeSpace() const {
+    return limit - (tail.load() - head.load());
+}
+
+// Statistics Part
+void LatencyHistogram::add(int64_t us) {
+    int index;
+    if (us < SubBuckets) {
+        index = us < 0 ? 0 : int(us);
+    }
+    else {
+        // The highest bit selects the power of two, the next 2 bits select the sub bucket
+        int msb = 0;
+        for (auto v = uint64_t(us); v >>= 1; ) {
+            msb += 1;
+        }
+        int sub = int(us >> (msb - 2)) & (SubBuckets - 1);
+        index = qMin((msb - 1) * SubBuckets + sub, Buckets - 1);
+    }
+    buckets[index].fetch_add(1, std::memory_order_relaxed);
+}
+void LatencyHistogram::reset() {
+    for (auto &bucket : buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+uint64_t LatencyHistogram::count() const {
+    uint64_t n = 0;
+    for (auto &bucket : buckets) {
+        n += bucket.load(std::memory_order_relaxed);
+    }
+    return n;
+}
+int64_t LatencyHistogram::percentile(double q) const {
+    uint64_t snapshot[Buckets];
+    uint64_t n = 0;
+    for (int i = 0; i < Buckets; i++) {
+        snapshot[i] = buckets[i].load(std::memory_order_relaxed);
+        n += snapshot[i];
+    }
+    if (n == 0) {
+        return 0;
+    }
+    auto upperBound = [](int index) -> int64_t {
+        // The lower bound of the next bucket
+        index += 1;
+        if (index < SubBuckets) {
+            return index;
+        }
+        int msb = index / SubBuckets + 1;
+        int sub = index % SubBuckets;
+        return int64_t(SubBuckets + sub) << (msb - 2);
+    };
+    uint64_t rank = qMax<uint64_t>(1, uint64_t(std::ceil(q * n)));
+    uint64_t sum = 0;
+    for (int i = 0; i < Buckets; i++) {
+        sum += snapshot[i];
+        if (sum >= rank) {
+            return upperBound(i);
+        }
+    }
+    return upperBound(Buckets - 1);
+}
+
+void PlaybackCounters::reset() {
+    decodeTime.reset();
+    convertTime.reset();
+    for (auto &bucket : drift) {
+        bucket = 0;
+    }
+    lateFrames = 0;
+    dropedFrames = 0;
+    skippedDecodes = 0;
+    decodeAverage = 0.0;
+    audioUnderruns = 0;
+    packets = 0;
+    throughput = 0.0;
+    for (int i = 0; i < 3; i++) {
+        queuePackets[i] = 0;
+        queueBytes[i] = 0;
+        queueDuration[i] = 0.0;
+    }
+    std::lock_guard locker(metadataMutex);
+    metadata.clear();
+    representation.clear();
+    representationSwitches.clear();
+}
+void PlaybackCounters::addDrift(double seconds) {
+    int ms = int(seconds * 1000);
+    int index = 0;
+    while (index < PlaybackStatistics::DriftBuckets - 1 && ms >= PlaybackStatistics::DriftBounds[index]) {
+        index += 1;
+    }
+    drift[index].fetch_add(1, std::memory_order_relaxed);
+}
 
 // AudioThread    
 AudioThread::AudioThread(DemuxerThread *parent, AVStream *stream, AVCodecContext *ctxt) 
     : QObject(), 
+      demuxerThread(parent),
       stream(stream), 
       codecCtxt(ctxt),
-      audioOutput(parent->audioOutput())
+      audioOutput(parent->audioOutput()),
+      queue(parent->packetPool())
 {
-    outputSampleFormat = AudioSampleFormat::Float32;
-    outputSampleRate = ctxt->sample_rate;
-    outputChannels = ctxt->channels;
-    needResample = false;
-    switch (ctxt->sample_fmt) {
-        case AV_SAMPLE_FMT_U8 : outputSampleFormat = AudioSampleFormat::Uint8; break;
-        case AV_SAMPLE_FMT_S16 : outputSampleFormat = AudioSampleFormat::Sint16; break;
-        // case AV_SAMPLE_FMT_S32 : outputSampleFormat = AudioSampleFormat::Sint32; break;
-        // May has S24 but input like AV_SAMPLE_FMT_S32
-        // I didnot how to handle it, so just convert
-        case AV_SAMPLE_FMT_FLT : outputSampleFormat = AudioSampleFormat::Float32; break;
-        default : needResample = true; outputSampleFormat = AudioSampleFormat::Float32; break;
-    }
-    if (!needResample) {
-        qDebug() << "AudioThread: output supported format, passthrough";
-    }
+    audioNegotiate();
 
+    bytesPerSecond = qreal(GetBytesPerFrame(outputSampleFormat, outputChannels)) * outputSampleRate;
+    ring.allocate(size_t(bytesPerSecond * RingMilliseconds / 1000));
 
     audioOutput->setCallback([this](void *data, int n) {
         audioCallback(data, n);
@@ -192,74 +749,241 @@ AudioThread::AudioThread(DemuxerThread *parent, AVStream *stream, AVCodecContext
     );
     audioOutput->pause(true);
     audioInitialized = audioOutput->isOpen();
+    deviceLatency = audioOutput->latency();
+
+    startDecoder();
+}
+void AudioThread::startDecoder() {
+    // Decoding is not real time, keep it away from the device callback
+    decoderThread = QThread::create(&AudioThread::run, this);
+    decoderThread->setObjectName("NekoAV AudioDecoderThread");
+    decoderThread->start();
+}
+void AudioThread::stopDecoder() {
+    queue.requestStop();
+    wakeDecoder();
+    decoderThread->wait();
+    delete decoderThread;
+    decoderThread = nullptr;
+}
+void AudioThread::wakeDecoder() {
+    if (!ringWaitting) {
+        // Nobody sleeping, no syscall on the device thread
+        return;
+    }
+    std::lock_guard locker(ringMutex);
+    ringCond.notify_one();
+}
+void AudioThread::replaceStream(AVStream *newStream, AVCodecContext *ctxt) {
+    // Stop the decoder only, the device keeps playing what left in the ring
+    stopDecoder();
+    queue.clear();
+    queue.resume();
+
+    avcodec_free_context(&codecCtxt);
+    stream = newStream;
+    codecCtxt = ctxt;
+    swrCtxt.reset();
+    tempoCleanup();
+    tempoFailedRate = 0.0;
+    buffer = nullptr;
+    bufferIndex = 0;
+    bufferSize = 0;
+    seekTarget = AV_NOPTS_VALUE;
+    pendingSeekTarget = -1.0;
+    discardRequested = false;
+    audioClock = 0.0;
+
+    auto prevFormat = outputSampleFormat;
+    auto prevSampleRate = outputSampleRate;
+    auto prevChannels = outputChannels;
+    audioNegotiate();
+    if (outputSampleFormat != prevFormat || outputSampleRate != prevSampleRate || outputChannels != prevChannels) {
+        // The ring is in the old format, reopen with the new one
+        bool paused = audioOutput->isPaused();
+        audioOutput->close();
+
+        bytesPerSecond = qreal(GetBytesPerFrame(outputSampleFormat, outputChannels)) * outputSampleRate;
+        ring.allocate(size_t(bytesPerSecond * RingMilliseconds / 1000));
+        audioOutput->open(
+            outputSampleFormat,
+            outputSampleRate,
+            outputChannels
+        );
+        audioOutput->pause(paused);
+        audioInitialized = audioOutput->isOpen();
+        deviceLatency = audioOutput->latency();
+        deviceFed = false;
+        qDebug() << "AudioThread reopen the device for the next source";
+    }
+
+    startDecoder();
+}
+void AudioThread::audioNegotiate() {
+    // The format of the stream, in packed
+    AudioDeviceFormat wanted;
+    wanted.sampleRate = codecCtxt->sample_rate;
+    wanted.channels = codecCtxt->channels;
+    bool planar = av_sample_fmt_is_planar(codecCtxt->sample_fmt);
+    bool known = true;
+    switch (av_get_packed_sample_fmt(codecCtxt->sample_fmt)) {
+        case AV_SAMPLE_FMT_U8 : wanted.format = AudioSampleFormat::Uint8; break;
+        case AV_SAMPLE_FMT_S16 : wanted.format = AudioSampleFormat::Sint16; break;
+        // May has S24 but input like AV_SAMPLE_FMT_S32
+        // I didnot how to handle it, so just convert
+        case AV_SAMPLE_FMT_FLT : wanted.format = AudioSampleFormat::Float32; break;
+        default : known = false; wanted.format = AudioSampleFormat::Float32; break;
+    }
+
+    // Ask the device, open it with the closest native one
+    auto native = audioOutput->closestNativeFormat(wanted);
+    outputSampleFormat = native.format;
+    outputSampleRate = native.sampleRate;
+    outputChannels = native.channels;
+
+    // Interleave is enough if only the layout differs
+    bool sameSamples = known && native.format == wanted.format && 
+                       native.sampleRate == wanted.sampleRate && native.channels == wanted.channels;
+    needResample = !sameSamples;
+    needInterleave = sameSamples && planar;
+
+    const char *path = "passthrough";
+    if (needResample) {
+        path = "resample (swr)";
+    }
+    else if (needInterleave) {
+        path = "interleave";
+    }
+    qDebug().nospace() << "AudioThread: stream " << av_get_sample_fmt_name(codecCtxt->sample_fmt) << " "
+                       << wanted.sampleRate << "Hz " << wanted.channels << "ch => device "
+                       << av_get_sample_fmt_name(ToAVSampleFormat(outputSampleFormat)) << " "
+                       << outputSampleRate << "Hz " << outputChannels << "ch, path " << path 
+                       << " (kernels " << GetAudioKernels().name << ")";
 }
 AudioThread::~AudioThread() {
+    // Close the device first, the callback reads the ring
     audioOutput->close();
 
+    stopDecoder();
+
+    tempoCleanup();
+
     avcodec_free_context(&codecCtxt);
 }
 void AudioThread::pause(bool v) {
     audioOutput->pause(v);
 }
-// FIXME : Memory bug here
+qreal AudioThread::clock() const {
+    // Take the ring size and audioClock of the same write, or the clock steps back between them
+    size_t size;
+    qreal  end;
+    uint64_t seq;
+    do {
+        seq = clockSeq.load();
+        size = ring.size();
+        end = audioClock;
+    }
+    while ((seq & 1) || seq != clockSeq.load());
+
+    // One second of stretched data is tempoRate seconds of media
+    qreal pending = size / bytesPerSecond + (isPaused() ? 0.0 : deviceLatency);
+    return end - pending * tempoRate;
+}
 void AudioThread::audioCallback(void *data, int len) {
+    // Real time thread, only copy here
+    demuxerThread->markStartup(StartupStage::FirstAudioCallback);
+
     uint8_t *dst = static_cast<uint8_t*>(data);
-    while (len > 0) {
+    size_t n = ring.read(dst, len);
+    if (n < size_t(len)) {
+        // Make slience, the empty ring before the first data is not a underrun
+        ::memset(dst + n, 0, len - n);
+        if (audioOutput->isNullDevice()) {
+            // No deadline on the null device, the decoder is just behind, give it one period instead of spinning
+            if (n == 0) {
+                QThread::usleep(uint64_t(len / bytesPerSecond * 1000000));
+            }
+        }
+        else if (!eof && deviceFed) {
+            demuxerThread->counters()->audioUnderruns += 1;
+        }
+    }
+    deviceFed = deviceFed || n > 0;
+    if (ring.freeSpace() >= ring.capacity() / 4) {
+        wakeDecoder();
+    }
+}
+void AudioThread::run() {
+    while (!queue.stopRequested()) {
+        if (discardRequested.exchange(false)) {
+            // Position changed, the decoded data is useless
+            bufferIndex = bufferSize;
+            ring.discard();
+        }
         if (bufferIndex >= bufferSize) {
             // Run out of buffer
-            int audioSize = audioDecodeFrame();
-            if (audioSize < 0) {
-                // No audio
-                break;
+            if (audioDecodeFrame() < 0) {
+                continue;
             }
         }
 
-        // Write buffer
-        int left = bufferSize - bufferIndex;
-        left = qMin(len, left);
-
-        ::memcpy(dst, buffer + bufferIndex, left);
-        
-        dst += left;
-        
-        len -= left;
-        bufferIndex += left;
-
-        // Update current clock
-        audioClock = audioClock + qreal(left) / GetBytesPerFrame(outputSampleFormat, outputChannels) / outputSampleRate; 
-    }
+        // Write buffer, the clock is at the end of written data, published with the tail as one snapshot
+        clockSeq += 1;
+        size_t n = ring.write(buffer + bufferIndex, bufferSize - bufferIndex);
+        bufferIndex += n;
+        audioClock = audioClock + n / bytesPerSecond * tempoRate;
+        clockSeq += 1;
+        if (bufferIndex >= bufferSize) {
+            continue;
+        }
 
-    // Make slience
-    if (len) {
-        ::memset(dst, 0, len);
+        // Ring is full, wait for the device to consume a part of it
+        // Bounded, a closed or paused device never wakes us
+        qreal wait = qreal(ring.capacity()) / 4 / bytesPerSecond;
+        std::unique_lock locker(ringMutex);
+        ringWaitting = true;
+        ringCond.wait_for(locker, std::chrono::microseconds(int64_t(wait * 1000000)), [this]() {
+            return ring.freeSpace() >= ring.capacity() / 4 || queue.stopRequested() || discardRequested;
+        });
+        ringWaitting = false;
     }
 }
 int AudioThread::audioDecodeFrame() {
     // Try get packet
     int ret;
     while (true) {
-        AVPacket *packet = queue.get(false);
+        AVPacket *packet = queue.get();
         if (packet == EofPacket) {
             // No more data
             waitting = true;
+            eof = true;
             return -1;
         }
         if (packet == FlushPacket) {
             avcodec_flush_buffers(codecCtxt);
             swrCtxt.reset();
+            tempoCleanup();
+            ring.discard();
+
+            qreal target = pendingSeekTarget.exchange(-1.0);
+            if (target >= 0) {
+                // A seek may flush more than once, keep the target of it
+                seekTarget = int64_t(target / av_q2d(stream->time_base));
+            }
 
             // BTK_LOG(BTK_RED("[AudioThread] ") "Got flush\n");
             continue;
         }
         if (packet == nullptr) {
-            // No Data
+            // Stop requested
             waitting = true;
             return -1;
         }
         waitting = false;
+        eof = false;
 
         // Normal data
-        AVPtr<AVPacket> guard(packet);
+        PacketGuard guard(queue.packetPool(), packet);
 
         // Check the timestamp here
         int64_t curTime = av_gettime_relative();
@@ -280,11 +1004,22 @@ int AudioThread::audioDecodeFrame() {
             return -1; // Err
         }
 
+        demuxerThread->markStartup(StartupStage::FirstDecodedFrame);
+
         double decodeUsed = (av_gettime_relative() - curTime) / NEKOAV_TIME_BASE;
         if (decodeUsed > 0.04) {
             qWarning() << "AudioThread spent too long to decode" << decodeUsed;
         }
 
+        // Accurate seek, drop the frames end before the target
+        if (seekTarget != AV_NOPTS_VALUE && frame->pts != AV_NOPTS_VALUE) {
+            int64_t duration = av_rescale_q(frame->nb_samples, {1, frame->sample_rate}, stream->time_base);
+            if (frame->pts + duration <= seekTarget) {
+                continue;
+            }
+            seekTarget = AV_NOPTS_VALUE;
+        }
+
         // Update audio clock 
         if (frame->pts == AV_NOPTS_VALUE) {
             audioClock = 0.0;
@@ -305,21 +1040,38 @@ int AudioThread::audioDecodeFrame() {
     }
 }
 int AudioThread::audioResample(int wanted_samples) {
+    if (needInterleave) {
+        // Planar => packed, the samples are not changed
+        int size = frame->nb_samples * GetBytesPerFrame(outputSampleFormat, outputChannels);
+        FFReallocateBuffer(&swrBuffer, size);
+
+        auto &kernels = GetAudioKernels();
+        auto planes = const_cast<const uint8_t * const *>(frame->extended_data);
+        switch (GetBytesPerSample(outputSampleFormat)) {
+            case 1 : kernels.interleave8(swrBuffer.get(), planes, outputChannels, frame->nb_samples); break;
+            case 2 : kernels.interleave16(swrBuffer.get(), planes, outputChannels, frame->nb_samples); break;
+            default : kernels.interleave32(swrBuffer.get(), planes, outputChannels, frame->nb_samples); break;
+        }
+
+        buffer = swrBuffer.get();
+        bufferSize = size;
+        bufferIndex = 0;
+
+        return audioTempo(size);
+    }
     if (!needResample) {
-        // Just output this data
-        int size = frame->linesize[0];
+        // Just output this data, linesize may contains padding
+        int size = frame->nb_samples * GetBytesPerFrame(outputSampleFormat, outputChannels);
 
         buffer = frame->data[0];
         bufferSize = size;
         bufferIndex = 0;
 
-        return size;
+        return audioTempo(size);
     }
 
-    // Get frame samples buffer size
-    int data_size = av_samples_get_buffer_size(nullptr, codecCtxt->channels, frame->nb_samples, AVSampleFormat(frame->format), 1);
-
-    auto out_sample_rate = codecCtxt->sample_rate;
+    auto out_sample_rate = outputSampleRate;
+    auto out_sample_fmt = ToAVSampleFormat(outputSampleFormat);
     auto in_sample_rate = frame->sample_rate;
 
     if (!swrCtxt) {
@@ -328,7 +1080,9 @@ int AudioThread::audioResample(int wanted_samples) {
                             av_get_channel_layout_nb_channels(codecCtxt->channel_layout)) ?
                             codecCtxt->channel_layout :
                             av_get_default_channel_layout(codecCtxt->channels);
-        auto    out_chanel_layout = in_channel_layout;
+        int64_t out_chanel_layout = outputChannels == codecCtxt->channels ? 
+                            in_channel_layout : 
+                            av_get_default_channel_layout(outputChannels);
 
         Q_ASSERT(frame->format == codecCtxt->sample_fmt);
 
@@ -336,7 +1090,7 @@ int AudioThread::audioResample(int wanted_samples) {
             swr_alloc_set_opts(
                 nullptr,
                 out_chanel_layout,
-                AV_SAMPLE_FMT_FLT,
+                out_sample_fmt,
                 out_sample_rate,
                 in_channel_layout,
                 codecCtxt->sample_fmt,
@@ -354,11 +1108,12 @@ int AudioThread::audioResample(int wanted_samples) {
         // Convert
         uint8_t *buffer_data;
 
-        const uint8_t **in = (const uint8_t**) frame->data;
+        const uint8_t **in = (const uint8_t**) frame->extended_data;
         uint8_t **out = &buffer_data;
 
-        int out_count = int64_t(wanted_samples) * out_sample_rate / in_sample_rate;
-        int out_size = av_samples_get_buffer_size(nullptr, codecCtxt->channels, out_count, codecCtxt->sample_fmt, 1);
+        // Some more room for the samples delayed in swr
+        int out_count = int64_t(wanted_samples) * out_sample_rate / in_sample_rate + 256;
+        int out_size = av_samples_get_buffer_size(nullptr, outputChannels, out_count, out_sample_fmt, 1);
         if (out_size < 0) {
             qDebug() << ("av_samples_get_buffer_size() failed\n");
             return -1;
@@ -384,12 +1139,12 @@ int AudioThread::audioResample(int wanted_samples) {
         if (len2 == out_count) {
             // BTK_LOG("audio buffer is probably too small\n");
         }
-        int resampled_data_size = len2 * codecCtxt->channels * av_get_bytes_per_sample(codecCtxt->sample_fmt);
+        int resampled_data_size = len2 * GetBytesPerFrame(outputSampleFormat, outputChannels);
 
         buffer = swrBuffer.get();
         bufferIndex = 0;
         bufferSize = resampled_data_size;
-        return resampled_data_size;
+        return audioTempo(resampled_data_size);
     }
     else {
         // Opps
@@ -398,17 +1153,173 @@ int AudioThread::audioResample(int wanted_samples) {
     }
 }
 
+int AudioThread::audioTempo(int size) {
+    qreal rate = demuxerThread->playbackRate();
+    if (rate != tempoRate && rate != tempoFailedRate) {
+        // Rate changed, the samples still in filter are dropped
+        tempoCleanup();
+        if (rate != 1.0) {
+            if (tempoInit(rate)) {
+                tempoRate = rate;
+            }
+            else {
+                tempoFailedRate = rate;
+            }
+        }
+    }
+    if (!tempoGraph) {
+        // Normal speed or no time stretch support
+        return size;
+    }
+
+#if defined(NEKOAV_AVFILTER)
+    int bytesPerFrame = GetBytesPerFrame(outputSampleFormat, outputChannels);
+
+    // Copy the output data into frame and feed the atempo
+    AVFrame *f = tempoFrame.get();
+    av_frame_unref(f);
+    f->format = ToAVSampleFormat(outputSampleFormat);
+    f->sample_rate = outputSampleRate;
+    f->channel_layout = av_get_default_channel_layout(outputChannels);
+    f->channels = outputChannels;
+    f->nb_samples = size / bytesPerFrame;
+    f->pts = tempoSamplesIn;
+    tempoSamplesIn += f->nb_samples;
+    if (av_frame_get_buffer(f, 0) < 0) {
+        return -1;
+    }
+    ::memcpy(f->data[0], buffer, size);
+    if (av_buffersrc_add_frame(tempoSource, f) < 0) {
+        qDebug() << "AudioThread failed to feed atempo";
+        return -1;
+    }
+
+    // Drain all stretched data
+    int total = 0;
+    while (av_buffersink_get_frame(tempoSink, f) >= 0) {
+        int n = f->nb_samples * bytesPerFrame;
+        if (total + n > tempoBufferCapacity) {
+            tempoBufferCapacity = total + n;
+            FFReallocateBuffer(&tempoBuffer, tempoBufferCapacity);
+        }
+        ::memcpy(tempoBuffer.get() + total, f->data[0], n);
+        total += n;
+        av_frame_unref(f);
+    }
+
+    // May be zero, atempo need more data
+    buffer = tempoBuffer.get();
+    bufferIndex = 0;
+    bufferSize = total;
+    return total;
+#else
+    return size;
+#endif
+}
+bool AudioThread::tempoInit(qreal rate) {
+#if defined(NEKOAV_AVFILTER)
+    tempoGraph = avfilter_graph_alloc();
+    if (!tempoGraph) {
+        return false;
+    }
+
+    char args[256];
+    ::snprintf(
+        args, sizeof(args),
+        "time_base=1/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%" PRIx64,
+        outputSampleRate,
+        outputSampleRate,
+        av_get_sample_fmt_name(ToAVSampleFormat(outputSampleFormat)),
+        uint64_t(av_get_default_channel_layout(outputChannels))
+    );
+
+    int ret = avfilter_graph_create_filter(&tempoSource, avfilter_get_by_name("abuffer"), "in", args, nullptr, tempoGraph);
+    if (ret >= 0) {
+        ret = avfilter_graph_create_filter(&tempoSink, avfilter_get_by_name("abuffersink"), "out", nullptr, nullptr, tempoGraph);
+    }
+    if (ret < 0) {
+        qDebug() << "AudioThread failed to create atempo graph" << FFErrorToString(ret);
+        tempoCleanup();
+        return false;
+    }
+
+    // Old atempo only accept [0.5, 2.0], so chain them
+    QByteArray desc;
+    qreal r = rate;
+    while (r > 2.0) {
+        desc += "atempo=2.0,";
+        r /= 2.0;
+    }
+    while (r < 0.5) {
+        desc += "atempo=0.5,";
+        r /= 0.5;
+    }
+    desc += "atempo=" + QByteArray::number(r, 'f', 6);
+
+    AVFilterInOut *outputs = avfilter_inout_alloc();
+    AVFilterInOut *inputs = avfilter_inout_alloc();
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = tempoSource;
+    outputs->pad_idx = 0;
+    outputs->next = nullptr;
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = tempoSink;
+    inputs->pad_idx = 0;
+    inputs->next = nullptr;
+
+    ret = avfilter_graph_parse_ptr(tempoGraph, desc.constData(), &inputs, &outputs, nullptr);
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    if (ret >= 0) {
+        ret = avfilter_graph_config(tempoGraph, nullptr);
+    }
+    if (ret < 0) {
+        qDebug() << "AudioThread failed to config atempo graph" << desc << FFErrorToString(ret);
+        tempoCleanup();
+        return false;
+    }
+
+    qDebug() << "AudioThread time stretch by" << desc;
+    tempoSamplesIn = 0;
+    return true;
+#else
+    qWarning() << "AudioThread no libavfilter, playback rate is not supported";
+    return false;
+#endif
+}
+void AudioThread::tempoCleanup() {
+#if defined(NEKOAV_AVFILTER)
+    avfilter_graph_free(&tempoGraph);
+#endif
+    tempoGraph = nullptr;
+    tempoSource = nullptr;
+    tempoSink = nullptr;
+    tempoRate = 1.0;
+}
 
 // VideoThread
 VideoThread::VideoThread(DemuxerThread *parent, AVStream *stream, AVCodecContext *ctxt) :
     demuxerThread(parent),
     stream(stream),
-    codecCtxt(ctxt)    
+    codecCtxt(ctxt),
+    queue(parent->packetPool())
 {
     tryHardwareInit();
     setObjectName("NekoAV VideoThread");
     
     videoSink = demuxerThread->videoSink();
+    presentation = videoSink->presentation;
+    if (presentation) {
+        // The ring keeps two more frames, the one on the screen and the one being converted
+        size_t capacity = videoFrameBuffers() - 2;
+        presentation->attach(this, capacity, [this](int64_t wallTime) {
+            qreal clock = demuxerThread->clock();
+            if (isPaused()) {
+                return clock;
+            }
+            return clock + (wallTime - av_gettime_relative()) / NEKOAV_TIME_BASE * demuxerThread->playbackRate();
+        }, demuxerThread->counters());
+    }
 
     pause(true);
 
@@ -418,7 +1329,7 @@ VideoThread::VideoThread(DemuxerThread *parent, AVStream *stream, AVCodecContext
     presentThread->start();
 }
 VideoThread::~VideoThread() {
-    queue.flush();
+    detachPresentation();
     queue.requestStop();
     pause(false);
     // Wait
@@ -509,6 +1420,8 @@ void VideoThread::run() {
             cond.wait(lock);
             continue;
         }
+        // The frame is dropped if a seek flushes the presentation queue before it is queued
+        uint64_t generation = presentation ? presentation->generation() : 0;
         AVPacket *packet = queue.get();
         if (packet == EofPacket) {
             // No more data
@@ -517,6 +1430,20 @@ void VideoThread::run() {
         }
         if (packet == FlushPacket) {
             avcodec_flush_buffers(codecCtxt);
+            decoderLag = 0;
+            if (presentation) {
+                presentation->flush();
+            }
+
+            // Position changed, the lateness before is meaningless
+            catchUpLateFrames = 0;
+            catchUpSyncFrames = 0;
+
+            qreal target = pendingSeekTarget.exchange(-1.0);
+            if (target >= 0) {
+                // A seek may flush more than once, keep the target of it
+                seekTarget = int64_t(target / av_q2d(stream->time_base));
+            }
 
             // BTK_LOG(BTK_RED("[VideoThread] ") "Got flush\n");
             continue;
@@ -529,24 +1456,97 @@ void VideoThread::run() {
         waitting = false;
 
         // Let's begin
-        AVPtr<AVPacket> guard(packet);
+        PacketGuard guard(queue.packetPool(), packet);
+
+        // Fast playback, only decode reference frames
+        double rate = demuxerThread->playbackRate();
+        AVDiscard skipFrame = rate > 1.5 ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+        if (skipFrame != rateSkipFrame) {
+            rateSkipFrame = skipFrame;
+            videoApplyDiscard();
+        }
+
+        // Accurate seek, the non reference frames before the target are useless
+        skipFrame = AVDISCARD_DEFAULT;
+        if (seekTarget != AV_NOPTS_VALUE && packet->pts != AV_NOPTS_VALUE && packet->pts < seekTarget) {
+            skipFrame = AVDISCARD_NONREF;
+        }
+        if (skipFrame != seekSkipFrame) {
+            seekSkipFrame = skipFrame;
+            videoApplyDiscard();
+        }
+
         AVFrame *frame;
         if (!videoDecodeFrame(packet, &frame)) {
             continue;
         }
 
+        if (seekTarget != AV_NOPTS_VALUE) {
+            // Decode and discard until the target, no sync
+            int64_t duration = srcFrame->pkt_duration > 0 ? srcFrame->pkt_duration : 0;
+            if (srcFrame->pts != AV_NOPTS_VALUE && srcFrame->pts + duration <= seekTarget) {
+                continue;
+            }
+            seekTarget = AV_NOPTS_VALUE;
+            if (seekSkipFrame != AVDISCARD_DEFAULT) {
+                seekSkipFrame = AVDISCARD_DEFAULT;
+                videoApplyDiscard();
+            }
+
+            // Present it at once
+            videoClock = srcFrame->pts * av_q2d(stream->time_base);
+            videoFrameCount += 1;
+            if (presentation) {
+                videoQueueFrame(frame, presentation->generation(), true);
+            }
+            else {
+                videoWriteFrame(frame);
+            }
+            demuxerThread->seekFinished(videoClock);
+            continue;
+        }
+
+        if (demuxerThread->isFreeRunning()) {
+            // Benchmark, present at once
+            videoClock = srcFrame->pts * av_q2d(stream->time_base);
+            videoFrameCount += 1;
+            videoWriteFrame(frame);
+            continue;
+        }
+
+        if (presentation) {
+            // Decode ahead, the renderer takes it at the vsync, only the late frames are handled here
+            double currentFramePts = srcFrame->pts * av_q2d(stream->time_base);
+            double diff = demuxerThread->clock() - currentFramePts;
+
+            videoClock = currentFramePts;
+            videoFrameCount += 1;
+            videoUpdateCatchUp(diff);
+
+            if (diff > 0.3) {
+                videoDropedFrameCount += 1;
+                demuxerThread->counters()->dropedFrames += 1;
+                qDebug() << "VideoThread drop frame for " << videoDropedFrameCount << " / " << videoFrameCount;
+                continue;
+            }
+            videoQueueFrame(frame, generation, false);
+            continue;
+        }
+
         // TODO : Add sws_scale_duration to adjust the time
-        // Sync
+        // Sync, the clocks are in media time, the durations and sleeps are in wall time
         double currentFramePts = srcFrame->pts * av_q2d(stream->time_base);
         double masterClock = demuxerThread->clock();
-        double diff = masterClock - videoClock - swsScaleDuration - videoDecodeDuration;
+        double diff = masterClock - videoClock - (swsScaleDuration + videoDecodeDuration) * rate;
 
         videoClock = currentFramePts;
         videoFrameCount += 1;
+        videoUpdateCatchUp(diff);
+        demuxerThread->counters()->addDrift(diff);
 
         if (diff < 0 && -diff < AVNoSyncThreshold) {
             // We are too fast
-            auto delay = -diff;
+            auto delay = -diff / rate;
 
             std::unique_lock lock(condMutex);
             cond.wait_for(lock, std::chrono::milliseconds(int64_t(delay * 1000)));
@@ -555,6 +1555,7 @@ void VideoThread::run() {
             // We are too slow, drop
             // BTK_LOG(BTK_RED("[VideoThread] ") "A-V = %lf Too slow, drop sws_duration = %lf\n", diff, sws_scale_duration);
             videoDropedFrameCount += 1;
+            demuxerThread->counters()->dropedFrames += 1;
             qDebug() << "VideoThread drop frame for " << videoDropedFrameCount << " / " << videoFrameCount;
             continue;
         }
@@ -566,7 +1567,7 @@ void VideoThread::run() {
             }
             // BTK_LOG("duration %lf, diff %lf\n", delay, diff);
             // Sleep for it
-            delay = qMin(delay, diff);
+            delay = qMin(delay, diff) / rate;
 
             std::unique_lock lock(condMutex);
             cond.wait_for(lock, std::chrono::milliseconds(int64_t(delay * 1000)));
@@ -574,7 +1575,9 @@ void VideoThread::run() {
 
         videoWriteFrame(frame);
     }
-    videoSink->setVideoFrame(VideoFrame());
+    if (!keepLastFrame) {
+        videoSink->setVideoFrame(VideoFrame());
+    }
 }
 bool VideoThread::videoDecodeFrame(AVPacket *packet, AVFrame **retFrame) {
     int64_t decBeginTime = av_gettime_relative();
@@ -586,11 +1589,24 @@ bool VideoThread::videoDecodeFrame(AVPacket *packet, AVFrame **retFrame) {
         // BTK_LOG(BTK_RED("[VideoThread] ") "avcodec_send_packet failed!!!\n");
         return false;
     }
+    decoderLag += 1;
     ret = avcodec_receive_frame(codecCtxt, srcFrame.get());
     if (ret < 0) {
-        // Need more packet
+        if (ret != AVERROR(EAGAIN)) {
+            return false;
+        }
+        // Need more packet, the frame threads and the reordering hold some, or the decoder skipped it
+        if (catchUpLevel == 0) {
+            decoderDelay = std::max(decoderDelay, decoderLag);
+        }
+        else if (decoderLag > decoderDelay) {
+            // Deeper than the decoder ever holds, this packet gives no frame
+            decoderLag -= 1;
+            demuxerThread->counters()->skippedDecodes += 1;
+        }
         return false;
     }
+    decoderLag = std::max<int64_t>(decoderLag - 1, 0);
     if (srcFrame->format == hardwarePixfmt) {
         // Hardware decode
         ret = av_hwframe_transfer_data(swFrame.get(), srcFrame.get(), 0);
@@ -600,12 +1616,179 @@ bool VideoThread::videoDecodeFrame(AVPacket *packet, AVFrame **retFrame) {
         cvtSource = swFrame.get();
     }
 
+    demuxerThread->markStartup(StartupStage::FirstDecodedFrame);
+
     *retFrame = cvtSource;
+    demuxerThread->counters()->decodeTime.add(av_gettime_relative() - decBeginTime);
     videoDecodeDuration = (av_gettime_relative() - decBeginTime) / NEKOAV_TIME_BASE;
+    auto &average = demuxerThread->counters()->decodeAverage;
+    average = average * 0.9 + videoDecodeDuration * 0.1;
 
     return true;
 }
-void VideoThread::videoWriteFrame(AVFrame *source) {
+
+// Discard settings of each catch up level, from decode all to keyframe only
+struct CatchUpLevel {
+    AVDiscard skipFrame;
+    AVDiscard skipLoopFilter;
+    AVDiscard skipIdct;
+};
+static constexpr CatchUpLevel CatchUpLevels[] = {
+    {AVDISCARD_DEFAULT, AVDISCARD_DEFAULT, AVDISCARD_DEFAULT},
+    {AVDISCARD_NONREF,  AVDISCARD_NONREF,  AVDISCARD_DEFAULT},
+    {AVDISCARD_BIDIR,   AVDISCARD_BIDIR,   AVDISCARD_NONREF },
+    {AVDISCARD_NONKEY,  AVDISCARD_ALL,     AVDISCARD_BIDIR  },
+};
+static constexpr int    CatchUpMaxLevel = std::size(CatchUpLevels) - 1;
+static constexpr double CatchUpLateThreshold = 0.1; //< A-V bigger than it is late
+static constexpr int    CatchUpLateFrames = 5; //< Continuous late frames to raise level
+static constexpr int    CatchUpSyncFrames = 3; //< Continuous in sync frames to relax level
+static constexpr double CatchUpRaiseInterval = 0.5; //< Give the decoder time to catch up
+static constexpr double CatchUpRelaxInterval = 2.0;
+
+void VideoThread::videoUpdateCatchUp(double diff) {
+    if (diff > CatchUpLateThreshold) {
+        catchUpLateFrames += 1;
+        catchUpSyncFrames = 0;
+        demuxerThread->counters()->lateFrames += 1;
+    }
+    else if (diff > -CatchUpLateThreshold) {
+        catchUpSyncFrames += 1;
+        catchUpLateFrames = 0;
+    }
+
+    double elapsed = (av_gettime_relative() - catchUpChangedTime) / NEKOAV_TIME_BASE;
+    int level = catchUpLevel;
+    if (catchUpLateFrames >= CatchUpLateFrames && level < CatchUpMaxLevel && elapsed > CatchUpRaiseInterval) {
+        level += 1;
+    }
+    else if (catchUpSyncFrames >= CatchUpSyncFrames && level > 0 && elapsed > CatchUpRelaxInterval) {
+        level -= 1;
+    }
+    if (level == catchUpLevel) {
+        return;
+    }
+
+    qDebug() << "VideoThread catch up level" << catchUpLevel << "=>" << level << "A-V" << diff;
+
+    catchUpLevel = level;
+    catchUpLateFrames = 0;
+    catchUpSyncFrames = 0;
+    catchUpChangedTime = av_gettime_relative();
+    videoApplyDiscard();
+}
+void VideoThread::videoApplyDiscard() {
+    auto &level = CatchUpLevels[catchUpLevel];
+    codecCtxt->skip_frame = std::max({level.skipFrame, rateSkipFrame, seekSkipFrame});
+    codecCtxt->skip_loop_filter = level.skipLoopFilter;
+    codecCtxt->skip_idct = level.skipIdct;
+}
+int VideoThread::videoFrameBuffers() const {
+    int n = demuxerThread->videoFrameBuffers();
+    if (presentation) {
+        // The queue depth plus the frame on the screen and the one being converted
+        n = std::max(n, MinPresentationDepth + 2);
+    }
+    return std::clamp(n, 1, int(MaxFrameBuffers));
+}
+bool VideoThread::videoAllocFrames(int width, int height, AVPixelFormat format) {
+    int n = videoFrameBuffers();
+
+    dstFrames.clear();
+    dstFrameIndex = 0;
+    for (int i = 0; i < n; i++) {
+        AVPtr<AVFrame> frame(av_frame_alloc());
+        frame->width = width;
+        frame->height = height;
+        frame->format = format;
+        if (av_frame_get_buffer(frame.get(), 32) < 0) {
+            dstFrames.clear();
+            return false;
+        }
+        dstFrames.push_back(std::move(frame));
+    }
+
+    qDebug() << "VideoThread alloc" << n << "frames" << width << "x" << height << av_pix_fmt_desc_get(format)->name;
+    return true;
+}
+AVFrame *VideoThread::videoAcquireFrame() {
+    // Find a frame no longer referenced by the sink, start from the oldest one
+    for (size_t i = 0; i < dstFrames.size(); i++) {
+        auto frame = dstFrames[(dstFrameIndex + i) % dstFrames.size()].get();
+        if (av_frame_is_writable(frame)) {
+            dstFrameIndex = (dstFrameIndex + i + 1) % dstFrames.size();
+            return frame;
+        }
+    }
+    // All in use, grow the pool so the steady state stays allocation free
+    if (dstFrames.size() < MaxFrameBuffers) {
+        auto oldest = dstFrames[dstFrameIndex].get();
+        AVPtr<AVFrame> frame(av_frame_alloc());
+        frame->width = oldest->width;
+        frame->height = oldest->height;
+        frame->format = oldest->format;
+        if (av_frame_get_buffer(frame.get(), 32) < 0) {
+            return nullptr;
+        }
+        // Insert before the oldest one, as the newest of the ring
+        auto ret = frame.get();
+        dstFrames.insert(dstFrames.begin() + dstFrameIndex, std::move(frame));
+        dstFrameIndex = (dstFrameIndex + 1) % dstFrames.size();
+        qDebug() << "VideoThread grow frames to" << dstFrames.size();
+        return ret;
+    }
+    // At the cap, give the oldest one a new buffer, the old one will be freed by the sink
+    auto frame = dstFrames[dstFrameIndex].get();
+    int width = frame->width;
+    int height = frame->height;
+    int format = frame->format;
+
+    av_frame_unref(frame);
+    frame->width = width;
+    frame->height = height;
+    frame->format = format;
+    if (av_frame_get_buffer(frame, 32) < 0) {
+        return nullptr;
+    }
+    dstFrameIndex = (dstFrameIndex + 1) % dstFrames.size();
+    return frame;
+}
+void VideoThread::videoWriteFrame(AVFrame *source) {
+    auto out = videoConvertFrame(source);
+    if (out.isNull()) {
+        return;
+    }
+    videoSink->setVideoFrame(out);
+    demuxerThread->markStartup(StartupStage::FirstPresentedFrame);
+}
+void VideoThread::videoQueueFrame(AVFrame *source, uint64_t generation, bool immediate) {
+    auto out = videoConvertFrame(source);
+    if (out.isNull()) {
+        return;
+    }
+    double pts = srcFrame->pts * av_q2d(stream->time_base);
+    double duration = 0.0;
+    if (srcFrame->pkt_duration > 0) {
+        duration = srcFrame->pkt_duration * av_q2d(stream->time_base);
+    }
+    else if (stream->avg_frame_rate.num > 0) {
+        duration = av_q2d(av_inv_q(stream->avg_frame_rate));
+    }
+    if (presentation->push(out, pts, duration, generation, immediate)) {
+        demuxerThread->markStartup(StartupStage::FirstPresentedFrame);
+    }
+}
+void VideoThread::flushPresentation() {
+    if (presentation) {
+        presentation->flush();
+    }
+}
+void VideoThread::detachPresentation() {
+    if (presentation) {
+        presentation->detach(this);
+    }
+}
+VideoFrame VideoThread::videoConvertFrame(AVFrame *source) {
     
     // Lazy eval beacuse of the hardware access
     if (firstFrame) {
@@ -618,40 +1801,7 @@ void VideoThread::videoWriteFrame(AVFrame *source) {
         qDebug() << "VideoThread source frame format" << av_pix_fmt_desc_get(srcFormat)->name;
 
         if (needConvert) {
-            // Prepare convertion buffer
-            auto dstFormat = ToAVPixelFormat(videoSink->supportedPixelFormats().first());
-
-            size_t n     = av_image_get_buffer_size(dstFormat, codecCtxt->width, codecCtxt->height, 32);
-            uint8_t *buf = static_cast<uint8_t*>(av_malloc(n));
-
-            av_image_fill_arrays(
-                dstFrame->data,
-                dstFrame->linesize,
-                buf,
-                dstFormat,
-                codecCtxt->width, codecCtxt->height,
-                32
-            );
-
-            swsCtxt.reset(
-                sws_getContext(
-                    codecCtxt->width,
-                    codecCtxt->height,
-                    AVPixelFormat(source->format),
-                    codecCtxt->width,
-                    codecCtxt->height,
-                    dstFormat,
-                    0,
-                    nullptr,
-                    nullptr,
-                    nullptr
-                )
-            );
-            if (!swsCtxt) {
-                // BTK_LOG(BTK_RED("[VideoThread] ") "sws_getContext failed!!!\n");
-                return;
-            }
-            dstFrame->format = dstFormat;
+            dstFormat = ToAVPixelFormat(videoSink->supportedPixelFormats().first());
         }
         else {
             qDebug() << "VideoSink directly support" << av_pix_fmt_desc_get(srcFormat)->name << " ,just passthrough";
@@ -660,38 +1810,40 @@ void VideoThread::videoWriteFrame(AVFrame *source) {
 
     if (!needConvert) {
         swsScaleDuration = 0.0;
-
-        videoSink->setVideoFrame(VideoFrame::fromAVFrame(source));
+        return VideoFrame::fromAVFrame(source);
     }
-    else if (swsCtxt) {
-        // Need convert and has ctxt
-        // Convert it
-        std::lock_guard locker(dstFrameMutex);
-        
-        int64_t swsBeginTime = av_gettime_relative();
-        int ret = sws_scale(
-            swsCtxt.get(),
-            source->data,
-            source->linesize,
-            0,
-            codecCtxt->height,
-            dstFrame->data,
-            dstFrame->linesize
-        );
 
-        // Copy dara
-        dstFrame->width = codecCtxt->width;
-        dstFrame->height = codecCtxt->height;
+    // Prepare convertion, only changed when the resolution or format changed
+    if (!swsSlicer.configure(source->width, source->height, AVPixelFormat(source->format), dstFormat)) {
+        // BTK_LOG(BTK_RED("[VideoThread] ") "sws_getContext failed!!!\n");
+        return VideoFrame();
+    }
+    if (dstFrames.empty() || dstFrames[0]->width != source->width || dstFrames[0]->height != source->height ||
+        dstFrames[0]->format != dstFormat) {
+        if (!videoAllocFrames(source->width, source->height, dstFormat)) {
+            return VideoFrame();
+        }
+    }
+    auto dstFrame = videoAcquireFrame();
+    if (!dstFrame) {
+        return VideoFrame();
+    }
 
-        swsScaleDuration = (av_gettime_relative() - swsBeginTime) / NEKOAV_TIME_BASE;
+    // Convert it in slices, the frame is only referenced by us, the sink may still use the other ones
+    int64_t swsBeginTime = av_gettime_relative();
+    int ret = swsSlicer.convert(source, dstFrame);
+    dstFrame->pts = source->pts;
 
-        if (ret < 0) {
-            // BTK_LOG(BTK_RED("[VideoThread] ") "sws_scale failed %d!!!\n", ret);
-            return;
-        }
+    swsScaleDuration = (av_gettime_relative() - swsBeginTime) / NEKOAV_TIME_BASE;
+    demuxerThread->counters()->convertTime.add(av_gettime_relative() - swsBeginTime);
 
-        videoSink->setVideoFrame(VideoFrame::fromAVFrame(dstFrame.get()));
+    if (ret < 0) {
+        // BTK_LOG(BTK_RED("[VideoThread] ") "sws_scale failed %d!!!\n", ret);
+        return VideoFrame();
     }
+
+    // Only add a reference, no copy
+    return VideoFrame::fromAVFrame(dstFrame);
 }
 void VideoThread::pause(bool v) {
     if (paused == v) {
@@ -701,163 +1853,202 @@ void VideoThread::pause(bool v) {
     cond.notify_one();
 }
 
-SubtitleThread::SubtitleThread(DemuxerThread *parent, AVStream *stream, AVCodecContext *ctxt) :
+SubtitleThread::SubtitleThread(DemuxerThread *parent, AVStream *stream, AVCodecContext *ctxt, const QUrl &scanSource) :
     QThread(),
     demuxerThread(parent),
+    codecCtxt(ctxt),
     stream(stream),
-    codecCtxt(ctxt)    
+    scanSource(scanSource),
+    queue(parent->packetPool(), QueueCapacity)
 {
     setObjectName("NekoAV SubtitleThread");
     
     videoSink = demuxerThread->videoSink();
 
+    paused = true;
     start();
-    pause(true);
 }
 
 SubtitleThread::~SubtitleThread() {
-    queue.flush();
     queue.requestStop();
-    pause(false);
-    cond.notify_one();
+    wakeUp();
     // Wait
     wait();
 
+    // It notifies us when done, stop it before our members gone
+    scanner.reset();
     avcodec_free_context(&codecCtxt);
 }
+static bool IsTextSubtitle(AVStream *stream) {
+    auto desc = avcodec_descriptor_get(stream->codecpar->codec_id);
+    return desc && (desc->props & AV_CODEC_PROP_TEXT_SUB);
+}
 void SubtitleThread::run() {
-    // Try get packet
-    int ret;
-    int got;
+    restartIndex();
 
-    AVSubtitle subtitle;
-    QRegularExpression reg("{.*?}");
-    QString text;
     while (!queue.stopRequested()) {
-        mainloop : 
-        if (reqRefresh) {
-            reqRefresh = false;
-        }
-        if (paused) {
-            waitting = true;
-            std::unique_lock lock(condMutex);
-            cond.wait(lock);
-            continue;
-        }
-        AVPacket *packet = queue.get();
-        if (packet == EofPacket) {
-            // No more data
-            waitting = true;
-            continue;
-        }
-        if (packet == FlushPacket) {
-            avcodec_flush_buffers(codecCtxt);
-            
-            // BTK_LOG(BTK_RED("[VideoThread] ") "Got flush\n");
-            continue;
-        }
-        if (packet == nullptr) {
-            // No Data
-            waitting = true;
-            continue;
+        applyRequests();
+        if (scanner && scanner->isDone()) {
+            // Replace the events from the packets, the scanned one has all of them
+            SubtitleIndex scanned;
+            if (scanner->take(scanned)) {
+                index = std::move(scanned);
+                indexComplete = true;
+            }
+            scanner.reset();
         }
-        waitting = false;
 
-        AVPtr<AVPacket> pguard(packet);
-
-        ret = avcodec_decode_subtitle2(codecCtxt, &subtitle, &got, packet);
-        if (!got || ret < 0) {
-            continue;
+        AVPacket *packet;
+        while ((packet = queue.get(false)) != nullptr) {
+            if (packet == FlushPacket) {
+                if (codecCtxt) {
+                    avcodec_flush_buffers(codecCtxt);
+                }
+                continue;
+            }
+            if (packet == SyncPacket) {
+                continue;
+            }
+            decodePacket(packet);
         }
-        
-        // Free the subtitle if
-        AVPtr<AVSubtitle> sguard(&subtitle);
 
-        if (subtitle.num_rects <= 0) {
-            continue;
-        }
-        auto data = subtitle.rects[0];
-        if (data->type == SUBTITLE_TEXT) {
-            text = QString::fromUtf8(data->text);
+        // Look up the text at the clock, and sleep until it changes
+        double clock = demuxerThread->clock();
+        double next;
+        QList<SubtitleImage> images;
+        if (!indexComplete) {
+            index.prune(clock - BitmapKeepDuration);
         }
-        if (data->type == SUBTITLE_ASS) {
-            text = QString::fromUtf8(data->ass).replace(reg, "").split(",").back();
-        }
-
-        // Sleep until we got it
-        double duration = packet->duration * av_q2d(stream->time_base);
-        double currentPts = packet->pts * av_q2d(stream->time_base);
-        double startPts = currentPts + subtitle.start_display_time / NEKOAV_TIME_BASE;
-        double endPts = currentPts + subtitle.end_display_time / NEKOAV_TIME_BASE + duration;
-
-        double diff = startPts - demuxerThread->clock();
-
-        while (diff > 0) {
-            // Wait until
-            std::unique_lock lock(condMutex);
-            cond.wait_for(lock, 10ms);
+        auto text = index.lookup(clock, &next, &images);
+        showText(text);
+        showImages(images);
 
-            diff = startPts - demuxerThread->clock();
-            if (queue.stopRequested()) {
-                goto quitLabel;
-            }
-            if (reqRefresh) {
-                goto mainloop;
-            }
+        std::unique_lock lock(condMutex);
+        if (paused || std::isinf(next)) {
+            cond.wait(lock, [this]() { return notified; });
         }
-        if (demuxerThread->clock() > endPts) {
-            // Skip it
-            continue;
+        else {
+            double rate = qMax(demuxerThread->playbackRate(), 0.01);
+            auto timeout = std::chrono::microseconds(int64_t((next - clock) / rate * NEKOAV_TIME_BASE) + 1000);
+            cond.wait_for(lock, qMin<std::chrono::microseconds>(timeout, MaxWait), [this]() { return notified; });
         }
+        notified = false;
+    }
 
-        // Put subtitle
-        qDebug() << "Puting subtitle " << text << "Started " << startPts << " end " << endPts;
-        videoSink->setSubtitleText(text);
-
-        diff = endPts - demuxerThread->clock();
-        while (diff > 0) {
-            // Wait until
-            std::unique_lock lock(condMutex);
-            cond.wait_for(lock, 10ms);
-
-            diff = endPts - demuxerThread->clock();
-
-            if (queue.stopRequested()) {
-                goto quitLabel;
-            }
-            if (reqRefresh) {
-                goto mainloop;
-            }
+    showText(QString());
+    showImages({ });
+}
+void SubtitleThread::applyRequests() {
+    AVStream *newStream;
+    QUrl      newExternal;
+    bool      externalChanged;
+    {
+        std::lock_guard lock(condMutex);
+        newStream = requestedStream;
+        newExternal = requestedExternal;
+        externalChanged = hasExternalRequest;
+        requestedStream = nullptr;
+        hasExternalRequest = false;
+    }
+    if (!newStream && !externalChanged) {
+        return;
+    }
+    if (newStream) {
+        avcodec_free_context(&codecCtxt);
+        auto [ctxt, errcode] = FFCreateDecoderContext(newStream);
+        codecCtxt = ctxt;
+        stream = ctxt ? newStream : nullptr;
+        if (!ctxt) {
+            qDebug() << "SubtitleThread failed to open decoder" << FFErrorToString(errcode);
         }
+    }
+    if (externalChanged) {
+        externalSource = newExternal;
+    }
+    restartIndex();
+}
+void SubtitleThread::restartIndex() {
+    scanner.reset();
+    index.clear();
+    indexComplete = false;
+    showText(QString());
+    showImages({ });
 
-        // End 
-        videoSink->setSubtitleText(QString());
+    if (!externalSource.isEmpty()) {
+        startScan(externalSource, -1);
+    }
+    else if (stream && !scanSource.isEmpty() && IsTextSubtitle(stream)) {
+        startScan(scanSource, stream->index);
     }
+}
+void SubtitleThread::startScan(const QUrl &url, int streamIndex) {
+    scanner = std::make_unique<SubtitleScanner>(this, url, streamIndex);
+    scanner->start();
+}
+void SubtitleThread::decodePacket(AVPacket *packet) {
+    PacketGuard pguard(queue.packetPool(), packet);
 
-    quitLabel : videoSink->setSubtitleText(QString());
+    // Not needed if the scanner has all events, or packets of the previous stream
+    if (indexComplete || !externalSource.isEmpty() || !codecCtxt || packet->stream_index != stream->index) {
+        return;
+    }
+    AVSubtitle subtitle;
+    int got = 0;
+    int ret = avcodec_decode_subtitle2(codecCtxt, &subtitle, &got, packet);
+    if (ret < 0 || !got) {
+        return;
+    }
+    AVPtr<AVSubtitle> sguard(&subtitle);
+    index.add(subtitle, packet, stream->time_base, QSize(codecCtxt->width, codecCtxt->height));
+}
+void SubtitleThread::showText(const QString &text) {
+    if (text == currentText) {
+        return;
+    }
+    currentText = text;
+    videoSink->setSubtitleText(text);
+}
+void SubtitleThread::showImages(const QList<SubtitleImage> &images) {
+    // The same images keep the cache key while they are shown
+    QList<qint64> keys;
+    for (auto &image : images) {
+        keys.push_back(image.image.cacheKey());
+    }
+    if (keys == currentImages) {
+        return;
+    }
+    currentImages = keys;
+    videoSink->setSubtitleImages(images);
 }
 void SubtitleThread::pause(bool v) {
     if (paused == v) {
         return;
     }
     paused = v;
-    cond.notify_one();
+    wakeUp();
 }
 void SubtitleThread::switchStream(AVStream* stream) {
-    refresh();
-
-    while (!waitting) { 
-        std::this_thread::sleep_for(1ms);
+    {
+        std::lock_guard lock(condMutex);
+        requestedStream = stream;
     }
-
-    avcodec_free_context(&codecCtxt);
-    auto [ctxt, errcode] = FFCreateDecoderContext(stream);
-    codecCtxt = ctxt;
+    queue.flush();
+    wakeUp();
+}
+void SubtitleThread::setExternalSource(const QUrl &url) {
+    {
+        std::lock_guard lock(condMutex);
+        requestedExternal = url;
+        hasExternalRequest = true;
+    }
+    wakeUp();
 }
 void SubtitleThread::refresh() {
-    reqRefresh = true;
-    queue.flush();
-    queue.put(FlushPacket);
+    wakeUp();
+}
+void SubtitleThread::wakeUp() {
+    std::lock_guard lock(condMutex);
+    notified = true;
     cond.notify_one();
 }
 
@@ -867,12 +2058,13 @@ DemuxerThread::DemuxerThread(MediaPlayerPrivate *parent) : QThread(), player(par
 }
 DemuxerThread::~DemuxerThread() {
     // Tell it we should  quit
+    destroying = true;
     quit = true;
     wakeUp();
     wait();
 
     avformat_close_input(&formatCtxt);
-    av_free(ioBuffer);
+    readAhead.reset();
 }
 void DemuxerThread::run() {
     QScopedPointer<QObject> invokeHelperGuard(new QObject());
@@ -882,8 +2074,10 @@ void DemuxerThread::run() {
     if (!load()) {
         return;
     }
-    if (prepareWorker()) {
-        runDemuxer();
+    // Keep going if the next source was preloaded
+    bool ok = prepareWorker();
+    while (ok) {
+        ok = runDemuxer() && handoverPreloaded();
     }
     
     // Settings some status
@@ -892,22 +2086,191 @@ void DemuxerThread::run() {
     player->setPlaybackState(PlaybackState::StoppedState);
 
     // Cleanup
+    cleanupWorkers(false);
+    invokeHelper = nullptr;
+
+    for (auto pak : preloadedPackets) {
+        av_packet_free(&pak);
+    }
+    preloadedPackets.clear();
+
+    avformat_close_input(&formatCtxt);
+    readAhead.reset();
+    av_packet_free(&packet);
+
+    qDebug() << "DemuxerThread packet pool allocated" << packetPool()->allocatedCount() 
+             << "recycled" << packetPool()->recycledCount();
+}
+void DemuxerThread::cleanupWorkers(bool keepLastFrame) {
+    if (videoThread) {
+        videoThread->setKeepLastFrame(keepLastFrame);
+        // The renderer reads the audio clock by it
+        videoThread->detachPresentation();
+    }
     delete audioThread;
+    delete handoverAudioThread;
     delete videoThread;
     delete subtitleThread;
 
     audioThread = nullptr;
+    handoverAudioThread = nullptr;
     videoThread = nullptr;
     subtitleThread = nullptr;
-    invokeHelper = nullptr;
+    for (auto &n : activeThreads) {
+        n = 0;
+    }
+}
+Preloader *DemuxerThread::takePreloader(bool anySource) {
+    std::lock_guard locker(player->preloadMutex);
+    auto preloader = player->preloader;
+    if (!preloader || !preloader->isReady()) {
+        return nullptr;
+    }
+    if (!anySource && (player->ioDevice || preloader->url() != player->url)) {
+        return nullptr;
+    }
+    player->preloader = nullptr;
+    return preloader;
+}
+bool DemuxerThread::adoptPreloaded(Preloader *preloader) {
+    formatCtxt = preloader->take(preloadedPackets);
+    if (!formatCtxt) {
+        return false;
+    }
+    formatCtxt->interrupt_callback.callback = [](void *_self) -> int {
+        return static_cast<DemuxerThread *>(_self)->interruptHandler();
+    };
+    formatCtxt->interrupt_callback.opaque = this;
+
+    player->videoStream = preloader->videoStream;
+    player->audioStream = preloader->audioStream;
+    player->subtitleStream = preloader->subtitleStream;
+
+    // Opened in background, so they cost nothing
+    player->startupMark(StartupStage::OpenInput);
+    player->startupMark(StartupStage::FindStreamInfo);
+
+    qDebug() << "DemuxerThread use the preloaded" << preloader->url() << "with" << preloadedPackets.size() << "packets";
+    return true;
+}
+bool DemuxerThread::handoverPreloaded() {
+    if (!atEnd || destroying) {
+        return false;
+    }
+    std::unique_ptr<Preloader> preloader(takePreloader(true));
+    if (!preloader) {
+        return false;
+    }
 
+    // Keep the last frame on the screen until the next one comes, and the audio device open
+    auto audio = std::exchange(audioThread, nullptr);
+    cleanupWorkers(true);
+    handoverAudioThread = audio;
     avformat_close_input(&formatCtxt);
-    av_packet_free(&packet);
+    readAhead.reset();
+    player->startupReset(av_gettime_relative(), AV_NOPTS_VALUE);
+    player->resetCounters();
+    {
+        std::lock_guard locker(player->settingsMutex);
+        player->url = preloader->url();
+        player->ioDevice = nullptr;
+        player->subtitleFile = QUrl(); //< It was for the previous source
+        if (!adoptPreloaded(preloader.get())) {
+            return false;
+        }
+        prepareBuffering();
+    }
+
+    // Reset the status of the previous source
+    quit = false;
+    atEnd = false;
+    hasSeek = false;
+    afterSeek = false;
+    curPosition = 0;
+    externalClock = 0.0;
+    prevBufferProgress = 0.0f;
+
+    publishMetadata();
+    Q_EMIT ffmpegSourceChanged(preloader->url());
+    Q_EMIT ffmpegMediaLoaded();
+
+    return prepareWorker();
+}
+void DemuxerThread::prepareBuffering() {
+    // Check the URL if is network stream
+    if (player->url.scheme().startsWith("http")) {
+        // TODO : Add more checking
+        isLocalSource = false;
+    }
+    else {
+        isLocalSource = true;
+    }
+    // The settingsMutex is held by the caller
+    std::shared_ptr<BufferingPolicy> newPolicy = player->bufferingPolicy;
+    auto state = newPolicy->createState(isLocalSource);
+
+    // Destroy the old state before its policy
+    std::lock_guard locker(bufferingMutex);
+    buffering = std::move(state);
+    policy = std::move(newPolicy);
+}
+bool DemuxerThread::prepareReadAhead() {
+    std::unique_ptr<ByteSource> source;
+    int64_t size = player->readAheadSize;
+    if (player->ioDevice) {
+        source = ByteSource::fromDevice(player->ioDevice);
+    }
+    else if (size > 0 && !player->inputFormat && player->url.scheme().startsWith("http")) {
+        // Open it by ourself, so the I/O runs out of the demuxer thread, and the fetched ranges go to the disk cache
+        AVDictionary *copy = nullptr;
+        av_dict_copy(&copy, player->options, 0);
+        std::shared_ptr<AVDictionary> options(copy, [](AVDictionary *dict) { av_dict_free(&dict); });
+
+        auto url = player->url;
+        auto interrupt = formatCtxt->interrupt_callback;
+        source = DiskCache::instance().open(url, player->cacheKey, [url, options, interrupt](int *errcode) {
+            return ByteSource::open(url, options.get(), interrupt, errcode);
+        }, &errcode);
+        if (!source) {
+            return false;
+        }
+    }
+    if (!source) {
+        return true;
+    }
+    readAhead = std::make_unique<ReadAheadIO>(std::move(source), size);
+    readAhead->setInterruptCallback(formatCtxt->interrupt_callback);
+    formatCtxt->pb = readAhead->context();
+    return true;
+}
+int64_t DemuxerThread::fetchedBytes() const {
+    if (readAhead) {
+        return readAhead->fetchedBytes();
+    }
+    return formatCtxt->pb ? formatCtxt->pb->bytes_read : 0;
 }
 bool DemuxerThread::load() {
     // Shoud we lock here ?
     std::lock_guard locker(player->settingsMutex);
 
+    // The same source was preloaded, skip the opening
+    std::unique_ptr<Preloader> preloader(takePreloader(false));
+    if (preloader) {
+        if (!adoptPreloaded(preloader.get())) {
+            return false;
+        }
+        publishMetadata();
+        player->setMediaStatus(MediaStatus::LoadedMedia);
+        player->loaded = true;
+        Q_EMIT ffmpegMediaLoaded();
+        prepareBuffering();
+
+        while (player->playbackState != PlaybackState::PlayingState) {
+            waitForEvent(1h);
+        }
+        return true;
+    }
+
     formatCtxt = avformat_alloc_context();
     if (!formatCtxt) {
         errcode = AVERROR(ENOMEM);
@@ -920,51 +2283,10 @@ bool DemuxerThread::load() {
     };
     formatCtxt->interrupt_callback.opaque = this;
 
-    // Set ADIOContext if
-    if (player->ioDevice) {
-        auto ioDevice = player->ioDevice;
-
-        // Alloc memory for 
-        ioBufferSize = 32 * 1024; //< 32K
-        ioBuffer = (uint8_t*) av_malloc(ioBufferSize);
-
-        ioCtxt = avio_alloc_context(
-            ioBuffer,
-            ioBufferSize,
-            ioDevice->isWritable(),
-            ioDevice,
-            ioDevice->isReadable() ? +[](void *opaque, uint8_t *buf, int buf_size) -> int {
-                auto dev = static_cast<QIODevice *>(opaque);
-                auto n = dev->read((char *)buf, buf_size);
-
-                return n;
-            } : nullptr,
-            ioDevice->isWritable() ? +[](void *opaque, uint8_t *buf, int buf_size) -> int {
-                auto dev = static_cast<QIODevice *>(opaque);
-                auto n = dev->write((char*)buf, buf_size);
-
-                return n;
-            } : nullptr,
-            !ioDevice->isSequential() ? +[](void *opaque, int64_t offset, int whence) -> int64_t {
-                auto dev = static_cast<QIODevice *>(opaque);
-                auto pos = dev->pos();                
-
-                // Get Current pos;
-                if (pos < 0) {
-                    return -1;
-                }
-                switch (whence) {
-                    case SEEK_SET : pos = offset; break;
-                    case SEEK_CUR : pos += offset; break;
-                    case SEEK_END : pos = dev->size() + offset; break;
-                }
-                if (dev->seek(pos)) {
-                    return 0;
-                }
-                return -1;
-            } : nullptr
-        );
-        formatCtxt->pb = ioCtxt;
+    // Read ahead of the device or network source
+    if (!prepareReadAhead()) {
+        player->setMediaStatus(MediaStatus::InvalidMedia);
+        return sendError(errcode);
     }
 
     // Try open
@@ -987,6 +2309,7 @@ bool DemuxerThread::load() {
         player->setMediaStatus(MediaStatus::InvalidMedia);
         return sendError(errcode);
     }
+    player->startupMark(StartupStage::OpenInput);
     
     // Begin get info
     errcode = avformat_find_stream_info(formatCtxt, nullptr);
@@ -994,10 +2317,12 @@ bool DemuxerThread::load() {
         player->setMediaStatus(MediaStatus::InvalidMedia);
         return sendError(errcode);
     }
+    player->startupMark(StartupStage::FindStreamInfo);
 
     // Dump info
     av_dump_format(formatCtxt, 0, url.data(), 0);
 
+    publishMetadata();
     player->setMediaStatus(MediaStatus::LoadedMedia);
     player->loaded = true;
 
@@ -1014,14 +2339,7 @@ bool DemuxerThread::load() {
 
     Q_EMIT ffmpegMediaLoaded();
 
-    // Check the URL if is network stream
-    if (url.startsWith("http")) {
-        // TODO : Add more checking
-        isLocalSource = false;
-    }
-    else {
-        isLocalSource = true;
-    }
+    prepareBuffering();
 
     // If not playing just load, waiting for it
     while (player->playbackState != PlaybackState::PlayingState) {
@@ -1041,17 +2359,100 @@ bool DemuxerThread::prepareWorker() {
         if (!prepareCodec(player->videoStream)) {
             return false;
         }
+        buildKeyframeIndex();
     }
     if (player->subtitleStream >= 0 && videoSink()) {
         if (!prepareCodec(player->subtitleStream)) {
             return false;
         }
     }
+    applySubtitleFile();
+    if (handoverAudioThread) {
+        // The next source has no audio to play on it
+        delete handoverAudioThread;
+        handoverAudioThread = nullptr;
+    }
+    player->startupExpect(audioThread != nullptr, videoThread != nullptr);
+    player->startupMark(StartupStage::CodecOpen);
+
+    // Packets from the preloader go first
+    for (auto pak : preloadedPackets) {
+        dispatchPacket(pak);
+    }
+    preloadedPackets.clear();
     return true;
 }
+int  DemuxerThread::decoderThreadsFor(AVStream *stream) const {
+    auto type = stream->codecpar->codec_type;
+    if (type == AVMEDIA_TYPE_AUDIO) {
+        return player->decoderThreads[int(StreamType::Audio)];
+    }
+    if (type == AVMEDIA_TYPE_SUBTITLE) {
+        return player->decoderThreads[int(StreamType::Subtitle)];
+    }
+    int threads = player->decoderThreads[int(StreamType::Video)];
+    if (threads > 0) {
+        return threads;
+    }
+
+    // Auto, bigger picture need more threads, leave a core for the other workers
+    int cores = qMax(1u, std::thread::hardware_concurrency());
+    int64_t pixels = int64_t(stream->codecpar->width) * stream->codecpar->height;
+    int wanted;
+    if (pixels <= 1280 * 720) {
+        wanted = 4;
+    }
+    else if (pixels <= 1920 * 1080) {
+        wanted = 8;
+    }
+    else {
+        wanted = 16;
+    }
+    return std::clamp(qMin(wanted, cores - 1), 1, 16);
+}
+void DemuxerThread::buildKeyframeIndex() {
+    keyframeIndex.clear();
+
+    // From the container index, the left will be added while demuxing
+    auto stream = formatCtxt->streams[player->videoStream];
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+    int n = avformat_index_get_entries_count(stream);
+    for (int i = 0; i < n; i++) {
+        auto entry = avformat_index_get_entry(stream, i);
+        if (entry->flags & AVINDEX_KEYFRAME) {
+            keyframeIndex.add(entry->timestamp, entry->pos);
+        }
+    }
+#else
+    for (int i = 0; i < stream->nb_index_entries; i++) {
+        auto &entry = stream->index_entries[i];
+        if (entry.flags & AVINDEX_KEYFRAME) {
+            keyframeIndex.add(entry.timestamp, entry.pos);
+        }
+    }
+#endif
+    qDebug() << "DemuxerThread keyframe index from container" << keyframeIndex.size();
+}
 bool DemuxerThread::prepareCodec(int streamid) {
     auto stream = formatCtxt->streams[streamid];
-    auto [codecCtxt, retCode] = FFCreateDecoderContext(stream);
+    auto type = stream->codecpar->codec_type;
+    auto streamType = StreamType::Video;
+    if (type == AVMEDIA_TYPE_AUDIO) {
+        streamType = StreamType::Audio;
+    }
+    else if (type == AVMEDIA_TYPE_SUBTITLE) {
+        streamType = StreamType::Subtitle;
+    }
+
+    int threads = decoderThreadsFor(stream);
+    int threadType = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    switch (player->decoderThreadType[int(streamType)].load()) {
+        case DecoderThreadType::Frame : threadType = FF_THREAD_FRAME; break;
+        case DecoderThreadType::Slice : threadType = FF_THREAD_SLICE; break;
+        default : break;
+    }
+
+    auto [codecCtxt, retCode] = FFCreateDecoderContext(stream, threads, threadType);
     if (codecCtxt == nullptr) {
         errcode = retCode;
         return sendError(errcode);
@@ -1060,16 +2461,38 @@ bool DemuxerThread::prepareCodec(int streamid) {
     qDebug() << "DemuxerThread Create Codec " << codecCtxt->codec->name << " fullname" << codecCtxt->codec->long_name;
 
     // Common init done
-    if (codecCtxt->codec_type == AVMEDIA_TYPE_AUDIO) {
-        audioThread = new AudioThread(this, stream, codecCtxt);
-        return true;
+    auto activeType = codecCtxt->active_thread_type;
+    auto active = codecCtxt->thread_count;
+    if (type == AVMEDIA_TYPE_AUDIO) {
+        if (handoverAudioThread) {
+            // Kept from the previous source, no gap by reopening the device
+            audioThread = std::exchange(handoverAudioThread, nullptr);
+            audioThread->replaceStream(stream, codecCtxt);
+        }
+        else {
+            audioThread = new AudioThread(this, stream, codecCtxt);
+        }
     }
-    else if (codecCtxt->codec_type == AVMEDIA_TYPE_VIDEO) {
+    else if (type == AVMEDIA_TYPE_VIDEO) {
         videoThread = new VideoThread(this, stream, codecCtxt);
-        return true;
-    }
-    else if (codecCtxt->codec_type == AVMEDIA_TYPE_SUBTITLE) {
-        subtitleThread = new SubtitleThread(this, stream, codecCtxt);
+        // The hardware init may replace the context
+        active = videoThread->decoderThreads();
+        activeType = videoThread->decoderThreadType();
+    }
+    else if (type == AVMEDIA_TYPE_SUBTITLE) {
+        // Local files can be opened again to scan the whole stream
+        QUrl scanSource;
+        if (player->url.isLocalFile() && !player->ioDevice) {
+            scanSource = player->url;
+        }
+        delete subtitleThread; //< Created for a subtitle file when loading
+        subtitleThread = new SubtitleThread(this, stream, codecCtxt, scanSource);
+    }
+    if (type == AVMEDIA_TYPE_AUDIO || type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_SUBTITLE) {
+        activeThreads[int(streamType)] = active;
+        qDebug() << "DemuxerThread" << av_get_media_type_string(type) << "decoder threads requested" << threads
+                 << "active" << active
+                 << (activeType == FF_THREAD_FRAME ? "frame" : activeType == FF_THREAD_SLICE ? "slice" : "none");
         return true;
     }
 
@@ -1092,11 +2515,16 @@ bool DemuxerThread::runDemuxer() {
     int eof = false;
     while (true) {
         mainloop : doUpdateClock();
+        doUpdateStatistics();
 
         if (quit) {
             break;
         }
 
+        if (seekMissedInQueue()) {
+            // A worker took the packets before it ran the seek in its queue, seek the file
+            requestSeek(seekPosition);
+        }
         if (hasSeek) {
             if (!doSeek()) {
                 // Seek Error
@@ -1114,7 +2542,7 @@ bool DemuxerThread::runDemuxer() {
                 if (hasSeek || quit) {
                     goto mainloop;
                 }
-                if (tooMuchPackets()) {
+                if (tooMuchBuffered()) {
                     waitForEvent(10ms);
                     continue;
                 }
@@ -1135,7 +2563,7 @@ bool DemuxerThread::runDemuxer() {
         }
 
         // Check too much packet
-        if (tooMuchPackets()) {
+        if (tooMuchBuffered()) {
             if (waitForEvent(20ms)) {
                 continue;
             }
@@ -1175,13 +2603,51 @@ bool DemuxerThread::runDemuxer() {
                 goto mainloop;
             }
             quit = true;
+            atEnd = true;
         }
     }
     return true;
 }
+void DemuxerThread::dispatchPacket(AVPacket *pak) {
+    PacketQueue *target = nullptr;
+    if (pak->stream_index == player->audioStream && audioThread) {
+        target = &audioThread->packetQueue();
+        markStartup(StartupStage::FirstAudioPacket);
+    }
+    else if (pak->stream_index == player->videoStream && videoThread) {
+        target = &videoThread->packetQueue();
+        markStartup(StartupStage::FirstVideoPacket);
+        if ((pak->flags & AV_PKT_FLAG_KEY) && pak->pts != AV_NOPTS_VALUE) {
+            keyframeIndex.add(pak->pts, pak->pos);
+        }
+    }
+    else if (pak->stream_index == player->subtitleStream && subtitleThread) {
+        target = &subtitleThread->packetQueue();
+        markStartup(StartupStage::FirstSubtitlePacket);
+    }
+    if (target && subtitleThread && target == &subtitleThread->packetQueue()) {
+        // A stalled subtitle decoder must not stop the playback, drop it instead of sleeping
+        if (!target->tryPut(pak)) {
+            qWarning() << "DemuxerThread subtitle queue is full, drop the packet";
+            packetPool()->release(pak);
+            return;
+        }
+        counters()->packets += 1;
+        subtitleThread->wakeUp();
+    }
+    else if (target) {
+        counters()->packets += 1;
+        target->put(pak);
+    }
+    else {
+        packetPool()->release(pak);
+    }
+}
 bool DemuxerThread::readFrame(int *eof) {
     isReading = true;
+    int64_t readBegin = av_gettime_relative();
     errcode = av_read_frame(formatCtxt, packet);
+    readDuration += av_gettime_relative() - readBegin;
     isReading = false;
     if (errcode < 0) {
         if (errcode == AVERROR_EOF) {
@@ -1194,22 +2660,16 @@ bool DemuxerThread::readFrame(int *eof) {
         }
     }
     else {
-        // Dispatch here
-        if (packet->stream_index == player->audioStream && audioThread) {
-            audioThread->packetQueue().put(av_packet_clone(packet));
-        }
-        else if (packet->stream_index == player->videoStream && videoThread) {
-            videoThread->packetQueue().put(av_packet_clone(packet));
-        }
-        else if (packet->stream_index == player->subtitleStream && subtitleThread) {
-            subtitleThread->packetQueue().put(av_packet_clone(packet));
-        }
-        av_packet_unref(packet);
+        // Dispatch here, move the data into a pooled shell instead of clone it
+        auto pak = packetPool()->acquire();
+        av_packet_move_ref(pak, packet);
+        dispatchPacket(pak);
     }
 
     if (isLocalSource) {
         return true;
     }
+    doUpdateThroughput();
 
     // Check buffering here
     if (player->mediaStatus == MediaStatus::BufferingMedia) {
@@ -1222,7 +2682,7 @@ bool DemuxerThread::readFrame(int *eof) {
             Q_EMIT ffmpegBuffering(bufferedDuration(), curProgress);
         }
 
-        if (hasEnoughPackets() || *eof) {
+        if (hasEnoughBuffered() || *eof) {
             // End of buffering
             qDebug() << "DemuxerThread leave buffering";
             Q_EMIT ffmpegBuffering(bufferedDuration(), 1.0);
@@ -1233,7 +2693,7 @@ bool DemuxerThread::readFrame(int *eof) {
             }
         }
     }
-    else if (tooLessPackets() && !(*eof)) {
+    else if (tooLessBuffered() && !(*eof)) {
 #if     defined(NEKOAV_BUFFERING_1)
         // Wait for next time 
         if (prevTooLessPacketsTime == 0) {
@@ -1254,49 +2714,102 @@ bool DemuxerThread::readFrame(int *eof) {
         player->setMediaStatus(MediaStatus::BufferingMedia);
         doPause(true);
     }
-    else {
-        prevTooLessPacketsTime = 0; //< Clear the mark
+    else {
+        prevTooLessPacketsTime = 0; //< Clear the mark
+    }
+    return true;
+}
+auto DemuxerThread::bufferStatus() const -> BufferStatus {
+    BufferStatus status;
+    bool first = true;
+    auto add = [&](const PacketQueue &queue, int streamIndex) {
+        qreal  duration = queue.duration() * av_q2d(formatCtxt->streams[streamIndex]->time_base);
+        qint64 packets = queue.size();
+        status.bytes += queue.bytes();
+        if (first) {
+            status.duration = duration;
+            status.packets = packets;
+            first = false;
+        }
+        else {
+            status.duration = qMin(status.duration, duration);
+            status.packets = qMin(status.packets, packets);
+        }
+    };
+    if (audioThread) {
+        add(audioThread->packetQueue(), player->audioStream);
+    }
+    if (videoThread && !isPictureStream(player->videoStream)) {
+        add(videoThread->packetQueue(), player->videoStream);
     }
-    return true;
+    if (subtitleThread) {
+        // Subtitle is sparse, only count the memory
+        status.bytes += subtitleThread->packetQueue().bytes();
+    }
+    return status;
 }
-bool DemuxerThread::tooMuchPackets() const {
-    if (audioThread) {
-        if (audioThread->packetQueue().size() > bufferedPacketsLimit) {
-            return true;
-        }
+bool DemuxerThread::tooMuchBuffered() const {
+    // put sleeps on a full queue, keep the audio and video off it, so the demuxer never sleeps on a paused worker,
+    // the subtitle is not checked, it drops the packets over its own capacity
+    auto nearlyFull = [](const PacketQueue &queue) {
+        return queue.size() >= queue.capacity() - queue.capacity() / 8;
+    };
+    if (audioThread && nearlyFull(audioThread->packetQueue())) {
+        return true;
     }
-    if (videoThread) {
-        if (videoThread->packetQueue().size() > bufferedPacketsLimit) {
-            return true;
-        }
+    if (videoThread && nearlyFull(videoThread->packetQueue())) {
+        return true;
     }
-    return false;
+    return buffering->isFull(bufferStatus());
 }
-bool DemuxerThread::tooLessPackets() const {
+bool DemuxerThread::seekMissedInQueue() {
+    // Take all the flags, do not stop at the first one
+    bool missed = false;
     if (audioThread) {
-        if (audioThread->packetQueue().size() < bufferedPacketsLessThreshold) {
-            return true;
-        }
+        missed = audioThread->packetQueue().takeSeekMissed() || missed;
     }
     if (videoThread) {
-        if (videoThread->packetQueue().size() < bufferedPacketsLessThreshold) {
-            return true;
-        }
+        missed = videoThread->packetQueue().takeSeekMissed() || missed;
     }
-    return false;
+    if (subtitleThread) {
+        missed = subtitleThread->packetQueue().takeSeekMissed() || missed;
+    }
+    return missed;
 }
-bool DemuxerThread::hasEnoughPackets() const {
-    if (audioThread) {
-        if (audioThread->packetQueue().size() < bufferedPacketsEnough) {
-            return false;
-        }
+bool DemuxerThread::tooLessBuffered() const {
+    return buffering->isStarving(bufferStatus());
+}
+bool DemuxerThread::hasEnoughBuffered() const {
+    return buffering->isEnough(bufferStatus());
+}
+void DemuxerThread::doUpdateThroughput() {
+    if (!formatCtxt->pb) {
+        return;
     }
-    if (videoThread) {
-        if (videoThread->packetQueue().size() < bufferedPacketsEnough) {
-            return false;
-        }
+    int64_t now = av_gettime_relative();
+    int64_t bytes = fetchedBytes();
+    int64_t busy = readAhead ? readAhead->fetchTime() : readDuration;
+    if (throughputSampleTime == 0) {
+        throughputSampleTime = now;
+        throughputSampleBytes = bytes;
+        throughputSampleBusy = busy;
+        return;
     }
-    return true;
+    qreal elapsed = (now - throughputSampleTime) / NEKOAV_TIME_BASE;
+    if (elapsed < 0.5) {
+        // Sample per 500ms
+        return;
+    }
+    // The reading stops when the buffer is full, only count the time in the read calls
+    qreal reading = (busy - throughputSampleBusy) / NEKOAV_TIME_BASE;
+    if (reading > 0.01) {
+        buffering->addThroughputSample(bytes - throughputSampleBytes, reading);
+        counters()->throughput = (bytes - throughputSampleBytes) / reading;
+    }
+
+    throughputSampleTime = now;
+    throughputSampleBytes = bytes;
+    throughputSampleBusy = busy;
 }
 bool DemuxerThread::sendError(int errc) {
     qDebug() << FFErrorToString(errc);
@@ -1315,6 +2828,15 @@ bool DemuxerThread::doSeek() {
     bool seekInQueue = true;
     qreal curSeekPosition = seekPosition;
 
+    // The workers drop the frames before the target after the flush
+    if (audioThread) {
+        audioThread->setSeekTarget(curSeekPosition);
+        audioThread->discardBuffered();
+    }
+    if (videoThread && !isPictureStream(player->videoStream)) {
+        videoThread->setSeekTarget(curSeekPosition);
+    }
+
     // Pause thread & Try directly seek in queue
     if (audioThread) {
         restoreAudio = !audioThread->isPaused();
@@ -1328,6 +2850,7 @@ bool DemuxerThread::doSeek() {
         // We didnot seek if it is a audio cover
         restoreVideo = !videoThread->isPaused();
         videoThread->pause(true);
+        videoThread->flushPresentation();
         if (seekInQueue) {
             int64_t pos = curSeekPosition / av_q2d(formatCtxt->streams[player->videoStream]->time_base);
             seekInQueue = videoThread->packetQueue().seek(pos); //< Left thread will do this if prev is successful
@@ -1336,7 +2859,7 @@ bool DemuxerThread::doSeek() {
     if (subtitleThread) {
         restoreSubtitle = !subtitleThread->isPaused();
         subtitleThread->pause(true);
-        if (seekInQueue) {
+        if (seekInQueue && player->subtitleStream >= 0) {
             int64_t pos = curSeekPosition / av_q2d(formatCtxt->streams[player->subtitleStream]->time_base);
             seekInQueue = subtitleThread->packetQueue().seek(pos); //< Left thread will do this if prev is successful
         }
@@ -1346,24 +2869,35 @@ bool DemuxerThread::doSeek() {
         // Failed to seek in the queue, flush the queue and seek the file
         if (audioThread) {
             audioThread->packetQueue().flush();
-            audioThread->packetQueue().put(FlushPacket);
         }
         if (videoThread && !isPictureStream(player->videoStream)) {
             videoThread->packetQueue().flush();
-            videoThread->packetQueue().put(FlushPacket);
         }
         if (subtitleThread) {
             subtitleThread->packetQueue().flush();
-            subtitleThread->packetQueue().put(FlushPacket);
             subtitleThread->refresh();
         }
 
-        // Do seek
-        int64_t pos = curSeekPosition * NEKOAV_TIME_BASE;
-        errcode = av_seek_frame(formatCtxt, -1, pos, AVSEEK_FLAG_BACKWARD);
-        if (errcode < 0) {
-            qDebug() << "DemuxerThread failed to seek subtitleStream ";
-            return sendError(errcode);
+        // Do seek, jump to the gop of the target by the keyframe index
+        bool seeked = false;
+        if (videoThread && !isPictureStream(player->videoStream)) {
+            auto stream = formatCtxt->streams[player->videoStream];
+            auto entry = keyframeIndex.lookup(curSeekPosition / av_q2d(stream->time_base));
+            if (entry && entry->pos >= 0 && (formatCtxt->iformat->flags & AVFMT_TS_DISCONT)) {
+                // Timestamps are not reliable (like mpegts), use the byte position
+                seeked = av_seek_frame(formatCtxt, player->videoStream, entry->pos, AVSEEK_FLAG_BYTE) >= 0;
+            }
+            else if (entry) {
+                seeked = av_seek_frame(formatCtxt, player->videoStream, entry->pts, AVSEEK_FLAG_BACKWARD) >= 0;
+            }
+        }
+        if (!seeked) {
+            int64_t pos = curSeekPosition * NEKOAV_TIME_BASE;
+            errcode = av_seek_frame(formatCtxt, -1, pos, AVSEEK_FLAG_BACKWARD);
+            if (errcode < 0) {
+                qDebug() << "DemuxerThread failed to seek subtitleStream ";
+                return sendError(errcode);
+            }
         }
     }
     else {
@@ -1372,7 +2906,7 @@ bool DemuxerThread::doSeek() {
 
     // Set external Clock 
     externalClock = curSeekPosition;
-    externalClockStart = av_gettime_relative() - externalClock * NEKOAV_TIME_BASE;
+    externalClockStart = av_gettime_relative() - externalClock * NEKOAV_TIME_BASE / externalClockRate;
 
     if (seekPosition == curSeekPosition) {
         // User didnot seek at our do seeking
@@ -1392,15 +2926,90 @@ bool DemuxerThread::doSeek() {
     if (restoreSubtitle) {
         subtitleThread->pause(false);
     }
+    if (subtitleThread) {
+        // The events before the position are still in the index
+        subtitleThread->refresh();
+    }
+    if (!videoThread || isPictureStream(player->videoStream)) {
+        // No video frame will tell us
+        seekFinished(curSeekPosition);
+    }
 
     return true;
 }
+void DemuxerThread::seekFinished(qreal position) {
+    qreal ms = (av_gettime_relative() - seekBeginTime) / 1000.0;
+    qDebug() << "DemuxerThread seek to" << position << "took" << ms << "ms";
+    Q_EMIT ffmpegSeekFinished(position, ms);
+}
 bool DemuxerThread::waitForEvent(std::chrono::milliseconds ms) {
     doUpdateClock();
     std::unique_lock locker(condMutex);
     return cond.wait_for(locker, ms) == std::cv_status::no_timeout;
 }
+void DemuxerThread::doUpdatePlaybackRate() {
+    qreal rate = playbackRate();
+    if (rate == externalClockRate) {
+        return;
+    }
+    // Rebase the external clock at current position
+    if (!(videoThread && videoThread->isPaused())) {
+        externalClock = (av_gettime_relative() - externalClockStart) / NEKOAV_TIME_BASE * externalClockRate;
+    }
+    externalClockRate = rate;
+    externalClockStart = av_gettime_relative() - externalClock * NEKOAV_TIME_BASE / externalClockRate;
+
+    qDebug() << "DemuxerThread playback rate changed to" << rate;
+}
+void DemuxerThread::doUpdateStatistics() {
+    auto c = counters();
+    auto publish = [&](StreamType type, PacketQueue *queue, int streamIndex) {
+        int i = int(type);
+        if (!queue) {
+            c->queuePackets[i].store(0, std::memory_order_relaxed);
+            c->queueBytes[i].store(0, std::memory_order_relaxed);
+            c->queueDuration[i].store(0.0, std::memory_order_relaxed);
+            return;
+        }
+        qreal duration = queue->duration() * av_q2d(formatCtxt->streams[streamIndex]->time_base);
+        c->queuePackets[i].store(queue->size(), std::memory_order_relaxed);
+        c->queueBytes[i].store(queue->bytes(), std::memory_order_relaxed);
+        c->queueDuration[i].store(duration, std::memory_order_relaxed);
+    };
+    publish(StreamType::Audio, audioThread ? &audioThread->packetQueue() : nullptr, player->audioStream);
+    publish(StreamType::Video, videoThread ? &videoThread->packetQueue() : nullptr, player->videoStream);
+    publish(StreamType::Subtitle, subtitleThread ? &subtitleThread->packetQueue() : nullptr, player->subtitleStream);
+
+    // The adaptive input formats put the quality switches into the metadata
+    if (formatCtxt->event_flags & AVFMT_EVENT_FLAG_METADATA_UPDATED) {
+        publishMetadata();
+    }
+}
+void DemuxerThread::publishMetadata() {
+    formatCtxt->event_flags &= ~AVFMT_EVENT_FLAG_METADATA_UPDATED;
+    auto current = av_dict_get(formatCtxt->metadata, "nekoav_representation", nullptr, 0);
+    auto switches = av_dict_get(formatCtxt->metadata, "nekoav_representation_switches", nullptr, 0);
+
+    // The representation keys are internal, they go to the statistics instead of metaData()
+    AVDictionary *published = nullptr;
+    AVDictionaryEntry *cur = av_dict_get(formatCtxt->metadata, "", nullptr, AV_DICT_IGNORE_SUFFIX);
+    while (cur) {
+        if (!QByteArrayView(cur->key).startsWith("nekoav_representation")) {
+            av_dict_set(&published, cur->key, cur->value, 0);
+        }
+        cur = av_dict_get(formatCtxt->metadata, "", cur, AV_DICT_IGNORE_SUFFIX);
+    }
+
+    auto c = counters();
+    std::lock_guard locker(c->metadataMutex);
+    c->metadata = MediaMetaData::fromAVDictionary(published);
+    av_dict_free(&published);
+    c->representation = current ? QString::fromUtf8(current->value) : QString();
+    c->representationSwitches = switches ? QString::fromUtf8(switches->value).split('\n', Qt::SkipEmptyParts) : QStringList();
+}
 void DemuxerThread::doUpdateClock() {
+    doUpdatePlaybackRate();
+
     qreal curPos = position();
     if ((curPos - int64_t(curPos)) < 0.1 && abs(curPos - curPosition) >= 1) {
         // Time to update , 1s per second
@@ -1423,6 +3032,7 @@ void DemuxerThread::doUpdateClock() {
     eventDispatcher()->processEvents(QEventLoop::AllEvents);
 }
 void DemuxerThread::requestSeek(qreal pos) {
+    seekBeginTime = av_gettime_relative();
     hasSeek = true;
     seekPosition = pos;
 
@@ -1454,6 +3064,32 @@ void DemuxerThread::requestSwitchStream(int streamIndex) {
         }
     }, Qt::QueuedConnection);
 }
+void DemuxerThread::requestSubtitleFile() {
+    if (!invokeHelper) {
+        // Not running, prepareWorker will apply it
+        return;
+    }
+    QMetaObject::invokeMethod(invokeHelper, [this]() {
+        applySubtitleFile();
+    }, Qt::QueuedConnection);
+}
+void DemuxerThread::applySubtitleFile() {
+    QUrl url;
+    {
+        std::lock_guard locker(player->settingsMutex);
+        url = player->subtitleFile;
+    }
+    if (!subtitleThread) {
+        if (url.isEmpty() || !videoSink()) {
+            return;
+        }
+        // No embedded subtitle, only for the file
+        subtitleThread = new SubtitleThread(this, nullptr, nullptr, QUrl());
+        subtitleThread->pause(player->playbackState != PlaybackState::PlayingState);
+    }
+    qDebug() << "DemuxerThread use subtitle file" << url;
+    subtitleThread->setExternalSource(url);
+}
 void DemuxerThread::doPause(bool v) {
     // Save external clock
     if (v) {
@@ -1461,7 +3097,7 @@ void DemuxerThread::doPause(bool v) {
     }
     else {
         // Restore
-        externalClockStart = av_gettime_relative() - externalClock * NEKOAV_TIME_BASE;
+        externalClockStart = av_gettime_relative() - externalClock * NEKOAV_TIME_BASE / externalClockRate;
     }
 
     // Do work
@@ -1505,7 +3141,7 @@ qreal DemuxerThread::clock() const {
             return externalClock;
         }
     }
-    return (av_gettime_relative() - externalClockStart) / NEKOAV_TIME_BASE;
+    return (av_gettime_relative() - externalClockStart) / NEKOAV_TIME_BASE * externalClockRate;
 }
 qreal DemuxerThread::position() const {
     if (afterSeek) {
@@ -1533,21 +3169,11 @@ float DemuxerThread::bufferProgress() const {
     if (!audioThread && !videoThread) {
         return 0.0;
     }
-
-    size_t packets = std::numeric_limits<size_t>::max();
-    if (audioThread) {
-        packets = qMin(packets, audioThread->packetQueue().size());
-    }
-    if (videoThread && !isPictureStream(player->videoStream)) {
-        packets = qMin(packets, videoThread->packetQueue().size());
-    }
-    if (packets < bufferedPacketsLessThreshold) {
-        packets = bufferedPacketsLessThreshold;
+    std::lock_guard locker(bufferingMutex);
+    if (!buffering) {
+        return 0.0;
     }
-
-    auto progress = double(packets - bufferedPacketsLessThreshold) / double(bufferedPacketsEnough);
-    progress = (int64_t(progress * 100)) / 100.0; //< Make it like 0.1 0.2 0.3
-    return progress;
+    return buffering->progress(bufferStatus());
 }
 bool DemuxerThread::isPictureStream(int idx) const {
     // TODO : Improve
@@ -1558,8 +3184,15 @@ bool DemuxerThread::isPictureStream(int idx) const {
 }
 
 // MediaPlayerPrivate here
+MediaPlayerPrivate::MediaPlayerPrivate(MediaPlayer *player) : player(player) {
+    startupReset(0, AV_NOPTS_VALUE);
+
+    statisticsTimer.setInterval(1000);
+    connect(&statisticsTimer, &QTimer::timeout, this, &MediaPlayerPrivate::statisticsTimeout);
+}
 MediaPlayerPrivate::~MediaPlayerPrivate() {
     stop();
+    delete preloader;
 }
 void MediaPlayerPrivate::load() {
     if (demuxerThread) {
@@ -1592,6 +3225,14 @@ void MediaPlayerPrivate::load() {
                 this, &MediaPlayerPrivate::demuxerBuffering,   
                 Qt::QueuedConnection
         );
+        connect(demuxerThread, &DemuxerThread::ffmpegSeekFinished, 
+                this, &MediaPlayerPrivate::demuxerSeekFinished,   
+                Qt::QueuedConnection
+        );
+        connect(demuxerThread, &DemuxerThread::ffmpegSourceChanged, 
+                this, &MediaPlayerPrivate::demuxerSourceChanged,   
+                Qt::QueuedConnection
+        );
 
         demuxerThread->start(QThread::HighPriority);
     }, Qt::QueuedConnection);
@@ -1614,7 +3255,6 @@ void MediaPlayerPrivate::pause() {
     if (!demuxerThread) {
         return;
     }
-
     setPlaybackState(PlaybackState::PausedState);
 }
 void MediaPlayerPrivate::setMediaStatus(MediaStatus s) {
@@ -1645,7 +3285,15 @@ void MediaPlayerPrivate::setPlaybackState(PlaybackState s) {
     }
 
     auto cb = [this]() {
-        Q_EMIT player->playingChanged(playbackState == PlaybackState::PlayingState);
+        // The demuxer thread sets StoppedState at the end of media, the timer follows the state here
+        bool playing = playbackState == PlaybackState::PlayingState;
+        if (playing && statisticsTimer.interval() > 0) {
+            statisticsTimer.start();
+        }
+        else if (!playing) {
+            statisticsTimer.stop();
+        }
+        Q_EMIT player->playingChanged(playing);
         Q_EMIT player->playbackStateChanged(playbackState);
     };
 
@@ -1717,6 +3365,110 @@ void MediaPlayerPrivate::demuxerMediaLoaded() {
 void MediaPlayerPrivate::demuxerPositionChanged(qreal pos) {
     Q_EMIT player->positionChanged(pos);
 }
+void MediaPlayerPrivate::demuxerSeekFinished(qreal pos, qreal ms) {
+    Q_EMIT player->seekFinished(pos, ms);
+}
+void MediaPlayerPrivate::demuxerSourceChanged(const QUrl &url) {
+    startupSource = url;
+    Q_EMIT player->sourceChanged(url);
+}
+void MediaPlayerPrivate::startupReset(int64_t origin, int64_t resolved) {
+    startupOrigin = origin;
+    for (auto &stage : startupStages) {
+        stage = -1;
+    }
+    if (resolved != AV_NOPTS_VALUE) {
+        startupStages[int(StartupStage::Resolve)] = (resolved - origin) / 1000;
+    }
+    startupExpectAudio = false;
+    startupExpectVideo = false;
+    startupReported = false;
+}
+void MediaPlayerPrivate::resetCounters() {
+    counters.reset();
+    // The sink counts since it was created
+    counters.coalescedBase = videoSink ? videoSink->coalescedFramesCount() : 0;
+}
+void MediaPlayerPrivate::startupBeginLoad() {
+    resetCounters();
+
+    // Began before resolving the url ?
+    int64_t now = av_gettime_relative();
+    int64_t begin = startupPendingBegin.exchange(AV_NOPTS_VALUE);
+    if (begin == AV_NOPTS_VALUE) {
+        startupReset(now, AV_NOPTS_VALUE);
+    }
+    else {
+        startupReset(begin, now);
+    }
+}
+void MediaPlayerPrivate::startupMark(StartupStage stage) {
+    auto &slot = startupStages[int(stage)];
+    if (slot.load(std::memory_order_relaxed) >= 0) {
+        // Fast path, it is called on every packet
+        return;
+    }
+    int64_t expected = -1;
+    int64_t ms = (av_gettime_relative() - startupOrigin) / 1000;
+    if (!slot.compare_exchange_strong(expected, ms)) {
+        return;
+    }
+
+    // Complete when the decoders opened, and the first picture / sound are out
+    auto reached = [this](StartupStage s) {
+        return startupStages[int(s)] >= 0;
+    };
+    if (!reached(StartupStage::CodecOpen)) {
+        return;
+    }
+    if (startupExpectVideo && !reached(StartupStage::FirstPresentedFrame)) {
+        return;
+    }
+    if (startupExpectAudio && !reached(StartupStage::FirstAudioCallback)) {
+        return;
+    }
+    if (startupReported.exchange(true)) {
+        return;
+    }
+    QMetaObject::invokeMethod(this, &MediaPlayerPrivate::startupFinished, Qt::QueuedConnection);
+}
+void MediaPlayerPrivate::startupExpect(bool audio, bool video) {
+    startupExpectAudio = audio;
+    startupExpectVideo = video;
+}
+auto MediaPlayerPrivate::startupTimeline() const -> StartupTimeline {
+    auto at = [this](StartupStage s) -> qint64 {
+        return startupStages[int(s)];
+    };
+    StartupTimeline timeline;
+    timeline.source = startupSource;
+    timeline.resolve = at(StartupStage::Resolve);
+    timeline.openInput = at(StartupStage::OpenInput);
+    timeline.findStreamInfo = at(StartupStage::FindStreamInfo);
+    timeline.codecOpen = at(StartupStage::CodecOpen);
+    timeline.firstAudioPacket = at(StartupStage::FirstAudioPacket);
+    timeline.firstVideoPacket = at(StartupStage::FirstVideoPacket);
+    timeline.firstSubtitlePacket = at(StartupStage::FirstSubtitlePacket);
+    timeline.firstDecodedFrame = at(StartupStage::FirstDecodedFrame);
+    timeline.firstPresentedFrame = at(StartupStage::FirstPresentedFrame);
+    timeline.firstAudioCallback = at(StartupStage::FirstAudioCallback);
+    return timeline;
+}
+void MediaPlayerPrivate::statisticsTimeout() {
+    Q_EMIT player->statisticsUpdated(player->statistics());
+}
+void MediaPlayerPrivate::startupFinished() {
+    auto t = startupTimeline();
+
+    // One line, easy to grep and aggregate
+    qDebug().noquote() << QString(
+        "MediaPlayer startup %1 resolve=%2 open=%3 info=%4 codec=%5 packet(a/v/s)=%6/%7/%8 decoded=%9 presented=%10 audio=%11 (ms)"
+    ).arg(t.source.toString()).arg(t.resolve).arg(t.openInput).arg(t.findStreamInfo).arg(t.codecOpen)
+     .arg(t.firstAudioPacket).arg(t.firstVideoPacket).arg(t.firstSubtitlePacket)
+     .arg(t.firstDecodedFrame).arg(t.firstPresentedFrame).arg(t.firstAudioCallback);
+
+    Q_EMIT player->startupFinished(t);
+}
 void MediaPlayerPrivate::updateMediaInfo() {
     Q_EMIT player->durationChanged(player->duration());
     // Q_EMIT player->positionChanged(player->position());
@@ -1752,9 +3504,71 @@ void MediaPlayer::setPosition(qreal pos) {
     if (d->demuxerThread) {
         d->demuxerThread->requestSeek(pos);
     }
+    // Seek away from the end, the next source is not needed soon, cancelPreload checks the preloader under the lock
+    if (duration() - pos > MediaPlayerPrivate::PreloadKeepDistance) {
+        cancelPreload();
+    }
 }
-void MediaPlayer::setPlaybackRate(qreal) {
-
+void MediaPlayer::preloadNext(const QUrl &url) {
+    cancelPreload();
+    if (url.isEmpty()) {
+        return;
+    }
+    std::lock_guard locker(d->preloadMutex);
+    d->preloader = new Preloader(url, d->options, d->inputFormat, d->preloadMemoryBudget);
+    d->preloader->start(QThread::LowPriority);
+}
+void MediaPlayer::cancelPreload() {
+    Preloader *preloader;
+    {
+        std::lock_guard locker(d->preloadMutex);
+        preloader = std::exchange(d->preloader, nullptr);
+    }
+    if (preloader) {
+        qDebug() << "MediaPlayer cancel preload" << preloader->url();
+        delete preloader;
+    }
+}
+auto MediaPlayer::preloadedSource() const -> QUrl {
+    std::lock_guard locker(d->preloadMutex);
+    return d->preloader ? d->preloader->url() : QUrl();
+}
+auto MediaPlayer::isPreloadReady() const -> bool {
+    std::lock_guard locker(d->preloadMutex);
+    return d->preloader && d->preloader->isReady();
+}
+void MediaPlayer::setPreloadMemoryBudget(qint64 bytes) {
+    d->preloadMemoryBudget = bytes;
+}
+auto MediaPlayer::preloadMemoryBudget() const -> qint64 {
+    return d->preloadMemoryBudget;
+}
+void MediaPlayer::setDiskCache(const QString &dir, qint64 maxBytes) {
+    DiskCache::instance().configure(dir, maxBytes);
+}
+void MediaPlayer::setReadAheadSize(qint64 bytes) {
+    d->readAheadSize = qMax<qint64>(bytes, 0);
+}
+auto MediaPlayer::readAheadSize() const -> qint64 {
+    return d->readAheadSize;
+}
+void MediaPlayer::setPlaybackRate(qreal rate) {
+    rate = std::clamp(rate, 0.25, 4.0);
+    if (rate == d->playbackRate) {
+        return;
+    }
+#if !defined(NEKOAV_AVFILTER)
+    if (hasAudio()) {
+        qWarning() << "MediaPlayer::setPlaybackRate need libavfilter for audio time stretch";
+        return;
+    }
+#endif
+    // Workers and the demuxer pick it up at next frame
+    d->playbackRate = rate;
+    Q_EMIT playbackRateChanged(rate);
+}
+auto MediaPlayer::playbackRate() const -> qreal {
+    return d->playbackRate;
 }
 auto MediaPlayer::duration() const -> qreal {
     auto ctxt = d->formatContext();
@@ -1830,6 +3644,55 @@ auto MediaPlayer::bufferProgress() const -> float {
     }
     return d->demuxerThread->bufferProgress();
 }
+auto MediaPlayer::allocatedPacketsCount() const -> quint64 {
+    return d->packetPool.allocatedCount();
+}
+auto MediaPlayer::recycledPacketsCount() const -> quint64 {
+    return d->packetPool.recycledCount();
+}
+auto MediaPlayer::dropedFramesCount() const -> quint64 {
+    return d->counters.dropedFrames;
+}
+auto MediaPlayer::coalescedFramesCount() const -> quint64 {
+    if (!d->videoSink) {
+        return 0;
+    }
+    return d->videoSink->coalescedFramesCount() - d->counters.coalescedBase;
+}
+auto MediaPlayer::skippedDecodeCount() const -> quint64 {
+    return d->counters.skippedDecodes;
+}
+auto MediaPlayer::videoDecodeDuration() const -> qreal {
+    return d->counters.decodeAverage;
+}
+void MediaPlayer::setDecoderThreading(StreamType type, int threads, DecoderThreadType threadType) {
+    d->decoderThreads[int(type)] = std::clamp(threads, 0, 16);
+    d->decoderThreadType[int(type)] = threadType;
+}
+auto MediaPlayer::decoderThreads(StreamType type) const -> int {
+    return d->decoderThreads[int(type)];
+}
+auto MediaPlayer::decoderThreadType(StreamType type) const -> DecoderThreadType {
+    return d->decoderThreadType[int(type)];
+}
+auto MediaPlayer::activeDecoderThreads(StreamType type) const -> int {
+    if (!d->demuxerThread) {
+        return 0;
+    }
+    return d->demuxerThread->activeDecoderThreads(type);
+}
+void MediaPlayer::setVideoFrameBuffers(int n) {
+    d->videoFrameBuffers = std::clamp(n, 1, 16);
+}
+auto MediaPlayer::videoFrameBuffers() const -> int {
+    return d->videoFrameBuffers;
+}
+void MediaPlayer::setFreeRunning(bool enabled) {
+    d->freeRunning = enabled;
+}
+auto MediaPlayer::isFreeRunning() const -> bool {
+    return d->freeRunning;
+}
 auto MediaPlayer::isAvailable() const -> bool {
     return true;
 }
@@ -1898,21 +3761,12 @@ auto MediaPlayer::subtitleTracks() const -> QList<MediaMetaData> {
     return getTracks(d->formatContext(), AVMEDIA_TYPE_SUBTITLE);
 }
 auto MediaPlayer::metaData() const -> MediaMetaData {
-    auto ctxt = d->formatContext();
-    if (!ctxt) {
+    if (!d->formatContext()) {
         return { };
     }
-
-    MediaMetaData data;
-    AVDictionary *metadata = ctxt->metadata;
-    AVDictionaryEntry *cur = av_dict_get(metadata, nullptr, nullptr, 0);
-    while (cur) {
-        data.insert(cur->key, cur->value);
-
-        cur = av_dict_get(metadata, nullptr, cur, 0);
-    }
-
-    return data;
+    // The copy of the demuxer, the format context may update it when reading
+    std::lock_guard locker(d->counters.metadataMutex);
+    return d->counters.metadata;
 }
 
 auto MediaPlayer::activeAudioTrack() const -> int {
@@ -1963,23 +3817,104 @@ void MediaPlayer::setActiveSubtitleTrack(int t)  {
     if (!isLoaded()) {
         return;
     }
+    if (!subtitleFile().isEmpty()) {
+        // Back to the embedded stream
+        setSubtitleFile(QUrl());
+    }
     if (t == activeSubtitleTrack()) {
         return;
     }
     t = toFFTrack(d->formatContext(), t, AVMEDIA_TYPE_SUBTITLE);
     d->demuxerThread->requestSwitchStream(t);
 }
+void MediaPlayer::setSubtitleFile(const QUrl &url) {
+    {
+        std::lock_guard locker(d->settingsMutex);
+        if (d->subtitleFile == url) {
+            return;
+        }
+        d->subtitleFile = url;
+    }
+    if (d->demuxerThread) {
+        d->demuxerThread->requestSubtitleFile();
+    }
+}
+auto MediaPlayer::subtitleFile() const -> QUrl {
+    std::lock_guard locker(d->settingsMutex);
+    return d->subtitleFile;
+}
 
 // Settings
-void MediaPlayer::setSource(const QUrl &url) {
+void MediaPlayer::setSource(const QUrl &url, const QString &cacheKey) {
     stop();
+    if (preloadedSource() != url) {
+        cancelPreload();
+    }
     d->ioDevice = nullptr;
     d->url = url;
+    d->cacheKey = cacheKey;
+    d->subtitleFile = QUrl();
+    d->startupSource = url;
+    d->startupBeginLoad();
 }
 void MediaPlayer::setSourceDevice(QIODevice *dev, const QUrl &url) {
     stop();
+    cancelPreload();
     d->ioDevice = dev;
     d->url = url;
+    d->cacheKey = QString();
+    d->subtitleFile = QUrl();
+    d->startupSource = url;
+    d->startupBeginLoad();
+}
+void MediaPlayer::beginStartupTimeline() {
+    d->startupPendingBegin = av_gettime_relative();
+}
+auto MediaPlayer::startupTimeline() const -> StartupTimeline {
+    return d->startupTimeline();
+}
+auto MediaPlayer::statistics() const -> PlaybackStatistics {
+    auto &c = d->counters;
+    PlaybackStatistics stats;
+    for (int i = 0; i < 3; i++) {
+        stats.queues[i].packets = c.queuePackets[i].load(std::memory_order_relaxed);
+        stats.queues[i].bytes = c.queueBytes[i].load(std::memory_order_relaxed);
+        stats.queues[i].duration = c.queueDuration[i].load(std::memory_order_relaxed);
+    }
+    const double quantiles[3] = {0.5, 0.9, 0.99};
+    for (int i = 0; i < 3; i++) {
+        stats.decodeTime[i] = c.decodeTime.percentile(quantiles[i]) / 1000.0;
+        stats.convertTime[i] = c.convertTime.percentile(quantiles[i]) / 1000.0;
+    }
+    for (int i = 0; i < PlaybackStatistics::DriftBuckets; i++) {
+        stats.drift[i] = c.drift[i].load(std::memory_order_relaxed);
+    }
+    stats.frames = c.decodeTime.count();
+    stats.dropedFrames = dropedFramesCount();
+    stats.coalescedFrames = coalescedFramesCount();
+    stats.lateFrames = c.lateFrames;
+    stats.skippedDecodes = skippedDecodeCount();
+    stats.audioUnderruns = c.audioUnderruns;
+    stats.packets = c.packets;
+    stats.throughput = c.throughput;
+    {
+        std::lock_guard locker(c.metadataMutex);
+        stats.representation = c.representation;
+        stats.representationSwitches = c.representationSwitches;
+    }
+    return stats;
+}
+void MediaPlayer::setStatisticsInterval(int ms) {
+    d->statisticsTimer.setInterval(qMax(ms, 0));
+    if (ms <= 0) {
+        d->statisticsTimer.stop();
+    }
+    else if (d->playbackState == PlaybackState::PlayingState) {
+        d->statisticsTimer.start();
+    }
+}
+auto MediaPlayer::statisticsInterval() const -> int {
+    return d->statisticsTimer.interval();
 }
 void MediaPlayer::setAudioOutput(AudioOutput *output) {
     if (d->audioOutput) {
@@ -2023,6 +3958,25 @@ void MediaPlayer::setVideoOutput(QObject *object) {
     }
 }
 void MediaPlayer::setOption(const QString &key, const QString &value) {
+    // Decoder threading, handled by us
+    static const QStringList threadingKeys = {"audio_threads", "video_threads", "audio_thread_type", "video_thread_type"};
+    if (threadingKeys.contains(key)) {
+        auto type = key.startsWith("audio") ? StreamType::Audio : StreamType::Video;
+        if (key.endsWith("_threads")) {
+            setDecoderThreading(type, value.toInt(), decoderThreadType(type));
+        }
+        else {
+            auto threadType = DecoderThreadType::Auto;
+            if (value == "frame") {
+                threadType = DecoderThreadType::Frame;
+            }
+            else if (value == "slice") {
+                threadType = DecoderThreadType::Slice;
+            }
+            setDecoderThreading(type, decoderThreads(type), threadType);
+        }
+        return;
+    }
     av_dict_set(&d->options, key.toUtf8().data(), value.toUtf8().data(), 0);
 }
 void MediaPlayer::setHttpUseragent(const QString &useragent) {
@@ -2034,9 +3988,23 @@ void MediaPlayer::setHttpReferer(const QString &referer) {
 void MediaPlayer::setInputFormat(AVInputFormat *i) {
     d->inputFormat = i;
 }
+void MediaPlayer::setBufferingPolicy(std::shared_ptr<BufferingPolicy> policy) {
+    if (!policy) {
+        policy = std::make_shared<AdaptiveBufferingPolicy>();
+    }
+    std::lock_guard locker(d->settingsMutex);
+    d->bufferingPolicy = std::move(policy);
+}
+std::shared_ptr<BufferingPolicy> MediaPlayer::bufferingPolicy() const {
+    std::lock_guard locker(d->settingsMutex);
+    return d->bufferingPolicy;
+}
 void MediaPlayer::clearOptions() {
     av_dict_free(&d->options);
 }
+auto MediaPlayer::options() const -> Dictionary {
+    return Dictionary::fromAVDictionary(d->options);
+}
 QStringList MediaPlayer::supportedMediaTypes() {
     QStringList types;
 
@@ -2072,28 +4040,45 @@ VideoSink::~VideoSink() {
     Q_EMIT aboutToDestroy();
 }
 void  VideoSink::setVideoFrame(const VideoFrame &f) {
-    frame = f;
-    if (frame.isNull()) {
-        *mark = false;
-        mark = std::make_shared<bool>(false);
+    {
+        std::lock_guard locker(frameMutex);
+        frame = f;
+        updateSize(frame);
+    }
+    {
+        // VideoFrame is a shared pointer, so the swap is a short lock instead of a lock free exchange
+        std::lock_guard locker(mailboxMutex);
+        if (mailboxFull && !mailbox.isNull()) {
+            // The GUI thread is busy, it only needs the newest one
+            coalesced += 1;
+        }
+        mailbox = f;
+        mailboxFull = true;
     }
-    if (size.width() != frame.width() || size.height() != frame.height()) {
-        size.setWidth(frame.width());
-        size.setHeight(frame.height());
-
-
-        QMetaObject::invokeMethod(this, [this]() {
-            Q_EMIT videoSizeChanged();
-        }, Qt::QueuedConnection);
+    if (notifyPending.exchange(true)) {
+        return;
     }
-    QMetaObject::invokeMethod(this, [this, m = mark]() {
-        if (!m) {
-            qDebug() << "VideoSink::putVideoFrame cancelled call";
-            return;
+    QMetaObject::invokeMethod(this, [this]() {
+        // Clear it before taking, a frame comes after it queues a new notification
+        notifyPending = false;
+
+        VideoFrame latest;
+        {
+            std::lock_guard locker(mailboxMutex);
+            if (!mailboxFull) {
+                // Taken by the previous notification
+                return;
+            }
+            latest = mailbox;
+            mailbox = VideoFrame();
+            mailboxFull = false;
         }
-        Q_EMIT videoFrameChanged(frame);
+        Q_EMIT videoFrameChanged(latest);
     }, Qt::QueuedConnection);
 }
+quint64 VideoSink::coalescedFramesCount() const {
+    return coalesced;
+}
 void  VideoSink::setSubtitleText(const QString &text) {
     subtitle = text;
     QMetaObject::invokeMethod(this, [this, text]() {
@@ -2104,17 +4089,182 @@ void  VideoSink::addPixelFormat(VideoPixelFormat fmt) {
     formats.push_back(fmt);
 }
 QSize VideoSink::videoSize() const {
+    std::lock_guard locker(frameMutex);
     return size;
 }
 VideoFrame VideoSink::videoFrame() const {
+    std::lock_guard locker(frameMutex);
     return frame;
 }
+void  VideoSink::setSubtitleImages(const QList<SubtitleImage> &list) {
+    images = list;
+    QMetaObject::invokeMethod(this, [this, list]() {
+        Q_EMIT subtitleImagesChanged(list);
+    }, Qt::QueuedConnection);
+}
 QString VideoSink::subtitleText() const {
     return subtitle;
 }
+QList<SubtitleImage> VideoSink::subtitleImages() const {
+    return images;
+}
 QList<VideoPixelFormat> VideoSink::supportedPixelFormats() const {
     return formats;
 }
+void  VideoSink::setPresentationQueue(bool enabled) {
+    if (!enabled) {
+        presentation.reset();
+        return;
+    }
+    if (presentation) {
+        return;
+    }
+    presentation = std::make_shared<PresentationQueue>();
+    presentation->setNotify([this]() {
+        QMetaObject::invokeMethod(this, [this]() {
+            Q_EMIT videoFrameQueued();
+        }, Qt::QueuedConnection);
+    });
+}
+bool  VideoSink::hasPresentationQueue() const {
+    return presentation != nullptr;
+}
+VideoFrame VideoSink::presentFrame(qint64 displayTime) {
+    if (!presentation) {
+        return VideoFrame();
+    }
+    auto f = presentation->take(displayTime);
+    if (!f.isNull()) {
+        std::lock_guard locker(frameMutex);
+        frame = f;
+        updateSize(frame);
+    }
+    return f;
+}
+qint64 VideoSink::presentationTime() {
+    return av_gettime_relative();
+}
+void  VideoSink::updateSize(const VideoFrame &f) {
+    if (size.width() == f.width() && size.height() == f.height()) {
+        return;
+    }
+    size.setWidth(f.width());
+    size.setHeight(f.height());
+
+    QMetaObject::invokeMethod(this, [this]() {
+        Q_EMIT videoSizeChanged();
+    }, Qt::QueuedConnection);
+}
+
+// Presentation Queue
+void PresentationQueue::attach(const void *owner, size_t n, Clock fn, PlaybackCounters *c) {
+    std::lock_guard locker(mutex);
+    currentOwner = owner;
+    capacity = std::max<size_t>(n, 1);
+    clock = std::move(fn);
+    counters = c;
+    entries.clear();
+    flushGeneration += 1;
+}
+void PresentationQueue::detach(const void *owner) {
+    {
+        std::lock_guard locker(mutex);
+        if (currentOwner != owner) {
+            // Replaced by the next source
+            return;
+        }
+        currentOwner = nullptr;
+        clock = nullptr;
+        counters = nullptr;
+        entries.clear();
+        flushGeneration += 1;
+    }
+    spaceCond.notify_all();
+}
+bool PresentationQueue::push(const VideoFrame &frame, double pts, double duration, uint64_t gen, bool immediate) {
+    std::unique_lock locker(mutex);
+    const void *owner = currentOwner;
+    auto ready = [&]() {
+        return entries.size() < capacity || currentOwner != owner || flushGeneration != gen;
+    };
+    while (!spaceCond.wait_for(locker, StallTimeout, ready)) {
+        // The renderer does not paint, like a hidden widget, drop the passed one so the playback goes on
+        auto &entry = entries.front();
+        if (entry.immediate || (clock && entry.pts + entry.duration < clock(av_gettime_relative()))) {
+            entries.pop_front();
+            if (counters) {
+                counters->dropedFrames += 1;
+            }
+        }
+    }
+    if (!owner || currentOwner != owner) {
+        return false;
+    }
+    if (flushGeneration != gen) {
+        // Decoded before seeking
+        return true;
+    }
+    bool wasEmpty = entries.empty();
+    entries.push_back({frame, pts, duration, immediate});
+    locker.unlock();
+
+    if (wasEmpty && notify) {
+        notify();
+    }
+    return true;
+}
+VideoFrame PresentationQueue::take(int64_t displayTime) {
+    std::lock_guard locker(mutex);
+    if (entries.empty()) {
+        return VideoFrame();
+    }
+    VideoFrame out;
+    if (entries.front().immediate) {
+        out = std::move(entries.front().frame);
+        entries.pop_front();
+        spaceCond.notify_all();
+        return out;
+    }
+    if (!clock) {
+        return VideoFrame();
+    }
+
+    // The frame whose pts is nearest to the vsync, so a 24p cadence on 60Hz stays even
+    double media = clock(displayTime);
+    double shownPts = 0.0;
+    while (!entries.empty() && !entries.front().immediate) {
+        auto &entry = entries.front();
+        if (entry.pts - entry.duration / 2 > media) {
+            break;
+        }
+        if (!out.isNull() && counters) {
+            counters->dropedFrames += 1;
+        }
+        out = std::move(entry.frame);
+        shownPts = entry.pts;
+        entries.pop_front();
+    }
+    if (out.isNull()) {
+        return out;
+    }
+    if (counters) {
+        counters->addDrift(media - shownPts);
+    }
+    spaceCond.notify_all();
+    return out;
+}
+void PresentationQueue::flush() {
+    {
+        std::lock_guard locker(mutex);
+        entries.clear();
+        flushGeneration += 1;
+    }
+    spaceCond.notify_all();
+}
+bool PresentationQueue::empty() const {
+    std::lock_guard locker(mutex);
+    return entries.empty();
+}
 
 
 // Video Frame
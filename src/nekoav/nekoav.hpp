@@ -2,9 +2,13 @@
 
 #include <QGraphicsItem>
 #include <QWidget>
+#include <QImage>
 #include <QString>
 #include <QObject>
 #include <QUrl>
+#include <atomic>
+#include <memory>
+#include <mutex>
 
 #if   defined(_MSC_VER) && defined(NEKO_DLL)
     #define NEKO_EXPORT 	__declspec(dllexport)
@@ -36,6 +40,10 @@ class VideoWidgetPrivate;
 class VideoFramePrivate;
 class MediaPlayerPrivate;
 class AudioOutputPrivate;
+class AdaptiveBufferingPolicyPrivate;
+class ThumbnailGeneratorPrivate;
+class PresentationQueue;
+class VideoThread;
 class VideoSink;
 
 // Enums
@@ -45,6 +53,16 @@ enum class AudioSampleFormat {
     Sint32,
     Float32,
 };
+enum class StreamType {
+    Audio,
+    Video,
+    Subtitle,
+};
+enum class DecoderThreadType {
+    Auto, //< Let the decoder choose, frame threading first
+    Frame,
+    Slice,
+};
 enum class VideoPixelFormat {
     Invalid,
 
@@ -170,6 +188,19 @@ class NEKO_API VideoWidget       : public QWidget {
         QScopedPointer<VideoWidgetPrivate> d;
 };
 
+/**
+ * @brief A bitmap subtitle (PGS / DVD / DVB), converted to RGBA once when decoded
+ * 
+ * Use image.cacheKey() as the key of the uploaded texture, it is the same while the subtitle is shown.
+ */
+struct SubtitleImage {
+    QImage image; //< In QImage::Format_RGBA8888
+    QRect  rect; //< Position in the canvas
+    QSize  canvasSize; //< The picture the rect is relative to, invalid on the video size
+    qreal  start = 0.0; //< Display interval in seconds
+    qreal  end = 0.0;
+};
+
 class NEKO_API VideoSink  : public QObject {
     Q_OBJECT
     Q_PROPERTY(QString subtitleText READ subtitleText WRITE setSubtitleText NOTIFY subtitleTextChanged)
@@ -180,22 +211,75 @@ class NEKO_API VideoSink  : public QObject {
 
         void setVideoFrame(const VideoFrame &frame);
         void setSubtitleText(const QString &subtitle);
+        void setSubtitleImages(const QList<SubtitleImage> &images);
         void addPixelFormat(VideoPixelFormat pixelFormat);
         VideoFrame videoFrame() const;
         QSize      videoSize() const;
         QString    subtitleText() const;
+        QList<SubtitleImage> subtitleImages() const;
         QList<VideoPixelFormat> supportedPixelFormats() const;
+        /**
+         * @brief Get how many frames were replaced by a newer one before the GUI thread took them
+         * 
+         * @return quint64 
+         */
+        quint64    coalescedFramesCount() const;
+        /**
+         * @brief Queue the timestamped frames for the renderer instead of emitting videoFrameChanged for each one,
+         * the renderer takes them by presentFrame at its vsync, it takes effect at the next load of the player
+         * 
+         * @param enabled 
+         */
+        void setPresentationQueue(bool enabled);
+        bool hasPresentationQueue() const;
+        /**
+         * @brief Take the queued frame best matching the display time, call it at each paint of the renderer
+         * 
+         * @param displayTime Predicted time of the vsync showing the paint, in microseconds of presentationTime()
+         * @return VideoFrame Null on keeping the current one
+         */
+        VideoFrame presentFrame(qint64 displayTime);
+        /**
+         * @brief Get the monotonic time in microseconds, the clock of the display time
+         * 
+         * @return qint64 
+         */
+        static qint64 presentationTime();
     Q_SIGNALS:
         void videoFrameChanged(const VideoFrame &frame);
+        void videoFrameQueued(); //< A frame comes to the empty presentation queue, the renderer should paint
         void videoSizeChanged();
         void subtitleTextChanged(const QString &);
+        void subtitleImagesChanged(const QList<SubtitleImage> &);
         void aboutToDestroy();
     private:
+        void updateSize(const VideoFrame &frame); //< With frameMutex held
+
         QString    subtitle;
+        QList<SubtitleImage> images;
+        mutable std::mutex frameMutex; //< Guards frame and size, the workers set them and the GUI thread presents
         VideoFrame frame;
         QSize      size = {0, 0};
         QList<VideoPixelFormat> formats; //< supported formats (default has RGBA32)
-        std::shared_ptr<bool> mark = std::make_shared<bool>(true);
+        std::shared_ptr<PresentationQueue> presentation; //< Null on disabled
+
+        // Latest frame for the GUI thread, only one notification is queued however fast the frames come
+        std::mutex            mailboxMutex;
+        VideoFrame            mailbox;
+        bool                  mailboxFull = false;
+        std::atomic<bool>     notifyPending {false};
+        std::atomic<quint64>  coalesced {0};
+    friend class VideoThread;
+};
+
+/**
+ * @brief A format the audio device plays without converting
+ * 
+ */
+struct AudioDeviceFormat {
+    AudioSampleFormat format = AudioSampleFormat::Float32;
+    int               sampleRate = 0; //< 0 on any
+    int               channels = 0; //< 0 on any
 };
 
 /**
@@ -214,6 +298,14 @@ class NEKO_API AudioOutput : public QObject {
         bool open(AudioSampleFormat format, int sampleRate, int channels);
         void pause(bool on);
         bool close();
+        /**
+         * @brief Pull the data in a thread as fast as possible and discard it instead of playing on the device,
+         * for the headless benchmarks, it takes effect at next open
+         * 
+         * @param enabled 
+         */
+        void setNullDevice(bool enabled);
+        bool isNullDevice() const;
         void setVolume(float volume);
         void setCallback(const Routinue &);
         void setMuted(bool v);
@@ -222,6 +314,26 @@ class NEKO_API AudioOutput : public QObject {
         bool isPaused() const;
         bool isMuted() const;
         float volume() const;
+        /**
+         * @brief Get the seconds of the device buffer, the data given to the callback is played after it
+         * 
+         * @return qreal 
+         */
+        qreal latency() const;
+        /**
+         * @brief Get the native formats of the default device, queried from the backend once
+         * 
+         * @return QList<AudioDeviceFormat> empty on unknown
+         */
+        QList<AudioDeviceFormat> nativeFormats() const;
+        /**
+         * @brief Get the native format closest to the wanted one, the sample rate matters most, then the channels.
+         * The field the device doesnot care is kept
+         * 
+         * @param wanted The format of the stream
+         * @return AudioDeviceFormat The wanted one on unknown
+         */
+        AudioDeviceFormat closestNativeFormat(const AudioDeviceFormat &wanted) const;
     Q_SIGNALS:
         void volumeChanged(float volume);
         void mutedChanged(bool muted);
@@ -230,6 +342,161 @@ class NEKO_API AudioOutput : public QObject {
         QScopedPointer<AudioOutputPrivate> d;
 };
 
+/**
+ * @brief Buffered data of the demuxer
+ * 
+ */
+struct BufferStatus {
+    qreal  duration = 0.0; //< Minimum buffered seconds of the audio / video streams
+    qint64 bytes = 0; //< Total buffered bytes of all streams
+    qint64 packets = 0; //< Minimum buffered packets of the audio / video streams
+};
+
+/**
+ * @brief Time of each stage of a load in milliseconds, from the beginning of it, -1 on not reached
+ * 
+ * The load begins at MediaPlayer::beginStartupTimeline (before resolving the url) or MediaPlayer::setSource.
+ */
+struct StartupTimeline {
+    QUrl   source;
+    qint64 resolve = -1; //< The url resolved, only if began before the setSource
+    qint64 openInput = -1; //< avformat_open_input done
+    qint64 findStreamInfo = -1; //< avformat_find_stream_info done
+    qint64 codecOpen = -1; //< All decoders opened
+    qint64 firstAudioPacket = -1;
+    qint64 firstVideoPacket = -1;
+    qint64 firstSubtitlePacket = -1;
+    qint64 firstDecodedFrame = -1;
+    qint64 firstPresentedFrame = -1; //< First video frame sent to the sink
+    qint64 firstAudioCallback = -1;
+};
+
+/**
+ * @brief Snapshot of the playback statistics, from the beginning of current load
+ * 
+ */
+struct PlaybackStatistics {
+    static constexpr int DriftBuckets = 9;
+    static constexpr int DriftBounds[DriftBuckets - 1] = {-100, -40, -20, -10, 10, 20, 40, 100}; //< Milliseconds between the drift buckets
+
+    struct Queue {
+        qint64 packets = 0;
+        qint64 bytes = 0;
+        qreal  duration = 0.0; //< Seconds
+    };
+
+    Queue   queues[3]; //< Packets waiting to decode, indexed by StreamType
+    qreal   decodeTime[3] = {}; //< P50 / P90 / P99 of the video decoding in milliseconds
+    qreal   convertTime[3] = {}; //< P50 / P90 / P99 of the video conversion in milliseconds
+    quint64 frames = 0; //< Decoded video frames
+    quint64 dropedFrames = 0; //< Decoded but not presented
+    quint64 coalescedFrames = 0; //< Given to the sink but replaced by a newer one before the GUI thread took it
+    quint64 lateFrames = 0; //< Presented later than the clock
+    quint64 skippedDecodes = 0; //< Not decoded by the catch up mode
+    quint64 drift[DriftBuckets] = {}; //< A-V of the video frames at the sync, bucket i is in [DriftBounds[i - 1], DriftBounds[i])
+    quint64 audioUnderruns = 0; //< The audio device wanted data but the PCM ring is empty
+    qreal   throughput = 0.0; //< Network read bytes per second
+    quint64 packets = 0; //< Demuxed packets dispatched to the decoders
+    QString     representation; //< Current video quality of an adaptive source (like DashInputFormat), empty on none
+    QStringList representationSwitches; //< Quality switches of an adaptive source, like "12.0s 1080P -> 720P (starved)"
+};
+
+/**
+ * @brief The buffering state of one loaded source, created by BufferingPolicy::createState,
+ * all methods are called from the demuxer thread, except progress may also be called from the player thread
+ * 
+ */
+class NEKO_API BufferingState {
+    public:
+        virtual ~BufferingState() = default;
+
+        /**
+         * @brief Feed a network throughput sample
+         * 
+         * @param bytes The bytes read in this sample
+         * @param seconds The time this sample took
+         */
+        virtual void  addThroughputSample(qint64 bytes, qreal seconds) = 0;
+        /**
+         * @brief Should the demuxer stop reading ahead
+         */
+        virtual bool  isFull(const BufferStatus &status) const = 0;
+        /**
+         * @brief Should the player pause and enter buffering
+         */
+        virtual bool  isStarving(const BufferStatus &status) const = 0;
+        /**
+         * @brief Could the player leave buffering
+         */
+        virtual bool  isEnough(const BufferStatus &status) const = 0;
+        /**
+         * @brief Get the buffering progress in [0, 1]
+         */
+        virtual float progress(const BufferStatus &status) const = 0;
+};
+
+/**
+ * @brief Decide when the demuxer should stop reading ahead or enter buffering
+ * 
+ * A policy only holds the tuning, it may be shared by the players,
+ * each load gets its own BufferingState (like the throughput samples) from createState.
+ */
+class NEKO_API BufferingPolicy {
+    public:
+        virtual ~BufferingPolicy() = default;
+
+        /**
+         * @brief Create the state of a new loaded source, called from the demuxer thread.
+         * The state may refer to the policy, the player keeps the policy alive as long as the state
+         * 
+         * @param localSource Is the source a local file
+         */
+        virtual auto createState(bool localSource) -> std::unique_ptr<BufferingState> = 0;
+};
+
+/**
+ * @brief The default buffering policy, works on buffered seconds and bytes
+ * 
+ * The buffering target grows when the network throughput is unstable, 
+ * and the read ahead shrinks for local files.
+ * The setters could be called from any thread, they take effect at once for all the sources using it.
+ */
+class NEKO_API AdaptiveBufferingPolicy : public BufferingPolicy {
+    public:
+        AdaptiveBufferingPolicy();
+        AdaptiveBufferingPolicy(const AdaptiveBufferingPolicy &) = delete;
+        ~AdaptiveBufferingPolicy();
+
+        /**
+         * @brief Set the memory ceiling of all buffered packets (default 150 MB)
+         */
+        void   setMemoryLimit(qint64 bytes);
+        /**
+         * @brief Set the buffered seconds to enter buffering (default 0.5s)
+         */
+        void   setLowWatermark(qreal seconds);
+        /**
+         * @brief Set the buffered seconds to leave buffering on a stable network (default 2s)
+         */
+        void   setBufferDuration(qreal seconds);
+        /**
+         * @brief Set the upper bound of the buffered seconds to leave buffering (default 10s)
+         */
+        void   setMaxBufferDuration(qreal seconds);
+        /**
+         * @brief Set how many seconds we read ahead for network / local sources (default 60s / 5s)
+         */
+        void   setReadAheadDuration(qreal network, qreal local);
+
+        qint64 memoryLimit() const;
+        qreal  lowWatermark() const;
+        qreal  bufferDuration() const;
+        qreal  maxBufferDuration() const;
+
+        auto   createState(bool localSource) -> std::unique_ptr<BufferingState> override;
+    private:
+        QScopedPointer<AdaptiveBufferingPolicyPrivate> d;
+};
 
 class NEKO_API MediaPlayer : public QObject {
     Q_OBJECT
@@ -284,6 +551,15 @@ class NEKO_API MediaPlayer : public QObject {
         void setActiveVideoTrack(int index);
         void setActiveSubtitleTrack(int index);
 
+        /**
+         * @brief Show the subtitles of a external file (srt, ass...) instead of the embedded track
+         * 
+         * The file is scanned once in background, it is cleared when the source changed.
+         * @param url The file, empty to go back to the embedded track
+         */
+        void setSubtitleFile(const QUrl &url);
+        QUrl subtitleFile() const;
+
         void setAudioOutput(AudioOutput *output);
         AudioOutput *audioOutput() const;
 
@@ -325,14 +601,191 @@ class NEKO_API MediaPlayer : public QObject {
 
         MediaMetaData metaData() const;
 
+        /**
+         * @brief Get how many AVPacket the demuxer allocated, it should stop growing at the steady state
+         * 
+         * @return quint64 
+         */
+        quint64 allocatedPacketsCount() const;
+        /**
+         * @brief Get how many AVPacket the demuxer reused from the packet pool
+         * 
+         * @return quint64 
+         */
+        quint64 recycledPacketsCount() const;
+        /**
+         * @brief Get how many video frames was decoded but droped because they are too late
+         * 
+         * @return quint64 
+         */
+        quint64 dropedFramesCount() const;
+        /**
+         * @brief Get how many video packets was not decoded by the catch up (skip_frame) mode
+         * 
+         * @return quint64 
+         */
+        quint64 skippedDecodeCount() const;
+        /**
+         * @brief Get how many video frames were replaced in the sink before the GUI thread took them
+         * 
+         * @return quint64 
+         */
+        quint64 coalescedFramesCount() const;
+        /**
+         * @brief Get the average time of decoding a video frame in seconds
+         * 
+         * @return qreal 
+         */
+        qreal videoDecodeDuration() const;
+
         void setOption(const QString &key, const QString &value);
         void clearOptions();
+        /**
+         * @brief Get the options of the demuxer and protocols, the decoder threading ones are not included
+         * 
+         * @return Dictionary 
+         */
+        Dictionary options() const;
 
         void setHttpUseragent(const QString &useragent);
         void setHttpReferer(const QString &referer);
 
         void setInputFormat(AVInputFormat *avInputFormat);
 
+        /**
+         * @brief Mark the beginning of the next load, call it before resolving the url (like Episode::fetchVideo),
+         * so the resolve time is in the timeline
+         * 
+         */
+        void beginStartupTimeline();
+        /**
+         * @brief Get the startup timeline of current load, startupFinished is emitted when it is complete
+         * 
+         * @return StartupTimeline 
+         */
+        StartupTimeline startupTimeline() const;
+
+        /**
+         * @brief Get the statistics of current load, cheap enough to call at any time
+         * 
+         * @return PlaybackStatistics 
+         */
+        PlaybackStatistics statistics() const;
+        /**
+         * @brief Set the interval of statisticsUpdated when playing, 0 on disable, default is 1000ms
+         * 
+         * @param ms 
+         */
+        void setStatisticsInterval(int ms);
+        int  statisticsInterval() const;
+
+        /**
+         * @brief Open the next source in background near the end of current one, and prefill its packets.
+         * When current source ends, it is played at once without the opening (sourceChanged is emitted),
+         * setSource with the same url also uses it. It is cancelled if seek away from the end
+         * 
+         * @param url The next source, empty on cancel
+         */
+        void preloadNext(const QUrl &url);
+        void cancelPreload();
+        /**
+         * @brief Get the source being preloaded, empty on none
+         * 
+         * @return QUrl 
+         */
+        QUrl preloadedSource() const;
+        bool isPreloadReady() const;
+        /**
+         * @brief Set the max bytes of the prefilled packets, default is 32MB
+         * 
+         * @param bytes 
+         */
+        void setPreloadMemoryBudget(qint64 bytes);
+        qint64 preloadMemoryBudget() const;
+        /**
+         * @brief Set the ring buffer size of the read ahead I/O thread, it takes effect at next load.
+         * Source device is always read ahead (at least 2MB), 0 on disable it for http sources, default is 16MB
+         * 
+         * @param bytes 
+         */
+        void setReadAheadSize(qint64 bytes);
+        qint64 readAheadSize() const;
+        /**
+         * @brief Set the disk cache of the read ahead http sources, shared by all players, it takes effect at next load.
+         * The fetched byte ranges are kept across restarts and only the missing ones are downloaded,
+         * sources are evicted by last use over maxBytes. Default is the "media" dir in the cache location with 1GB
+         * 
+         * @param dir Empty on disable
+         * @param maxBytes 
+         */
+        static void setDiskCache(const QString &dir, qint64 maxBytes);
+
+        /**
+         * @brief Set the buffering policy, the player shares the ownership,
+         * the new policy takes effect at next load, pass nullptr to restore the default one.
+         * Changing the tuning of the current policy takes effect at once
+         * 
+         * @param policy 
+         */
+        void setBufferingPolicy(std::shared_ptr<BufferingPolicy> policy);
+        /**
+         * @brief Get current buffering policy, default is an AdaptiveBufferingPolicy of the player
+         * 
+         * @return std::shared_ptr<BufferingPolicy> 
+         */
+        std::shared_ptr<BufferingPolicy> bufferingPolicy() const;
+
+        /**
+         * @brief Set how many converted video frames could be in flight, 
+         * so the conversion of next frame doesnot wait for the upload of current one, it takes effect at next load.
+         * With a presentation queue on the sink, at least 5 are used, the queue holds all of them except two
+         * 
+         * @param n The count, in [1, 16], default is 3
+         */
+        void setVideoFrameBuffers(int n);
+
+        /**
+         * @brief Set the decoder threading of a stream type, it takes effect at next load, 
+         * also could be set by option "audio_threads" "video_threads" "audio_thread_type" "video_thread_type" (auto / frame / slice)
+         * 
+         * @param type The stream type
+         * @param threads The thread count, 0 on auto (video by resolution and cores), default audio is 1 and video is 0
+         * @param threadType The thread type
+         */
+        void setDecoderThreading(StreamType type, int threads, DecoderThreadType threadType = DecoderThreadType::Auto);
+        /**
+         * @brief Get the configured thread count of a stream type
+         * 
+         * @return int 
+         */
+        int  decoderThreads(StreamType type) const;
+        /**
+         * @brief Get the configured thread type of a stream type
+         * 
+         * @return DecoderThreadType 
+         */
+        DecoderThreadType decoderThreadType(StreamType type) const;
+        /**
+         * @brief Get the thread count the current decoder of the stream type really use, 0 on no decoder
+         * 
+         * @return int 
+         */
+        int  activeDecoderThreads(StreamType type) const;
+        /**
+         * @brief Get the count of converted video frames
+         * 
+         * @return int 
+         */
+        int  videoFrameBuffers() const;
+        /**
+         * @brief Decode and present as fast as possible, without the A-V sync, frame dropping and catch up,
+         * for the benchmarks. Use it with a null AudioOutput, it takes effect at once
+         * 
+         * @param enabled 
+         */
+        void setFreeRunning(bool enabled);
+        bool isFreeRunning() const;
+
         static QStringList supportedMediaTypes();
         static QStringList supportedProtocols();
     public Q_SLOTS:
@@ -345,7 +798,14 @@ class NEKO_API MediaPlayer : public QObject {
 
         void setPlaybackRate(qreal rate);
 
-        void setSource(const QUrl &source);
+        /**
+         * @brief Set the source to play
+         * 
+         * @param source 
+         * @param cacheKey Identify the content in the disk cache, for the urls changing on each fetch of the same content,
+         * empty on the url without its signing query items
+         */
+        void setSource(const QUrl &source, const QString &cacheKey = QString());
         void setSourceDevice(QIODevice *device, const QUrl &sourceUrl = QUrl());
     Q_SIGNALS:
         void sourceChanged(const QUrl &media);
@@ -376,10 +836,100 @@ class NEKO_API MediaPlayer : public QObject {
         void errorChanged();
         void errorOccurred(MediaPlayer::Error error, const QString &errorString);
 
+        /**
+         * @brief Emitted when the first frame after a seek is ready
+         * 
+         * @param position The position of the first frame
+         * @param milliseconds The time from the seek requested
+         */
+        void seekFinished(qreal position, qreal milliseconds);
+        /**
+         * @brief The first frame is presented and the audio begins, once per load
+         * 
+         * @param timeline The stages of this load
+         */
+        void startupFinished(const StartupTimeline &timeline);
+        void statisticsUpdated(const PlaybackStatistics &statistics);
+
     private:
         QScopedPointer<MediaPlayerPrivate> d;
 };
 
+/**
+ * @brief Generate the thumbnails of a source for trick play (like the progress bar preview)
+ * 
+ * It opens another demuxer on the source in a low priority thread, decodes only the keyframes in low resolution
+ * and put them into a sprite sheet at a fixed interval, in order outward from the focus position.
+ * The finished sheet is cached to the disk per source.
+ */
+class NEKO_API ThumbnailGenerator : public QObject {
+    Q_OBJECT
+    public:
+        explicit ThumbnailGenerator(QObject *parent = nullptr);
+        ThumbnailGenerator(const ThumbnailGenerator &) = delete;
+        ~ThumbnailGenerator();
+
+        /**
+         * @brief Set the source and begin to generate, stop the previous one
+         * 
+         * @param source 
+         */
+        void setSource(const QUrl &source);
+        /**
+         * @brief Stop generating and release the source
+         * 
+         */
+        void stop();
+
+        /**
+         * @brief Set the option of the demuxer, like setOption of MediaPlayer, takes effect at next setSource
+         */
+        void setOption(const QString &key, const QString &value);
+        /**
+         * @brief Replace all the options, like the ones from MediaPlayer::options()
+         */
+        void setOptions(const Dictionary &options);
+        /**
+         * @brief Set the wanted interval in seconds (default 10), it may be bigger on long sources
+         */
+        void setInterval(qreal seconds);
+        /**
+         * @brief Set the max size of a thumbnail (default 160x90), the aspect ratio is kept
+         */
+        void setThumbnailSize(const QSize &size);
+        /**
+         * @brief Set the directory of the cached sheets, default is in the cache location
+         */
+        void setCacheDirectory(const QString &dir);
+        /**
+         * @brief Set the position the thumbnails around it are generated first, thread safe
+         * 
+         * @param position In seconds
+         */
+        void setFocusPosition(qreal position);
+
+        qreal interval() const;
+        QSize thumbnailSize() const;
+        /**
+         * @brief Get the thumbnail at the position
+         * 
+         * @param position In seconds
+         * @return QImage null on not generated yet or failed to decode
+         */
+        QImage thumbnail(qreal position) const;
+        /**
+         * @brief Get the whole sprite sheet, tiles are in row major order
+         * 
+         * @return QImage 
+         */
+        QImage spriteSheet() const;
+    Q_SIGNALS:
+        void thumbnailReady(qreal position);
+        void finished();
+    private:
+        QScopedPointer<ThumbnailGeneratorPrivate> d;
+};
+
 inline size_t GetBytesPerSample(AudioSampleFormat fmt) {
     switch (fmt) {
         case AudioSampleFormat::Uint8: return sizeof(uint8_t);
@@ -400,8 +950,18 @@ NEKO_USING(AudioSampleFormat);
 NEKO_USING(VideoPixelFormat);
 NEKO_USING(MediaMetaData);
 NEKO_USING(VideoFrame);
+NEKO_USING(StreamType);
+NEKO_USING(DecoderThreadType);
 NEKO_USING(VideoSink);
+NEKO_USING(SubtitleImage);
 NEKO_USING(VideoWidget);
 NEKO_USING(MediaPlayer);
 NEKO_USING(AudioOutput);
+NEKO_USING(AudioDeviceFormat);
+NEKO_USING(BufferingPolicy);
+NEKO_USING(BufferingState);
+NEKO_USING(StartupTimeline);
+NEKO_USING(PlaybackStatistics);
+NEKO_USING(AdaptiveBufferingPolicy);
+NEKO_USING(ThumbnailGenerator);
 
@@ -0,0 +1,167 @@
+#define NEKO_SOURCE
+#include "nekoav.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+
+namespace NekoAV {
+
+class AdaptiveBufferingPolicyPrivate {
+    public:
+        static constexpr int FallbackPacketsLess = 50; //< Used when the packets has no duration
+        static constexpr int FallbackPacketsEnough = 100;
+
+        // Settings, could be changed from any thread
+        std::atomic<qint64> memoryLimit {150 * 1024 * 1024};
+        std::atomic<qreal>  lowWatermark {0.5};
+        std::atomic<qreal>  bufferDuration {2.0};
+        std::atomic<qreal>  maxBufferDuration {10.0};
+        std::atomic<qreal>  networkReadAhead {60.0};
+        std::atomic<qreal>  localReadAhead {5.0};
+};
+
+/**
+ * @brief The state of one source, the samples are only touched by the demuxer thread,
+ * progress may also be read from the player thread, so the variation is atomic
+ * 
+ */
+class AdaptiveBufferingState final : public BufferingState {
+    public:
+        static constexpr int MaxSamples = 16;
+
+        AdaptiveBufferingState(const AdaptiveBufferingPolicyPrivate *d, bool localSource);
+
+        void  addThroughputSample(qint64 bytes, qreal seconds) override;
+        bool  isFull(const BufferStatus &status) const override;
+        bool  isStarving(const BufferStatus &status) const override;
+        bool  isEnough(const BufferStatus &status) const override;
+        float progress(const BufferStatus &status) const override;
+    private:
+        qreal targetDuration() const;
+
+        const AdaptiveBufferingPolicyPrivate *d;
+        const bool localSource;
+
+        std::atomic<qreal> variation {0.0}; //< Coefficient of variation, 0 means a stable network
+        qreal samples[MaxSamples] {}; //< Throughput samples in bytes per second
+        int   samplesCount = 0;
+        int   samplesIndex = 0;
+};
+
+AdaptiveBufferingState::AdaptiveBufferingState(const AdaptiveBufferingPolicyPrivate *d, bool localSource) :
+    d(d), localSource(localSource) {
+
+}
+
+qreal AdaptiveBufferingState::targetDuration() const {
+    // Use the tuning of now, so the changes of policy take effect at once
+    qreal base = d->bufferDuration;
+    qreal target = base * (1.0 + 2.0 * variation.load());
+    return std::clamp(target, base, qMax(base, d->maxBufferDuration.load()));
+}
+void AdaptiveBufferingState::addThroughputSample(qint64 bytes, qreal seconds) {
+    if (seconds <= 0.0) {
+        return;
+    }
+    samples[samplesIndex] = bytes / seconds;
+    samplesIndex = (samplesIndex + 1) % MaxSamples;
+    samplesCount = qMin(samplesCount + 1, MaxSamples);
+
+    qreal sum = 0.0;
+    for (int i = 0; i < samplesCount; i++) {
+        sum += samples[i];
+    }
+    qreal mean = sum / samplesCount;
+    qreal variance = 0.0;
+    for (int i = 0; i < samplesCount; i++) {
+        variance += (samples[i] - mean) * (samples[i] - mean);
+    }
+    variance /= samplesCount;
+
+    variation = mean > 0.0 ? std::sqrt(variance) / mean : 1.0;
+}
+bool AdaptiveBufferingState::isFull(const BufferStatus &status) const {
+    if (status.bytes >= d->memoryLimit) {
+        return true;
+    }
+    qreal readAhead = localSource ? d->localReadAhead : d->networkReadAhead;
+    return status.duration >= readAhead;
+}
+bool AdaptiveBufferingState::isStarving(const BufferStatus &status) const {
+    if (localSource) {
+        // Local file is fast enough, no need to buffering
+        return false;
+    }
+    if (status.duration <= 0.0) {
+        // Packets has no duration, use the count
+        return status.packets < AdaptiveBufferingPolicyPrivate::FallbackPacketsLess;
+    }
+    return status.duration < d->lowWatermark;
+}
+bool AdaptiveBufferingState::isEnough(const BufferStatus &status) const {
+    if (status.bytes >= d->memoryLimit || isFull(status)) {
+        // Could not buffer more
+        return true;
+    }
+    if (status.duration <= 0.0) {
+        return status.packets >= AdaptiveBufferingPolicyPrivate::FallbackPacketsEnough;
+    }
+    return status.duration >= targetDuration();
+}
+float AdaptiveBufferingState::progress(const BufferStatus &status) const {
+    qreal progress;
+    if (status.duration <= 0.0) {
+        progress = qreal(status.packets - AdaptiveBufferingPolicyPrivate::FallbackPacketsLess) /
+                   AdaptiveBufferingPolicyPrivate::FallbackPacketsEnough;
+    }
+    else {
+        qreal low = d->lowWatermark;
+        qreal target = targetDuration();
+        progress = target > low ? (status.duration - low) / (target - low) : 1.0;
+    }
+    progress = std::clamp(progress, 0.0, 1.0);
+    progress = (int64_t(progress * 100)) / 100.0; //< Make it like 0.1 0.2 0.3
+    return progress;
+}
+
+AdaptiveBufferingPolicy::AdaptiveBufferingPolicy() : d(new AdaptiveBufferingPolicyPrivate) {
+
+}
+AdaptiveBufferingPolicy::~AdaptiveBufferingPolicy() {
+
+}
+
+void AdaptiveBufferingPolicy::setMemoryLimit(qint64 bytes) {
+    d->memoryLimit = bytes;
+}
+void AdaptiveBufferingPolicy::setLowWatermark(qreal seconds) {
+    d->lowWatermark = seconds;
+}
+void AdaptiveBufferingPolicy::setBufferDuration(qreal seconds) {
+    d->bufferDuration = seconds;
+}
+void AdaptiveBufferingPolicy::setMaxBufferDuration(qreal seconds) {
+    d->maxBufferDuration = seconds;
+}
+void AdaptiveBufferingPolicy::setReadAheadDuration(qreal network, qreal local) {
+    d->networkReadAhead = network;
+    d->localReadAhead = local;
+}
+qint64 AdaptiveBufferingPolicy::memoryLimit() const {
+    return d->memoryLimit;
+}
+qreal AdaptiveBufferingPolicy::lowWatermark() const {
+    return d->lowWatermark;
+}
+qreal AdaptiveBufferingPolicy::bufferDuration() const {
+    return d->bufferDuration;
+}
+qreal AdaptiveBufferingPolicy::maxBufferDuration() const {
+    return d->maxBufferDuration;
+}
+auto AdaptiveBufferingPolicy::createState(bool localSource) -> std::unique_ptr<BufferingState> {
+    return std::make_unique<AdaptiveBufferingState>(d.data(), localSource);
+}
+
+}
\ No newline at end of file
@@ -0,0 +1,518 @@
+#define NEKO_SOURCE
+#include "nekoav.hpp"
+#include "nekoprivate.hpp"
+#include <QCryptographicHash>
+#include <QStandardPaths>
+#include <QDataStream>
+#include <QDateTime>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QUrlQuery>
+#include <QFile>
+#include <QDir>
+#include <QSet>
+#include <algorithm>
+#include <cstring>
+
+namespace NekoAV {
+
+/**
+ * @brief Serve the fetched ranges from the disk, fetch the holes from the upstream and store them
+ *
+ * Only used on the I/O thread, except cancel
+ */
+class CachedByteSource final : public ByteSource {
+    public:
+        static constexpr int64_t MetaSaveInterval = 4 * 1024 * 1024; //< Save the ranges per written bytes
+
+        CachedByteSource(DiskCache *cache, const QString &key, const QString &path, const QUrl &url) :
+            cache(cache), key(key), dataPath(path + ".data"), metaPath(path + ".meta"), url(url) { }
+        ~CachedByteSource() {
+            saveMeta();
+            cache->release(key, cachedBytes());
+        }
+
+        /**
+         * @brief Load the ranges of the previous fetches
+         *
+         * @return true The url is cached, validate it before serving
+         */
+        bool load() {
+            int64_t size = -1;
+            if (!DiskCache::loadMeta(metaPath, &size, &ranges) || !openData()) {
+                ranges.clear();
+                return false;
+            }
+            totalSize = size;
+            return true;
+        }
+        /**
+         * @brief Begin a new cache of the opened upstream, drop the stale data
+         *
+         */
+        bool create(std::unique_ptr<ByteSource> &source) {
+            ranges.clear();
+            data.close();
+            QFile::remove(metaPath);
+            QFile::remove(dataPath);
+            if (!openData()) {
+                return false;
+            }
+            upstream = std::move(source);
+            upstreamPos = 0;
+            totalSize = upstream->size();
+            validated = true;
+            return true;
+        }
+        void setOpener(DiskCache::Opener fn) {
+            opener = std::move(fn);
+        }
+
+        /**
+         * @brief Open the upstream and check it still has the cached size and the same head of the first range,
+         * drop the stale data if not
+         *
+         * Even a complete entry may be stale, so a loaded cache is never served before it
+         * @return int < 0 on error
+         */
+        int validate() {
+            if (validated) {
+                return 0;
+            }
+            return openUpstream();
+        }
+
+        int read(uint8_t *buf, int size) override {
+            if (pos >= totalSize) {
+                return AVERROR_EOF;
+            }
+
+            // In a fetched range
+            auto next = ranges.upper_bound(pos);
+            if (next != ranges.begin()) {
+                auto prev = std::prev(next);
+                if (prev->first <= pos && pos < prev->second) {
+                    int n = readData(buf, std::min<int64_t>(size, prev->second - pos));
+                    if (n > 0) {
+                        pos += n;
+                        return n;
+                    }
+                    // Broken data file, fetch it again
+                    qDebug() << "DiskCache failed to read" << dataPath << ", drop the range";
+                    ranges.erase(prev);
+                    next = ranges.upper_bound(pos);
+                }
+            }
+
+            // In a hole, only fetch to the next range
+            int64_t holeEnd = next != ranges.end() ? next->first : totalSize;
+            int want = std::min<int64_t>(size, holeEnd - pos);
+            if (!upstream) {
+                if (int ret = openUpstream(); ret < 0) {
+                    return ret;
+                }
+            }
+            if (upstreamPos != pos) {
+                if (!upstream->seek(pos)) {
+                    return AVERROR(EIO);
+                }
+                upstreamPos = pos;
+            }
+            int n = upstream->read(buf, want);
+            if (n <= 0) {
+                return n;
+            }
+            writeData(buf, n);
+            pos += n;
+            upstreamPos += n;
+            return n;
+        }
+        bool seek(int64_t to) override {
+            if (to < 0 || to > totalSize) {
+                return false;
+            }
+            pos = to;
+            return true;
+        }
+        int64_t size() override {
+            return totalSize;
+        }
+        bool isSeekable() const override {
+            return true;
+        }
+        void cancel() override {
+            std::lock_guard locker(upstreamMutex);
+            cancelled = true;
+            if (upstream) {
+                upstream->cancel();
+            }
+        }
+    private:
+        int openUpstream() {
+            if (cancelled) {
+                return AVERROR_EXIT;
+            }
+            int errcode = AVERROR(EIO);
+            auto source = opener ? opener(&errcode) : nullptr;
+            if (!source) {
+                return errcode;
+            }
+            {
+                // Publish it first, so cancel can abort the reads of the check
+                std::lock_guard locker(upstreamMutex);
+                if (cancelled) {
+                    source->cancel();
+                }
+                upstream = std::move(source);
+            }
+            int64_t sourcePos = 0;
+            int same = upstream->size() == totalSize ? sameContent(&sourcePos) : 0;
+            if (same < 0) {
+                return same;
+            }
+            if (!same) {
+                // The url points to another content now
+                qDebug() << "DiskCache source of" << url << "changed, drop the cache";
+                cache->account(key, -cachedBytes());
+                std::unique_ptr<ByteSource> source;
+                {
+                    std::lock_guard locker(upstreamMutex);
+                    source = std::move(upstream);
+                }
+                if (!create(source)) {
+                    return AVERROR(EIO);
+                }
+            }
+            upstreamPos = sourcePos;
+            validated = true;
+            return 0;
+        }
+        /**
+         * @brief Compare the head of the first range with the upstream, the same size may still be another content
+         *
+         * The ffmpeg http protocol does not give us the ETag or Last-Modified, so the bytes are the validator
+         * @param sourcePos Set to the upstream position after reading
+         * @return int 1 on same, 0 on not, < 0 on error
+         */
+        int sameContent(int64_t *sourcePos) {
+            if (ranges.empty()) {
+                return 1;
+            }
+            auto [begin, end] = *ranges.begin();
+            int64_t n = std::min<int64_t>(end - begin, DiskCache::FingerprintSize);
+            if (begin != 0 && !upstream->seek(begin)) {
+                return AVERROR(EIO);
+            }
+            *sourcePos = begin;
+
+            std::vector<uint8_t> remote(n);
+            int64_t got = 0;
+            while (got < n) {
+                int ret = upstream->read(remote.data() + got, n - got);
+                if (ret == AVERROR_EOF || ret == 0) {
+                    // Shorter than the cached range
+                    return 0;
+                }
+                if (ret < 0) {
+                    return ret;
+                }
+                got += ret;
+                *sourcePos += ret;
+            }
+            QByteArray local(n, Qt::Uninitialized);
+            if (!data.seek(begin) || data.read(local.data(), n) != n) {
+                // Broken data file, no way to serve it
+                return 0;
+            }
+            return ::memcmp(local.constData(), remote.data(), n) == 0;
+        }
+        bool openData() {
+            data.setFileName(dataPath);
+            if (!data.open(QIODevice::ReadWrite)) {
+                qWarning() << "DiskCache failed to open" << dataPath << data.errorString();
+                return false;
+            }
+            return true;
+        }
+        int readData(uint8_t *buf, int64_t size) {
+            if (!data.seek(pos)) {
+                return -1;
+            }
+            return data.read(reinterpret_cast<char*>(buf), size);
+        }
+        void writeData(const uint8_t *buf, int size) {
+            if (writeFailed) {
+                return;
+            }
+            // Seek beyond the end leaves a hole, the file is sparse on most file systems
+            if (!data.seek(pos) || data.write(reinterpret_cast<const char*>(buf), size) != size) {
+                qWarning() << "DiskCache failed to write" << dataPath << data.errorString();
+                writeFailed = true;
+                return;
+            }
+            int64_t before = cachedBytes();
+            DiskCache::addRange(ranges, pos, pos + size);
+            cache->account(key, cachedBytes() - before);
+
+            unsavedBytes += size;
+            if (unsavedBytes >= MetaSaveInterval) {
+                saveMeta();
+            }
+        }
+        int64_t cachedBytes() const {
+            return DiskCache::rangesBytes(ranges);
+        }
+        void saveMeta() {
+            unsavedBytes = 0;
+            if (ranges.empty() || totalSize <= 0) {
+                return;
+            }
+            data.flush();
+            DiskCache::saveMeta(metaPath, totalSize, ranges);
+        }
+
+        DiskCache                  *cache;
+        QString                     key;
+        QString                     dataPath;
+        QString                     metaPath;
+        QUrl                        url;
+        DiskCache::Opener           opener;
+        QFile                       data;
+        DiskCache::Ranges           ranges;
+        int64_t                     totalSize = -1;
+        int64_t                     pos = 0;
+        int64_t                     upstreamPos = 0;
+        int64_t                     unsavedBytes = 0;
+        bool                        writeFailed = false;
+        bool                        validated = false; //< The upstream was opened with the cached content, or the cache is new
+
+        std::mutex                  upstreamMutex; //< For cancel from other threads
+        std::unique_ptr<ByteSource> upstream;
+        bool                        cancelled = false;
+};
+
+DiskCache &DiskCache::instance() {
+    static DiskCache cache;
+    return cache;
+}
+void DiskCache::configure(const QString &dir, int64_t size) {
+    std::lock_guard locker(mutex);
+    directory = dir;
+    maxSize = size;
+    configured = true;
+    scanned = false;
+    items.clear();
+    totalBytes = 0;
+}
+auto DiskCache::open(const QUrl &url, const QString &contentKey, Opener opener, int *errcode) -> std::unique_ptr<ByteSource> {
+    std::unique_lock locker(mutex);
+    if (!configured) {
+        directory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/media";
+        configured = true;
+    }
+    if (directory.isEmpty() || maxSize <= 0) {
+        locker.unlock();
+        return opener(errcode);
+    }
+    scan();
+
+    auto path = contentKey.isEmpty() ? keyOf(url) : contentKey;
+    auto key = QString::fromLatin1(QCryptographicHash::hash(path.toUtf8(), QCryptographicHash::Sha1).toHex());
+    if (inUse.count(key)) {
+        // Opened by another player, like preloading
+        locker.unlock();
+        return opener(errcode);
+    }
+    inUse.insert(key);
+    items[key].lastUse = QDateTime::currentMSecsSinceEpoch();
+    locker.unlock();
+
+    auto source = std::make_unique<CachedByteSource>(this, key, directory + "/" + key, url);
+    source->setOpener(opener);
+    if (source->load()) {
+        if (int ret = source->validate(); ret < 0) {
+            *errcode = ret;
+            return nullptr;
+        }
+    }
+    else {
+        auto upstream = opener(errcode);
+        if (!upstream || !upstream->isSeekable() || upstream->size() < DiskCache::MinSourceSize || !source->create(upstream)) {
+            // Like live streams and playlists, or the cache is not writable, go without it
+            source.reset();
+            return upstream;
+        }
+    }
+    return source;
+}
+void DiskCache::scan() {
+    if (scanned) {
+        return;
+    }
+    scanned = true;
+    QDir().mkpath(directory);
+    QDir dir(directory);
+    for (auto &info : dir.entryInfoList({"*.meta"}, QDir::Files)) {
+        auto key = info.completeBaseName();
+        int64_t size = -1;
+        Ranges ranges;
+        if (!loadMeta(info.filePath(), &size, &ranges)) {
+            dir.remove(key + ".meta");
+            dir.remove(key + ".data");
+            continue;
+        }
+        // Not the size of the data file, it is sparse, a half fetched source has the full apparent size
+        Item &item = items[key];
+        item.bytes = rangesBytes(ranges);
+        item.lastUse = info.lastModified().toMSecsSinceEpoch();
+        totalBytes += item.bytes;
+    }
+    trim();
+}
+void DiskCache::trim() {
+    untrimmedBytes = 0;
+    if (totalBytes <= maxSize) {
+        return;
+    }
+    std::vector<std::pair<int64_t, QString> > lru;
+    for (auto &[key, item] : items) {
+        if (!inUse.count(key)) {
+            lru.emplace_back(item.lastUse, key);
+        }
+    }
+    std::sort(lru.begin(), lru.end());
+    for (auto &[lastUse, key] : lru) {
+        if (totalBytes <= maxSize) {
+            break;
+        }
+        QDir dir(directory);
+        dir.remove(key + ".meta");
+        dir.remove(key + ".data");
+        totalBytes -= items[key].bytes;
+        items.erase(key);
+        qDebug() << "DiskCache evicted" << key;
+    }
+}
+void DiskCache::release(const QString &key, int64_t bytes) {
+    std::lock_guard locker(mutex);
+    inUse.erase(key);
+    auto &item = items[key];
+    totalBytes += bytes - item.bytes;
+    item.bytes = bytes;
+    item.lastUse = QDateTime::currentMSecsSinceEpoch();
+    if (bytes == 0) {
+        items.erase(key);
+    }
+    trim();
+}
+int64_t DiskCache::usedBytes() {
+    std::lock_guard locker(mutex);
+    return totalBytes;
+}
+QString DiskCache::keyOf(const QUrl &url) {
+    // Lower case, by the CDNs (CloudFront, Azure SAS, Akamai) and bilibili
+    static const QSet<QString> signingKeys = {
+        "expires", "signature", "key-pair-id", "policy",
+        "se", "st", "sig", "skoid", "sktid", "skt", "ske",
+        "token", "auth_key", "hdnts", "hdnea", "__token__", "wstime", "wssecret", "txtime", "txsecret",
+        "deadline", "upsig", "uparams", "trid", "e",
+    };
+    static const QStringList signingPrefixes = {"x-amz-", "x-goog-", "x-oss-"};
+
+    QUrlQuery query(url);
+    auto items = query.queryItems(QUrl::FullyEncoded);
+    QSet<QString> listed;
+    for (auto &item : items) {
+        if (item.first.compare("uparams", Qt::CaseInsensitive) == 0) {
+            // bilibili names the signed items in it
+            for (auto &name : QUrl::fromPercentEncoding(item.second.toUtf8()).split(',')) {
+                listed.insert(name.toLower());
+            }
+        }
+    }
+    QStringList kept;
+    for (auto &item : items) {
+        auto name = item.first.toLower();
+        bool signing = signingKeys.contains(name) || listed.contains(name) || std::any_of(
+            signingPrefixes.begin(), signingPrefixes.end(), [&](const QString &prefix) { return name.startsWith(prefix); }
+        );
+        if (!signing) {
+            kept.push_back(item.first + "=" + item.second);
+        }
+    }
+    auto key = url.host().toLower() + url.path(QUrl::FullyEncoded);
+    if (!kept.isEmpty()) {
+        key += "?" + kept.join('&');
+    }
+    return key;
+}
+void DiskCache::addRange(Ranges &ranges, int64_t begin, int64_t end) {
+    // Merge the overlapped or adjacent ranges
+    auto iter = ranges.upper_bound(begin);
+    if (iter != ranges.begin() && std::prev(iter)->second >= begin) {
+        --iter;
+        begin = iter->first;
+    }
+    while (iter != ranges.end() && iter->first <= end) {
+        end = std::max(end, iter->second);
+        iter = ranges.erase(iter);
+    }
+    ranges.emplace(begin, end);
+}
+int64_t DiskCache::rangesBytes(const Ranges &ranges) {
+    int64_t n = 0;
+    for (auto &[begin, end] : ranges) {
+        n += end - begin;
+    }
+    return n;
+}
+bool DiskCache::loadMeta(const QString &path, int64_t *size, Ranges *ranges) {
+    QFile meta(path);
+    if (!meta.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QDataStream stream(&meta);
+    quint32 magic = 0, version = 0, count = 0;
+    qint64  total = -1;
+    stream >> magic >> version;
+    if (magic != MetaMagic || version != MetaVersion) {
+        return false;
+    }
+    stream >> total >> count;
+    for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++) {
+        qint64 begin, end;
+        stream >> begin >> end;
+        if (begin >= 0 && end > begin && end <= total) {
+            addRange(*ranges, begin, end);
+        }
+    }
+    if (stream.status() != QDataStream::Ok || total <= 0) {
+        ranges->clear();
+        return false;
+    }
+    *size = total;
+    return true;
+}
+bool DiskCache::saveMeta(const QString &path, int64_t size, const Ranges &ranges) {
+    QSaveFile meta(path);
+    if (!meta.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    QDataStream stream(&meta);
+    stream << MetaMagic << MetaVersion << qint64(size) << quint32(ranges.size());
+    for (auto &[begin, end] : ranges) {
+        stream << qint64(begin) << qint64(end);
+    }
+    return meta.commit();
+}
+void DiskCache::account(const QString &key, int64_t bytes) {
+    std::lock_guard locker(mutex);
+    items[key].bytes += bytes;
+    totalBytes += bytes;
+    untrimmedBytes += bytes;
+    if (untrimmedBytes >= 16 * 1024 * 1024) {
+        trim();
+    }
+}
+
+}
@@ -1,11 +1,22 @@
 #include "nekofmt.hpp"
+#include <QThread>
 #include <QDebug>
 #include <QUrl>
 
+#include <condition_variable>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include <vector>
+#include <mutex>
+#include <deque>
+
 extern "C" {
     #include <libavformat/avformat.h>
     #include <libavformat/version.h>
     #include <libavformat/avio.h>
+    #include <libavutil/time.h>
 }
 
 #define CHECK_VERSION()                                  \
@@ -15,6 +26,88 @@ extern "C" {
 
 namespace NekoAV {
 
+using namespace std::chrono_literals;
+
+class DashInputFormatPrivate;
+
+/**
+ * @brief Demux one side of the dash source in its own thread into a small queue,
+ * so a stall of one connection doesnot block the other one
+ * 
+ */
+class DashStreamReader {
+    public:
+        static constexpr size_t MaxQueuedPackets = 128;
+
+        DashStreamReader(DashInputFormatPrivate *parent, AVMediaType type) : parent(parent), type(type) { }
+        DashStreamReader(const DashStreamReader &) = delete;
+        ~DashStreamReader();
+
+        int  open(const QUrl &url, const AVDictionary *options);
+        int  addParentStream(AVFormatContext *ctxt);
+        void start();
+
+        // Called with the parent mutex held
+        void    requestSeek(int64_t timestamp, int flags);
+        /**
+         * @brief Switch to another representation at the next keyframe, only for video
+         * 
+         * @param index Index in the parent representations
+         */
+        void    requestSwitch(int index);
+        int64_t headTime() const;
+
+        // Protected by the parent mutex
+        std::deque<AVPacket*>   queue;
+        std::condition_variable spaceCond; //< Packet taken, seek requested or quit
+        bool                    eof = false;
+        int                     error = 0;
+        bool                    seekPending = false;
+        int64_t                 seekTarget = 0; //< In AV_TIME_BASE
+        int                     seekFlags = 0;
+        int                     seekResult = 0;
+        uint64_t                generation = 0; //< Changed by each seek
+        bool                    quit = false;
+        double                  throughput = 0.0; //< Estimated bytes per second of the connection
+        int64_t                 starvedTime = 0; //< Microseconds the parent waited for our packets
+        int                     representation = 0; //< Index of the current representation
+        int                     switchTarget = -1;
+        bool                    switching = false; //< A switch is requested or waiting for the keyframe
+
+        std::atomic<bool>       abort = false; //< Interrupt the blocking I/O
+
+        AVFormatContext        *formatCtxt = nullptr;
+        AVStream               *parentStream = nullptr;
+        int                     streamIndex = -1;
+    private:
+        void run();
+        void clearQueue();
+        void push(AVPacket *packet);
+        void sampleThroughput(int64_t bytes, int64_t duration);
+        int  openContext(const QUrl &url, const AVDictionary *options, AVFormatContext **ctxt, int *index);
+        void prepareSwitch(int index, int64_t point, uint64_t gen);
+        void joinSwitcher();
+        void finishSwitch(bool withKeyframe);
+
+        DashInputFormatPrivate *parent;
+        AVMediaType             type;
+        QThread                *thread = nullptr;
+        QThread                *switcher = nullptr; //< Opens the next representation, so the current one keeps feeding
+
+        // Protected by the parent mutex, set by the switcher when it is done
+        bool                    switcherDone = false;
+        AVFormatContext        *nextCtxt = nullptr; //< The representation switching to
+        int                     nextStreamIndex = -1;
+        int                     nextRepresentation = -1;
+        AVPacket               *nextKeyframe = nullptr; //< First packet of the next representation
+        int64_t                 switchPoint = 0; //< Pts of nextKeyframe in AV_TIME_BASE
+        int64_t                 lastTime = AV_NOPTS_VALUE; //< Pts of the last pushed packet in AV_TIME_BASE
+        int64_t                 sampleBytes = 0;
+        int64_t                 sampleDuration = 0;
+        double                  fastEstimate = 0.0;
+        double                  slowEstimate = 0.0;
+};
+
 class DashInputFormatPrivate : public AVInputFormat {
     public:
         DashInputFormatPrivate() {
@@ -60,146 +153,618 @@ class DashInputFormatPrivate : public AVInputFormat {
         
 
         int readHeader(AVFormatContext *ctxt) {
-            int ret;
-            ret = avformat_open_input(&videoFormatCtxt, videoSource.toString().toUtf8().data(), nullptr, nullptr);
-            if (ret < 0) {
-                return ret;
-            }
-            ret = avformat_find_stream_info(videoFormatCtxt, nullptr);
-            if (ret < 0) {
-                return ret;
+            if (representations.empty()) {
+                return AVERROR(EINVAL);
             }
+            interrupt = ctxt->interrupt_callback;
+            video.reset(new DashStreamReader(this, AVMEDIA_TYPE_VIDEO));
+            audio.reset(new DashStreamReader(this, AVMEDIA_TYPE_AUDIO));
 
-            ret = avformat_open_input(&audioFormatCtxt, audioSource.toString().toUtf8().data(), nullptr, nullptr);
-            if (ret < 0) {
-                return ret;
+            // Begin with the best one under the initial bandwidth
+            int initial = 0;
+            for (size_t i = 0; i < representations.size(); i++) {
+                if (representations[i].bandwidth <= initialBandwidth) {
+                    initial = i;
+                }
             }
-            ret = avformat_find_stream_info(audioFormatCtxt, nullptr);
-
-            // Find audio stream
-            audioStream = av_find_best_stream(audioFormatCtxt, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
-            videoStream = av_find_best_stream(videoFormatCtxt, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+            video->representation = initial;
+            switchHistory.clear();
+            lastSwitchTime = av_gettime_relative();
+            lastDecisionTime = lastSwitchTime;
+            lastStarvedTime = 0;
+            countStarved = false;
+            metadataChanged = true;
+            QUrl videoSource = representations[initial].url;
 
-            // Check them
-            if (videoStream < 0 || audioStream < 0) {
-                return AVERROR_STREAM_NOT_FOUND;
+            // Open both sides at the same time, the startup only waits for the slower one
+            int videoRet = 0;
+            int audioRet = 0;
+            std::unique_ptr<QThread> videoOpener(QThread::create([&]() {
+                videoRet = video->open(videoSource, videoOptions);
+            }));
+            std::unique_ptr<QThread> audioOpener(QThread::create([&]() {
+                audioRet = audio->open(audioSource, audioOptions);
+            }));
+            videoOpener->start();
+            audioOpener->start();
+            while (!videoOpener->wait(10) || !audioOpener->wait(10)) {
+                if (interrupt.callback && interrupt.callback(interrupt.opaque)) {
+                    video->abort = true;
+                    audio->abort = true;
+                }
+            }
+            if (video->abort) {
+                return AVERROR_EXIT;
             }
-            parentVideoStream = avformat_new_stream(ctxt, nullptr);
-            parentAudioStream = avformat_new_stream(ctxt, nullptr);
-
-
-#if         1
-            parentVideoStream->duration = videoFormatCtxt->streams[videoStream]->duration;
-            parentAudioStream->duration = audioFormatCtxt->streams[audioStream]->duration;
-            
-            parentVideoStream->time_base = videoFormatCtxt->streams[videoStream]->time_base;
-            parentAudioStream->time_base = audioFormatCtxt->streams[audioStream]->time_base;
 
-            parentVideoStream->nb_frames = videoFormatCtxt->streams[videoStream]->nb_frames;
-            parentAudioStream->nb_frames = audioFormatCtxt->streams[audioStream]->nb_frames;
-#endif
+            if (videoRet < 0) {
+                return videoRet;
+            }
+            if (audioRet < 0) {
+                return audioRet;
+            }
+            int ret;
+            if ((ret = video->addParentStream(ctxt)) < 0) {
+                return ret;
+            }
+            if ((ret = audio->addParentStream(ctxt)) < 0) {
+                return ret;
+            }
+            ctxt->duration = std::max(video->formatCtxt->duration, audio->formatCtxt->duration);
 
-            currentFormatCtxt = audioFormatCtxt;
+            video->start();
+            audio->start();
             return 0;
         }
         int readPacket(AVFormatContext *ctxt, AVPacket *packet) {
-            auto switchContext = [this]() {
-                if (currentFormatCtxt == audioFormatCtxt) {
-                    currentFormatCtxt = videoFormatCtxt;
-                }
-                else {
-                    currentFormatCtxt = audioFormatCtxt;
-                }
-            };
-            auto sendPacket = [this](AVPacket *packet) {
-                if (currentFormatCtxt == audioFormatCtxt && packet->stream_index == audioStream) {
-                    // Map to parent audio stream
-                    packet->stream_index = parentAudioStream->index;
+            std::unique_lock locker(mutex);
+            while (true) {
+                if (video->error < 0) {
+                    return video->error;
                 }
-                else if (currentFormatCtxt == videoFormatCtxt && packet->stream_index == videoStream) {
-                    // Map to parent video stream
-                    packet->stream_index = parentVideoStream->index;
+                if (audio->error < 0) {
+                    return audio->error;
                 }
-                else {
-                    // Not us
-                    av_packet_unref(packet);
-                    return false;
+                bool videoReady = !video->queue.empty() || video->eof;
+                bool audioReady = !audio->queue.empty() || audio->eof;
+                if (videoReady && audioReady) {
+                    break;
                 }
-                return true;
-            };
-            while (true) {
-                int ret = av_read_frame(currentFormatCtxt, packet);
-                if (ret < 0) {
-                    if (ret != AVERROR_EOF) {
-                        // Error
-                        return ret;
-                    }
-                    // Just eof switch to another ctxt
-                    switchContext();
-                    ret = av_read_frame(currentFormatCtxt, packet);
-                    if (ret < 0) {
-                        // Eof or something
-                        return ret;
-                    }
-                    else {
-                        if (!sendPacket(packet)) {
-                            continue;
-                        }
-                    }
+                if (interrupt.callback && interrupt.callback(interrupt.opaque)) {
+                    return AVERROR_EXIT;
                 }
-                else {
-                    if (!sendPacket(packet)) {
-                        continue;
-                    }
+                int64_t begin = av_gettime_relative();
+                dataCond.wait_for(locker, 10ms);
+                if (!videoReady && countStarved) {
+                    video->starvedTime += av_gettime_relative() - begin;
                 }
-                return ret;
             }
+            adapt();
+            if (metadataChanged) {
+                publishMetadata(ctxt);
+            }
+
+            // Take the one of the smaller dts, so the output is interleaved
+            DashStreamReader *reader = nullptr;
+            if (video->queue.empty() && audio->queue.empty()) {
+                return AVERROR_EOF;
+            }
+            else if (video->queue.empty()) {
+                reader = audio.get();
+            }
+            else if (audio->queue.empty()) {
+                reader = video.get();
+            }
+            else {
+                reader = video->headTime() <= audio->headTime() ? video.get() : audio.get();
+            }
+
+            AVPacket *head = reader->queue.front();
+            reader->queue.pop_front();
+            reader->spaceCond.notify_one();
+
+            av_packet_move_ref(packet, head);
+            av_packet_free(&head);
+            packet->stream_index = reader->parentStream->index;
+            if (reader == video.get()) {
+                // The wait for the first packet is the startup or the seek, not a starving
+                countStarved = true;
+            }
+            return 0;
         }
         int readSeek(AVFormatContext *ctxt, int stream_index, int64_t timestamp, int flags) {
-            if (stream_index == parentAudioStream->index) {
-                return av_seek_frame(audioFormatCtxt, audioStream, timestamp, flags);
+            if (stream_index >= 0) {
+                if (stream_index >= int(ctxt->nb_streams)) {
+                    return AVERROR_STREAM_NOT_FOUND;
+                }
+                timestamp = av_rescale_q(timestamp, ctxt->streams[stream_index]->time_base, AV_TIME_BASE_Q);
             }
-            if (stream_index == parentVideoStream->index) {
-                return av_seek_frame(videoFormatCtxt, videoStream, timestamp, flags);
+
+            // Both sides seek in their threads at the same time
+            std::unique_lock locker(mutex);
+            for (auto reader : {video.get(), audio.get()}) {
+                reader->requestSeek(timestamp, flags);
+            }
+            while (video->seekPending || audio->seekPending) {
+                if (interrupt.callback && interrupt.callback(interrupt.opaque)) {
+                    return AVERROR_EXIT;
+                }
+                dataCond.wait_for(locker, 10ms);
+            }
+            video->starvedTime = 0;
+            lastStarvedTime = 0;
+            countStarved = false;
+            if (video->seekResult < 0) {
+                return video->seekResult;
             }
-            return AVERROR_STREAM_NOT_FOUND;
+            return audio->seekResult;
         }
-        int readClose(AVFormatContext *ctxt) {
-            // Cleanup
-            avformat_close_input(&videoFormatCtxt);
-            avformat_close_input(&audioFormatCtxt);
-            currentFormatCtxt = nullptr;
-
-            audioStream = -1;
-            videoStream = -1;
+        /**
+         * @brief Decide the representation of the video, called in readPacket with the mutex held
+         * 
+         */
+        void adapt() {
+            int64_t now = av_gettime_relative();
+            if (!adaptive || representations.size() < 2 || video->switching || now - lastDecisionTime < DecisionInterval) {
+                return;
+            }
+            lastDecisionTime = now;
 
-            parentAudioStream = nullptr;
-            parentVideoStream = nullptr;
+            double bitsPerSecond = video->throughput * 8;
+            if (bitsPerSecond <= 0) {
+                return;
+            }
+            int current = video->representation;
+            int target = 0;
+            for (size_t i = 0; i < representations.size(); i++) {
+                if (representations[i].bandwidth <= bitsPerSecond * SafetyFactor) {
+                    target = i;
+                }
+            }
+            const char *reason = "throughput";
 
+            // The buffer is running dry, step down at once
+            bool starved = video->starvedTime - lastStarvedTime >= StarvedThreshold;
+            lastStarvedTime = video->starvedTime;
+            if (starved && current > 0 && target >= current) {
+                target = current - 1;
+                reason = "starved";
+            }
+            if (target > current) {
+                // Only step up when we are well ahead and have stayed for a while
+                bool healthy = video->queue.size() >= DashStreamReader::MaxQueuedPackets / 2;
+                if (!healthy || now - lastSwitchTime < UpSwitchHold) {
+                    return;
+                }
+            }
+            if (target == current) {
+                return;
+            }
+            qDebug() << "DashInputFormat switch video from" << representationName(current) << "to" << representationName(target)
+                     << "by" << reason << "estimated" << bitsPerSecond / 1000 << "kbps";
+            switchReason = reason;
+            lastSwitchTime = now;
+            video->requestSwitch(target);
+        }
+        /**
+         * @brief Called by the video reader when the switch is done, with the mutex held
+         * 
+         * @param point The time in seconds
+         */
+        void switched(int from, int to, double point) {
+            switchHistory.push_back(
+                QString::asprintf("%.1fs ", point) + representationName(from) + " -> " + representationName(to) + " (" + switchReason + ")"
+            );
+            while (switchHistory.size() > MaxSwitchHistory) {
+                switchHistory.removeFirst();
+            }
+            metadataChanged = true;
+        }
+        /**
+         * @brief Put the representation status into the metadata, so the player could show them in statistics
+         * 
+         */
+        void publishMetadata(AVFormatContext *ctxt) {
+            metadataChanged = false;
+            av_dict_set(&ctxt->metadata, "nekoav_representation", representationName(video->representation).toUtf8().constData(), 0);
+            av_dict_set(&ctxt->metadata, "nekoav_representation_switches", switchHistory.join('\n').toUtf8().constData(), 0);
+            ctxt->event_flags |= AVFMT_EVENT_FLAG_METADATA_UPDATED;
+        }
+        QString representationName(int index) const {
+            auto &r = representations[index];
+            return r.name.isEmpty() ? QString("%1kbps").arg(r.bandwidth / 1000) : r.name;
+        }
+        int readClose(AVFormatContext *ctxt) {
+            // Cleanup, the reader stops its thread
+            video.reset();
+            audio.reset();
             return 0;
         }
 
         static constexpr int Magic = 0x114514;
         int              formatMagic = Magic;
-        AVFormatContext *videoFormatCtxt = nullptr;
-        AVFormatContext *audioFormatCtxt = nullptr;
 
-        AVFormatContext *currentFormatCtxt = nullptr;
-        
-        QUrl             videoSource;
+        struct Representation {
+            QUrl    url;
+            int64_t bandwidth = 0; //< Bits per second
+            QString name;
+        };
+
+        static constexpr double  SafetyFactor = 0.8; //< Of the estimated throughput could be used
+        static constexpr int64_t DecisionInterval = 1000000; //< Microseconds
+        static constexpr int64_t UpSwitchHold = 10000000; //< Min microseconds from the last switch before stepping up
+        static constexpr int64_t StarvedThreshold = 300000; //< Microseconds waited for video in an interval
+        static constexpr int     MaxSwitchHistory = 32; //< Only the last switches are kept and published
+
+        std::vector<Representation> representations; //< Of the video, sorted by bandwidth, not changed when playing
         QUrl             audioSource;
+        int64_t          initialBandwidth = 2000000;
+        bool             adaptive = true;
         
         AVDictionary    *videoOptions = nullptr;
         AVDictionary    *audioOptions = nullptr;
 
-        int              audioStream = -1;
-        int              videoStream = -1;
+        AVIOInterruptCB  interrupt {nullptr, nullptr}; //< Of the parent context
+
+        // Shared with the readers
+        std::mutex                        mutex;
+        std::condition_variable           dataCond; //< Packet pushed, eof, error or seek done
+        std::unique_ptr<DashStreamReader> video;
+        std::unique_ptr<DashStreamReader> audio;
+        QStringList                       switchHistory;
+        QString                           switchReason;
+        bool                              metadataChanged = false;
 
-        AVStream        *parentAudioStream = nullptr;
-        AVStream        *parentVideoStream = nullptr;
+        // Only used in the demuxer thread
+        int64_t                           lastSwitchTime = 0;
+        int64_t                           lastDecisionTime = 0;
+        int64_t                           lastStarvedTime = 0;
+        bool                              countStarved = false; //< Got the first video packet since the header or seek
+    friend class DashStreamReader;
     friend class DashInputFormat;
 };
 
+DashStreamReader::~DashStreamReader() {
+    if (thread) {
+        {
+            std::lock_guard locker(parent->mutex);
+            quit = true;
+        }
+        abort = true;
+        spaceCond.notify_one();
+        thread->wait();
+        delete thread;
+    }
+    joinSwitcher();
+    clearQueue();
+    av_packet_free(&nextKeyframe);
+    avformat_close_input(&nextCtxt);
+    avformat_close_input(&formatCtxt);
+}
+int DashStreamReader::openContext(const QUrl &url, const AVDictionary *options, AVFormatContext **ctxt, int *index) {
+    *ctxt = avformat_alloc_context();
+    if (!*ctxt) {
+        return AVERROR(ENOMEM);
+    }
+    (*ctxt)->interrupt_callback.callback = [](void *self) -> int {
+        return static_cast<DashStreamReader*>(self)->abort.load();
+    };
+    (*ctxt)->interrupt_callback.opaque = this;
+
+    AVDictionary *opts = nullptr;
+    av_dict_copy(&opts, options, 0);
+    int ret = avformat_open_input(ctxt, url.toString().toUtf8().data(), nullptr, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        qWarning() << "DashStreamReader failed to open" << url;
+        return ret;
+    }
+    ret = avformat_find_stream_info(*ctxt, nullptr);
+    if (ret < 0) {
+        avformat_close_input(ctxt);
+        return ret;
+    }
+    *index = av_find_best_stream(*ctxt, type, -1, -1, nullptr, 0);
+    if (*index < 0) {
+        avformat_close_input(ctxt);
+        return AVERROR_STREAM_NOT_FOUND;
+    }
+    // Only the stream of our type is wanted
+    for (unsigned i = 0; i < (*ctxt)->nb_streams; i++) {
+        if (int(i) != *index) {
+            (*ctxt)->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+    return 0;
+}
+int DashStreamReader::open(const QUrl &url, const AVDictionary *options) {
+    return openContext(url, options, &formatCtxt, &streamIndex);
+}
+int DashStreamReader::addParentStream(AVFormatContext *ctxt) {
+    auto stream = formatCtxt->streams[streamIndex];
+    parentStream = avformat_new_stream(ctxt, nullptr);
+    if (!parentStream) {
+        return AVERROR(ENOMEM);
+    }
+    int ret = avcodec_parameters_copy(parentStream->codecpar, stream->codecpar);
+    if (ret < 0) {
+        return ret;
+    }
+    parentStream->duration = stream->duration;
+    parentStream->start_time = stream->start_time;
+    parentStream->time_base = stream->time_base;
+    parentStream->nb_frames = stream->nb_frames;
+    parentStream->avg_frame_rate = stream->avg_frame_rate;
+    parentStream->r_frame_rate = stream->r_frame_rate;
+    parentStream->sample_aspect_ratio = stream->sample_aspect_ratio;
+    return 0;
+}
+void DashStreamReader::start() {
+    thread = QThread::create(&DashStreamReader::run, this);
+    thread->setObjectName(type == AVMEDIA_TYPE_VIDEO ? "NekoAV DashVideoReader" : "NekoAV DashAudioReader");
+    thread->start();
+}
+void DashStreamReader::requestSeek(int64_t timestamp, int flags) {
+    seekTarget = timestamp;
+    seekFlags = flags;
+    seekPending = true;
+    generation += 1;
+    clearQueue();
+    spaceCond.notify_one();
+}
+void DashStreamReader::requestSwitch(int index) {
+    switchTarget = index;
+    switching = true;
+    spaceCond.notify_one();
+}
+int64_t DashStreamReader::headTime() const {
+    auto packet = queue.front();
+    int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if (ts == AV_NOPTS_VALUE) {
+        // Unknown, take it at once
+        return INT64_MIN;
+    }
+    return av_rescale_q(ts, parentStream->time_base, AV_TIME_BASE_Q);
+}
+void DashStreamReader::clearQueue() {
+    for (auto packet : queue) {
+        av_packet_free(&packet);
+    }
+    queue.clear();
+}
+void DashStreamReader::push(AVPacket *packet) {
+    // The representations may be in different time base
+    av_packet_rescale_ts(packet, formatCtxt->streams[streamIndex]->time_base, parentStream->time_base);
+    int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if (ts != AV_NOPTS_VALUE) {
+        lastTime = av_rescale_q(ts, parentStream->time_base, AV_TIME_BASE_Q);
+    }
+    queue.push_back(packet);
+}
+void DashStreamReader::sampleThroughput(int64_t bytes, int64_t duration) {
+    sampleBytes += bytes;
+    sampleDuration += duration;
+    if (sampleDuration < 200000 && sampleBytes < 512 * 1024) {
+        return;
+    }
+    if (sampleBytes > 0 && sampleDuration > 0) {
+        // The fast one follows the drops, the slow one ignores the spikes, take the smaller
+        double rate = sampleBytes * 1000000.0 / sampleDuration;
+        fastEstimate = fastEstimate > 0 ? fastEstimate * 0.6 + rate * 0.4 : rate;
+        slowEstimate = slowEstimate > 0 ? slowEstimate * 0.9 + rate * 0.1 : rate;
+        throughput = std::min(fastEstimate, slowEstimate);
+    }
+    sampleBytes = 0;
+    sampleDuration = 0;
+}
+void DashStreamReader::prepareSwitch(int index, int64_t point, uint64_t gen) {
+    AVFormatContext *ctxt = nullptr;
+    AVPacket *packet = nullptr;
+    int idx = -1;
+    int64_t time = AV_NOPTS_VALUE;
+
+    // Runs in the switcher thread, only hand over the result with the mutex held
+    auto done = [&](bool ok) {
+        std::lock_guard locker(parent->mutex);
+        if (ok && gen == generation && !quit) {
+            nextCtxt = ctxt;
+            nextStreamIndex = idx;
+            nextRepresentation = index;
+            nextKeyframe = packet;
+            switchPoint = time;
+        }
+        else {
+            // Failed, or seeked when preparing, the keyframe is not for the new position
+            if (ok) {
+                qDebug() << "DashStreamReader drop the prepared representation" << index << ", seeked";
+            }
+            else {
+                qWarning() << "DashStreamReader failed to switch to representation" << index;
+            }
+            av_packet_free(&packet);
+            avformat_close_input(&ctxt);
+        }
+        switcherDone = true;
+        spaceCond.notify_one();
+    };
+
+    auto &target = parent->representations[index];
+    if (openContext(target.url, parent->videoOptions, &ctxt, &idx) < 0) {
+        return done(false);
+    }
+    auto stream = ctxt->streams[idx];
+    if (stream->codecpar->codec_id != parentStream->codecpar->codec_id) {
+        qWarning() << "DashStreamReader cannot switch to" << target.url << ", the codec is different";
+        return done(false);
+    }
+    if (point != AV_NOPTS_VALUE) {
+        // To the keyframe at or after the point
+        av_seek_frame(ctxt, -1, point, 0);
+    }
+
+    // Find the first keyframe after what we have read
+    packet = av_packet_alloc();
+    while (true) {
+        int ret = av_read_frame(ctxt, packet);
+        if (ret < 0) {
+            return done(false);
+        }
+        int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+        if (packet->stream_index == idx && (packet->flags & AV_PKT_FLAG_KEY) && ts != AV_NOPTS_VALUE) {
+            time = av_rescale_q(ts, stream->time_base, AV_TIME_BASE_Q);
+            if (point == AV_NOPTS_VALUE || time > point) {
+                // The current one kept feeding when we were reading, make sure it is still ahead
+                std::lock_guard locker(parent->mutex);
+                if (gen != generation || quit || lastTime == AV_NOPTS_VALUE || time > lastTime) {
+                    break;
+                }
+                point = lastTime;
+            }
+        }
+        av_packet_unref(packet);
+    }
+    // The decoder needs the parameter sets of the new one
+    if (stream->codecpar->extradata_size > 0) {
+        auto side = av_packet_new_side_data(packet, AV_PKT_DATA_NEW_EXTRADATA, stream->codecpar->extradata_size);
+        if (side) {
+            ::memcpy(side, stream->codecpar->extradata, stream->codecpar->extradata_size);
+        }
+    }
+    done(true);
+}
+void DashStreamReader::joinSwitcher() {
+    if (!switcher) {
+        return;
+    }
+    switcher->wait();
+    delete switcher;
+    switcher = nullptr;
+    switcherDone = false;
+}
+void DashStreamReader::finishSwitch(bool withKeyframe) {
+    int from = representation;
+    avformat_close_input(&formatCtxt);
+    formatCtxt = nextCtxt;
+    streamIndex = nextStreamIndex;
+    representation = nextRepresentation;
+    nextCtxt = nullptr;
+    if (withKeyframe) {
+        push(nextKeyframe);
+        nextKeyframe = nullptr;
+    }
+    else {
+        av_packet_free(&nextKeyframe);
+    }
+    switching = false;
+    parent->switched(from, representation, switchPoint / double(AV_TIME_BASE));
+}
+void DashStreamReader::run() {
+    std::unique_lock locker(parent->mutex);
+    while (!quit) {
+        if (seekPending) {
+            if (nextCtxt) {
+                // Seek the new representation directly
+                finishSwitch(false);
+            }
+            int64_t target = seekTarget;
+            int     flags = seekFlags;
+            uint64_t gen = generation;
+
+            locker.unlock();
+            int ret = av_seek_frame(formatCtxt, -1, target, flags);
+            locker.lock();
+
+            if (gen != generation) {
+                // Seeked again, do the new one
+                continue;
+            }
+            seekPending = false;
+            seekResult = ret;
+            eof = false;
+            error = 0;
+            lastTime = AV_NOPTS_VALUE;
+            parent->dataCond.notify_all();
+            continue;
+        }
+        if (switcherDone) {
+            // Finished, it will not touch us anymore
+            locker.unlock();
+            joinSwitcher();
+            locker.lock();
+
+            if (!nextCtxt) {
+                switching = false;
+            }
+            else if (eof) {
+                // The current one ended when preparing, the new one takes over at once
+                eof = false;
+                finishSwitch(true);
+                parent->dataCond.notify_all();
+            }
+            continue;
+        }
+        if (switchTarget >= 0 && !nextCtxt && !switcher) {
+            // Open the new one and find its keyframe in the switcher, the current one keeps going until there
+            int index = switchTarget;
+            int64_t point = lastTime;
+            uint64_t gen = generation;
+            switchTarget = -1;
+
+            switcher = QThread::create(&DashStreamReader::prepareSwitch, this, index, point, gen);
+            switcher->setObjectName("NekoAV DashSwitcher");
+            switcher->start();
+            continue;
+        }
+        if (queue.size() >= MaxQueuedPackets || eof || error < 0) {
+            spaceCond.wait(locker);
+            continue;
+        }
+
+        uint64_t gen = generation;
+        locker.unlock();
+        AVPacket *packet = av_packet_alloc();
+        int64_t bytes = formatCtxt->pb ? formatCtxt->pb->bytes_read : 0;
+        int64_t begin = av_gettime_relative();
+        int ret = av_read_frame(formatCtxt, packet);
+        int64_t duration = av_gettime_relative() - begin;
+        bytes = (formatCtxt->pb ? formatCtxt->pb->bytes_read : 0) - bytes;
+        locker.lock();
+
+        sampleThroughput(bytes, duration);
+        if (gen != generation || ret < 0 || packet->stream_index != streamIndex) {
+            av_packet_free(&packet);
+            if (gen != generation) {
+                // The packet is before the seek
+                continue;
+            }
+            if (ret == AVERROR_EOF && nextCtxt) {
+                finishSwitch(true);
+            }
+            else if (ret == AVERROR_EOF) {
+                eof = true;
+            }
+            else if (ret < 0 && !quit) {
+                qWarning() << "DashStreamReader failed to read packet" << ret;
+                error = ret;
+            }
+            parent->dataCond.notify_all();
+            continue;
+        }
+        if (nextCtxt) {
+            int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+            if (ts != AV_NOPTS_VALUE && av_rescale_q(ts, formatCtxt->streams[streamIndex]->time_base, AV_TIME_BASE_Q) >= switchPoint) {
+                // The new one takes over from its keyframe
+                av_packet_free(&packet);
+                finishSwitch(true);
+                parent->dataCond.notify_all();
+                continue;
+            }
+        }
+        push(packet);
+        parent->dataCond.notify_all();
+    }
+}
+
 DashInputFormat::DashInputFormat(QObject *parent) : QObject(parent), d(new DashInputFormatPrivate()) {
 
 }
@@ -211,7 +776,36 @@ void *DashInputFormat::getAVInputFormat() {
     return static_cast<AVInputFormat*>(d.get());
 }
 void  DashInputFormat::setVideoSource(const QUrl &source) {
-    d->videoSource = source;
+    clearVideoRepresentations();
+    addVideoRepresentation(source, 0);
+}
+void  DashInputFormat::addVideoRepresentation(const QUrl &url, qint64 bandwidth, const QString &name) {
+    auto &reps = d->representations;
+    auto iter = std::upper_bound(reps.begin(), reps.end(), bandwidth, [](qint64 b, const auto &r) {
+        return b < r.bandwidth;
+    });
+    reps.insert(iter, {url, bandwidth, name});
+}
+void  DashInputFormat::clearVideoRepresentations() {
+    d->representations.clear();
+}
+void  DashInputFormat::setInitialBandwidth(qint64 bitsPerSecond) {
+    d->initialBandwidth = bitsPerSecond;
+}
+void  DashInputFormat::setAdaptive(bool enabled) {
+    std::lock_guard locker(d->mutex);
+    d->adaptive = enabled;
+}
+QString DashInputFormat::currentVideoRepresentation() const {
+    std::lock_guard locker(d->mutex);
+    if (!d->video || d->representations.empty()) {
+        return QString();
+    }
+    return d->representationName(d->video->representation);
+}
+QStringList DashInputFormat::videoSwitchHistory() const {
+    std::lock_guard locker(d->mutex);
+    return d->switchHistory;
 }
 void  DashInputFormat::setAudioSource(const QUrl &source) {
     d->audioSource = source;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <QStringList>
 #include <QObject>
 #include <QString>
 
@@ -14,7 +15,41 @@ class DashInputFormat : public QObject {
 
         void *getAVInputFormat();
         void  setAudioSource(const QUrl &url);
+        /**
+         * @brief Set the only video representation, no adaptive switching
+         * 
+         */
         void  setVideoSource(const QUrl &url);
+        /**
+         * @brief Add a quality level of the video, the video switches between them at the keyframes by the measured throughput,
+         * they should be in the same codec, do not change them when playing
+         * 
+         * @param url 
+         * @param bandwidth Bits per second
+         * @param name Shown in the statistics, like "1080P", default is the bandwidth
+         */
+        void  addVideoRepresentation(const QUrl &url, qint64 bandwidth, const QString &name = QString());
+        void  clearVideoRepresentations();
+        /**
+         * @brief Set the bandwidth the first representation is chosen by, default is 2Mbps
+         * 
+         */
+        void  setInitialBandwidth(qint64 bitsPerSecond);
+        /**
+         * @brief Enable the switching, default is true
+         * 
+         */
+        void  setAdaptive(bool enabled);
+        /**
+         * @brief Get the name of current video representation, thread safe
+         * 
+         */
+        QString     currentVideoRepresentation() const;
+        /**
+         * @brief Get the switches like "12.0s 1080P -> 720P (starved)", thread safe
+         * 
+         */
+        QStringList videoSwitchHistory() const;
         void  setAudioOption(const QByteArray &key, const QByteArray &value);
         void  setVideoOption(const QByteArray &key, const QByteArray &value);
         void  clearVideoOption();
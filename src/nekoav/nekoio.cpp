@@ -0,0 +1,331 @@
+#define NEKO_SOURCE
+#include "nekoav.hpp"
+#include "nekoprivate.hpp"
+#include <QIODevice>
+#include <algorithm>
+#include <cstring>
+
+namespace NekoAV {
+
+class DeviceByteSource final : public ByteSource {
+    public:
+        DeviceByteSource(QIODevice *device) : device(device) {
+            // Emitted in the thread of the device, only wake the reader here
+            auto wake = [this]() {
+                std::lock_guard locker(mutex);
+                cond.notify_one();
+            };
+            auto finish = [this]() {
+                std::lock_guard locker(mutex);
+                finished = true;
+                cond.notify_one();
+            };
+            connections[0] = QObject::connect(device, &QIODevice::readyRead, wake);
+            connections[1] = QObject::connect(device, &QIODevice::readChannelFinished, finish);
+            connections[2] = QObject::connect(device, &QIODevice::aboutToClose, finish);
+        }
+        ~DeviceByteSource() {
+            for (auto &c : connections) {
+                QObject::disconnect(c);
+            }
+        }
+
+        int read(uint8_t *buf, int size) override {
+            while (!cancelled) {
+                auto n = device->read(reinterpret_cast<char*>(buf), size);
+                if (n < 0) {
+                    return AVERROR(EIO);
+                }
+                if (n > 0) {
+                    return n;
+                }
+                if (!device->isOpen() || (!device->isSequential() && device->atEnd())) {
+                    return AVERROR_EOF;
+                }
+                // Sequential device without data now (like a socket), only the end of the channel is the end
+                std::unique_lock locker(mutex);
+                if (finished && device->bytesAvailable() == 0) {
+                    return AVERROR_EOF;
+                }
+                // Bounded, the device may live in a thread without event loop, then nobody signals us
+                cond.wait_for(locker, 100ms, [this]() {
+                    return cancelled || finished || device->bytesAvailable() > 0;
+                });
+            }
+            return AVERROR_EXIT;
+        }
+        bool seek(int64_t pos) override {
+            return device->seek(pos);
+        }
+        int64_t size() override {
+            return device->isSequential() ? -1 : device->size();
+        }
+        bool isSeekable() const override {
+            return !device->isSequential();
+        }
+        void cancel() override {
+            std::lock_guard locker(mutex);
+            cancelled = true;
+            cond.notify_one();
+        }
+    private:
+        QIODevice              *device;
+        QMetaObject::Connection connections[3];
+        std::mutex              mutex;
+        std::condition_variable cond;
+        Atomic<bool>            cancelled = false;
+        bool                    finished = false; //< The read channel is finished or closing, protected by mutex
+};
+
+class UrlByteSource final : public ByteSource {
+    public:
+        ~UrlByteSource() {
+            avio_closep(&ctxt);
+        }
+
+        int open(const QUrl &url, const AVDictionary *options, AVIOInterruptCB cb) {
+            openInterrupt = cb;
+            AVIOInterruptCB self;
+            self.callback = [](void *opaque) -> int {
+                auto source = static_cast<UrlByteSource*>(opaque);
+                if (source->cancelled) {
+                    return 1;
+                }
+                if (source->opening && source->openInterrupt.callback) {
+                    return source->openInterrupt.callback(source->openInterrupt.opaque);
+                }
+                return 0;
+            };
+            self.opaque = this;
+
+            AVDictionary *opts = nullptr;
+            av_dict_copy(&opts, options, 0);
+            QByteArray path = url.toString().toUtf8();
+            opening = true;
+            int ret = avio_open2(&ctxt, path.data(), AVIO_FLAG_READ, &self, &opts);
+            opening = false;
+            av_dict_free(&opts);
+            return ret;
+        }
+
+        int read(uint8_t *buf, int size) override {
+            int n = avio_read_partial(ctxt, buf, size);
+            if (n == 0 && avio_feof(ctxt)) {
+                return AVERROR_EOF;
+            }
+            return n;
+        }
+        bool seek(int64_t pos) override {
+            return avio_seek(ctxt, pos, SEEK_SET) >= 0;
+        }
+        int64_t size() override {
+            auto n = avio_size(ctxt);
+            return n < 0 ? -1 : n;
+        }
+        bool isSeekable() const override {
+            return ctxt->seekable & AVIO_SEEKABLE_NORMAL;
+        }
+        void cancel() override {
+            cancelled = true;
+        }
+    private:
+        AVIOContext     *ctxt = nullptr;
+        AVIOInterruptCB  openInterrupt {nullptr, nullptr};
+        Atomic<bool>     opening = false;
+        Atomic<bool>     cancelled = false;
+};
+
+auto ByteSource::fromDevice(QIODevice *device) -> std::unique_ptr<ByteSource> {
+    return std::make_unique<DeviceByteSource>(device);
+}
+auto ByteSource::open(const QUrl &url, const AVDictionary *options, AVIOInterruptCB interrupt, int *errcode) -> std::unique_ptr<ByteSource> {
+    auto source = std::make_unique<UrlByteSource>();
+    int ret = source->open(url, options, interrupt);
+    if (ret < 0) {
+        *errcode = ret;
+        return nullptr;
+    }
+    return source;
+}
+
+ReadAheadIO::ReadAheadIO(std::unique_ptr<ByteSource> src, int64_t bufferSize) : source(std::move(src)) {
+    setObjectName("NekoAV ReadAheadIO");
+
+    capacity = qMax(bufferSize, MinBufferSize);
+    backKeep = capacity / 4;
+    ring.reset(new uint8_t[capacity]);
+    totalSize = source->size();
+    seekable = source->isSeekable();
+
+    auto buffer = static_cast<uint8_t*>(av_malloc(AVIOBufferSize));
+    ioCtxt = avio_alloc_context(
+        buffer,
+        AVIOBufferSize,
+        0,
+        this,
+        [](void *opaque, uint8_t *buf, int size) -> int {
+            return static_cast<ReadAheadIO*>(opaque)->read(buf, size);
+        },
+        nullptr,
+        seekable ? +[](void *opaque, int64_t offset, int whence) -> int64_t {
+            return static_cast<ReadAheadIO*>(opaque)->seek(offset, whence);
+        } : nullptr
+    );
+    ioCtxt->seekable = seekable ? AVIO_SEEKABLE_NORMAL : 0;
+
+    start();
+}
+ReadAheadIO::~ReadAheadIO() {
+    {
+        std::lock_guard locker(mutex);
+        quit = true;
+    }
+    source->cancel();
+    spaceCond.notify_one();
+    wait();
+
+    qDebug() << "ReadAheadIO fetched" << fetched.load() << "bytes, seeks in memory" << memorySeeks.load();
+
+    if (ioCtxt) {
+        av_freep(&ioCtxt->buffer);
+    }
+    avio_context_free(&ioCtxt);
+}
+int64_t ReadAheadIO::bufferedBytes() const {
+    std::lock_guard locker(mutex);
+    return windowEnd - readPos;
+}
+int ReadAheadIO::read(uint8_t *buf, int size) {
+    std::unique_lock locker(mutex);
+    while (readPos >= windowEnd) {
+        if (error) {
+            return error;
+        }
+        if (eof) {
+            return AVERROR_EOF;
+        }
+        if (interrupt.callback && interrupt.callback(interrupt.opaque)) {
+            return AVERROR_EXIT;
+        }
+        dataCond.wait_for(locker, 10ms);
+    }
+
+    // Copy, may wrap around
+    int64_t n = std::min<int64_t>(size, windowEnd - readPos);
+    int64_t offset = readPos % capacity;
+    int64_t first = std::min(n, capacity - offset);
+    ::memcpy(buf, ring.get() + offset, first);
+    ::memcpy(buf + first, ring.get(), n - first);
+    readPos += n;
+
+    spaceCond.notify_one();
+    return n;
+}
+int64_t ReadAheadIO::seek(int64_t offset, int whence) {
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE) {
+        return totalSize;
+    }
+
+    std::lock_guard locker(mutex);
+    int64_t target;
+    switch (whence) {
+        case SEEK_SET : target = offset; break;
+        case SEEK_CUR : target = readPos + offset; break;
+        case SEEK_END : {
+            if (totalSize < 0) {
+                return AVERROR(ENOSYS);
+            }
+            target = totalSize + offset;
+            break;
+        }
+        default : return AVERROR(EINVAL);
+    }
+    if (target < 0) {
+        return AVERROR(EINVAL);
+    }
+    if (target >= windowStart && target <= windowEnd) {
+        // In memory
+        readPos = target;
+        memorySeeks += 1;
+        spaceCond.notify_one();
+        return target;
+    }
+
+    // Drop the window, the I/O thread seeks the source
+    windowStart = target;
+    windowEnd = target;
+    readPos = target;
+    generation += 1;
+    seekPending = true;
+    eof = false;
+    error = 0;
+    spaceCond.notify_one();
+    return target;
+}
+void ReadAheadIO::run() {
+    std::vector<uint8_t> chunk(ChunkSize);
+    std::unique_lock locker(mutex);
+    while (!quit) {
+        if (seekPending) {
+            seekPending = false;
+            int64_t target = windowEnd;
+            uint64_t gen = generation;
+
+            locker.unlock();
+            bool ok = source->seek(target);
+            locker.lock();
+
+            if (gen != generation) {
+                // Seeked again
+                continue;
+            }
+            if (!ok) {
+                error = AVERROR(EIO);
+                dataCond.notify_all();
+            }
+            continue;
+        }
+
+        // Drop the oldest bytes behind the reader if no space
+        int64_t start = std::max(windowStart, readPos - backKeep);
+        int64_t space = capacity - (windowEnd - start);
+        if (space <= 0 || eof || error) {
+            spaceCond.wait(locker);
+            continue;
+        }
+        windowStart = start;
+
+        int want = std::min<int64_t>(space, ChunkSize);
+        uint64_t gen = generation;
+
+        locker.unlock();
+        int64_t begin = av_gettime_relative();
+        int n = source->read(chunk.data(), want);
+        fetchDuration += av_gettime_relative() - begin;
+        locker.lock();
+
+        if (gen != generation) {
+            // Seeked when reading, the data is not for the new position
+            continue;
+        }
+        if (n == AVERROR_EOF) {
+            eof = true;
+        }
+        else if (n < 0) {
+            qDebug() << "ReadAheadIO failed to read" << FFErrorToString(n);
+            error = n;
+        }
+        else if (n > 0) {
+            int64_t offset = windowEnd % capacity;
+            int64_t first = std::min<int64_t>(n, capacity - offset);
+            ::memcpy(ring.get() + offset, chunk.data(), first);
+            ::memcpy(ring.get(), chunk.data() + first, n - first);
+            windowEnd += n;
+            fetched += n;
+        }
+        dataCond.notify_all();
+    }
+}
+
+}
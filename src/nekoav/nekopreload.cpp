@@ -0,0 +1,95 @@
+#define NEKO_SOURCE
+#include "nekoav.hpp"
+#include "nekoprivate.hpp"
+
+namespace NekoAV {
+
+Preloader::Preloader(const QUrl &url, AVDictionary *opts, AVInputFormat *fmt, int64_t budget) :
+    sourceUrl(url), inputFormat(fmt), memoryBudget(budget)
+{
+    setObjectName("NekoAV Preloader");
+    av_dict_copy(&options, opts, 0);
+}
+Preloader::~Preloader() {
+    cancel();
+    wait();
+
+    for (auto pak : packets) {
+        av_packet_free(&pak);
+    }
+    avformat_close_input(&formatCtxt);
+    av_dict_free(&options);
+}
+AVFormatContext *Preloader::take(std::vector<AVPacket*> &out) {
+    if (!ready) {
+        return nullptr;
+    }
+    out = std::move(packets);
+    packets.clear();
+    ready = false;
+
+    auto ret = formatCtxt;
+    formatCtxt = nullptr;
+    return ret;
+}
+void Preloader::run() {
+    formatCtxt = avformat_alloc_context();
+    formatCtxt->interrupt_callback.callback = [](void *self) -> int {
+        return static_cast<Preloader*>(self)->cancelled.load();
+    };
+    formatCtxt->interrupt_callback.opaque = this;
+
+    QByteArray url = sourceUrl.isLocalFile() ? sourceUrl.toLocalFile().toUtf8() : sourceUrl.toString().toUtf8();
+    int errcode = avformat_open_input(&formatCtxt, url.data(), inputFormat, &options);
+    if (errcode < 0) {
+        qDebug() << "Preloader failed to open" << sourceUrl << FFErrorToString(errcode);
+        return;
+    }
+    errcode = avformat_find_stream_info(formatCtxt, nullptr);
+    if (errcode < 0) {
+        qDebug() << "Preloader failed to find stream info" << FFErrorToString(errcode);
+        return;
+    }
+
+    // Same as the DemuxerThread::load
+    videoStream = av_find_best_stream(formatCtxt, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    audioStream = av_find_best_stream(formatCtxt, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+    subtitleStream = av_find_best_stream(formatCtxt, AVMEDIA_TYPE_SUBTITLE, -1, -1, nullptr, 0);
+    if (audioStream < 0 && videoStream < 0) {
+        return;
+    }
+
+    // Prefill in the budget, measure by the main stream
+    int     mainStream = videoStream >= 0 ? videoStream : audioStream;
+    int64_t mainDuration = 0;
+    double  timeBase = av_q2d(formatCtxt->streams[mainStream]->time_base);
+    while (!cancelled) {
+        if (packetsBytes >= memoryBudget || packets.size() >= MaxPackets || mainDuration * timeBase >= MaxDuration) {
+            break;
+        }
+        auto pak = av_packet_alloc();
+        errcode = av_read_frame(formatCtxt, pak);
+        if (errcode < 0) {
+            av_packet_free(&pak);
+            break;
+        }
+        int idx = pak->stream_index;
+        if (idx != videoStream && idx != audioStream && idx != subtitleStream) {
+            av_packet_free(&pak);
+            continue;
+        }
+        if (idx == mainStream && pak->duration > 0) {
+            mainDuration += pak->duration;
+        }
+        packetsBytes += pak->size;
+        packets.push_back(pak);
+    }
+    if (cancelled) {
+        return;
+    }
+
+    qDebug() << "Preloader ready" << sourceUrl << "packets" << packets.size() << "bytes" << packetsBytes;
+    ready = true;
+}
+
+}
@@ -4,13 +4,23 @@
 #include "nekowrap.hpp"
 
 #include <QThread>
+#include <QTimer>
 
 #include <condition_variable>
+#include <functional>
 #include <atomic>
 #include <mutex>
+#include <thread>
+#include <memory>
+#include <vector>
 #include <deque>
+#include <map>
+#include <set>
 
 
+struct AVFilterGraph;
+struct AVFilterContext;
+
 namespace NekoAV {
 
 inline static auto EofPacket = nullptr;
@@ -25,28 +35,469 @@ using Atomic = std::atomic<T>;
 
 using namespace std::chrono_literals;
 
+/**
+ * @brief Free list of AVPacket shells, shared by the demuxer and workers of a player
+ * 
+ * The demuxer moves the read packet into an acquired shell, workers give it back by release,
+ * so a steady-state playback allocates no packet.
+ * No lock on both sides, release pushes the shell to a lock free stack (linked by AVPacket::opaque),
+ * the only acquiring thread takes the whole stack at once into its own cache, nobody else pops, so no ABA.
+ */
+class PacketPool final {
+    public:
+        static constexpr size_t MaxIdlePackets = 16384;
+
+        PacketPool() = default;
+        PacketPool(const PacketPool &) = delete;
+        ~PacketPool();
+
+        /**
+         * @brief Get an empty packet, allocate it only if the free list is empty
+         * 
+         * @note Only called by one thread (the demuxer)
+         * @return AVPacket* 
+         */
+        AVPacket *acquire();
+        /**
+         * @brief Unref the packet and put it back, special packets are ignored
+         * 
+         * @param packet 
+         */
+        void      release(AVPacket *packet);
+
+        uint64_t  allocatedCount() const noexcept {
+            return allocated;
+        }
+        uint64_t  recycledCount() const noexcept {
+            return recycled;
+        }
+    private:
+        AVPacket              *cache = nullptr; //< Taken from the stack, only used by the acquiring thread
+        Atomic<AVPacket*>      stack = nullptr; //< Released shells
+        Atomic<size_t>         idle = 0; //< Shells in the stack and the cache
+        Atomic<uint64_t>       allocated = 0; //< Packets allocated by av_packet_alloc
+        Atomic<uint64_t>       recycled = 0; //< Packets reused from the free list
+};
+
+/**
+ * @brief Return the packet to pool (or free it if no pool) at the scope exit
+ * 
+ */
+class PacketGuard final {
+    public:
+        PacketGuard(PacketPool *pool, AVPacket *packet) : pool(pool), packet(packet) { }
+        PacketGuard(const PacketGuard &) = delete;
+        ~PacketGuard();
+    private:
+        PacketPool *pool;
+        AVPacket   *packet;
+};
+
+/**
+ * @brief Single producer / single consumer packet queue on a ring
+ * 
+ * The demuxer thread is the only producer (put / flush / seek), the worker thread is the only consumer (get / unget).
+ * No lock is taken on either side while the ring is neither empty nor full, each side only sleeps on the empty or
+ * full ring and is only notified when sleeping.
+ * flush and seek never touch the ring, they post a command, the consumer runs it in its next get and returns
+ * a FlushPacket, so only the consumer moves head.
+ */
 class PacketQueue final {
     public:
-        PacketQueue();
+        static constexpr size_t DefaultCapacity = 8192;
+        static constexpr size_t UngetReserve = 8; //< Slots reserved for unget, producer never use them
+
+        PacketQueue(PacketPool *pool = nullptr, size_t capacity = DefaultCapacity);
         PacketQueue(const PacketQueue &) = delete;
         ~PacketQueue();
 
+        /**
+         * @brief Drop all the packets put before, the consumer gets a FlushPacket first (producer side)
+         * 
+         */
         void flush();
+        /**
+         * @brief Put the packet, sleep until the consumer takes one if the ring is full (producer side)
+         * 
+         * @note The packet is released if the stop requested when sleeping
+         */
         void put(AVPacket *packet);
-        void unget(AVPacket *packet);
+        /**
+         * @brief Put the packet only if the ring has space (producer side)
+         * 
+         * @return false on full, the packet is not taken
+         */
+        bool tryPut(AVPacket *packet);
+        bool unget(AVPacket *packet);
+        /**
+         * @brief Drop the packets before the keyframe of pos, the consumer gets a FlushPacket first (producer side)
+         * 
+         * @return false if pos is not buffered, nothing changed
+         * @note The consumer may take packets before it runs the command, so it may miss the keyframe at last,
+         * seekMissed() tells the producer to seek the file
+         */
         bool seek(int64_t pos);
+        /**
+         * @brief Get and clear the flag of a missed seek (producer side)
+         * 
+         */
+        bool takeSeekMissed();
+        /**
+         * @brief Release all the packets at once, only when the consumer is not running
+         * 
+         */
+        void clear();
         void requestStop();
+        /**
+         * @brief Clear the stop request, for a consumer started again
+         * 
+         */
+        void resume();
         auto get(bool blocking = true) -> AVPacket *;
+        /**
+         * @brief Slots in use, with the flushed packets the consumer not dropped yet
+         * 
+         */
         size_t size() const;
+        size_t capacity() const;
         int64_t duration() const;
+        int64_t bytes() const;
         bool    stopRequested() const;
+
+        PacketPool *packetPool() const noexcept {
+            return pool;
+        }
     private:
-        std::deque<AVPacket*>   packets;
-        std::condition_variable cond;
-        std::mutex              condMutex;
-        Atomic<int64_t>         packetsDuration = 0; //< Sums of packet duration
+        // Posted by flush / seek, run by the consumer
+        struct Command {
+            size_t  dropUntil = 0; //< Packets before it are flushed
+            int64_t seekPos = AV_NOPTS_VALUE; //< Drop to the keyframe of it after dropUntil
+        };
+        // What the producer put in the slot, it searches them in seek without touching the packets
+        struct SlotInfo {
+            int64_t pts = AV_NOPTS_VALUE;
+            int64_t duration = 0;
+            bool    special = false;
+            bool    key = false;
+        };
+
+        template <typename Pred>
+        void sleepUntil(Atomic<bool> &waitting, std::condition_variable &c, Pred &&pred);
+        void wake(Atomic<bool> &waitting, std::condition_variable &c);
+        void advanceHead(size_t newHead);
+        void release(AVPacket *packet);
+        void push(AVPacket *packet);
+        void drop(size_t until);
+        AVPacket *runCommand();
+
+        PacketPool             *pool = nullptr; //< Where the dropped packets go
+        std::unique_ptr<AVPacket*[]> ring;
+        std::unique_ptr<SlotInfo[]>  infos; //< (producer side)
+        size_t                  mask = 0;
+        size_t                  limit = 0; //< Max packets producer can put
+        size_t                  ungetDepth = 0; //< How many packets was ungeted after the max head, (consumer side)
+        uint64_t                handledCommand = 0; //< (consumer side)
+        size_t                  flushMark = 0; //< Tail of the last flush, (producer side)
+
+        alignas(64) Atomic<size_t> head = 0; //< Read position, (consumer side)
+        alignas(64) Atomic<size_t> tail = 0; //< Write position, (producer side)
+
+        // Sums of packet duration and size, the buffered ones are put - max(taken, flushed)
+        alignas(64) Atomic<int64_t> putDuration = 0;
+        Atomic<int64_t>         putBytes = 0;
+        Atomic<int64_t>         takenDuration = 0;
+        Atomic<int64_t>         takenBytes = 0;
+        Atomic<int64_t>         flushedDuration = 0;
+        Atomic<int64_t>         flushedBytes = 0;
+
+        Atomic<uint64_t>        commandSeq = 0; //< Changed by each command, the consumer only checks it on the hot path
+        Command                 command;
+        std::mutex              commandMutex;
+        Atomic<bool>            seekMissed = false;
+
+        Atomic<bool>            consumerWaitting = false;
+        Atomic<bool>            producerWaitting = false;
         Atomic<bool>            stop = false;
+        std::condition_variable notEmptyCond;
+        std::condition_variable notFullCond;
+        std::mutex              condMutex;
+};
+
+/**
+ * @brief Convert a frame in horizontal slices, one SwsContext per slice
+ * 
+ * The caller thread converts the first slice, the other slices are converted by the workers at the same time.
+ * The picture is not scaled, so each slice is a independent convertion of a smaller picture.
+ */
+class SwsSlicer final {
+    public:
+        SwsSlicer() = default;
+        SwsSlicer(const SwsSlicer &) = delete;
+        ~SwsSlicer();
+
+        /**
+         * @brief Prepare the contexts, do nothing if the arguments are not changed
+         * 
+         * @param slices The slices count, 0 on DefaultSlices()
+         * @return true on ok
+         */
+        bool configure(int width, int height, AVPixelFormat srcFormat, AVPixelFormat dstFormat, int slices = 0);
+        /**
+         * @brief Convert the src to dst, they must match the configured size and formats
+         * 
+         * @return int < 0 on error
+         */
+        int  convert(const AVFrame *src, AVFrame *dst);
+        int  slicesCount() const noexcept {
+            return slices.size();
+        }
+
+        /**
+         * @brief Get the slices count by the cores and the resolution
+         * 
+         * @return int 
+         */
+        static int DefaultSlices(int width, int height);
+    private:
+        struct Slice {
+            AVPtr<SwsContext> ctxt;
+            int y = 0;
+            int height = 0;
+        };
+
+        void stopWorkers();
+        void workerMain(int idx, uint64_t generation);
+        int  convertSlice(int idx);
+
+        std::vector<Slice>       slices;
+        std::vector<std::thread> workers; //< Worker n convert slice n + 1
+
+        int           width = 0;
+        int           height = 0;
+        AVPixelFormat srcFormat = AV_PIX_FMT_NONE;
+        AVPixelFormat dstFormat = AV_PIX_FMT_NONE;
+        int           requestedSlices = -1;
+
+        // Current job, protected by mutex
+        const AVFrame *jobSrc = nullptr;
+        AVFrame       *jobDst = nullptr;
+        uint64_t       jobGeneration = 0;
+        int            jobPending = 0;
+        int            jobError = 0;
+        bool           quit = false;
+        std::condition_variable jobCond;
+        std::condition_variable doneCond;
+        std::mutex              mutex;
+};
+
+/**
+ * @brief Keyframes of a stream, built from the container index and while demuxing
+ * 
+ * Only used by the demuxer thread.
+ */
+class KeyframeIndex final {
+    public:
+        struct Entry {
+            int64_t pts; //< In stream time base
+            int64_t pos; //< Byte position, -1 on unknown
+        };
+
+        void clear() {
+            entries.clear();
+        }
+        /**
+         * @brief Add a keyframe, it is fast when added in order
+         */
+        void add(int64_t pts, int64_t pos);
+        /**
+         * @brief Find the last keyframe before or at the pts
+         * 
+         * @return const Entry* nullptr on not found
+         */
+        const Entry *lookup(int64_t pts) const;
+        size_t size() const noexcept {
+            return entries.size();
+        }
+    private:
+        std::vector<Entry> entries; //< Sorted by pts
+};
+
+/**
+ * @brief Single producer single consumer ring of PCM bytes, lock free
+ * 
+ * The producer (the audio decoder) writes and discards, the consumer (the device callback) reads.
+ */
+class PcmRing final {
+    public:
+        /**
+         * @brief Allocate the buffer, not thread safe
+         * 
+         * @param bytes The max readable bytes
+         */
+        void   allocate(size_t bytes);
+        /**
+         * @brief Write as much as possible, producer side
+         * 
+         * @return size_t The bytes written
+         */
+        size_t write(const uint8_t *data, size_t n);
+        /**
+         * @brief Read as much as possible, consumer side
+         * 
+         * @return size_t The bytes read
+         */
+        size_t read(uint8_t *data, size_t n);
+        /**
+         * @brief Drop all written data, the consumer skips them at next read, producer side
+         * 
+         */
+        void   discard();
+        size_t size() const;
+        size_t freeSpace() const;
+        size_t capacity() const noexcept {
+            return limit;
+        }
+    private:
+        std::unique_ptr<uint8_t[]> buffer;
+        size_t                  mask = 0;
+        size_t                  limit = 0;
+
+        alignas(64) Atomic<uint64_t> head = 0; //< Read position, (consumer side)
+        alignas(64) Atomic<uint64_t> tail = 0; //< Write position, (producer side)
+        Atomic<uint64_t>        discardPos = 0; //< Data before it is dropped
+};
+
+/**
+ * @brief Histogram of durations in microseconds, 4 buckets per power of two, lock free
+ * 
+ * The percentile is the upper bound of the bucket, so the error is less than 25%.
+ */
+class LatencyHistogram final {
+    public:
+        static constexpr int SubBuckets = 4;
+        static constexpr int Buckets = SubBuckets * 25; //< Up to about a minute
+
+        LatencyHistogram() {
+            reset();
+        }
+
+        void     add(int64_t us);
+        void     reset();
+        /**
+         * @brief Get the percentile
+         * 
+         * @param q In [0, 1]
+         * @return int64_t The duration in microseconds, 0 on empty
+         */
+        int64_t  percentile(double q) const;
+        uint64_t count() const;
+    private:
+        Atomic<uint64_t> buckets[Buckets];
+};
+
+/**
+ * @brief Counters of a playback for the statistics, owned by the player and reset at each load
+ * 
+ * Written by the workers and read by any thread, all relaxed atomic.
+ * The workers are deleted by the demuxer thread, so the GUI thread reads them here instead of from the workers.
+ */
+class PlaybackCounters final {
+    public:
+        PlaybackCounters() {
+            reset();
+        }
+
+        void reset();
+        /**
+         * @brief Add a A-V drift of a presented video frame
+         * 
+         * @param seconds The master clock minus the video clock
+         */
+        void addDrift(double seconds);
+
+        LatencyHistogram decodeTime;
+        LatencyHistogram convertTime;
+        Atomic<uint64_t> drift[PlaybackStatistics::DriftBuckets];
+        Atomic<uint64_t> lateFrames;
+        Atomic<uint64_t> dropedFrames; //< Decoded but not presented, by the VideoThread or the presentation queue
+        Atomic<uint64_t> skippedDecodes; //< Packets the decoder skipped by the catch up
+        Atomic<qreal>    decodeAverage; //< Moving average of the video decoding in seconds
+        Atomic<uint64_t> coalescedBase; //< Coalesced frames of the sink before this load
+        Atomic<uint64_t> audioUnderruns;
+        Atomic<uint64_t> packets;
+        Atomic<qreal>    throughput; //< Bytes per second of the last sample
+
+        // Published by the demuxer, indexed by StreamType
+        Atomic<int64_t>  queuePackets[3];
+        Atomic<int64_t>  queueBytes[3];
+        Atomic<qreal>    queueDuration[3];
+
+        // Published by the demuxer from the format metadata, protected by metadataMutex
+        // The input format may update the metadata when reading (like DashInputFormat), so the GUI thread reads this copy
+        std::mutex       metadataMutex;
+        MediaMetaData    metadata;
+        QString          representation;
+        QStringList      representationSwitches;
+};
+
+/**
+ * @brief Converted frames waiting for the display, filled by the VideoThread and taken by the renderer at its vsync
+ * 
+ * Owned by the VideoSink, a VideoThread attaches it with the media clock and detaches it at exit.
+ * The decoder only blocks when it is full, so it decodes ahead instead of sleeping until the frame is due.
+ */
+class PresentationQueue final {
+    public:
+        using Clock = std::function<double(int64_t wallTime)>; //< Media time at the wall time of av_gettime_relative
+
+        static constexpr auto StallTimeout = 100ms; //< No frame taken in it, the renderer is not painting
+
+        void     attach(const void *owner, size_t capacity, Clock clock, PlaybackCounters *counters);
+        void     detach(const void *owner);
+        /**
+         * @brief Wait for a free slot and queue the frame
+         * 
+         * @param generation Got before decoding it, the frame is dropped if flushed after that
+         * @param immediate Show it at the next take regardless of the clock, like the first frame after seeking
+         * @return false on detached
+         */
+        bool     push(const VideoFrame &frame, double pts, double duration, uint64_t generation, bool immediate);
+        /**
+         * @brief Take the frame of the display time, the passed ones are dropped
+         * 
+         * @param displayTime The wall time of the vsync showing it
+         * @return VideoFrame Null on keeping the current one
+         */
+        VideoFrame take(int64_t displayTime);
+        /**
+         * @brief Drop all the frames, like seeking
+         * 
+         */
+        void     flush();
+        bool     empty() const;
+        void     setNotify(std::function<void()> fn) {
+            notify = std::move(fn);
+        }
+        uint64_t generation() const noexcept {
+            return flushGeneration;
+        }
+    private:
+        struct Entry {
+            VideoFrame frame;
+            double     pts;
+            double     duration;
+            bool       immediate;
+        };
+
         mutable std::mutex      mutex;
+        std::condition_variable spaceCond;
+        std::deque<Entry>       entries;
+        size_t                  capacity = 2;
+        const void             *currentOwner = nullptr;
+        Clock                   clock;
+        PlaybackCounters       *counters = nullptr;
+        Atomic<uint64_t>        flushGeneration = 0;
+        std::function<void()>   notify; //< Called when a frame comes to the empty queue, set by the sink
 };
 
 class DemuxerThread;
@@ -57,9 +508,11 @@ class AudioThread final : public QObject {
         AudioThread(DemuxerThread *parent, AVStream *stream, AVCodecContext *ctxt);
         ~AudioThread();
         
+        static constexpr int RingMilliseconds = 200; //< Decoded PCM ahead of the device
+
         bool idle() const {
             // return waitting;
-            return queue.size() == 0;
+            return queue.size() == 0 && ring.size() == 0;
         }
         bool isOk() const {
             return audioInitialized;
@@ -67,18 +520,51 @@ class AudioThread final : public QObject {
         bool isPaused() const {
             return audioOutput->isPaused();
         }
-        qreal clock() const {
-            return audioClock;
-        }
+        /**
+         * @brief The time is playing, the end of written data minus the data in ring and device
+         * 
+         * @return qreal 
+         */
+        qreal clock() const;
         
         PacketQueue &packetQueue() noexcept {
             return queue;
         }
+        /**
+         * @brief Drop the frames before it after the next flush
+         * 
+         * @param position In seconds
+         */
+        void setSeekTarget(qreal position) {
+            pendingSeekTarget = position;
+        }
+        /**
+         * @brief Drop the decoded data, the position is changed
+         * 
+         */
+        void discardBuffered() {
+            discardRequested = true;
+            wakeDecoder();
+        }
         void pause(bool v);
+        /**
+         * @brief Decode the stream of the next source, the device is reopened only if the format changed
+         * 
+         * @param stream 
+         * @param ctxt The opened decoder, the thread takes it
+         */
+        void replaceStream(AVStream *stream, AVCodecContext *ctxt);
     private:
+        void audioNegotiate();
+        void startDecoder();
+        void stopDecoder();
+        void wakeDecoder();
         void audioCallback(void *data, int datasize);
         int  audioDecodeFrame();
         int  audioResample(int outSamples);
+        int  audioTempo(int size);
+        bool tempoInit(qreal rate);
+        void tempoCleanup();
         void run();
 
         DemuxerThread  *demuxerThread = nullptr;
@@ -86,9 +572,10 @@ class AudioThread final : public QObject {
         AVStream       *stream = nullptr;
 
         AudioOutput    *audioOutput = nullptr;
-        QThread        *decoderThread = nullptr;
+        QThread        *decoderThread = nullptr; //< Decode & resample into the ring
 
         PacketQueue     queue;
+        PcmRing         ring; //< Only copied out by the device callback
 
         // Frame decode to
         AVPtr<AVFrame>       frame {av_frame_alloc()};
@@ -98,25 +585,55 @@ class AudioThread final : public QObject {
         int                  bufferIndex = 0; //< Position in buffer, (in byte)
         int                  bufferSize = 0; //< Size of buffer
         bool                 needResample = false;
+        bool                 needInterleave = false; //< Planar of a supported format
         bool                 audioInitialized = false;
 
+        // Time stretch (atempo), only used when playback rate != 1.0
+        AVFilterGraph       *tempoGraph = nullptr;
+        AVFilterContext     *tempoSource = nullptr;
+        AVFilterContext     *tempoSink = nullptr;
+        AVPtr<AVFrame>       tempoFrame {av_frame_alloc()};
+        AVPtr<uint8_t>       tempoBuffer{ }; //< Buffers of stretched data
+        int                  tempoBufferCapacity = 0;
+        int64_t              tempoSamplesIn = 0;
+        Atomic<qreal>        tempoRate = 1.0; //< Rate of the data in buffer
+        qreal                tempoFailedRate = 0.0; //< Rate we failed to init, donot retry it
+
         AudioSampleFormat    outputSampleFormat{ };
         int                  outputSampleRate{ };
         int                  outputChannels{ };
 
+        // Accurate seek
+        int64_t        seekTarget = AV_NOPTS_VALUE; //< Drop frames before it, in stream time base
+        Atomic<qreal>  pendingSeekTarget = -1.0; //< Take effect at flush, < 0 on none
+
         // Status
         Atomic<bool>   waitting = false;
-        Atomic<qreal>  audioClock = 0.0f;
+        Atomic<bool>   eof = false; //< No more data, the empty ring is not a underrun
+        Atomic<bool>   discardRequested = false;
+        Atomic<qreal>  audioClock = 0.0f; //< Media time of the end of data in the ring
+        Atomic<uint64_t> clockSeq = 0; //< Odd while the ring tail and audioClock are updating, clock() retries on it
+        qreal          bytesPerSecond = 0.0;
+        qreal          deviceLatency = 0.0;
+        bool           deviceFed = false; //< The callback got data once, only touched by the device thread
+
+        // The decoder sleeps on a full ring, the callback only notifies when it is sleeping
+        Atomic<bool>            ringWaitting = false;
+        std::condition_variable ringCond;
+        std::mutex              ringMutex;
 };
 
 class VideoThread final : public QObject {
     Q_OBJECT
     public:
+        static constexpr size_t MaxFrameBuffers = 16; //< Cap of the converted frames ring, even when the sink holds all of them
+        static constexpr int    MinPresentationDepth = 3; //< Queued frames at least on the sink with a presentation queue
+
         VideoThread(DemuxerThread *parent, AVStream *stream, AVCodecContext *ctxt);
         ~VideoThread();
 
         bool idle() const {
-            return waitting;
+            return waitting && (!presentation || presentation->empty());
         }
         bool isPaused() const {
             return paused;
@@ -124,14 +641,55 @@ class VideoThread final : public QObject {
         qreal clock() const {
             return videoClock;
         }
+        uint64_t framesCount() const {
+            return videoFrameCount;
+        }
+        int      decoderThreads() const {
+            return codecCtxt->thread_count;
+        }
+        int      decoderThreadType() const {
+            return codecCtxt->active_thread_type;
+        }
 
         PacketQueue &packetQueue() noexcept {
             return queue;
         }
+        /**
+         * @brief Decode and discard the frames before it after the next flush, without presenting or syncing
+         * 
+         * @param position In seconds
+         */
+        void setSeekTarget(qreal position) {
+            pendingSeekTarget = position;
+        }
+        /**
+         * @brief Don't clear the sink at exit, the next source will replace the frame
+         * 
+         */
+        void setKeepLastFrame(bool v) {
+            keepLastFrame = v;
+        }
+        /**
+         * @brief Drop the frames waiting for the display, like seeking
+         * 
+         */
+        void flushPresentation();
+        /**
+         * @brief Stop giving frames to the renderer, before the clock sources are destroyed
+         * 
+         */
+        void detachPresentation();
         void pause(bool v);
     private:
         bool videoDecodeFrame(AVPacket *packet, AVFrame **ret);
         void videoWriteFrame(AVFrame *source);
+        void videoQueueFrame(AVFrame *source, uint64_t generation, bool immediate);
+        VideoFrame videoConvertFrame(AVFrame *source);
+        bool videoAllocFrames(int width, int height, AVPixelFormat format);
+        int  videoFrameBuffers() const;
+        AVFrame *videoAcquireFrame();
+        void videoUpdateCatchUp(double diff);
+        void videoApplyDiscard();
         void tryHardwareInit();
         void run();
 
@@ -141,15 +699,17 @@ class VideoThread final : public QObject {
 
         VideoSink      *videoSink = nullptr;
         PacketQueue     queue;
+        std::shared_ptr<PresentationQueue> presentation; //< Null on the sink without it
 
         // Thread
         QThread        *presentThread = nullptr; //< for Write frames
 
         // Frame
-        AVPtr<SwsContext> swsCtxt;
+        SwsSlicer      swsSlicer;
         AVPtr<AVFrame> srcFrame {av_frame_alloc()};
-        AVPtr<AVFrame> dstFrame {av_frame_alloc()};
-        std::mutex     dstFrameMutex;
+        std::vector<AVPtr<AVFrame>> dstFrames; //< Ring of converted frames, shared with the sink by ref count
+        size_t         dstFrameIndex = 0; //< Next frame to write in the ring
+        AVPixelFormat  dstFormat = AV_PIX_FMT_NONE;
 
         // Hardware
         AVPtr<AVFrame> swFrame {av_frame_alloc()};
@@ -159,6 +719,18 @@ class VideoThread final : public QObject {
         std::condition_variable cond;
         std::mutex   condMutex;
 
+        // Catch up, skip decoding when we are too slow
+        AVDiscard rateSkipFrame = AVDISCARD_DEFAULT; //< skip_frame wanted by the playback rate
+        AVDiscard seekSkipFrame = AVDISCARD_DEFAULT; //< skip_frame wanted by the accurate seek
+        int     catchUpLevel = 0; //< Index of the discard level
+        int     catchUpLateFrames = 0; //< Continuous late frames
+        int     catchUpSyncFrames = 0; //< Continuous in sync frames
+        int64_t catchUpChangedTime = 0; //< Time of the last level changed
+
+        // Accurate seek
+        int64_t       seekTarget = AV_NOPTS_VALUE; //< Discard frames before it, in stream time base
+        Atomic<qreal> pendingSeekTarget = -1.0; //< Take effect at flush, < 0 on none
+
         // Status
         int64_t videoClockStart = 0; //< Video started time
         double  swsScaleDuration = 0.0; //< prev Swscale take's time
@@ -169,19 +741,136 @@ class VideoThread final : public QObject {
         // Atomoic Status 
         Atomic<bool>   paused = false;
         Atomic<bool>   waitting = false;
+        Atomic<bool>   keepLastFrame = false;
         Atomic<double> videoClock = 0.0f;
         Atomic<uint64_t> videoFrameCount = 0; //< All frames received count
-        Atomic<uint64_t> videoDropedFrameCount = 0; //< Droped frame count
+        Atomic<uint64_t> videoDropedFrameCount = 0; //< Droped frame count (decoded but not presented)
+        int64_t          decoderLag = 0; //< Packets sent to the decoder without a frame out yet
+        int64_t          decoderDelay = 0; //< Max lag out of the catch up, the frames held by the decoder threads and reordering
+};
+
+/**
+ * @brief Subtitle events keyed by the start / end time, for looking up the text and bitmaps at a clock
+ * 
+ * Sorted by the start, with a implicit tree of the max end over it, 
+ * so the lookup is O(log n + k) for the k events on the screen. Only used by one thread.
+ */
+class SubtitleIndex final {
+    public:
+        static constexpr double FallbackDuration = 5.0; //< Used when the event has no end and no next event
+
+        struct Entry {
+            double  start; //< In seconds
+            double  end; //< Exclusive, infinity on unknown (closed by the next empty subtitle)
+            double  shownEnd; //< The end, or until the next event when unknown, computed by rebuild
+            QString text;
+            QList<SubtitleImage> images; //< Bitmap rects, converted to RGBA
+        };
+
+        void clear();
+        /**
+         * @brief Add the events of a decoded subtitle, the bitmap rects are converted to RGBA here
+         * 
+         * A subtitle without rects ends the events of unknown end before it (like PGS).
+         * @param packet The packet of the subtitle
+         * @param timeBase The time base of the packet
+         * @param canvasSize The picture size of the bitmap rects, invalid on the video size
+         */
+        void add(const AVSubtitle &subtitle, const AVPacket *packet, AVRational timeBase, QSize canvasSize = QSize());
+        void add(Entry entry);
+        /**
+         * @brief Drop the bitmap events ended before the time, they are decoded again after seeking back
+         * 
+         */
+        void prune(double before);
+        /**
+         * @brief Get the text on the screen at the time, the events are joined by new line
+         * 
+         * @param time The clock in seconds
+         * @param next Set to the next time the text changes, infinity on never
+         * @param images Set to the bitmaps on the screen, could be nullptr
+         * @return QString empty on no events
+         */
+        QString lookup(double time, double *next, QList<SubtitleImage> *images = nullptr);
+        size_t  size() const noexcept {
+            return entries.size();
+        }
+    private:
+        void rebuild();
+        void collect(size_t node, size_t lo, size_t hi, size_t limit, double time, std::vector<size_t> &out) const;
+
+        std::vector<Entry>  entries; //< Sorted by start after rebuild
+        std::vector<double> maxEnd; //< Implicit tree, leaves at [leaves, 2 * leaves)
+        size_t              leaves = 0;
+        bool                dirty = false;
 };
 
+class SubtitleThread;
+
+/**
+ * @brief Demux and decode a whole text subtitle stream once in background
+ * 
+ * It opens the source again, so the player's demuxer is never blocked.
+ */
+class SubtitleScanner final : public QThread {
+    public:
+        /**
+         * @param url The source to open
+         * @param streamIndex The stream to scan, -1 for the best subtitle stream (like a external file)
+         */
+        SubtitleScanner(SubtitleThread *notify, const QUrl &url, int streamIndex);
+        ~SubtitleScanner();
+
+        void cancel() {
+            cancelled = true;
+        }
+        bool isDone() const noexcept {
+            return done;
+        }
+        /**
+         * @brief Move the result out, only valid when done
+         * 
+         * @return true on the whole stream was scanned
+         */
+        bool take(SubtitleIndex &index);
+    private:
+        void run() override;
+        bool scan();
+
+        SubtitleThread  *notify = nullptr;
+        QUrl             sourceUrl;
+        int              streamIndex = -1;
+
+        SubtitleIndex    index;
+        bool             succeed = false;
+        Atomic<bool>     cancelled = false;
+        Atomic<bool>     done = false;
+};
+
+/**
+ * @brief Show the subtitle text at the clock, from a SubtitleIndex
+ * 
+ * Text streams are scanned once in background (embedded in local sources, or an external file), 
+ * before it is done the events are decoded from the packet queue. Bitmap streams are always decoded
+ * from the packet queue, their rects are converted to RGBA once and sent to the sink as SubtitleImage. It only wakes at the next change of the text,
+ * or when someone calls wakeUp.
+ */
 class SubtitleThread final : public QThread {
     Q_OBJECT
     public:
-        SubtitleThread(DemuxerThread *parent, AVStream *stream, AVCodecContext *ctxt);
+        static constexpr auto MaxWait = 500ms; //< Follow the clock drift when waiting for a far event
+        static constexpr double BitmapKeepDuration = 60.0; //< Seconds of the bitmap events kept behind the clock
+        static constexpr size_t QueueCapacity = 1024; //< Subtitle is sparse, the packets over it are dropped instead of blocking the demuxer
+
+        /**
+         * @param stream The embedded stream, nullptr on only external files
+         * @param ctxt The decoder of the stream, took by it
+         * @param scanSource The url to scan the embedded stream, empty on it can not be opened twice
+         */
+        SubtitleThread(DemuxerThread *parent, AVStream *stream, AVCodecContext *ctxt, const QUrl &scanSource);
         ~SubtitleThread();
 
         bool idle() const {
-            // return waitting;
             return queue.size() == 0;
         }
         bool isPaused() const {
@@ -191,26 +880,328 @@ class SubtitleThread final : public QThread {
             return queue;
         }
         void pause(bool v);
+        /**
+         * @brief Switch to the embedded stream, it is applied by the worker, the caller never waits
+         * 
+         */
         void switchStream(AVStream *stream);
+        /**
+         * @brief Use a external subtitle file instead of the embedded stream, empty to go back
+         * 
+         */
+        void setExternalSource(const QUrl &url);
+        /**
+         * @brief Look up the text again, like after seeking
+         * 
+         */
         void refresh();
+        /**
+         * @brief Wake the worker, thread safe
+         * 
+         */
+        void wakeUp();
     private:
         void run() override;
+        void applyRequests();
+        void restartIndex();
+        void startScan(const QUrl &url, int streamIndex);
+        void decodePacket(AVPacket *packet);
+        void showText(const QString &text);
+        void showImages(const QList<SubtitleImage> &images);
 
         DemuxerThread  *demuxerThread = nullptr;
-        AVCodecContext *codecCtxt = nullptr;
+        AVCodecContext *codecCtxt = nullptr; //< Only touched by the worker after constructed
         AVStream       *stream = nullptr;
+        QUrl            scanSource;
 
         VideoSink      *videoSink = nullptr;
-        PacketQueue     queue;        
+        PacketQueue     queue;
 
-        // Sync 
+        // Worker
+        SubtitleIndex   index; //< From the scanner, or the packets before the scan is done
+        bool            indexComplete = false;
+        QUrl            externalSource;
+        QString         currentText;
+        QList<qint64>   currentImages; //< Cache keys of the shown images
+        std::unique_ptr<SubtitleScanner> scanner;
+
+        // Sync, the requests are protected by condMutex
         std::condition_variable cond;
         std::mutex   condMutex;
+        bool         notified = false;
+        AVStream    *requestedStream = nullptr;
+        QUrl         requestedExternal;
+        bool         hasExternalRequest = false;
         Atomic<bool> paused = false;
-        Atomic<bool> waitting = false;
-        Atomic<bool> reqRefresh = false;
+};
 
-        Atomic<double> subtitleClock = 0.0;
+/**
+ * @brief Stages of the startup timeline, indexed the array in MediaPlayerPrivate
+ * 
+ */
+enum class StartupStage {
+    Resolve,
+    OpenInput,
+    FindStreamInfo,
+    CodecOpen,
+    FirstAudioPacket,
+    FirstVideoPacket,
+    FirstSubtitlePacket,
+    FirstDecodedFrame,
+    FirstPresentedFrame,
+    FirstAudioCallback,
+    Count,
+};
+
+/**
+ * @brief Open the next source in background and prefill its packets, for the gapless playback
+ * 
+ * The demuxer takes the opened context and the packets when the current source ends,
+ * or when the player loads the same url.
+ */
+class Preloader final : public QThread {
+    public:
+        static constexpr int    MaxPackets = 4096;
+        static constexpr double MaxDuration = 10.0; //< Seconds of the prefilled packets
+
+        Preloader(const QUrl &url, AVDictionary *options, AVInputFormat *inputFormat, int64_t memoryBudget);
+        ~Preloader();
+
+        /**
+         * @brief Stop it, the result is discarded
+         * 
+         */
+        void cancel() {
+            cancelled = true;
+        }
+        bool isReady() const noexcept {
+            return ready;
+        }
+        QUrl url() const {
+            return sourceUrl;
+        }
+        /**
+         * @brief Take the opened context and the packets, only valid when ready
+         * 
+         * @param packets The prefilled packets in the demuxing order
+         * @return AVFormatContext* 
+         */
+        AVFormatContext *take(std::vector<AVPacket*> &packets);
+        
+        int audioStream = -1;
+        int videoStream = -1;
+        int subtitleStream = -1;
+    private:
+        void run() override;
+
+        QUrl             sourceUrl;
+        AVDictionary    *options = nullptr; //< Copied from the player
+        AVInputFormat   *inputFormat = nullptr;
+        int64_t          memoryBudget = 0;
+
+        AVFormatContext *formatCtxt = nullptr;
+        std::vector<AVPacket*> packets;
+        int64_t          packetsBytes = 0;
+
+        Atomic<bool>     cancelled = false;
+        Atomic<bool>     ready = false;
+};
+
+/**
+ * @brief Where the ReadAheadIO reads from, only used by its I/O thread after created
+ * 
+ */
+class ByteSource {
+    public:
+        virtual ~ByteSource() = default;
+        /**
+         * @brief Read at most size bytes
+         * 
+         * @return int The bytes read, AVERROR_EOF on the end, other AVERROR on error
+         */
+        virtual int     read(uint8_t *buf, int size) = 0;
+        virtual bool    seek(int64_t pos) = 0;
+        /**
+         * @return int64_t The total size, -1 on unknown
+         */
+        virtual int64_t size() = 0;
+        virtual bool    isSeekable() const = 0;
+        /**
+         * @brief Abort the blocking read, thread safe
+         * 
+         */
+        virtual void    cancel() { }
+
+        static auto fromDevice(QIODevice *device) -> std::unique_ptr<ByteSource>;
+        /**
+         * @brief Open the url by the ffmpeg protocols (like http)
+         * 
+         * @param options Protocol options, the source takes a copy
+         * @param interrupt Only used when opening
+         * @param errcode Set on failure
+         */
+        static auto open(const QUrl &url, const AVDictionary *options, AVIOInterruptCB interrupt, int *errcode) -> std::unique_ptr<ByteSource>;
+};
+
+/**
+ * @brief Read ahead of the demuxer in a I/O thread, into a ring buffer
+ * 
+ * The ring keeps a quarter of it behind the read position, so the seeks in the window are served from memory.
+ */
+class ReadAheadIO final : public QThread {
+    public:
+        static constexpr int64_t MinBufferSize = 2 * 1024 * 1024;
+        static constexpr int     ChunkSize = 64 * 1024; //< Max bytes of a source read
+        static constexpr int     AVIOBufferSize = 32 * 1024;
+
+        ReadAheadIO(std::unique_ptr<ByteSource> source, int64_t bufferSize);
+        ~ReadAheadIO();
+
+        /**
+         * @brief Get the context for AVFormatContext::pb, owned by us
+         * 
+         */
+        AVIOContext *context() const noexcept {
+            return ioCtxt;
+        }
+        /**
+         * @brief Set the interrupt checked when the reader waits for data, the demuxer's one
+         * 
+         */
+        void    setInterruptCallback(AVIOInterruptCB cb) {
+            interrupt = cb;
+        }
+        /**
+         * @brief Bytes read from the source, for the throughput
+         * 
+         */
+        int64_t fetchedBytes() const noexcept {
+            return fetched;
+        }
+        /**
+         * @brief Microseconds spent in reading the source, it is idle when the buffer is full
+         * 
+         */
+        int64_t fetchTime() const noexcept {
+            return fetchDuration;
+        }
+        int64_t bufferedBytes() const;
+        quint64 memorySeekCount() const noexcept {
+            return memorySeeks;
+        }
+    private:
+        void    run() override;
+        int     read(uint8_t *buf, int size);
+        int64_t seek(int64_t offset, int whence);
+
+        std::unique_ptr<ByteSource> source;
+        std::unique_ptr<uint8_t[]>  ring;
+        int64_t          capacity = 0;
+        int64_t          backKeep = 0; //< Bytes kept behind the read position
+        int64_t          totalSize = -1;
+        bool             seekable = false;
+        AVIOContext     *ioCtxt = nullptr;
+        AVIOInterruptCB  interrupt {nullptr, nullptr};
+
+        // Protected by mutex
+        mutable std::mutex      mutex;
+        std::condition_variable dataCond; //< Reader waits for data
+        std::condition_variable spaceCond; //< I/O thread waits for space or seek
+        int64_t          windowStart = 0; //< Bytes of [windowStart, windowEnd) are in the ring
+        int64_t          windowEnd = 0;
+        int64_t          readPos = 0;
+        uint64_t         generation = 0; //< Changed by each seek out of the window
+        bool             seekPending = false;
+        bool             eof = false;
+        int              error = 0;
+        bool             quit = false;
+
+        Atomic<int64_t>  fetched = 0;
+        Atomic<int64_t>  fetchDuration = 0;
+        Atomic<quint64>  memorySeeks = 0;
+};
+
+/**
+ * @brief Byte range cache of the streamed sources on the disk, shared by all players
+ * 
+ * Each source is a sparse data file and a meta file of the fetched ranges, keyed by the url without its signing
+ * query items (or a key from the caller), the fetched ranges are served from the disk once the upstream has the cached
+ * size and the same bytes at the first range, only the holes go to the network.
+ * The sources are evicted by last use when the total of the fetched ranges is over the max size.
+ */
+class DiskCache final {
+    public:
+        using Opener = std::function<std::unique_ptr<ByteSource>(int *errcode)>;
+        using Ranges = std::map<int64_t, int64_t>; //< Begin to end of the fetched ranges, not overlapped
+        static constexpr int64_t DefaultMaxSize = 1024ll * 1024 * 1024;
+        static constexpr int64_t MinSourceSize = 1024 * 1024; //< Smaller ones (like playlists) may change, not cached
+        static constexpr int64_t FingerprintSize = 64 * 1024; //< Bytes compared with the upstream before serving a cached source
+        static constexpr quint32 MetaMagic = 0x4E4B4343; //< NKCC
+        static constexpr quint32 MetaVersion = 1;
+
+        static DiskCache &instance();
+
+        /**
+         * @brief Set the directory and max size, empty dir or 0 on disable
+         * 
+         */
+        void configure(const QString &dir, int64_t maxSize);
+        /**
+         * @brief Open the url through the cache, the opener is called at once,
+         * a cached url is served only if the opened upstream still has the cached size and the same head of the first range
+         * 
+         * @param key Identify the content, empty on keyOf(url)
+         * @param errcode Set on failure
+         * @return nullptr on failure, the source from opener if it cannot be cached (like not seekable)
+         */
+        auto open(const QUrl &url, const QString &key, Opener opener, int *errcode) -> std::unique_ptr<ByteSource>;
+        /**
+         * @brief Get the bytes of the fetched ranges of all sources
+         * 
+         */
+        int64_t usedBytes();
+
+        /**
+         * @brief Get the url as the key, the query items signing the url (like Expires, X-Amz-Signature) are dropped,
+         * they change on each fetch of the same content, the other ones may identify it (like ?id=)
+         * 
+         */
+        static QString keyOf(const QUrl &url);
+        /**
+         * @brief Add [begin, end) to the ranges, merge the overlapped or adjacent ones
+         * 
+         */
+        static void    addRange(Ranges &ranges, int64_t begin, int64_t end);
+        static int64_t rangesBytes(const Ranges &ranges);
+        /**
+         * @brief Read the meta file of a source
+         * 
+         * @return false on broken or not exists
+         */
+        static bool    loadMeta(const QString &path, int64_t *size, Ranges *ranges);
+        static bool    saveMeta(const QString &path, int64_t size, const Ranges &ranges);
+    private:
+        struct Item {
+            int64_t bytes = 0; //< Bytes in the fetched ranges
+            int64_t lastUse = 0; //< Msecs since epoch
+        };
+
+        void scan();
+        void trim();
+        void release(const QString &key, int64_t bytes);
+        void account(const QString &key, int64_t bytes);
+
+        std::mutex                 mutex;
+        QString                    directory;
+        int64_t                    maxSize = DefaultMaxSize;
+        bool                       configured = false;
+        bool                       scanned = false;
+        std::map<QString, Item>    items;
+        std::set<QString>          inUse; //< Opened keys, not evicted
+        int64_t                    totalBytes = 0;
+        int64_t                    untrimmedBytes = 0; //< Bytes written since last trim
+
+    friend class CachedByteSource;
 };
 
 class DemuxerThread final : public QThread {
@@ -231,6 +1222,11 @@ class DemuxerThread final : public QThread {
         void wakeUp();
         void requestSeek(qreal position);
         void requestSwitchStream(int stream);
+        /**
+         * @brief Apply the subtitle file of the player
+         * 
+         */
+        void requestSubtitleFile();
         void doPause(bool v);
 
         /**
@@ -240,12 +1236,23 @@ class DemuxerThread final : public QThread {
          */
         qreal clock() const;
         qreal position() const;
+        qreal playbackRate() const noexcept;
         qreal bufferedDuration() const;
         float bufferProgress() const;
 
         AVFormatContext *formatContext() const noexcept {
             return formatCtxt;
         }
+        VideoThread     *videoWorker() const noexcept {
+            return videoThread;
+        }
+        int              activeDecoderThreads(StreamType type) const noexcept {
+            return activeThreads[int(type)];
+        }
+        PacketPool      *packetPool() const noexcept;
+        PlaybackCounters *counters() const noexcept;
+        int              videoFrameBuffers() const noexcept;
+        bool             isFreeRunning() const noexcept;
         AudioOutput     *audioOutput() const noexcept;
         VideoSink       *videoSink() const  noexcept;
     Q_SIGNALS:
@@ -255,36 +1262,75 @@ class DemuxerThread final : public QThread {
         void ffmpegPositionChanged(qreal pos);
         void ffmpegErrorOccurred(int avcode);
         void ffmpegMediaLoaded();
+        void ffmpegSeekFinished(qreal position, qreal milliseconds);
+        void ffmpegSourceChanged(const QUrl &url);
+    public:
+        /**
+         * @brief Called by the worker when the first frame after seek is ready, thread safe
+         * 
+         * @param position The position of the frame
+         */
+        void seekFinished(qreal position);
+        /**
+         * @brief Record a stage of the startup timeline, thread safe
+         * 
+         */
+        void markStartup(StartupStage stage);
     private:
         bool load();
+        Preloader *takePreloader(bool anySource);
+        bool adoptPreloaded(Preloader *preloader);
+        void prepareBuffering(); //< With settingsMutex held
+        bool handoverPreloaded();
+        void dispatchPacket(AVPacket *pak);
+        void cleanupWorkers(bool keepLastFrame);
         bool prepareWorker();
+        void buildKeyframeIndex();
+        void applySubtitleFile();
         bool prepareCodec(int stream);
+        bool prepareReadAhead();
+        int64_t fetchedBytes() const;
+        int  decoderThreadsFor(AVStream *stream) const;
         bool sendError(int avcode);
         bool runDemuxer();
         bool readFrame(int *eof);
-        bool tooMuchPackets() const;
-        bool tooLessPackets() const;
-        bool hasEnoughPackets() const;
+        bool tooMuchBuffered() const;
+        bool seekMissedInQueue();
+        bool tooLessBuffered() const;
+        bool hasEnoughBuffered() const;
+        auto bufferStatus() const -> BufferStatus;
+        void doUpdateThroughput();
         bool waitForEvent(std::chrono::milliseconds ms);
         bool isPictureStream(int idx) const;
         void doUpdateClock();
+        void doUpdateStatistics();
+        void publishMetadata();
+        void doUpdatePlaybackRate();
         bool doSeek();
         int  interruptHandler();
 
-        AVIOContext     *ioCtxt = nullptr; //< Custom IO Context
+        std::unique_ptr<ReadAheadIO> readAhead; //< Custom IO of the device or network source, closed after formatCtxt
         AVFormatContext *formatCtxt = nullptr; //< Container of format context
         AVPacket        *packet = nullptr; //< Allocated packet
 
         MediaPlayerPrivate *player = nullptr; //< Player of the manager
 
         AudioThread        *audioThread = nullptr;
+        AudioThread        *handoverAudioThread = nullptr; //< Kept by the handover with the device open, taken by the next audio stream
         VideoThread        *videoThread = nullptr;
         SubtitleThread     *subtitleThread = nullptr;
+        Atomic<int>         activeThreads[3] = {0, 0, 0}; //< Decoder threads in use, indexed by StreamType
+
+        KeyframeIndex       keyframeIndex; //< Of the video stream
+        Atomic<int64_t>     seekBeginTime = 0; //< Time of the seek requested
 
         QObject            *invokeHelper = nullptr;
+        std::vector<AVPacket*> preloadedPackets; //< Dispatched after the workers are ready
 
         int                 errcode = 0;
         bool                quit = false;
+        bool                atEnd = false; //< Quit because of the end of media
+        Atomic<bool>        destroying = false; //< Quit by user, don't hand over
         bool                hasSeek = false;
         bool                isReading = false;
         bool                wakeupOnce = false; //< When call wakeup, set it to true, and clear in InterruptHandler
@@ -294,15 +1340,17 @@ class DemuxerThread final : public QThread {
 
         int64_t             externalClockStart = 0;
         qreal               externalClock = 0.0; //< External clock
-
-        uint8_t            *ioBuffer = nullptr;
-        int                 ioBufferSize = 0;
+        qreal               externalClockRate = 1.0; //< Playback rate of the external clock
 
         // Buffering     
-        int                 bufferedPacketsLimit = 4000;
-        int                 bufferedPacketsLessThreshold = 50;
-        int                 bufferedPacketsEnough = 100;
+        std::shared_ptr<BufferingPolicy> policy; //< Copied from player at load, keep it alive for the state
+        std::unique_ptr<BufferingState>  buffering; //< State of current source, replaced under bufferingMutex
+        mutable std::mutex  bufferingMutex; //< Only the player thread reading needs it, the demuxer thread owns the state
         float               prevBufferProgress = 0.0f;
+        int64_t             throughputSampleTime = 0; //< Begin time of current throughput sample
+        int64_t             throughputSampleBytes = 0; //< Fetched bytes at the begin of sample
+        int64_t             throughputSampleBusy = 0; //< Reading time at the begin of sample
+        int64_t             readDuration = 0; //< Time in av_read_frame, the reading time without read ahead
         int64_t             prevTooLessPacketsTime = 0; //< Previous buffer data not enough time
 
         // Stream info
@@ -320,7 +1368,7 @@ class MediaPlayerPrivate final : public QObject {
         using Loops = MediaPlayer::Loops;
         using Error = MediaPlayer::Error;
 
-        MediaPlayerPrivate(MediaPlayer *player) : player(player) { }
+        MediaPlayerPrivate(MediaPlayer *player);
         ~MediaPlayerPrivate();
 
         AVFormatContext *formatContext() const noexcept {
@@ -342,7 +1390,9 @@ class MediaPlayerPrivate final : public QObject {
 
         // Begin settingsMutex protect
         QUrl          url; //< Player Url
+        QString       cacheKey; //< Of the url in the disk cache, empty on derived from the url
         QIODevice    *ioDevice; //< IODevice for playback
+        QUrl          subtitleFile; //< External subtitle file, empty on the embedded stream
         AVDictionary *options = nullptr;
         AVInputFormat *inputFormat = nullptr; //< User custom input format
 
@@ -353,9 +1403,64 @@ class MediaPlayerPrivate final : public QObject {
         int           loops = Loops::Once;
 
         // End 
+        Atomic<qreal> playbackRate = 1.0; //< Read by the worker threads
+        Atomic<int>   videoFrameBuffers = 3; //< Size of the converted frames ring
+        Atomic<bool>  freeRunning = false; //< No sync, for benchmarks
+        Atomic<int64_t> readAheadSize = 16 * 1024 * 1024; //< Of the device and http sources, 0 on only devices
+        Atomic<int>   decoderThreads[3] = {1, 0, 1}; //< Indexed by StreamType, 0 on auto
+        Atomic<DecoderThreadType> decoderThreadType[3] = {DecoderThreadType::Auto, DecoderThreadType::Auto, DecoderThreadType::Auto};
         AudioOutput  *audioOutput = nullptr;
         VideoSink    *videoSink = nullptr;
 
+        PacketPool    packetPool; //< Shared by all demuxers of this player
+        PlaybackCounters counters;
+        QTimer        statisticsTimer; //< Emit statisticsUpdated when playing
+
+        std::shared_ptr<BufferingPolicy> bufferingPolicy = std::make_shared<AdaptiveBufferingPolicy>(); //< Guarded by settingsMutex
+
+        static constexpr qreal  PreloadKeepDistance = 60.0; //< Cancel the preload if seek farther from the end
+
+        std::mutex              preloadMutex; //< Protect the preloader, the demuxer may take it
+        Preloader              *preloader = nullptr;
+        Atomic<int64_t>         preloadMemoryBudget = 32 * 1024 * 1024;
+
+        /**
+         * @brief Begin a new startup timeline, time is from av_gettime_relative
+         * 
+         * @param origin The beginning of the load
+         * @param resolved The time the url resolved, AV_NOPTS_VALUE on unknown
+         */
+        void startupReset(int64_t origin, int64_t resolved);
+        /**
+         * @brief Begin the timeline at setSource, from beginStartupTimeline if it was called
+         * 
+         */
+        void startupBeginLoad();
+        /**
+         * @brief Reset the statistics counters for a new load
+         * 
+         */
+        void resetCounters();
+        /**
+         * @brief Record a stage of the startup timeline, only the first one counts, thread safe
+         * 
+         */
+        void startupMark(StartupStage stage);
+        /**
+         * @brief Tell which stages complete the timeline, called when the decoders are opened
+         * 
+         */
+        void startupExpect(bool audio, bool video);
+        auto startupTimeline() const -> StartupTimeline;
+
+        Atomic<int64_t>         startupPendingBegin = AV_NOPTS_VALUE; //< Set by beginStartupTimeline, used by next setSource
+        Atomic<int64_t>         startupOrigin = 0;
+        Atomic<int64_t>         startupStages[int(StartupStage::Count)];
+        Atomic<bool>            startupExpectAudio = false;
+        Atomic<bool>            startupExpectVideo = false;
+        Atomic<bool>            startupReported = false;
+        QUrl                    startupSource; //< Only touched in the player thread
+
         MediaPlayer  *player = nullptr;
         DemuxerThread *demuxerThread = nullptr;
 
@@ -369,6 +1474,10 @@ class MediaPlayerPrivate final : public QObject {
         void demuxerErrorOccurred(int errcode);
         void demuxerPositionChanged(qreal pos);
         void demuxerMediaLoaded();
+        void demuxerSeekFinished(qreal position, qreal milliseconds);
+        void demuxerSourceChanged(const QUrl &url);
+        void startupFinished();
+        void statisticsTimeout();
         void updateMediaInfo();
     friend class MediaPlayer;
 };
@@ -385,16 +1494,43 @@ class VideoFramePrivate final {
         AVPtr<AVFrame> frame;
 };
 
+inline PacketPool  *DemuxerThread::packetPool() const noexcept {
+    return &player->packetPool;
+}
+inline PlaybackCounters *DemuxerThread::counters() const noexcept {
+    return &player->counters;
+}
+inline int          DemuxerThread::videoFrameBuffers() const noexcept {
+    return player->videoFrameBuffers;
+}
+inline bool         DemuxerThread::isFreeRunning() const noexcept {
+    return player->freeRunning;
+}
+inline qreal        DemuxerThread::playbackRate() const noexcept {
+    return player->playbackRate;
+}
 inline AudioOutput *DemuxerThread::audioOutput() const noexcept {
     return player->audioOutput;
 }
 inline VideoSink   *DemuxerThread::videoSink() const  noexcept {
     return player->videoSink;
 }
+inline void         DemuxerThread::markStartup(StartupStage stage) {
+    player->startupMark(stage);
+}
 
 inline bool    IsSpecialPacket(AVPacket *pak) noexcept {
     return pak == EofPacket || pak == FlushPacket || pak == SyncPacket;
 }
+inline AVSampleFormat ToAVSampleFormat(AudioSampleFormat fmt) {
+    switch (fmt) {
+        case AudioSampleFormat::Uint8 : return AV_SAMPLE_FMT_U8;
+        case AudioSampleFormat::Sint16 : return AV_SAMPLE_FMT_S16;
+        case AudioSampleFormat::Sint32 : return AV_SAMPLE_FMT_S32;
+        case AudioSampleFormat::Float32 : return AV_SAMPLE_FMT_FLT;
+        default : return AV_SAMPLE_FMT_NONE;
+    }
+}
 inline AVPixelFormat ToAVPixelFormat(VideoPixelFormat fmt) {
     switch (fmt) {
         case VideoPixelFormat::RGBA32 : return AV_PIX_FMT_RGBA;
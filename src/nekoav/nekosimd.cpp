@@ -0,0 +1,313 @@
+#include "nekosimd.hpp"
+#include <QDebug>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(_M_X64)
+    #define NEKOAV_X86
+    #include <immintrin.h>
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+        #define NEKOAV_TARGET_AVX2
+    #else
+        #define NEKOAV_TARGET_AVX2 __attribute__((target("avx2")))
+    #endif
+#endif
+
+namespace NekoAV {
+
+// Scalar Part, also used for the tails of the vectorized ones
+static void GainF32Scalar(float *dst, const float *src, size_t n, float gain) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = std::clamp(src[i] * gain, -1.0f, 1.0f);
+    }
+}
+static void GainS16Scalar(int16_t *dst, const int16_t *src, size_t n, float gain) {
+    for (size_t i = 0; i < n; i++) {
+        long v = std::lrint(src[i] * gain);
+        dst[i] = int16_t(std::clamp<long>(v, INT16_MIN, INT16_MAX));
+    }
+}
+static void GainS32Scalar(int32_t *dst, const int32_t *src, size_t n, float gain) {
+    // Float has only 24 bits mantissa, use double to keep the low bits
+    for (size_t i = 0; i < n; i++) {
+        long long v = std::llrint(double(src[i]) * gain);
+        dst[i] = int32_t(std::clamp<long long>(v, INT32_MIN, INT32_MAX));
+    }
+}
+static void GainU8Scalar(uint8_t *dst, const uint8_t *src, size_t n, float gain) {
+    // Unsigned, 128 is the silence
+    for (size_t i = 0; i < n; i++) {
+        long v = 128 + std::lrint((int(src[i]) - 128) * gain);
+        dst[i] = uint8_t(std::clamp<long>(v, 0, 255));
+    }
+}
+template <typename T>
+static void InterleaveScalar(void *dst, const uint8_t * const *src, int channels, size_t samples) {
+    T *out = static_cast<T*>(dst);
+    for (int c = 0; c < channels; c++) {
+        const T *in = reinterpret_cast<const T*>(src[c]);
+        T *o = out + c;
+        for (size_t i = 0; i < samples; i++) {
+            o[i * channels] = in[i];
+        }
+    }
+}
+// Convert the tail from the sample offset
+template <typename T>
+static void InterleaveTail(void *dst, const uint8_t * const *src, int channels, size_t offset, size_t samples) {
+    if (offset >= samples) {
+        return;
+    }
+    const uint8_t *planes[8];
+    for (int c = 0; c < channels; c++) {
+        planes[c] = src[c] + offset * sizeof(T);
+    }
+    InterleaveScalar<T>(static_cast<T*>(dst) + offset * channels, planes, channels, samples - offset);
+}
+
+#if defined(NEKOAV_X86)
+
+// SSE2 Part, always there on x86_64
+static void GainF32SSE2(float *dst, const float *src, size_t n, float gain) {
+    __m128 g = _mm_set1_ps(gain);
+    __m128 lo = _mm_set1_ps(-1.0f);
+    __m128 hi = _mm_set1_ps(1.0f);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_mul_ps(_mm_loadu_ps(src + i), g);
+        v = _mm_min_ps(_mm_max_ps(v, lo), hi);
+        _mm_storeu_ps(dst + i, v);
+    }
+    GainF32Scalar(dst + i, src + i, n - i, gain);
+}
+static void GainS16SSE2(int16_t *dst, const int16_t *src, size_t n, float gain) {
+    __m128 g = _mm_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        // Sign extend to 32 bits
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        __m128 flo = _mm_mul_ps(_mm_cvtepi32_ps(lo), g);
+        __m128 fhi = _mm_mul_ps(_mm_cvtepi32_ps(hi), g);
+        // Pack with saturation, it is the clipping
+        __m128i r = _mm_packs_epi32(_mm_cvtps_epi32(flo), _mm_cvtps_epi32(fhi));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), r);
+    }
+    GainS16Scalar(dst + i, src + i, n - i, gain);
+}
+static void Interleave32SSE2(void *dst, const uint8_t * const *src, int channels, size_t samples) {
+    if (channels != 2) {
+        InterleaveScalar<float>(dst, src, channels, samples);
+        return;
+    }
+    auto l = reinterpret_cast<const float*>(src[0]);
+    auto r = reinterpret_cast<const float*>(src[1]);
+    auto out = static_cast<float*>(dst);
+    size_t i = 0;
+    for (; i + 4 <= samples; i += 4) {
+        __m128 vl = _mm_loadu_ps(l + i);
+        __m128 vr = _mm_loadu_ps(r + i);
+        _mm_storeu_ps(out + i * 2, _mm_unpacklo_ps(vl, vr));
+        _mm_storeu_ps(out + i * 2 + 4, _mm_unpackhi_ps(vl, vr));
+    }
+    InterleaveTail<float>(dst, src, channels, i, samples);
+}
+static void Interleave16SSE2(void *dst, const uint8_t * const *src, int channels, size_t samples) {
+    if (channels != 2) {
+        InterleaveScalar<int16_t>(dst, src, channels, samples);
+        return;
+    }
+    auto l = reinterpret_cast<const int16_t*>(src[0]);
+    auto r = reinterpret_cast<const int16_t*>(src[1]);
+    auto out = static_cast<int16_t*>(dst);
+    size_t i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        __m128i vl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(l + i));
+        __m128i vr = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 2), _mm_unpacklo_epi16(vl, vr));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 2 + 8), _mm_unpackhi_epi16(vl, vr));
+    }
+    InterleaveTail<int16_t>(dst, src, channels, i, samples);
+}
+
+// AVX2 Part, selected at runtime
+NEKOAV_TARGET_AVX2
+static void GainF32AVX2(float *dst, const float *src, size_t n, float gain) {
+    __m256 g = _mm256_set1_ps(gain);
+    __m256 lo = _mm256_set1_ps(-1.0f);
+    __m256 hi = _mm256_set1_ps(1.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = _mm256_mul_ps(_mm256_loadu_ps(src + i), g);
+        v = _mm256_min_ps(_mm256_max_ps(v, lo), hi);
+        _mm256_storeu_ps(dst + i, v);
+    }
+    GainF32Scalar(dst + i, src + i, n - i, gain);
+}
+NEKOAV_TARGET_AVX2
+static void GainS16AVX2(int16_t *dst, const int16_t *src, size_t n, float gain) {
+    __m256 g = _mm256_set1_ps(gain);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i lo = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        __m256i hi = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 8)));
+        __m256 flo = _mm256_mul_ps(_mm256_cvtepi32_ps(lo), g);
+        __m256 fhi = _mm256_mul_ps(_mm256_cvtepi32_ps(hi), g);
+        // Pack works in 128 bits lanes, fix the order after it
+        __m256i r = _mm256_packs_epi32(_mm256_cvtps_epi32(flo), _mm256_cvtps_epi32(fhi));
+        r = _mm256_permute4x64_epi64(r, 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), r);
+    }
+    GainS16Scalar(dst + i, src + i, n - i, gain);
+}
+NEKOAV_TARGET_AVX2
+static void Interleave32AVX2(void *dst, const uint8_t * const *src, int channels, size_t samples) {
+    auto out = static_cast<float*>(dst);
+    size_t i = 0;
+    if (channels == 2) {
+        auto l = reinterpret_cast<const float*>(src[0]);
+        auto r = reinterpret_cast<const float*>(src[1]);
+        for (; i + 8 <= samples; i += 8) {
+            __m256 vl = _mm256_loadu_ps(l + i);
+            __m256 vr = _mm256_loadu_ps(r + i);
+            __m256 lo = _mm256_unpacklo_ps(vl, vr); //< l0 r0 l1 r1 | l4 r4 l5 r5
+            __m256 hi = _mm256_unpackhi_ps(vl, vr); //< l2 r2 l3 r3 | l6 r6 l7 r7
+            _mm256_storeu_ps(out + i * 2, _mm256_permute2f128_ps(lo, hi, 0x20));
+            _mm256_storeu_ps(out + i * 2 + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+        }
+    }
+    else if (channels == 8) {
+        // 7.1, transpose 8 channels x 8 samples
+        const float *p[8];
+        for (int c = 0; c < 8; c++) {
+            p[c] = reinterpret_cast<const float*>(src[c]);
+        }
+        for (; i + 8 <= samples; i += 8) {
+            __m256 r0 = _mm256_loadu_ps(p[0] + i), r1 = _mm256_loadu_ps(p[1] + i);
+            __m256 r2 = _mm256_loadu_ps(p[2] + i), r3 = _mm256_loadu_ps(p[3] + i);
+            __m256 r4 = _mm256_loadu_ps(p[4] + i), r5 = _mm256_loadu_ps(p[5] + i);
+            __m256 r6 = _mm256_loadu_ps(p[6] + i), r7 = _mm256_loadu_ps(p[7] + i);
+
+            __m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpackhi_ps(r0, r1);
+            __m256 t2 = _mm256_unpacklo_ps(r2, r3), t3 = _mm256_unpackhi_ps(r2, r3);
+            __m256 t4 = _mm256_unpacklo_ps(r4, r5), t5 = _mm256_unpackhi_ps(r4, r5);
+            __m256 t6 = _mm256_unpacklo_ps(r6, r7), t7 = _mm256_unpackhi_ps(r6, r7);
+
+            // Sample k of channel 0 - 3 | sample k + 4 of channel 0 - 3
+            __m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+            __m256 s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+            __m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+            __m256 s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+            __m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+            __m256 s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+            __m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+            __m256 s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+            float *o = out + i * 8;
+            _mm256_storeu_ps(o + 0,  _mm256_permute2f128_ps(s0, s4, 0x20));
+            _mm256_storeu_ps(o + 8,  _mm256_permute2f128_ps(s1, s5, 0x20));
+            _mm256_storeu_ps(o + 16, _mm256_permute2f128_ps(s2, s6, 0x20));
+            _mm256_storeu_ps(o + 24, _mm256_permute2f128_ps(s3, s7, 0x20));
+            _mm256_storeu_ps(o + 32, _mm256_permute2f128_ps(s0, s4, 0x31));
+            _mm256_storeu_ps(o + 40, _mm256_permute2f128_ps(s1, s5, 0x31));
+            _mm256_storeu_ps(o + 48, _mm256_permute2f128_ps(s2, s6, 0x31));
+            _mm256_storeu_ps(o + 56, _mm256_permute2f128_ps(s3, s7, 0x31));
+        }
+    }
+    else {
+        InterleaveScalar<float>(dst, src, channels, samples);
+        return;
+    }
+    InterleaveTail<float>(dst, src, channels, i, samples);
+}
+
+static bool CpuSupportsAVX2() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    bool osxsave = info[2] & (1 << 27);
+    bool avx = info[2] & (1 << 28);
+    __cpuidex(info, 7, 0);
+    bool avx2 = info[1] & (1 << 5);
+    // The os must save the ymm registers
+    return osxsave && avx && avx2 && (_xgetbv(0) & 0x6) == 0x6;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+static const AudioKernels ScalarKernels = {
+    "scalar",
+    GainF32Scalar,
+    GainS16Scalar,
+    GainS32Scalar,
+    GainU8Scalar,
+    InterleaveScalar<float>,
+    InterleaveScalar<int16_t>,
+    InterleaveScalar<uint8_t>,
+};
+
+#if defined(NEKOAV_X86)
+static const AudioKernels SSE2Kernels = {
+    "sse2",
+    GainF32SSE2,
+    GainS16SSE2,
+    GainS32Scalar, //< Rare, the decoders output s16 / f32
+    GainU8Scalar,
+    Interleave32SSE2,
+    Interleave16SSE2,
+    InterleaveScalar<uint8_t>,
+};
+static const AudioKernels AVX2Kernels = {
+    "avx2",
+    GainF32AVX2,
+    GainS16AVX2,
+    GainS32Scalar,
+    GainU8Scalar,
+    Interleave32AVX2,
+    Interleave16SSE2,
+    InterleaveScalar<uint8_t>,
+};
+#endif
+
+const AudioKernels *GetAudioKernels(const char *name) {
+    if (::strcmp(name, "scalar") == 0) {
+        return &ScalarKernels;
+    }
+#if defined(NEKOAV_X86)
+    if (::strcmp(name, "sse2") == 0) {
+        return &SSE2Kernels;
+    }
+    if (::strcmp(name, "avx2") == 0) {
+        static const bool avx2 = CpuSupportsAVX2();
+        return avx2 ? &AVX2Kernels : nullptr;
+    }
+#endif
+    return nullptr;
+}
+const AudioKernels &GetAudioKernels() {
+    static const AudioKernels &kernels = []() -> const AudioKernels & {
+        auto k = GetAudioKernels("avx2");
+        if (!k) {
+            k = GetAudioKernels("sse2");
+        }
+        if (!k) {
+            k = &ScalarKernels;
+        }
+        qDebug() << "NekoAV audio kernels:" << k->name;
+        return *k;
+    }();
+    return kernels;
+}
+
+}
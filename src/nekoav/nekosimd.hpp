@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace NekoAV {
+
+/**
+ * @brief Kernels on audio samples, the gain ones work in place (dst == src is allowed)
+ *
+ * The float gain clips to [-1, 1], the integer ones saturate.
+ */
+struct AudioKernels {
+    const char *name;
+
+    void (*gainF32)(float *dst, const float *src, size_t n, float gain);
+    void (*gainS16)(int16_t *dst, const int16_t *src, size_t n, float gain);
+    void (*gainS32)(int32_t *dst, const int32_t *src, size_t n, float gain);
+    void (*gainU8)(uint8_t *dst, const uint8_t *src, size_t n, float gain);
+
+    /**
+     * @brief Planar to packed, for the 32 bits samples (f32 / s32)
+     *
+     * @param dst The packed output, samples * channels
+     * @param src The planes, one per channel
+     */
+    void (*interleave32)(void *dst, const uint8_t * const *src, int channels, size_t samples);
+    /**
+     * @brief Planar to packed, for the 16 bits samples
+     *
+     */
+    void (*interleave16)(void *dst, const uint8_t * const *src, int channels, size_t samples);
+    /**
+     * @brief Planar to packed, for the 8 bits samples
+     *
+     */
+    void (*interleave8)(void *dst, const uint8_t * const *src, int channels, size_t samples);
+};
+
+/**
+ * @brief Get the best kernels of this cpu (AVX2 / SSE2 / scalar), selected once at the first call
+ *
+ * @return const AudioKernels&
+ */
+const AudioKernels &GetAudioKernels();
+/**
+ * @brief Get the kernels by name ("scalar", "sse2", "avx2"), for testing
+ *
+ * @return const AudioKernels* nullptr on not supported by this cpu
+ */
+const AudioKernels *GetAudioKernels(const char *name);
+
+}
@@ -0,0 +1,331 @@
+#define NEKO_SOURCE
+#include "nekoav.hpp"
+#include "nekoprivate.hpp"
+#include <QRegularExpression>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <tuple>
+
+namespace NekoAV {
+
+static QString FFSubtitleRectText(const AVSubtitleRect *rect) {
+    if (rect->type == SUBTITLE_TEXT && rect->text) {
+        return QString::fromUtf8(rect->text);
+    }
+    if (rect->type != SUBTITLE_ASS || !rect->ass) {
+        return QString();
+    }
+    // ReadOrder,Layer,Style,Name,MarginL,MarginR,MarginV,Effect,Text
+    // Or Dialogue: Layer,Start,End,Style,Name,MarginL,MarginR,MarginV,Effect,Text on old ffmpeg
+    static const QRegularExpression tags("\\{[^}]*\\}");
+    QString line = QString::fromUtf8(rect->ass);
+    int fields = line.startsWith("Dialogue:") ? 9 : 8;
+    QString text = line.section(',', fields);
+    text.remove(tags);
+    text.replace("\\N", "\n");
+    text.replace("\\n", "\n");
+    text.replace("\\h", " ");
+    return text.trimmed();
+}
+
+static QImage FFSubtitleRectImage(const AVSubtitleRect *rect) {
+    if (rect->type != SUBTITLE_BITMAP || rect->w <= 0 || rect->h <= 0 || !rect->data[0] || !rect->data[1]) {
+        return QImage();
+    }
+    // Palette is 0xAARRGGBB in native endian, same as QRgb
+    auto palette = reinterpret_cast<const QRgb*>(rect->data[1]);
+    QImage indexed(rect->data[0], rect->w, rect->h, rect->linesize[0], QImage::Format_Indexed8);
+    indexed.setColorTable(QList<QRgb>(palette, palette + qBound(0, rect->nb_colors, 256)));
+    return indexed.convertToFormat(QImage::Format_RGBA8888);
+}
+
+void SubtitleIndex::clear() {
+    entries.clear();
+    maxEnd.clear();
+    leaves = 0;
+    dirty = false;
+}
+void SubtitleIndex::add(Entry entry) {
+    if ((entry.text.isEmpty() && entry.images.isEmpty()) || std::isnan(entry.start)) {
+        return;
+    }
+    entries.push_back(std::move(entry));
+    dirty = true;
+}
+void SubtitleIndex::add(const AVSubtitle &subtitle, const AVPacket *packet, AVRational timeBase, QSize canvasSize) {
+    if (packet->pts == AV_NOPTS_VALUE) {
+        return;
+    }
+    double pts = packet->pts * av_q2d(timeBase);
+    double start = pts + subtitle.start_display_time / 1000.0;
+    double end = std::numeric_limits<double>::infinity();
+    if (subtitle.end_display_time > subtitle.start_display_time && subtitle.end_display_time != UINT32_MAX) {
+        end = pts + subtitle.end_display_time / 1000.0;
+    }
+    else if (packet->duration > 0) {
+        end = pts + packet->duration * av_q2d(timeBase);
+    }
+
+    if (subtitle.num_rects == 0) {
+        // Clear the screen
+        for (auto &entry : entries) {
+            if (std::isinf(entry.end) && entry.start < start) {
+                entry.end = start;
+                dirty = true;
+            }
+        }
+        return;
+    }
+
+    Entry entry {start, end, end, QString(), { }};
+    for (unsigned i = 0; i < subtitle.num_rects; i++) {
+        auto rect = subtitle.rects[i];
+        if (rect->type == SUBTITLE_BITMAP) {
+            SubtitleImage image;
+            image.image = FFSubtitleRectImage(rect);
+            image.rect = QRect(rect->x, rect->y, rect->w, rect->h);
+            image.canvasSize = canvasSize;
+            if (!image.image.isNull()) {
+                entry.images.push_back(std::move(image));
+            }
+            continue;
+        }
+        auto rectText = FFSubtitleRectText(rect);
+        if (rectText.isEmpty()) {
+            continue;
+        }
+        if (!entry.text.isEmpty()) {
+            entry.text += '\n';
+        }
+        entry.text += rectText;
+    }
+    add(std::move(entry));
+}
+void SubtitleIndex::prune(double before) {
+    auto iter = std::remove_if(entries.begin(), entries.end(), [before](const Entry &e) {
+        return !e.images.isEmpty() && e.end < before;
+    });
+    if (iter != entries.end()) {
+        entries.erase(iter, entries.end());
+        dirty = true;
+    }
+}
+void SubtitleIndex::rebuild() {
+    dirty = false;
+    // By all the compared fields, so the same events are adjacent even when others start at the same time
+    auto rectKey = [](const QRect &r) {
+        return std::make_tuple(r.x(), r.y(), r.width(), r.height());
+    };
+    std::stable_sort(entries.begin(), entries.end(), [&](const Entry &a, const Entry &b) {
+        if (a.start != b.start) {
+            return a.start < b.start;
+        }
+        if (a.end != b.end) {
+            return a.end < b.end;
+        }
+        if (a.text != b.text) {
+            return a.text < b.text;
+        }
+        if (a.images.size() != b.images.size()) {
+            return a.images.size() < b.images.size();
+        }
+        for (int i = 0; i < a.images.size(); i++) {
+            if (a.images[i].rect != b.images[i].rect) {
+                return rectKey(a.images[i].rect) < rectKey(b.images[i].rect);
+            }
+        }
+        return false;
+    });
+    // The same events come again when the packets are demuxed again after seeking back
+    auto last = std::unique(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        if (a.start != b.start || a.end != b.end || a.text != b.text || a.images.size() != b.images.size()) {
+            return false;
+        }
+        for (int i = 0; i < a.images.size(); i++) {
+            if (a.images[i].rect != b.images[i].rect) {
+                return false;
+            }
+        }
+        return true;
+    });
+    entries.erase(last, entries.end());
+
+    // Unknown end, until the next event
+    for (size_t i = 0; i < entries.size(); i++) {
+        entries[i].shownEnd = entries[i].end;
+        if (!std::isinf(entries[i].end)) {
+            continue;
+        }
+        double end = entries[i].start + FallbackDuration;
+        for (size_t j = i + 1; j < entries.size(); j++) {
+            if (entries[j].start > entries[i].start) {
+                end = entries[j].start;
+                break;
+            }
+        }
+        entries[i].shownEnd = end;
+    }
+
+    leaves = 1;
+    while (leaves < entries.size()) {
+        leaves *= 2;
+    }
+    maxEnd.assign(leaves * 2, -std::numeric_limits<double>::infinity());
+    for (size_t i = 0; i < entries.size(); i++) {
+        maxEnd[leaves + i] = entries[i].shownEnd;
+    }
+    for (size_t i = leaves - 1; i > 0; i--) {
+        maxEnd[i] = std::max(maxEnd[i * 2], maxEnd[i * 2 + 1]);
+    }
+}
+void SubtitleIndex::collect(size_t node, size_t lo, size_t hi, size_t limit, double time, std::vector<size_t> &out) const {
+    // Only the events started before time, and the subtree has one not ended
+    if (lo >= limit || maxEnd[node] <= time) {
+        return;
+    }
+    if (hi - lo == 1) {
+        out.push_back(lo);
+        return;
+    }
+    size_t mid = (lo + hi) / 2;
+    collect(node * 2, lo, mid, limit, time, out);
+    collect(node * 2 + 1, mid, hi, limit, time, out);
+}
+QString SubtitleIndex::lookup(double time, double *next, QList<SubtitleImage> *images) {
+    if (dirty) {
+        rebuild();
+    }
+    *next = std::numeric_limits<double>::infinity();
+    if (images) {
+        images->clear();
+    }
+    if (entries.empty()) {
+        return QString();
+    }
+
+    auto iter = std::upper_bound(entries.begin(), entries.end(), time, [](double t, const Entry &e) {
+        return t < e.start;
+    });
+    size_t limit = iter - entries.begin();
+    if (limit < entries.size()) {
+        *next = entries[limit].start;
+    }
+
+    std::vector<size_t> hits;
+    collect(1, 0, leaves, limit, time, hits);
+
+    QString text;
+    for (auto idx : hits) {
+        auto &entry = entries[idx];
+        *next = std::min(*next, entry.shownEnd);
+        if (images) {
+            for (auto image : entry.images) {
+                image.start = entry.start;
+                image.end = entry.shownEnd;
+                images->push_back(std::move(image));
+            }
+        }
+        if (entry.text.isEmpty()) {
+            continue;
+        }
+        if (!text.isEmpty()) {
+            text += '\n';
+        }
+        text += entry.text;
+    }
+    return text;
+}
+
+SubtitleScanner::SubtitleScanner(SubtitleThread *notify, const QUrl &url, int streamIndex) :
+    notify(notify), sourceUrl(url), streamIndex(streamIndex)
+{
+    setObjectName("NekoAV SubtitleScanner");
+}
+SubtitleScanner::~SubtitleScanner() {
+    cancel();
+    wait();
+}
+bool SubtitleScanner::take(SubtitleIndex &out) {
+    if (!done || !succeed) {
+        return false;
+    }
+    out = std::move(index);
+    index.clear();
+    return true;
+}
+void SubtitleScanner::run() {
+    int64_t begin = av_gettime_relative();
+    succeed = scan();
+    if (succeed) {
+        qDebug() << "SubtitleScanner scanned" << sourceUrl << index.size() << "events in"
+                 << (av_gettime_relative() - begin) / 1000 << "ms";
+    }
+    done = true;
+    notify->wakeUp();
+}
+bool SubtitleScanner::scan() {
+    AVFormatContext *formatCtxt = avformat_alloc_context();
+    formatCtxt->interrupt_callback.callback = [](void *self) -> int {
+        return static_cast<SubtitleScanner*>(self)->cancelled.load();
+    };
+    formatCtxt->interrupt_callback.opaque = this;
+
+    QByteArray url = sourceUrl.isLocalFile() ? sourceUrl.toLocalFile().toUtf8() : sourceUrl.toString().toUtf8();
+    int errcode = avformat_open_input(&formatCtxt, url.data(), nullptr, nullptr);
+    if (errcode < 0) {
+        qDebug() << "SubtitleScanner failed to open" << sourceUrl << FFErrorToString(errcode);
+        return false;
+    }
+    AVPtr<AVFormatContext> formatGuard(formatCtxt);
+
+    if (streamIndex < 0) {
+        errcode = avformat_find_stream_info(formatCtxt, nullptr);
+        if (errcode < 0) {
+            qDebug() << "SubtitleScanner failed to find stream info" << FFErrorToString(errcode);
+            return false;
+        }
+        streamIndex = av_find_best_stream(formatCtxt, AVMEDIA_TYPE_SUBTITLE, -1, -1, nullptr, 0);
+    }
+    if (streamIndex < 0 || streamIndex >= int(formatCtxt->nb_streams)) {
+        qDebug() << "SubtitleScanner no subtitle stream in" << sourceUrl;
+        return false;
+    }
+    // Only the subtitle packets are wanted
+    for (unsigned i = 0; i < formatCtxt->nb_streams; i++) {
+        if (int(i) != streamIndex) {
+            formatCtxt->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+    auto stream = formatCtxt->streams[streamIndex];
+    auto [codecCtxt, retCode] = FFCreateDecoderContext(stream);
+    if (!codecCtxt) {
+        qDebug() << "SubtitleScanner failed to open decoder" << FFErrorToString(retCode);
+        return false;
+    }
+    AVPtr<AVCodecContext> codecGuard(codecCtxt);
+    AVPtr<AVPacket>       packet(av_packet_alloc());
+
+    while (!cancelled) {
+        errcode = av_read_frame(formatCtxt, packet.get());
+        if (errcode == AVERROR_EOF) {
+            return true;
+        }
+        if (errcode < 0) {
+            qDebug() << "SubtitleScanner failed to read" << FFErrorToString(errcode);
+            return false;
+        }
+        if (packet->stream_index == streamIndex) {
+            AVSubtitle subtitle;
+            int got = 0;
+            if (avcodec_decode_subtitle2(codecCtxt, &subtitle, &got, packet.get()) >= 0 && got) {
+                AVPtr<AVSubtitle> sguard(&subtitle);
+                index.add(subtitle, packet.get(), stream->time_base);
+            }
+        }
+        av_packet_unref(packet.get());
+    }
+    return false;
+}
+
+}
@@ -0,0 +1,397 @@
+#define NEKO_SOURCE
+#include "nekoav.hpp"
+#include "nekowrap.hpp"
+#include <QCryptographicHash>
+#include <QStandardPaths>
+#include <QFileInfo>
+#include <QPainter>
+#include <QThread>
+#include <QDebug>
+#include <QDir>
+#include <atomic>
+#include <cmath>
+#include <mutex>
+
+namespace NekoAV {
+
+class ThumbnailGeneratorPrivate {
+    public:
+        static constexpr int MaxThumbnails = 600; //< Limit the sheet memory, interval grows on long sources
+        static constexpr int Columns = 10;
+        static constexpr int MaxPacketsPerSeek = 500; //< Give up the tile if no keyframe in it
+
+        ThumbnailGeneratorPrivate(ThumbnailGenerator *self) : self(self) { }
+        ~ThumbnailGeneratorPrivate() {
+            stop();
+            av_dict_free(&options);
+        }
+
+        void stop();
+        void run();
+        bool openSource();
+        void closeSource();
+        bool generateTile(int idx);
+        int  nextTile() const;
+        bool loadCache();
+        void saveCache();
+        QString cachePath() const;
+
+        ThumbnailGenerator *self;
+
+        // Settings, only changed when the worker is stopped
+        QUrl          url;
+        AVDictionary *options = nullptr;
+        qreal         wantedInterval = 10.0;
+        QSize         tileSize {160, 90};
+        QString       cacheDir;
+
+        // Worker
+        QThread          *thread = nullptr;
+        std::atomic<bool> quit {false};
+        std::atomic<qreal> focus {0.0};
+
+        AVFormatContext  *formatCtxt = nullptr;
+        AVCodecContext   *codecCtxt = nullptr;
+        AVPtr<AVPacket>   packet {av_packet_alloc()};
+        AVPtr<AVFrame>    frame {av_frame_alloc()};
+        AVPtr<SwsContext> swsCtxt;
+        int               videoStream = -1;
+        int64_t           duration = 0; //< Of the source in AV_TIME_BASE, part of the cache key
+
+        // Shared with the user, protected by mutex
+        mutable std::mutex mutex;
+        QImage             sheet;
+        std::vector<bool>  done;
+        std::vector<bool>  failed; //< Done but nothing decoded, no image for them
+        qreal              interval = 10.0;
+        int                count = 0;
+};
+
+void ThumbnailGeneratorPrivate::stop() {
+    if (!thread) {
+        return;
+    }
+    quit = true;
+    thread->wait();
+    delete thread;
+    thread = nullptr;
+    quit = false;
+}
+QString ThumbnailGeneratorPrivate::cachePath() const {
+    QString dir = cacheDir;
+    if (dir.isEmpty()) {
+        dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/thumbnails";
+    }
+    // Signed urls change on every resolve, key by the path and the duration instead of the signing query
+    QString source = url.isLocalFile() ? url.toLocalFile() : url.adjusted(QUrl::RemoveUserInfo | QUrl::RemoveQuery | QUrl::RemoveFragment).toString();
+    QString key = QString("%1|%2|%3|%4x%5").arg(source).arg(duration).arg(wantedInterval).arg(tileSize.width()).arg(tileSize.height());
+    auto hash = QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex();
+    return dir + "/" + QString::fromLatin1(hash) + ".png";
+}
+bool ThumbnailGeneratorPrivate::loadCache() {
+    QImage image(cachePath());
+    if (image.isNull()) {
+        return false;
+    }
+    std::lock_guard locker(mutex);
+    if (image.size() != sheet.size()) {
+        // Not the same source anymore
+        return false;
+    }
+    sheet = image.convertToFormat(QImage::Format_RGBA8888);
+    std::fill(done.begin(), done.end(), true);
+    // A decoded tile is never transparent in the center, the failed ones are left untouched
+    for (int idx = 0; idx < count; idx++) {
+        QPoint center((idx % Columns) * tileSize.width() + tileSize.width() / 2, (idx / Columns) * tileSize.height() + tileSize.height() / 2);
+        failed[idx] = qAlpha(sheet.pixel(center)) == 0;
+    }
+    return true;
+}
+void ThumbnailGeneratorPrivate::saveCache() {
+    auto path = cachePath();
+    QDir().mkpath(QFileInfo(path).absolutePath());
+
+    QImage image;
+    {
+        std::lock_guard locker(mutex);
+        image = sheet;
+    }
+    if (!image.save(path)) {
+        qWarning() << "ThumbnailGenerator failed to save cache" << path;
+    }
+}
+bool ThumbnailGeneratorPrivate::openSource() {
+    formatCtxt = avformat_alloc_context();
+    formatCtxt->interrupt_callback.opaque = this;
+    formatCtxt->interrupt_callback.callback = [](void *opaque) -> int {
+        return static_cast<ThumbnailGeneratorPrivate*>(opaque)->quit.load();
+    };
+
+    AVDictionary *opts = nullptr;
+    av_dict_copy(&opts, options, 0);
+
+    QByteArray path = url.isLocalFile() ? url.toLocalFile().toUtf8() : url.toString().toUtf8();
+    int ret = avformat_open_input(&formatCtxt, path.data(), nullptr, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        qWarning() << "ThumbnailGenerator failed to open" << url << FFErrorToString(ret);
+        return false;
+    }
+    if (avformat_find_stream_info(formatCtxt, nullptr) < 0) {
+        return false;
+    }
+    videoStream = av_find_best_stream(formatCtxt, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (videoStream < 0 || formatCtxt->duration <= 0) {
+        return false;
+    }
+    auto stream = formatCtxt->streams[videoStream];
+    for (unsigned i = 0; i < formatCtxt->nb_streams; i++) {
+        if (int(i) != videoStream) {
+            formatCtxt->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    // Keyframes only, in the lowest resolution still bigger than the tile
+    auto codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    if (!codec) {
+        return false;
+    }
+    codecCtxt = avcodec_alloc_context3(codec);
+    if (avcodec_parameters_to_context(codecCtxt, stream->codecpar) < 0) {
+        return false;
+    }
+    int lowres = 0;
+    while (lowres < codec->max_lowres && (stream->codecpar->width >> (lowres + 1)) >= tileSize.width()) {
+        lowres += 1;
+    }
+    codecCtxt->lowres = lowres;
+    codecCtxt->skip_frame = AVDISCARD_NONKEY;
+    codecCtxt->skip_loop_filter = AVDISCARD_ALL;
+    codecCtxt->thread_count = 1;
+    if (avcodec_open2(codecCtxt, codec, nullptr) < 0) {
+        return false;
+    }
+
+    // Prepare the sheet
+    duration = formatCtxt->duration;
+    qreal seconds = duration / qreal(AV_TIME_BASE);
+    std::lock_guard locker(mutex);
+    interval = qMax(wantedInterval, seconds / MaxThumbnails);
+    count = qMax(1, int(std::ceil(seconds / interval)));
+    done.assign(count, false);
+    failed.assign(count, false);
+    sheet = QImage(
+        tileSize.width() * qMin(count, Columns),
+        tileSize.height() * ((count + Columns - 1) / Columns),
+        QImage::Format_RGBA8888
+    );
+    sheet.fill(Qt::transparent);
+
+    qDebug() << "ThumbnailGenerator" << count << "thumbnails, interval" << interval << "lowres" << lowres;
+    return true;
+}
+void ThumbnailGeneratorPrivate::closeSource() {
+    avcodec_free_context(&codecCtxt);
+    avformat_close_input(&formatCtxt);
+    swsCtxt.reset();
+    videoStream = -1;
+}
+int  ThumbnailGeneratorPrivate::nextTile() const {
+    // Nearest to the focus
+    int center = std::clamp(int(focus / interval), 0, count - 1);
+    std::lock_guard locker(mutex);
+    for (int dis = 0; dis < count; dis++) {
+        if (center + dis < count && !done[center + dis]) {
+            return center + dis;
+        }
+        if (center - dis >= 0 && !done[center - dis]) {
+            return center - dis;
+        }
+    }
+    return -1;
+}
+bool ThumbnailGeneratorPrivate::generateTile(int idx) {
+    auto stream = formatCtxt->streams[videoStream];
+    int64_t ts = (idx * interval) / av_q2d(stream->time_base);
+    if (stream->start_time != AV_NOPTS_VALUE) {
+        ts += stream->start_time;
+    }
+    if (av_seek_frame(formatCtxt, videoStream, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+        return false;
+    }
+    avcodec_flush_buffers(codecCtxt);
+
+    bool got = false;
+    for (int n = 0; n < MaxPacketsPerSeek && !got && !quit; n++) {
+        int ret = av_read_frame(formatCtxt, packet.get());
+        if (ret < 0) {
+            // Drain it
+            avcodec_send_packet(codecCtxt, nullptr);
+            got = avcodec_receive_frame(codecCtxt, frame.get()) >= 0;
+            break;
+        }
+        if (packet->stream_index != videoStream || !(packet->flags & AV_PKT_FLAG_KEY)) {
+            av_packet_unref(packet.get());
+            continue;
+        }
+        ret = avcodec_send_packet(codecCtxt, packet.get());
+        av_packet_unref(packet.get());
+        if (ret < 0 && ret != AVERROR(EAGAIN)) {
+            return false;
+        }
+        got = avcodec_receive_frame(codecCtxt, frame.get()) >= 0;
+    }
+    if (!got) {
+        return false;
+    }
+
+    // Fit into the tile
+    QSize size = QSize(frame->width, frame->height).scaled(tileSize, Qt::KeepAspectRatio);
+    if (size.isEmpty()) {
+        av_frame_unref(frame.get());
+        return false;
+    }
+    swsCtxt.reset(
+        sws_getCachedContext(
+            swsCtxt.release(),
+            frame->width,
+            frame->height,
+            AVPixelFormat(frame->format),
+            size.width(),
+            size.height(),
+            AV_PIX_FMT_RGBA,
+            SWS_BILINEAR,
+            nullptr,
+            nullptr,
+            nullptr
+        )
+    );
+    if (!swsCtxt) {
+        av_frame_unref(frame.get());
+        return false;
+    }
+    QImage image(size, QImage::Format_RGBA8888);
+    uint8_t *dstData[4] = {image.bits(), nullptr, nullptr, nullptr};
+    int      dstLinesize[4] = {int(image.bytesPerLine()), 0, 0, 0};
+    sws_scale(swsCtxt.get(), frame->data, frame->linesize, 0, frame->height, dstData, dstLinesize);
+    av_frame_unref(frame.get());
+
+    std::lock_guard locker(mutex);
+    QPoint origin((idx % Columns) * tileSize.width(), (idx / Columns) * tileSize.height());
+    QPainter painter(&sheet);
+    painter.setCompositionMode(QPainter::CompositionMode_Source);
+    painter.drawImage(origin + QPoint((tileSize.width() - size.width()) / 2, (tileSize.height() - size.height()) / 2), image);
+    return true;
+}
+void ThumbnailGeneratorPrivate::run() {
+    if (!openSource()) {
+        closeSource();
+        return;
+    }
+    if (loadCache()) {
+        qDebug() << "ThumbnailGenerator load from cache" << cachePath();
+        closeSource();
+        QMetaObject::invokeMethod(self, [this]() {
+            Q_EMIT self->finished();
+        }, Qt::QueuedConnection);
+        return;
+    }
+
+    int idx;
+    while (!quit && (idx = nextTile()) >= 0) {
+        // Mark it anyway, or a broken tile will be retried forever
+        bool ok = generateTile(idx);
+        {
+            std::lock_guard locker(mutex);
+            done[idx] = true;
+            failed[idx] = !ok;
+        }
+        if (ok) {
+            qreal position = idx * interval;
+            QMetaObject::invokeMethod(self, [this, position]() {
+                Q_EMIT self->thumbnailReady(position);
+            }, Qt::QueuedConnection);
+        }
+    }
+    closeSource();
+    if (quit) {
+        return;
+    }
+    saveCache();
+    QMetaObject::invokeMethod(self, [this]() {
+        Q_EMIT self->finished();
+    }, Qt::QueuedConnection);
+}
+
+ThumbnailGenerator::ThumbnailGenerator(QObject *parent) : QObject(parent), d(new ThumbnailGeneratorPrivate(this)) {
+
+}
+ThumbnailGenerator::~ThumbnailGenerator() {
+
+}
+void ThumbnailGenerator::setSource(const QUrl &source) {
+    d->stop();
+    {
+        std::lock_guard locker(d->mutex);
+        d->sheet = QImage();
+        d->done.clear();
+        d->failed.clear();
+        d->count = 0;
+    }
+    d->url = source;
+    if (source.isEmpty()) {
+        return;
+    }
+
+    // Never compete with the playback
+    d->thread = QThread::create(&ThumbnailGeneratorPrivate::run, d.get());
+    d->thread->setObjectName("NekoAV ThumbnailThread");
+    d->thread->start(QThread::LowestPriority);
+}
+void ThumbnailGenerator::stop() {
+    d->stop();
+}
+void ThumbnailGenerator::setOption(const QString &key, const QString &value) {
+    av_dict_set(&d->options, key.toUtf8().data(), value.toUtf8().data(), 0);
+}
+void ThumbnailGenerator::setOptions(const Dictionary &options) {
+    av_dict_free(&d->options);
+    d->options = options.toAVDictionary();
+}
+void ThumbnailGenerator::setInterval(qreal seconds) {
+    d->wantedInterval = qMax(seconds, 1.0);
+}
+void ThumbnailGenerator::setThumbnailSize(const QSize &size) {
+    d->tileSize = size;
+}
+void ThumbnailGenerator::setCacheDirectory(const QString &dir) {
+    d->cacheDir = dir;
+}
+void ThumbnailGenerator::setFocusPosition(qreal position) {
+    d->focus = position;
+}
+qreal ThumbnailGenerator::interval() const {
+    std::lock_guard locker(d->mutex);
+    return d->interval;
+}
+QSize ThumbnailGenerator::thumbnailSize() const {
+    return d->tileSize;
+}
+QImage ThumbnailGenerator::thumbnail(qreal position) const {
+    std::lock_guard locker(d->mutex);
+    if (d->count == 0) {
+        return QImage();
+    }
+    int idx = std::clamp(int(position / d->interval), 0, d->count - 1);
+    if (!d->done[idx] || d->failed[idx]) {
+        return QImage();
+    }
+    QRect rect((idx % ThumbnailGeneratorPrivate::Columns) * d->tileSize.width(), (idx / ThumbnailGeneratorPrivate::Columns) * d->tileSize.height(), d->tileSize.width(), d->tileSize.height());
+    return d->sheet.copy(rect);
+}
+QImage ThumbnailGenerator::spriteSheet() const {
+    std::lock_guard locker(d->mutex);
+    return d->sheet;
+}
+
+}
@@ -19,6 +19,10 @@ extern "C" {
 #endif
 }
 
+#if __has_include(<libavfilter/avfilter.h>)
+    #define NEKOAV_AVFILTER
+#endif
+
 namespace NekoAV {
 
 template <typename T>
@@ -191,12 +195,14 @@ inline AVPtr<uint8_t> &FFReallocateBuffer(AVPtr<uint8_t> *old, size_t newSize) {
 }
 
 /**
- * @brief Create a basic decoder object
+ * @brief Create and open a decoder for the stream
  * 
  * @param stream The AVStream pointer (can not be nullptr)
+ * @param threads The thread_count, 0 on auto by ffmpeg
+ * @param threadType The FF_THREAD_XXX flags
  * @return std::pair<AVCodecContext*, int> 
  */
-inline std::pair<AVCodecContext*, int> FFCreateDecoderContext(AVStream *stream) {
+inline std::pair<AVCodecContext*, int> FFCreateDecoderContext(AVStream *stream, int threads = 1, int threadType = FF_THREAD_FRAME | FF_THREAD_SLICE) {
     auto codec = avcodec_find_decoder(stream->codecpar->codec_id);
     int errcode = 0;
     if (!codec) {
@@ -214,6 +220,8 @@ inline std::pair<AVCodecContext*, int> FFCreateDecoderContext(AVStream *stream)
         avcodec_free_context(&codecCtxt);
         return {nullptr, errcode};
     }
+    codecCtxt->thread_count = threads;
+    codecCtxt->thread_type = threadType;
     errcode = avcodec_open2(codecCtxt, codecCtxt->codec, nullptr);
     if (errcode < 0) {
         avcodec_free_context(&codecCtxt);
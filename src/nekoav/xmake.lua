@@ -1,6 +1,6 @@
 if is_plat("linux") then 
     -- Use ffmpeg from system
-    add_requires("libavformat", "libavutil", "libavcodec", "libswresample", "libswscale")
+    add_requires("libavformat", "libavutil", "libavcodec", "libswresample", "libswscale", "libavfilter")
     -- Use SDL by default
     add_requires("libsdl")
 else 
@@ -19,7 +19,7 @@ target("nekoav")
 
     if is_plat("linux") then 
         -- Use ffmpeg from system
-        add_packages("libavformat", "libavutil", "libavcodec", "libswresample", "libswscale")
+        add_packages("libavformat", "libavutil", "libavcodec", "libswresample", "libswscale", "libavfilter")
         add_packages("libsdl")
     else 
         add_packages("ffmpeg")
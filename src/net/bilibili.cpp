@@ -6,6 +6,7 @@
 #include <QJsonArray>
 #include <QJsonObject>
 #include <QImage>
+#include <QMap>
 
 #define QZOOD_NO_PROTOBUF  
 
@@ -357,9 +358,13 @@ NetResult<QString> BiliClient::convertToCid(const QString &bvid) {
 
     return result;
 }
-NetResult<BiliVideoSource> BiliClient::fetchVideoSource(const QString &cid, const QString &bvid) {
+NetResult<BiliVideoSource> BiliClient::fetchVideoSource(const QString &cid, const QString &bvid, bool dash) {
     // QNetworkRequest request;
     QString url = QString("https://api.bilibili.com/x/player/playurl?qn=64&cid=%1&bvid=%2").arg(cid, bvid);
+    if (dash) {
+        // fnval 16 for dash, it returns all the qualities we could play
+        url = QString("https://api.bilibili.com/x/player/playurl?fnval=16&fourk=1&cid=%1&bvid=%2").arg(cid, bvid);
+    }
 
     
     // qDebug() << "Prepare for " << url;
@@ -386,6 +391,37 @@ NetResult<BiliVideoSource> BiliClient::fetchVideoSource(const QString &cid, cons
                 for (const auto &item : doc["data"]["durl"].toArray()) {
                     bilisource.urls.push_back(item.toObject()["url"].toString());
                 }
+
+                // Name of the qualities
+                QMap<int, QString> descriptions;
+                auto qualities = doc["data"]["accept_quality"].toArray();
+                auto names = doc["data"]["accept_description"].toArray();
+                for (int i = 0; i < qualities.size() && i < names.size(); i++) {
+                    descriptions[qualities[i].toInt()] = names[i].toString();
+                }
+                auto parseStreams = [&](const QJsonArray &array) {
+                    QList<BiliDashStream> streams;
+                    for (const auto &item : array) {
+                        auto object = item.toObject();
+                        BiliDashStream stream;
+                        stream.url = object.contains("baseUrl") ? object["baseUrl"].toString() : object["base_url"].toString();
+                        for (const auto &backup : object["backupUrl"].toArray()) {
+                            stream.backupUrls.push_back(backup.toString());
+                        }
+                        stream.quality = object["id"].toInt();
+                        stream.description = descriptions.value(stream.quality, QString::number(stream.quality));
+                        stream.codecs = object["codecs"].toString();
+                        stream.bandwidth = object["bandwidth"].toVariant().toLongLong();
+                        stream.width = object["width"].toInt();
+                        stream.height = object["height"].toInt();
+                        if (!stream.url.isEmpty()) {
+                            streams.push_back(stream);
+                        }
+                    }
+                    return streams;
+                };
+                bilisource.videoStreams = parseStreams(doc["data"]["dash"]["video"].toArray());
+                bilisource.audioStreams = parseStreams(doc["data"]["dash"]["audio"].toArray());
                 source = std::move(bilisource);
             }
         }
@@ -25,10 +25,23 @@ class BiliVideoInfo final {
         QString bvid;
         QString aid;
 };
+class BiliDashStream final {
+    public:
+        QString     url;
+        QStringList backupUrls;
+        QString     description; //< Name of the quality, like "1080P 高清"
+        QString     codecs; //< Like "avc1.640032"
+        int         quality = 0; //< The qn of the quality
+        qint64      bandwidth = 0; //< Bits per second
+        int         width = 0;
+        int         height = 0;
+};
 class BiliVideoSource final {
     public:
         QStringList urls;
         QByteArray referHeader; //< Header of refer
+        QList<BiliDashStream> videoStreams; //< All quality levels of dash, empty on not requested
+        QList<BiliDashStream> audioStreams;
 };
 class BiliUrlParse final {
     public:
@@ -188,9 +201,10 @@ class BiliClient final : public VideoInterface {
          * 
          * @param cid
          * @param bvid 
+         * @param dash Request the dash streams of every quality level instead of the single urls
          * @return NetResult<BiliVideoSource> 
          */
-        NetResult<BiliVideoSource> fetchVideoSource(const QString &cid, const QString &bvid);
+        NetResult<BiliVideoSource> fetchVideoSource(const QString &cid, const QString &bvid, bool dash = false);
         /**
          * @brief Seaech for bangumi
          * 
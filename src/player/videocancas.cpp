@@ -11,6 +11,8 @@
 #include <QFontMetricsF>
 #include <QTextCursor>
 #include <QPainter>
+#include <QScreen>
+#include <algorithm>
 #include <mutex>
 
 // OpenGL parts
@@ -201,10 +203,16 @@ void VideoCanvas::initializeGL() {
 VideoCanvasPrivate::VideoCanvasPrivate(VideoCanvas *parent) : QObject(parent), videoCanvas(parent) {
     connect(&videoSink, &NekoVideoSink::videoFrameChanged, this, &VideoCanvasPrivate::_on_VideoFrameChanged, Qt::QueuedConnection);
     connect(&videoSink, &NekoVideoSink::subtitleTextChanged, this, &VideoCanvasPrivate::_on_SubtitleTextChanged, Qt::QueuedConnection);
+    connect(&videoSink, &NekoVideoSink::subtitleImagesChanged, this, &VideoCanvasPrivate::_on_SubtitleImagesChanged, Qt::QueuedConnection);
 
 #if !defined(QZOOD_VIDEO_NO_CUSTOMIZE_OPENGL)
     videoSink.addPixelFormat(NekoVideoPixelFormat::YUV420P);
     videoSink.addPixelFormat(NekoVideoPixelFormat::NV12);
+
+    // Pick the frames at the vsync in paintGL instead of uploading each one when it comes
+    videoSink.setPresentationQueue(true);
+    connect(&videoSink, &NekoVideoSink::videoFrameQueued, videoCanvas, qOverload<>(&QWidget::update));
+    connect(videoCanvas, &QOpenGLWidget::frameSwapped, this, &VideoCanvasPrivate::_on_FrameSwapped);
 #endif
 }
 void VideoCanvasPrivate::paint(QPainter &painter) {
@@ -216,6 +224,12 @@ void VideoCanvasPrivate::paint(QPainter &painter) {
     if (!image.isNull()) {
         painter.drawImage(viewportRect(), image);
     }
+    painter.save();
+    painter.setOpacity(subtitleOpacity);
+    for (auto &sub : subtitleImages) {
+        painter.drawImage(subtitleImageRect(sub), sub.image);
+    }
+    painter.restore();
 #endif
     if (player) {
         painter.setFont(videoCanvas->font());
@@ -529,6 +543,29 @@ QRectF VideoCanvasPrivate::viewportRect() const {
 
     return QRectF(x, y, w, h);
 }
+QRectF VideoCanvasPrivate::subtitleImageRect(const NekoSubtitleImage &sub) const {
+    QSizeF canvas = sub.canvasSize;
+    if (canvas.isEmpty()) {
+        // Relative to the video picture
+#if defined(QZOOD_VIDEO_NO_CUSTOMIZE_OPENGL)
+        canvas = image.size();
+#else
+        canvas = QSizeF(textureWidth, textureHeight);
+#endif
+    }
+    QRectF out = viewportRect();
+    if (canvas.isEmpty()) {
+        return QRectF();
+    }
+    qreal sx = out.width() / canvas.width();
+    qreal sy = out.height() / canvas.height();
+    return QRectF(
+        out.x() + sub.rect.x() * sx,
+        out.y() + sub.rect.y() * sy,
+        sub.rect.width() * sx,
+        sub.rect.height() * sy
+    );
+}
 void VideoCanvasPrivate::_on_playerStateChanged(NekoMediaPlayer::PlaybackState state) {
     switch (state) {
         case NekoMediaPlayer::PlayingState : {
@@ -536,6 +573,8 @@ void VideoCanvasPrivate::_on_playerStateChanged(NekoMediaPlayer::PlaybackState s
             if (!danmakuList.empty()) {
                 danmakuTimer = startTimer(1000 / danmakuFps, Qt::PreciseTimer);
             }
+            // Begin the paint loop of the presentation queue
+            videoCanvas->update();
             break;
         }
         case NekoMediaPlayer::PausedState : {
@@ -558,6 +597,54 @@ void VideoCanvasPrivate::_on_SubtitleTextChanged(const QString &subtitle) {
     hasSubtitle = !subtitle.isEmpty();
     videoCanvas->update();
 }
+void VideoCanvasPrivate::_on_SubtitleImagesChanged(const QList<NekoSubtitleImage> &images) {
+    subtitleImages = images;
+
+#if !defined(QZOOD_VIDEO_NO_CUSTOMIZE_OPENGL)
+    if (!gl) {
+        // Not initialized, upload nothing
+        videoCanvas->update();
+        return;
+    }
+    videoCanvas->makeCurrent();
+
+    // Keep the textures still on the screen, so a subtitle is uploaded once for its whole interval
+    std::vector<SubtitleTexture> shown;
+    for (auto &sub : images) {
+        auto key = sub.image.cacheKey();
+        auto iter = std::find_if(subtitleTextures.begin(), subtitleTextures.end(), [key](const SubtitleTexture &t) {
+            return t.texture && t.image.image.cacheKey() == key;
+        });
+        if (iter != subtitleTextures.end()) {
+            shown.push_back(*iter);
+            iter->texture = 0;
+            continue;
+        }
+
+        SubtitleTexture texture;
+        texture.image = sub;
+        gl->glGenTextures(1, &texture.texture);
+        gl->glBindTexture(GL_TEXTURE_2D, texture.texture);
+        VGL_CHECK_ERROR();
+
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+        gl->glPixelStorei(GL_UNPACK_ROW_LENGTH, sub.image.bytesPerLine() / 4);
+        gl->glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, sub.image.width(), sub.image.height(), 0, GL_RGBA, GL_UNSIGNED_BYTE, sub.image.constBits());
+        VGL_CHECK_ERROR();
+        gl->glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+        shown.push_back(texture);
+    }
+    releaseSubtitleTextures();
+    subtitleTextures = std::move(shown);
+#endif
+
+    videoCanvas->update();
+}
 void VideoCanvasPrivate::_on_VideoFrameChanged(const NekoVideoFrame &frame) {
     // Update frame
     if (frame.isNull() || player->playbackState() == NekoMediaPlayer::StoppedState) {
@@ -580,6 +667,17 @@ void VideoCanvasPrivate::_on_VideoFrameChanged(const NekoVideoFrame &frame) {
         videoCanvas->update();
         return;
     }
+    uploadFrame(frame);
+    videoCanvas->update();
+}
+void VideoCanvasPrivate::_on_FrameSwapped() {
+    lastSwapTime = NekoVideoSink::presentationTime();
+    if (player && player->playbackState() == NekoMediaPlayer::PlayingState && videoSink.hasPresentationQueue()) {
+        // Paint at each vsync while playing, the frames are taken in paintGL
+        videoCanvas->update();
+    }
+}
+void VideoCanvasPrivate::uploadFrame(const NekoVideoFrame &frame) {
     std::lock_guard locker(frame);
 
     // Q_ASSERT(frame.pixelFormat() == NekoVideoPixelFormat::RGBA32);
@@ -721,9 +819,6 @@ void VideoCanvasPrivate::_on_VideoFrameChanged(const NekoVideoFrame &frame) {
         gl->glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
     }
 #endif    
-
-
-    videoCanvas->update();
 }
 
 
@@ -759,6 +854,21 @@ void main(){
 
 )";
 
+static auto subtitleShaderCode = R"(
+#version 330 core
+out vec4 fragColor;
+in  vec2 texturePos;
+
+uniform sampler2D subtitleTexture;
+uniform float     opacity;
+
+void main(){
+    vec4 color = texture(subtitleTexture, texturePos);
+    fragColor = vec4(color.rgb, color.a * opacity); //< Blended over the video
+}
+
+)";
+
 static auto yuv420PShaderCode = R"(
 #version 330 core
 out vec4 fragColor;
@@ -827,6 +937,16 @@ void VideoCanvasPrivate::cleanupGL() {
             t = 0;
         }
     }
+    if (subtitleArrayObject) {
+        gl->glDeleteVertexArrays(1, &subtitleArrayObject);
+        subtitleArrayObject = 0;
+    }
+    if (subtitleBufferObject) {
+        gl->glDeleteBuffers(1, &subtitleBufferObject);
+        subtitleBufferObject = 0;
+    }
+    releaseSubtitleTextures();
+    subtitleTextures.clear();
 
     for (auto &program : programObjects) {
         if (program) {
@@ -873,10 +993,28 @@ void VideoCanvasPrivate::initializeGL() {
     gl->glEnableVertexAttribArray(1);
     VGL_CHECK_ERROR();
 
+    // Same layout for the bitmap subtitles, the quad is written at each draw
+    gl->glGenVertexArrays(1, &subtitleArrayObject);
+    VGL_CHECK_ERROR();
+    gl->glBindVertexArray(subtitleArrayObject);
+    VGL_CHECK_ERROR();
+    gl->glGenBuffers(1, &subtitleBufferObject);
+    VGL_CHECK_ERROR();
+    gl->glBindBuffer(GL_ARRAY_BUFFER, subtitleBufferObject);
+    VGL_CHECK_ERROR();
+    gl->glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), nullptr, GL_DYNAMIC_DRAW);
+    VGL_CHECK_ERROR();
+    gl->glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), 0);
+    gl->glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (void*)(2 * sizeof(GLfloat)));
+    gl->glEnableVertexAttribArray(0);
+    gl->glEnableVertexAttribArray(1);
+    VGL_CHECK_ERROR();
+
     // prepare shader objects
     prepareProgram(Shader_RGBA, vertexShaderCode, fragmentShaderCode);
     prepareProgram(Shader_NV12, vertexShaderCode, nv12ShaderCode);
     prepareProgram(Shader_YUV420P, vertexShaderCode, yuv420PShaderCode);
+    prepareProgram(Shader_Subtitle, vertexShaderCode, subtitleShaderCode);
 }
 void VideoCanvasPrivate::prepareProgram(int type, const char *vtCode, const char *frCode) {
     GLuint programObject = gl->glCreateProgram();
@@ -938,10 +1076,36 @@ void VideoCanvasPrivate::prepareProgram(int type, const char *vtCode, const char
         gl->glUniform1i(gl->glGetUniformLocation(programObject, "uvTexture"), 1);
         VGL_CHECK_ERROR();
     }
+    if (type == Shader_Subtitle) {
+        gl->glUniform1i(gl->glGetUniformLocation(programObject, "subtitleTexture"), 0);
+        VGL_CHECK_ERROR();
+    }
 
     programObjects[type] = programObject;
 }
+void VideoCanvasPrivate::presentQueuedFrame() {
+    if (!videoSink.hasPresentationQueue()) {
+        return;
+    }
+    // The swap after the last vsync blocks until the next one, so this paint is shown a refresh interval after it
+    qreal refreshRate = videoCanvas->screen() ? videoCanvas->screen()->refreshRate() : 60.0;
+    qint64 interval = 1000000 / qMax(refreshRate, 1.0);
+    qint64 now = NekoVideoSink::presentationTime();
+    qint64 displayTime = lastSwapTime + interval;
+    if (displayTime < now) {
+        // Not in the paint loop
+        displayTime = now + interval;
+    }
+
+    auto frame = videoSink.presentFrame(displayTime);
+    if (frame.isNull() || !player || player->playbackState() == NekoMediaPlayer::StoppedState) {
+        return;
+    }
+    uploadFrame(frame);
+}
 void VideoCanvasPrivate::paintGL() {
+    presentQueuedFrame();
+
     gl->glClearColor(0.0, 0.0f, 0.0f, 1.0f);
     VGL_CHECK_ERROR();
     gl->glClear(GL_COLOR_BUFFER_BIT);
@@ -973,6 +1137,59 @@ void VideoCanvasPrivate::paintGL() {
     gl->glDrawArrays(GL_TRIANGLES, 0, 3);
     gl->glDrawArrays(GL_TRIANGLES, 2, 3);
     VGL_CHECK_ERROR();
+
+    paintSubtitleImages();
+}
+void VideoCanvasPrivate::paintSubtitleImages() {
+    if (subtitleTextures.empty()) {
+        return;
+    }
+    float width = videoCanvas->width();
+    float height = videoCanvas->height();
+
+    gl->glEnable(GL_BLEND);
+    gl->glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    gl->glActiveTexture(GL_TEXTURE0);
+    gl->glBindVertexArray(subtitleArrayObject);
+    gl->glBindBuffer(GL_ARRAY_BUFFER, subtitleBufferObject);
+    gl->glUseProgram(programObjects[Shader_Subtitle]);
+    gl->glUniform1f(gl->glGetUniformLocation(programObjects[Shader_Subtitle], "opacity"), subtitleOpacity);
+    VGL_CHECK_ERROR();
+
+    for (auto &sub : subtitleTextures) {
+        QRectF rect = subtitleImageRect(sub.image);
+        if (rect.isEmpty()) {
+            continue;
+        }
+        // Widget coordinates to NDC, y goes up, the first row of the texture is the top
+        float left = rect.left() / width * 2.0f - 1.0f;
+        float right = rect.right() / width * 2.0f - 1.0f;
+        float top = 1.0f - rect.top() / height * 2.0f;
+        float bottom = 1.0f - rect.bottom() / height * 2.0f;
+
+        float vertices[] = {
+            left, top,           0.0f, 0.0f,
+            right, top,          1.0f, 0.0f,
+            right, bottom,       1.0f, 1.0f,
+            left, bottom,        0.0f, 1.0f,
+            left, top,           0.0f, 0.0f,
+        };
+        gl->glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertices), vertices);
+        gl->glBindTexture(GL_TEXTURE_2D, sub.texture);
+        gl->glDrawArrays(GL_TRIANGLES, 0, 3);
+        gl->glDrawArrays(GL_TRIANGLES, 2, 3);
+        VGL_CHECK_ERROR();
+    }
+
+    gl->glDisable(GL_BLEND);
+}
+void VideoCanvasPrivate::releaseSubtitleTextures() {
+    for (auto &sub : subtitleTextures) {
+        if (sub.texture) {
+            gl->glDeleteTextures(1, &sub.texture);
+            sub.texture = 0;
+        }
+    }
 }
 void VideoCanvasPrivate::resizeGL(int w, int h) {
     qDebug() << "GL resized to w:" << w << " h:" << h;
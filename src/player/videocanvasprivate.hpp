@@ -23,6 +23,16 @@ class DanmakuPaintItem final {
         }
 };
 
+/**
+ * @brief A bitmap subtitle uploaded to the GPU, kept while it is on the screen
+ * 
+ */
+class SubtitleTexture final {
+    public:
+        GLuint            texture = 0;
+        NekoSubtitleImage image;
+};
+
 using DanmakuTracks = std::list<std::list<DanmakuPaintItem>>;
 using DanmakuTrack  = std::list<DanmakuPaintItem>;
 
@@ -36,6 +46,7 @@ class VideoCanvasPrivate final : public QObject {
             Shader_RGBA = 0,
             Shader_YUV420P = 1,
             Shader_NV12 = 2,
+            Shader_Subtitle = 3, //< RGBA with opacity, for the bitmap subtitles
             Shader_NbFormats,
         };
 
@@ -50,11 +61,14 @@ class VideoCanvasPrivate final : public QObject {
         GLuint textureWidth = 0;
         GLuint textureHeight = 0;
         GLuint programObjects[Shader_NbFormats] {};
+        GLuint subtitleArrayObject = 0;
+        GLuint subtitleBufferObject = 0; //< Quad of the bitmap subtitle, updated each draw
 
         int    currentShader = 0; //< Index of current shader
         GLFunctions gl; //< OpenGL Functions
 
         QImage              image;
+        qint64              lastSwapTime = 0; //< Presentation time of the last frameSwapped
 
         QStaticText         subtitleText;
         QFont               subtitleFont = QFont("黑体", 40);
@@ -62,6 +76,8 @@ class VideoCanvasPrivate final : public QObject {
         QColor              subtitleColor = Qt::white;
         QColor              subtitleOutlineColor = Qt::gray;
         bool                hasSubtitle = false;
+        QList<NekoSubtitleImage>     subtitleImages; //< Bitmap subtitles on the screen
+        std::vector<SubtitleTexture> subtitleTextures; //< Uploaded once when they appear
 
         // Danmakus
         QFont               danmakuFont = QFont("黑体");
@@ -84,6 +100,7 @@ class VideoCanvasPrivate final : public QObject {
 
         void paint(QPainter &);
         void paintDanmaku(QPainter &);
+        void paintSubtitleImages();
         void resizeTracks();
         void clearTracks();
 
@@ -92,7 +109,14 @@ class VideoCanvasPrivate final : public QObject {
         void cleanupGL();
         void resizeGL(int w, int h);
         void updateGLBuffer();
+        void uploadFrame(const NekoVideoFrame &frame);
+        /**
+         * @brief Take the queued frame for the vsync showing this paint and upload it
+         * 
+         */
+        void presentQueuedFrame();
         void prepareProgram(int type, const char *vtCode, const char *frCode);
+        void releaseSubtitleTextures();
 
         /**
          * @brief Get the texture puted rectangles
@@ -100,12 +124,20 @@ class VideoCanvasPrivate final : public QObject {
          * @return QRectF 
          */
         QRectF viewportRect() const;
+        /**
+         * @brief Get the rectangle of the bitmap subtitle on the canvas
+         * 
+         * @return QRectF 
+         */
+        QRectF subtitleImageRect(const NekoSubtitleImage &image) const;
     protected:
         void timerEvent(QTimerEvent *) override;
     private:
         void addDanmaku();
         void _on_VideoFrameChanged(const NekoVideoFrame &frame);
+        void _on_FrameSwapped();
         void _on_SubtitleTextChanged(const QString &text);
+        void _on_SubtitleImagesChanged(const QList<NekoSubtitleImage> &images);
         void _on_playerStateChanged(NekoMediaPlayer::PlaybackState status);
     friend class VideoCanvas;
 };
\ No newline at end of file
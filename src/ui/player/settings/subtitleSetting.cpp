@@ -6,6 +6,7 @@
 #include "ui_subtitleSetting.h"
 
 #include <QFileDialog>
+#include <QSet>
 #include <QColorDialog>
 
 void setColorForButton(QPushButton* colorButton,const QColor &color) {
@@ -41,6 +42,15 @@ void getColor(QPushButton* colorButton, std::function<void(const QColor& color)>
 
 class SubtitleSettingPrivate {
 public:
+    // 字幕来源类型, 存放在下拉框的 item data 中
+    enum SourceType {
+        None,
+        Track, //< 内嵌字幕轨道
+        File, //< loadSubtitleFromFile 加载的外部文件
+    };
+    static constexpr int SourceTypeRole = Qt::UserRole;
+    static constexpr int TrackIndexRole = Qt::UserRole + 1;
+
     SubtitleSettingPrivate(SubtitleSetting *self) : self(self), ui(new Ui::SubtitleSetting()) {
         ui->setupUi(self);
     }
@@ -102,8 +112,29 @@ public:
                 auto subtitleStrokeTransparency = video->getStatus<int>("subtitleStrokeTransparency").value_or(0);
                 ui->subtitleStrokeTransparencyBar->setValue(subtitleStrokeTransparency);
 
+                QSignalBlocker blocker(ui->subtitleComboBox);
                 ui->subtitleComboBox->clear();
-                ui->subtitleComboBox->addItems(video->subtitleSourceList());
+                auto sources = video->subtitleSourceList();
+                int track = 0;
+                for (int i = 0; i < sources.size(); i++) {
+                    if (subtitleFiles.contains(sources[i])) {
+                        addSubtitleItem(sources[i], File);
+                    }
+                    else if (i == 0) {
+                        // 第一项为 "无"
+                        addSubtitleItem(sources[i], None);
+                    }
+                    else {
+                        addSubtitleItem(sources[i], Track, track++);
+                    }
+                }
+                ui->subtitleComboBox->setCurrentText(video->getCurrentSubtitleSource());
+
+                // 新的视频源会清除外部字幕文件, 按下拉框记录的类型重新加载
+                int current = ui->subtitleComboBox->currentIndex();
+                if (current >= 0 && ui->subtitleComboBox->itemData(current, SourceTypeRole).toInt() == File) {
+                    videoWidget->player()->setSubtitleFile(QUrl::fromLocalFile(ui->subtitleComboBox->itemText(current)));
+                }
             }
         }
     }
@@ -112,23 +143,42 @@ public:
     VideoWidget *videoWidget = nullptr;
 
 private:
+    void addSubtitleItem(const QString &text, SourceType type, int track = -1) {
+        ui->subtitleComboBox->addItem(text);
+        int index = ui->subtitleComboBox->count() - 1;
+        ui->subtitleComboBox->setItemData(index, type, SourceTypeRole);
+        ui->subtitleComboBox->setItemData(index, track, TrackIndexRole);
+    }
+
     void connectToVideoWidget() {
         // 选择字幕
         ui->subtitleFontComboBox->setCurrentFont(videoWidget->videoCanvas()->subtitleFont());
         ui->subtitleSizeBox->setValue(videoWidget->videoCanvas()->subtitleFont().pixelSize());
 
-        QWidget::connect(ui->subtitleComboBox, &QComboBox::currentTextChanged, videoWidget, [this](const QString& text) {
-            int index = videoWidget->currentVideo()->subtitleSourceList().indexOf(text) - 1;
-            if (index >= 0 && index < videoWidget->player()->subtitleTracks().size()) {
+        QWidget::connect(ui->subtitleComboBox, &QComboBox::currentIndexChanged, videoWidget, [this](int idx) {
+            if (idx < 0) {
+                return;
+            }
+            QString text = ui->subtitleComboBox->itemText(idx);
+            auto type = ui->subtitleComboBox->itemData(idx, SourceTypeRole).toInt();
+            int index = ui->subtitleComboBox->itemData(idx, TrackIndexRole).toInt();
+            if (type == Track && index >= 0 && index < videoWidget->player()->subtitleTracks().size()) {
                 videoWidget->currentVideo()->setCurrentSubtitleSource(text);
                 videoWidget->player()->setActiveSubtitleTrack(index);
             }
+            else if (type == File) {
+                videoWidget->currentVideo()->setCurrentSubtitleSource(text);
+                videoWidget->player()->setSubtitleFile(QUrl::fromLocalFile(text));
+            }
         });
         QWidget::connect(ui->loadSubtitleButton, &QToolButton::clicked, videoWidget, [this](bool checked) {
             QString filePath = QFileDialog::getOpenFileName(videoWidget, videoWidget->tr("请选择字幕文件"), "./", ".ass;;.*");
             if (!filePath.isEmpty()) {
+                subtitleFiles.insert(filePath);
                 videoWidget->currentVideo()->loadSubtitleFromFile(filePath);
-                videoWidget->currentVideo()->setCurrentSubtitleSource(filePath);
+                // 选中后由 currentIndexChanged 切换到该文件
+                addSubtitleItem(filePath, File);
+                ui->subtitleComboBox->setCurrentIndex(ui->subtitleComboBox->count() - 1);
             }
         });
         QWidget::connect(ui->subtitleSynchronizeTimeBox, &QDoubleSpinBox::valueChanged, videoWidget, [this](double value) {
@@ -207,6 +257,7 @@ private:
 private:
     SubtitleSetting *self;
     QScopedPointer<Ui::SubtitleSetting> ui;
+    QSet<QString> subtitleFiles; //< 从文件加载的字幕, 与内嵌轨道标题区分
 };
 
 SubtitleSetting::SubtitleSetting(QWidget *parent) : QWidget(parent), SettingItem(), d(new SubtitleSettingPrivate(this)) {
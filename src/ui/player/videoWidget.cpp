@@ -8,6 +8,7 @@
 #include <QMimeData>
 #include <QShortcut>
 #include <QPushButton>
+#include <QPainter>
 
 #include "../../BLL/data/videoItemModel.hpp"
 #include "../util/widget/popupWidget.hpp"
@@ -81,6 +82,9 @@ public:
         mVideoProgressBar->setObjectName("videoProgressBar");
         static_cast<QVBoxLayout*>(mVideoSetting->layout())->insertWidget(0, mVideoProgressBar);
 
+        // 进度条预览缩略图
+        mThumbnails = new NekoThumbnailGenerator(self);
+
         // 实例化音量控制界面
         mVolumeSetting = new VolumeSettingWidget(self);
         mVolumeSetting->setObjectName("VolumeSettingWidget");
@@ -275,6 +279,7 @@ public:
     
     void clean() {
         stop();
+        mThumbnails->stop();
         deleteAllChildren(mSourceListWidget);
         mVideoProgressBar->setValue(0);
         mVideoProgressBar->setPreloadValue(0);
@@ -327,12 +332,40 @@ private:
         });
 
         QWidget::connect(mVideoProgressBar, &CustomSlider::tipBeforeShow, self, [this](QLabel *tipLabel, int value){
-            tipLabel->setText(timeFormat(value));
+            auto image = mThumbnails->thumbnail(value);
+            if (image.isNull()) {
+                tipLabel->setText(timeFormat(value));
+                return;
+            }
+            // 缩略图下方绘制时间
+            QPixmap pixmap = QPixmap::fromImage(image);
+            QPainter painter(&pixmap);
+            QRect textRect = pixmap.rect().adjusted(0, pixmap.height() - 20, 0, 0);
+            painter.fillRect(textRect, QColor(0, 0, 0, 120));
+            painter.setPen(Qt::white);
+            painter.drawText(textRect, Qt::AlignCenter, timeFormat(value));
+            tipLabel->setPixmap(pixmap);
+        });
+
+        // 缩略图从当前播放位置向外生成
+        QWidget::connect(mPlayer, &NekoMediaPlayer::positionChanged, mThumbnails, [this](qreal value){
+            mThumbnails->setFocusPosition(value);
+        });
+        QWidget::connect(mPlayer, &NekoMediaPlayer::mediaStatusChanged, mThumbnails, [this](NekoMediaPlayer::MediaStatus status){
+            if (status == NekoMediaPlayer::MediaStatus::LoadedMedia && mPlayer->hasVideo()) {
+                // 与播放器使用相同的请求头
+                mThumbnails->setOptions(mPlayer->options());
+                mThumbnails->setFocusPosition(mPlayer->position());
+                mThumbnails->setSource(mPlayer->source());
+            }
         });
 
         QWidget::connect(mPlayer, &NekoMediaPlayer::bufferedDurationChanged, self, [this](double sec){
             mVideoProgressBar->setPreloadValue(sec + position());
         });
+        QWidget::connect(mPlayer, &NekoMediaPlayer::startupFinished, self, [this](const NekoStartupTimeline &timeline){
+            qDebug() << "VideoWidget first presented frame in" << timeline.firstPresentedFrame << "ms";
+        });
         // 结束信号
         QWidget::connect(mPlayer, &NekoMediaPlayer::errorOccurred, self, [this](NekoMediaPlayer::Error error, const QString &errorString){
             videoLog(errorString);
@@ -537,6 +570,7 @@ private:
             qWarning() << "subtitle title : " << source[NekoMediaMetaData::Title];
             mVideo->addSubtitleSource(source[NekoMediaMetaData::Title]);
         }
+        // 字幕设置刷新时会重新加载外部字幕文件
         mSettings->refresh();
     }
 
@@ -548,6 +582,7 @@ public:
     PopupWidget *mVideoSetting = nullptr;
     QScopedPointer<Ui::VideoSettingView> ui_videoSetting;
     CustomSlider *mVideoProgressBar = nullptr;
+    NekoThumbnailGenerator *mThumbnails = nullptr;
 
     VolumeSettingWidget *mVolumeSetting = nullptr;
 
@@ -783,6 +818,7 @@ int ReadyStatus::changePostion(int pos) {
 
 int ReadyStatus::play() {
     self->videoLog("开始加载视频");
+    self->player()->beginStartupTimeline();
     self->currentVideo()->loadVideoToPlay(self, [self = this->self](const Result<QString>& url) {
         if (url.has_value()) {
             self->player()->setSource(url.value());
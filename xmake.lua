@@ -23,6 +23,7 @@ includes("./src/net")
 includes("./src/nekoav")
 includes("./src/manualTests")
 includes("./src/autoTests")
+includes("./src/benchmarks")
 
 target("zood")
     add_rules("qt.widgetapp")